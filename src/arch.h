@@ -155,8 +155,10 @@ inline void LwipPlatformDiag(const char* fmt, ...)
  * Being like that, we define it to 'int' if SSIZE_MAX is not defined.
  */
 
+#ifndef SSIZE_MAX
 typedef int64_t ssize_t;
 constexpr int64_t SSIZE_MAX = INT64_MAX;
+#endif
 
 
 /* some maximum values needed in lwip code */
@@ -0,0 +1,492 @@
+///
+/// file: bpf_prog.cpp
+///
+/// Classic BPF programs, see bpf_prog.h.
+///
+
+#include <bpf_prog.h>
+#include <lwip_debug.h>
+#include <new>
+
+/* decoded operations, dense so that the switch of bpf_prog_run() is a jump
+   table */
+enum BpfOp : uint8_t
+{
+    BPF_OP_LD_W_ABS,
+    BPF_OP_LD_H_ABS,
+    BPF_OP_LD_B_ABS,
+    BPF_OP_LD_W_IND,
+    BPF_OP_LD_H_IND,
+    BPF_OP_LD_B_IND,
+    BPF_OP_LD_LEN,
+    BPF_OP_LD_IMM,
+    BPF_OP_LD_MEM,
+    BPF_OP_LDX_IMM,
+    BPF_OP_LDX_MEM,
+    BPF_OP_LDX_LEN,
+    BPF_OP_LDX_MSH,
+    BPF_OP_ST,
+    BPF_OP_STX,
+    BPF_OP_ADD_K,
+    BPF_OP_ADD_X,
+    BPF_OP_SUB_K,
+    BPF_OP_SUB_X,
+    BPF_OP_MUL_K,
+    BPF_OP_MUL_X,
+    BPF_OP_DIV_K,
+    BPF_OP_DIV_X,
+    BPF_OP_MOD_K,
+    BPF_OP_MOD_X,
+    BPF_OP_AND_K,
+    BPF_OP_AND_X,
+    BPF_OP_OR_K,
+    BPF_OP_OR_X,
+    BPF_OP_XOR_K,
+    BPF_OP_XOR_X,
+    BPF_OP_LSH_K,
+    BPF_OP_LSH_X,
+    BPF_OP_RSH_K,
+    BPF_OP_RSH_X,
+    BPF_OP_NEG,
+    BPF_OP_JA,
+    BPF_OP_JEQ_K,
+    BPF_OP_JEQ_X,
+    BPF_OP_JGT_K,
+    BPF_OP_JGT_X,
+    BPF_OP_JGE_K,
+    BPF_OP_JGE_X,
+    BPF_OP_JSET_K,
+    BPF_OP_JSET_X,
+    BPF_OP_RET_K,
+    BPF_OP_RET_A,
+    BPF_OP_TAX,
+    BPF_OP_TXA,
+    BPF_OP_INVALID
+};
+
+/* Map a classic opcode to its operation, BPF_OP_INVALID if unknown */
+static BpfOp
+bpf_prog_decode(const uint16_t code)
+{
+    switch (code)
+    {
+    case LWIP_BPF_LD | LWIP_BPF_W | LWIP_BPF_ABS:
+        return BPF_OP_LD_W_ABS;
+    case LWIP_BPF_LD | LWIP_BPF_H | LWIP_BPF_ABS:
+        return BPF_OP_LD_H_ABS;
+    case LWIP_BPF_LD | LWIP_BPF_B | LWIP_BPF_ABS:
+        return BPF_OP_LD_B_ABS;
+    case LWIP_BPF_LD | LWIP_BPF_W | LWIP_BPF_IND:
+        return BPF_OP_LD_W_IND;
+    case LWIP_BPF_LD | LWIP_BPF_H | LWIP_BPF_IND:
+        return BPF_OP_LD_H_IND;
+    case LWIP_BPF_LD | LWIP_BPF_B | LWIP_BPF_IND:
+        return BPF_OP_LD_B_IND;
+    case LWIP_BPF_LD | LWIP_BPF_W | LWIP_BPF_LEN:
+        return BPF_OP_LD_LEN;
+    case LWIP_BPF_LD | LWIP_BPF_IMM:
+        return BPF_OP_LD_IMM;
+    case LWIP_BPF_LD | LWIP_BPF_MEM:
+        return BPF_OP_LD_MEM;
+    case LWIP_BPF_LDX | LWIP_BPF_IMM:
+        return BPF_OP_LDX_IMM;
+    case LWIP_BPF_LDX | LWIP_BPF_MEM:
+        return BPF_OP_LDX_MEM;
+    case LWIP_BPF_LDX | LWIP_BPF_W | LWIP_BPF_LEN:
+        return BPF_OP_LDX_LEN;
+    case LWIP_BPF_LDX | LWIP_BPF_B | LWIP_BPF_MSH:
+        return BPF_OP_LDX_MSH;
+    case LWIP_BPF_ST:
+        return BPF_OP_ST;
+    case LWIP_BPF_STX:
+        return BPF_OP_STX;
+    case LWIP_BPF_ALU | LWIP_BPF_ADD | LWIP_BPF_K:
+        return BPF_OP_ADD_K;
+    case LWIP_BPF_ALU | LWIP_BPF_ADD | LWIP_BPF_X:
+        return BPF_OP_ADD_X;
+    case LWIP_BPF_ALU | LWIP_BPF_SUB | LWIP_BPF_K:
+        return BPF_OP_SUB_K;
+    case LWIP_BPF_ALU | LWIP_BPF_SUB | LWIP_BPF_X:
+        return BPF_OP_SUB_X;
+    case LWIP_BPF_ALU | LWIP_BPF_MUL | LWIP_BPF_K:
+        return BPF_OP_MUL_K;
+    case LWIP_BPF_ALU | LWIP_BPF_MUL | LWIP_BPF_X:
+        return BPF_OP_MUL_X;
+    case LWIP_BPF_ALU | LWIP_BPF_DIV | LWIP_BPF_K:
+        return BPF_OP_DIV_K;
+    case LWIP_BPF_ALU | LWIP_BPF_DIV | LWIP_BPF_X:
+        return BPF_OP_DIV_X;
+    case LWIP_BPF_ALU | LWIP_BPF_MOD | LWIP_BPF_K:
+        return BPF_OP_MOD_K;
+    case LWIP_BPF_ALU | LWIP_BPF_MOD | LWIP_BPF_X:
+        return BPF_OP_MOD_X;
+    case LWIP_BPF_ALU | LWIP_BPF_AND | LWIP_BPF_K:
+        return BPF_OP_AND_K;
+    case LWIP_BPF_ALU | LWIP_BPF_AND | LWIP_BPF_X:
+        return BPF_OP_AND_X;
+    case LWIP_BPF_ALU | LWIP_BPF_OR | LWIP_BPF_K:
+        return BPF_OP_OR_K;
+    case LWIP_BPF_ALU | LWIP_BPF_OR | LWIP_BPF_X:
+        return BPF_OP_OR_X;
+    case LWIP_BPF_ALU | LWIP_BPF_XOR | LWIP_BPF_K:
+        return BPF_OP_XOR_K;
+    case LWIP_BPF_ALU | LWIP_BPF_XOR | LWIP_BPF_X:
+        return BPF_OP_XOR_X;
+    case LWIP_BPF_ALU | LWIP_BPF_LSH | LWIP_BPF_K:
+        return BPF_OP_LSH_K;
+    case LWIP_BPF_ALU | LWIP_BPF_LSH | LWIP_BPF_X:
+        return BPF_OP_LSH_X;
+    case LWIP_BPF_ALU | LWIP_BPF_RSH | LWIP_BPF_K:
+        return BPF_OP_RSH_K;
+    case LWIP_BPF_ALU | LWIP_BPF_RSH | LWIP_BPF_X:
+        return BPF_OP_RSH_X;
+    case LWIP_BPF_ALU | LWIP_BPF_NEG:
+        return BPF_OP_NEG;
+    case LWIP_BPF_JMP | LWIP_BPF_JA:
+        return BPF_OP_JA;
+    case LWIP_BPF_JMP | LWIP_BPF_JEQ | LWIP_BPF_K:
+        return BPF_OP_JEQ_K;
+    case LWIP_BPF_JMP | LWIP_BPF_JEQ | LWIP_BPF_X:
+        return BPF_OP_JEQ_X;
+    case LWIP_BPF_JMP | LWIP_BPF_JGT | LWIP_BPF_K:
+        return BPF_OP_JGT_K;
+    case LWIP_BPF_JMP | LWIP_BPF_JGT | LWIP_BPF_X:
+        return BPF_OP_JGT_X;
+    case LWIP_BPF_JMP | LWIP_BPF_JGE | LWIP_BPF_K:
+        return BPF_OP_JGE_K;
+    case LWIP_BPF_JMP | LWIP_BPF_JGE | LWIP_BPF_X:
+        return BPF_OP_JGE_X;
+    case LWIP_BPF_JMP | LWIP_BPF_JSET | LWIP_BPF_K:
+        return BPF_OP_JSET_K;
+    case LWIP_BPF_JMP | LWIP_BPF_JSET | LWIP_BPF_X:
+        return BPF_OP_JSET_X;
+    case LWIP_BPF_RET | LWIP_BPF_K:
+        return BPF_OP_RET_K;
+    case LWIP_BPF_RET | LWIP_BPF_A:
+        return BPF_OP_RET_A;
+    case LWIP_BPF_MISC | LWIP_BPF_TAX:
+        return BPF_OP_TAX;
+    case LWIP_BPF_MISC | LWIP_BPF_TXA:
+        return BPF_OP_TXA;
+    default:
+        return BPF_OP_INVALID;
+    }
+}
+
+/* Check the operands of instruction pc of a program with len instructions */
+static bool
+bpf_prog_check(const BpfOp op, const BpfInsn& insn, const size_t pc, const size_t len)
+{
+    /* instructions left after this one */
+    const size_t left = len - pc - 1;
+    switch (op)
+    {
+    case BPF_OP_LD_MEM:
+    case BPF_OP_LDX_MEM:
+    case BPF_OP_ST:
+    case BPF_OP_STX:
+        return insn.k < LWIP_BPF_MEMWORDS;
+    case BPF_OP_DIV_K:
+    case BPF_OP_MOD_K:
+        return insn.k != 0;
+    case BPF_OP_LSH_K:
+    case BPF_OP_RSH_K:
+        return insn.k < 32;
+    case BPF_OP_JA:
+        return insn.k < left;
+    case BPF_OP_JEQ_K:
+    case BPF_OP_JEQ_X:
+    case BPF_OP_JGT_K:
+    case BPF_OP_JGT_X:
+    case BPF_OP_JGE_K:
+    case BPF_OP_JGE_X:
+    case BPF_OP_JSET_K:
+    case BPF_OP_JSET_X:
+        return insn.jt < left && insn.jf < left;
+    default:
+        return op != BPF_OP_INVALID;
+    }
+}
+
+/**
+ * Check a classic BPF program and keep a decoded copy of it.
+ *
+ * @param insns the instructions
+ * @param len number of instructions, 1 to LWIP_BPF_MAXINSNS
+ * @param prog receives the program, to be freed with bpf_prog_free()
+ * @return ERR_VAL if the program is invalid, ERR_MEM if it could not be
+ *         allocated
+ */
+LwipStatus
+bpf_prog_create(const BpfInsn* insns, const size_t len, BpfProgram*& prog)
+{
+    prog = nullptr;
+    if (insns == nullptr || len == 0 || len > LWIP_BPF_MAXINSNS)
+    {
+        return ERR_VAL;
+    }
+    const BpfOp last = bpf_prog_decode(insns[len - 1].code);
+    if (last != BPF_OP_RET_K && last != BPF_OP_RET_A)
+    {
+        Logf(true, "bpf_prog_create: program does not end with RET\n");
+        return ERR_VAL;
+    }
+    const auto checked = new (std::nothrow) BpfProgram;
+    if (checked == nullptr)
+    {
+        return ERR_MEM;
+    }
+    checked->insns.resize(len);
+    for (size_t pc = 0; pc < len; pc++)
+    {
+        const BpfOp op = bpf_prog_decode(insns[pc].code);
+        if (!bpf_prog_check(op, insns[pc], pc, len))
+        {
+            Logf(true,
+                 "bpf_prog_create: invalid instruction %zu (code 0x%x)\n",
+                 pc,
+                 insns[pc].code);
+            delete checked;
+            return ERR_VAL;
+        }
+        checked->insns[pc] = {op, insns[pc].jt, insns[pc].jf, insns[pc].k};
+    }
+    prog = checked;
+    return STATUS_SUCCESS;
+}
+
+void
+bpf_prog_free(BpfProgram* prog)
+{
+    delete prog;
+}
+
+/* Load size bytes at off in network order; false if beyond the packet */
+static inline bool
+bpf_prog_load(const uint8_t* pkt, const size_t len, const uint64_t off, const size_t size, uint32_t& val)
+{
+    if (off > len || len - off < size)
+    {
+        return false;
+    }
+    const uint8_t* b = pkt + off;
+    switch (size)
+    {
+    case 4:
+        val = uint32_t(b[0]) << 24 | uint32_t(b[1]) << 16 | uint32_t(b[2]) << 8 | b[3];
+        break;
+    case 2:
+        val = uint32_t(b[0]) << 8 | b[1];
+        break;
+    default:
+        val = b[0];
+        break;
+    }
+    return true;
+}
+
+///
+/// Run a program on a packet.
+///
+/// @param pkt the packet, starting at the IP header for raw pcbs
+/// @param len its length
+/// @return the value of the RET the program ended with, 0 rejects the packet
+///
+uint32_t
+bpf_prog_run(const BpfProgram& prog, const uint8_t* pkt, const size_t len)
+{
+    uint32_t a = 0;
+    uint32_t x = 0;
+    uint32_t mem[LWIP_BPF_MEMWORDS] = {};
+    const BpfDecodedInsn* insn = prog.insns.data();
+    for (;; insn++)
+    {
+        const uint32_t k = insn->k;
+        switch (insn->op)
+        {
+        case BPF_OP_LD_W_ABS:
+            if (!bpf_prog_load(pkt, len, k, 4, a))
+            {
+                return 0;
+            }
+            break;
+        case BPF_OP_LD_H_ABS:
+            if (!bpf_prog_load(pkt, len, k, 2, a))
+            {
+                return 0;
+            }
+            break;
+        case BPF_OP_LD_B_ABS:
+            if (!bpf_prog_load(pkt, len, k, 1, a))
+            {
+                return 0;
+            }
+            break;
+        case BPF_OP_LD_W_IND:
+            if (!bpf_prog_load(pkt, len, uint64_t(x) + k, 4, a))
+            {
+                return 0;
+            }
+            break;
+        case BPF_OP_LD_H_IND:
+            if (!bpf_prog_load(pkt, len, uint64_t(x) + k, 2, a))
+            {
+                return 0;
+            }
+            break;
+        case BPF_OP_LD_B_IND:
+            if (!bpf_prog_load(pkt, len, uint64_t(x) + k, 1, a))
+            {
+                return 0;
+            }
+            break;
+        case BPF_OP_LD_LEN:
+            a = uint32_t(len);
+            break;
+        case BPF_OP_LD_IMM:
+            a = k;
+            break;
+        case BPF_OP_LD_MEM:
+            a = mem[k];
+            break;
+        case BPF_OP_LDX_IMM:
+            x = k;
+            break;
+        case BPF_OP_LDX_MEM:
+            x = mem[k];
+            break;
+        case BPF_OP_LDX_LEN:
+            x = uint32_t(len);
+            break;
+        case BPF_OP_LDX_MSH:
+            /* header length of the IPv4 header at k */
+            if (!bpf_prog_load(pkt, len, k, 1, x))
+            {
+                return 0;
+            }
+            x = (x & 0xf) << 2;
+            break;
+        case BPF_OP_ST:
+            mem[k] = a;
+            break;
+        case BPF_OP_STX:
+            mem[k] = x;
+            break;
+        case BPF_OP_ADD_K:
+            a += k;
+            break;
+        case BPF_OP_ADD_X:
+            a += x;
+            break;
+        case BPF_OP_SUB_K:
+            a -= k;
+            break;
+        case BPF_OP_SUB_X:
+            a -= x;
+            break;
+        case BPF_OP_MUL_K:
+            a *= k;
+            break;
+        case BPF_OP_MUL_X:
+            a *= x;
+            break;
+        case BPF_OP_DIV_K:
+            a /= k;
+            break;
+        case BPF_OP_DIV_X:
+            if (x == 0)
+            {
+                return 0;
+            }
+            a /= x;
+            break;
+        case BPF_OP_MOD_K:
+            a %= k;
+            break;
+        case BPF_OP_MOD_X:
+            if (x == 0)
+            {
+                return 0;
+            }
+            a %= x;
+            break;
+        case BPF_OP_AND_K:
+            a &= k;
+            break;
+        case BPF_OP_AND_X:
+            a &= x;
+            break;
+        case BPF_OP_OR_K:
+            a |= k;
+            break;
+        case BPF_OP_OR_X:
+            a |= x;
+            break;
+        case BPF_OP_XOR_K:
+            a ^= k;
+            break;
+        case BPF_OP_XOR_X:
+            a ^= x;
+            break;
+        case BPF_OP_LSH_K:
+            a <<= k;
+            break;
+        case BPF_OP_LSH_X:
+            a = x < 32 ? a << x : 0;
+            break;
+        case BPF_OP_RSH_K:
+            a >>= k;
+            break;
+        case BPF_OP_RSH_X:
+            a = x < 32 ? a >> x : 0;
+            break;
+        case BPF_OP_NEG:
+            a = 0U - a;
+            break;
+        case BPF_OP_JA:
+            insn += k;
+            break;
+        case BPF_OP_JEQ_K:
+            insn += a == k ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_JEQ_X:
+            insn += a == x ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_JGT_K:
+            insn += a > k ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_JGT_X:
+            insn += a > x ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_JGE_K:
+            insn += a >= k ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_JGE_X:
+            insn += a >= x ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_JSET_K:
+            insn += (a & k) != 0 ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_JSET_X:
+            insn += (a & x) != 0 ? insn->jt : insn->jf;
+            break;
+        case BPF_OP_RET_K:
+            return k;
+        case BPF_OP_RET_A:
+            return a;
+        case BPF_OP_TAX:
+            x = a;
+            break;
+        case BPF_OP_TXA:
+            a = x;
+            break;
+        default:
+            lwip_assert("bpf_prog_run: invalid operation", false);
+            return 0;
+        }
+    }
+}
+
+//
+// END OF FILE
+//
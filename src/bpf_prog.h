@@ -0,0 +1,122 @@
+///
+/// file: bpf_prog.h
+///
+/// Classic BPF programs, the packet filters of tcpdump and SO_ATTACH_FILTER.
+///
+/// A program is handed over as BpfInsn array in the classic encoding, so the
+/// output of pcap_compile() or tcpdump -dd loads as is. bpf_prog_create()
+/// checks it once, the way the kernel does before attaching a socket filter:
+/// known instructions only, jumps forward and inside the program, scratch
+/// memory indices in range, no division by a constant zero and a RET at the
+/// end. Every program that passes terminates, so bpf_prog_run() needs no step
+/// limit. The checked program is kept pre-decoded: every instruction is
+/// mapped to a dense operation number, which the interpreter dispatches on
+/// with a single jump table and no further checks of the encoding.
+///
+/// At run time loads outside the packet and divisions by X = 0 end the
+/// program with 0, i.e. reject the packet.
+///
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <lwip_status.h>
+#include <vector>
+
+/// One instruction, laid out like struct sock_filter / struct bpf_insn.
+struct BpfInsn
+{
+    uint16_t code;
+    /// jump offsets if true / false, relative to the next instruction
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+};
+
+/* instruction classes */
+constexpr uint16_t LWIP_BPF_LD = 0x00;
+constexpr uint16_t LWIP_BPF_LDX = 0x01;
+constexpr uint16_t LWIP_BPF_ST = 0x02;
+constexpr uint16_t LWIP_BPF_STX = 0x03;
+constexpr uint16_t LWIP_BPF_ALU = 0x04;
+constexpr uint16_t LWIP_BPF_JMP = 0x05;
+constexpr uint16_t LWIP_BPF_RET = 0x06;
+constexpr uint16_t LWIP_BPF_MISC = 0x07;
+
+/* load sizes */
+constexpr uint16_t LWIP_BPF_W = 0x00;
+constexpr uint16_t LWIP_BPF_H = 0x08;
+constexpr uint16_t LWIP_BPF_B = 0x10;
+
+/* load modes */
+constexpr uint16_t LWIP_BPF_IMM = 0x00;
+constexpr uint16_t LWIP_BPF_ABS = 0x20;
+constexpr uint16_t LWIP_BPF_IND = 0x40;
+constexpr uint16_t LWIP_BPF_MEM = 0x60;
+constexpr uint16_t LWIP_BPF_LEN = 0x80;
+constexpr uint16_t LWIP_BPF_MSH = 0xa0;
+
+/* ALU operations */
+constexpr uint16_t LWIP_BPF_ADD = 0x00;
+constexpr uint16_t LWIP_BPF_SUB = 0x10;
+constexpr uint16_t LWIP_BPF_MUL = 0x20;
+constexpr uint16_t LWIP_BPF_DIV = 0x30;
+constexpr uint16_t LWIP_BPF_OR = 0x40;
+constexpr uint16_t LWIP_BPF_AND = 0x50;
+constexpr uint16_t LWIP_BPF_LSH = 0x60;
+constexpr uint16_t LWIP_BPF_RSH = 0x70;
+constexpr uint16_t LWIP_BPF_NEG = 0x80;
+constexpr uint16_t LWIP_BPF_MOD = 0x90;
+constexpr uint16_t LWIP_BPF_XOR = 0xa0;
+
+/* jumps */
+constexpr uint16_t LWIP_BPF_JA = 0x00;
+constexpr uint16_t LWIP_BPF_JEQ = 0x10;
+constexpr uint16_t LWIP_BPF_JGT = 0x20;
+constexpr uint16_t LWIP_BPF_JGE = 0x30;
+constexpr uint16_t LWIP_BPF_JSET = 0x40;
+
+/* operand of ALU and jumps: k or X; return value: k or A */
+constexpr uint16_t LWIP_BPF_K = 0x00;
+constexpr uint16_t LWIP_BPF_X = 0x08;
+constexpr uint16_t LWIP_BPF_A = 0x10;
+
+/* MISC operations */
+constexpr uint16_t LWIP_BPF_TAX = 0x00;
+constexpr uint16_t LWIP_BPF_TXA = 0x80;
+
+/// Longest program accepted.
+constexpr size_t LWIP_BPF_MAXINSNS = 4096;
+
+/// Words of scratch memory (M[]).
+constexpr size_t LWIP_BPF_MEMWORDS = 16;
+
+/// An instruction after bpf_prog_create() checked and decoded it.
+struct BpfDecodedInsn
+{
+    /// operation, see bpf_prog.cpp
+    uint8_t op;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+};
+
+/// A checked program.
+struct BpfProgram
+{
+    std::vector<BpfDecodedInsn> insns;
+};
+
+LwipStatus
+bpf_prog_create(const BpfInsn* insns, size_t len, BpfProgram*& prog);
+
+void
+bpf_prog_free(BpfProgram* prog);
+
+uint32_t
+bpf_prog_run(const BpfProgram& prog, const uint8_t* pkt, size_t len);
+
+//
+// END OF FILE
+//
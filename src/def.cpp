@@ -1,6 +1,10 @@
 #include <def.h>
 #include <cstring>
+#if defined _MSC_VER
 #include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 
 /**
@@ -19,6 +23,8 @@ int lwip_getpid()
 {
     #if defined _MSC_VER 
         return _getpid();
+    #else
+        return getpid();
     #endif
 }
 
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 // #define std::max(x , y
 // )  (((x) > (y)) ? (x) : (y))  // NOLINT(cppcoreguidelines-macro-usage)
@@ -0,0 +1,63 @@
+///
+/// file: dst_cache.cpp
+///
+/// Per-pcb route caches, see dst_cache.h.
+///
+
+#include <cstring>
+#include <dst_cache.h>
+#include <nd6.h>
+#include <network_interface.h>
+
+/* starts at 1: a zeroed cache is empty */
+std::atomic<uint32_t> dst_cache_generation{1};
+
+DstCache* dst_cache_current;
+
+///
+/// Make all caches stale, called whenever a route, next hop, neighbour or
+/// netif may have changed.
+///
+void
+dst_cache_invalidate_all()
+{
+    if (dst_cache_generation.fetch_add(1, std::memory_order_relaxed) + 1 == 0)
+    {
+        /* skip the generation of empty caches */
+        dst_cache_generation.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+///
+/// Remember the route of dst after the transport looked it up.
+///
+void
+dst_cache_fill(DstCache& cache, const IpAddrInfo& dst, NetworkInterface* netif)
+{
+    cache.generation = dst_cache_generation.load(std::memory_order_relaxed);
+    cache.dst = dst;
+    cache.netif = netif;
+    cache.pmtu = is_ip_addr_v6(dst) ? nd6_get_destination_mtu(&dst.u_addr.ip6.addr, netif) : netif->mtu;
+    cache.ll_valid = false;
+}
+
+///
+/// Remember the next hop of the cached destination and the link-layer entry
+/// it was resolved with, called by the link layer for dst_cache_current.
+///
+void
+dst_cache_set_ll(DstCache& cache, const size_t ll_idx, const IpAddrInfo& next_hop, const uint8_t* hwaddr)
+{
+    if (cache.generation != dst_cache_generation.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    cache.next_hop = next_hop;
+    cache.ll_idx = ll_idx;
+    memcpy(cache.hwaddr.bytes, hwaddr, ETH_ADDR_LEN);
+    cache.ll_valid = true;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,100 @@
+///
+/// file: dst_cache.h
+///
+/// Per-pcb cache of the route to a destination, so that the packets of a
+/// long-lived flow skip the route and neighbour lookups.
+///
+/// The transport fills the cache with the netif and path MTU the first time
+/// it routes to a destination (dst_cache_fill()); the link layer adds the
+/// next hop and its ARP or neighbour cache entry once it resolved them for a
+/// packet of that pcb (dst_cache_set_ll()). Later packets to the same
+/// destination take the netif from the cache, and etharp_output() or
+/// nd6_get_next_hop_addr_or_queue() only check that the remembered entry
+/// still holds the next hop.
+///
+/// All caches are validated by one global generation: anything that may
+/// change a route (forwarding table commits, ARP and neighbour cache entries
+/// going away, netif state and address changes, path MTU updates) calls
+/// dst_cache_invalidate_all(), and every cache is refilled on its next use.
+///
+/// The transport points dst_cache_current at the cache of the pcb while
+/// it hands a packet for the cached destination to IP, like netif hints.
+///
+
+#pragma once
+
+#include <atomic>
+#include <ip_addr.h>
+#include <mac_address.h>
+
+struct NetworkInterface;
+
+struct DstCache
+{
+    /// dst_cache_generation when filled, 0 if empty
+    uint32_t generation;
+    /// destination the cache holds the route of
+    IpAddrInfo dst;
+    NetworkInterface* netif;
+    uint16_t pmtu;
+    /// whether the link layer set the fields below
+    bool ll_valid;
+    /// gateway, or dst itself if on-link
+    IpAddrInfo next_hop;
+    /// index of the ARP or neighbour cache entry of next_hop
+    size_t ll_idx;
+    MacAddress hwaddr;
+};
+
+extern std::atomic<uint32_t> dst_cache_generation;
+
+/// The cache of the pcb whose packet is being sent, see above.
+extern DstCache* dst_cache_current;
+
+void
+dst_cache_invalidate_all();
+
+void
+dst_cache_fill(DstCache& cache, const IpAddrInfo& dst, NetworkInterface* netif);
+
+void
+dst_cache_set_ll(DstCache& cache, size_t ll_idx, const IpAddrInfo& next_hop, const uint8_t* hwaddr);
+
+///
+/// Whether cache holds a route to dst that is still valid.
+///
+inline bool
+dst_cache_valid(const DstCache& cache, const IpAddrInfo& dst)
+{
+    return cache.generation == dst_cache_generation.load(std::memory_order_relaxed) &&
+        compare_ip_addr(cache.dst, dst);
+}
+
+///
+/// cache if it is for dst, to set dst_cache_current with; nullptr otherwise.
+///
+inline DstCache*
+dst_cache_for(DstCache& cache, const IpAddrInfo& dst)
+{
+    return dst_cache_valid(cache, dst) ? &cache : nullptr;
+}
+
+///
+/// The cache of the current packet if it is on netif and the link layer
+/// resolved its next hop, nullptr otherwise.
+///
+inline DstCache*
+dst_cache_ll(const NetworkInterface* netif)
+{
+    DstCache* cache = dst_cache_current;
+    if (cache == nullptr || !cache->ll_valid || cache->netif != netif ||
+        cache->generation != dst_cache_generation.load(std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+    return cache;
+}
+
+//
+// END OF FILE
+//
@@ -6,6 +6,7 @@
 #include <autoip.h>
 
 #include <dhcp.h>
+#include <dst_cache.h>
 
 #include <etharp.h>
 
@@ -80,6 +81,7 @@ clear_expired_arp_entries(std::vector<EtharpEntry>& entries)
             kArpMaxPending)
         {
             entries.erase(it);
+            dst_cache_invalidate_all();
         }
         else if (it->state == ETHARP_STATE_STABLE_REREQUESTING_1)
         {
@@ -226,6 +228,7 @@ etharp_find_entry(const Ip4AddrInfo& ipaddr,
             return ERR_MEM;
         }
         entries.erase(entries.begin() + i);
+        dst_cache_invalidate_all();
     }
     copy_ip4_addr(entries[i].ip4_addr_info.address, ipaddr.address);
     entries[i].ctime = 0;
@@ -295,6 +298,11 @@ etharp_update_arp_entry(NetworkInterface& netif,
 
     //  Logf(true | LWIP_DBG_TRACE, ("etharp_update_arp_entry: updating stable entry %"S16_F"\n", i));
     /* update address */
+    if (memcmp(&entries[found_index].mac_address, &mac_address, sizeof(mac_address)) != 0)
+    {
+        /* cached routes still send to the old address */
+        dst_cache_invalidate_all();
+    }
     entries[found_index].mac_address = mac_address;
 
     /* reset time stamp */
@@ -375,6 +383,7 @@ etharp_remove_static_entry(const Ip4AddrInfo& ip4_addr_info,
     }
     // entry found, free it
     entries.erase(entries.begin() + index);
+    dst_cache_invalidate_all();
     return STATUS_SUCCESS;
 }
 
@@ -395,6 +404,7 @@ etharp_cleanup_netif(NetworkInterface& netif, std::vector<EtharpEntry>& entries)
         if (it->netif.name == netif.name)
         {
             entries.erase(it);
+            dst_cache_invalidate_all();
         }
     }
 }
@@ -613,6 +623,45 @@ etharp_output_to_arp_index(struct NetworkInterface* netif, struct PacketBuffer*
 }
 
 
+/* Send q to the next hop the route cache of the sending pcb resolved, if its
+   ARP entry still holds that address and is not due for a re-request */
+static bool
+etharp_output_cached(struct NetworkInterface* netif, struct PacketBuffer* q, LwipStatus& err)
+{
+    DstCache* cache = dst_cache_ll(netif);
+    if (cache == nullptr || cache->ll_idx >= ARP_TABLE_SIZE) {
+        return false;
+    }
+    const auto& entry = arp_table[cache->ll_idx];
+    if (entry.state != ETHARP_STATE_STABLE ||
+        entry.ctime >= ARP_AGE_REREQUEST_USED_UNICAST ||
+        !is_ip4_addr_equal(&cache->next_hop.u_addr.ip4.address, &entry.ipaddr) ||
+        memcmp(&cache->hwaddr, &entry.MacAddress, ETH_ADDR_LEN) != 0) {
+        return false;
+    }
+    err = send_ethernet_pkt(netif, q, (struct MacAddress *)(netif->hwaddr), &cache->hwaddr, ETHTYPE_IP);
+    return true;
+}
+
+
+/* etharp_output_to_arp_index, remembering the entry in the route cache of the
+   sending pcb */
+static LwipStatus
+etharp_output_remember(struct NetworkInterface* netif,
+                       struct PacketBuffer* q,
+                       const Ip4Addr* next_hop,
+                       NetIfcAddrIdx arp_idx)
+{
+    if (dst_cache_current != nullptr && dst_cache_current->netif == netif) {
+        IpAddrInfo next_hop_addr{};
+        next_hop_addr.type = IPADDR_TYPE_V4;
+        next_hop_addr.u_addr.ip4.address = *next_hop;
+        dst_cache_set_ll(*dst_cache_current, arp_idx, next_hop_addr, arp_table[arp_idx].MacAddress.bytes);
+    }
+    return etharp_output_to_arp_index(netif, q, arp_idx);
+}
+
+
 /**
  * Resolve and fill-in Ethernet address header for outgoing IP packet.
  *
@@ -665,6 +714,11 @@ etharp_output(struct NetworkInterface* netif, struct PacketBuffer* q, const Ip4A
         /* unicast destination IP address? */
     }
     else {
+        /* same next hop as the last packet of the sending pcb? */
+        LwipStatus err;
+        if (etharp_output_cached(netif, q, err)) {
+            return err;
+        }
         /* outside local network? if so, this can neither be a global broadcast nor
            a subnet broadcast. */
         if (!cmp_ip4_addr_net(ipaddr, get_netif_ip4_addr(netif,,), get_netif_ip4_netmask(netif,)) &&
@@ -701,7 +755,7 @@ etharp_output(struct NetworkInterface* netif, struct PacketBuffer* q, const Ip4A
                     (is_ip4_addr_equal(dst_addr, &arp_table[etharp_cached_entry].ipaddr))) {
                     /* the per-pcb-cached entry is stable and the right one! */
                     // ETHARP_STATS_INC(etharp.cachehit);
-                    return etharp_output_to_arp_index(netif, q, etharp_cached_entry);
+                    return etharp_output_remember(netif, q, dst_addr, etharp_cached_entry);
                 }
             }
         }
@@ -716,7 +770,7 @@ etharp_output(struct NetworkInterface* netif, struct PacketBuffer* q, const Ip4A
 
                 (is_ip4_addr_equal(dst_addr, &arp_table[i].ipaddr))) {
                 /* found an existing, stable entry */
-                return etharp_output_to_arp_index(netif, q, i);
+                return etharp_output_remember(netif, q, dst_addr, i);
             }
         }
         /* no stable entry found, use the (slower) query function:
@@ -9,9 +9,17 @@
 #include <ethernet.h>
 #include <ieee.h>
 #include <ip.h>
+#include <ip4_acl.h>
+#include <ip4_fib.h>
+#include <ip4_rule.h>
+#include <ip6_fib.h>
+#include <ip_fwd.h>
 #include <lwip_debug.h>
 #include <pppoe.h>
+#include <tcp_priv.h>
+#include <udp.h>
 #include <cstring>
+#include <utility>
 
 
 const struct MacAddress ETH_BCAST_ADDR = {{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}};
@@ -187,6 +195,64 @@ ethernet_input(PacketBuffer& pkt_buf, NetworkInterface& net_ifc)
 }
 
 
+/**
+ * @ingroup ethernet
+ * Process the frames the driver queued on the rx_buffer of a netif, as one
+ * burst. The forwarding fast path (ip_fwd_burst()) takes the frames it can
+ * forward, IP_FWD_BURST_SIZE at a time, and ethernet_input() gets the rest.
+ * The ACKs the TCP segments of the burst ask for are held back and
+ * sent once the whole burst is in (see tcp_input_batch_begin()), and UDP pcbs
+ * with a recv_batch callback get all their datagrams of the burst in one call
+ * (see udp_input_batch_begin()).
+ *
+ * The end of a burst is where the stack thread holds no routing table, so
+ * the routing tables, policy rule sets and filter rule sets replaced by
+ * commits since the last burst are freed there.
+ *
+ * @param net_ifc the network interface the frames were received on
+ * @param netifs all network interfaces, for forwarding
+ * @param arp_entries the ARP table, for forwarding
+ * @return the number of frames processed
+ */
+size_t
+ethernet_input_burst(NetworkInterface& net_ifc,
+                     std::vector<NetworkInterface>& netifs,
+                     std::vector<EtharpEntry>& arp_entries)
+{
+    std::vector<PacketBuffer> frames;
+    std::vector<size_t> punted;
+    size_t count = 0;
+    tcp_input_batch_begin();
+    udp_input_batch_begin();
+    while (!net_ifc.rx_buffer.empty())
+    {
+        frames.clear();
+        while (!net_ifc.rx_buffer.empty() && frames.size() < IP_FWD_BURST_SIZE)
+        {
+            frames.push_back(std::move(net_ifc.rx_buffer.front()));
+            net_ifc.rx_buffer.pop();
+            if (frames.back().input_netif_idx == NETIF_NO_INDEX)
+            {
+                frames.back().input_netif_idx = get_and_inc_netif_num(net_ifc);
+            }
+        }
+        ip_fwd_burst(frames, netifs, arp_entries, punted);
+        for (const size_t i : punted)
+        {
+            ethernet_input(frames[i], net_ifc);
+        }
+        count += frames.size();
+    }
+    udp_input_batch_end();
+    tcp_input_batch_end();
+    ip4_fib_reclaim();
+    ip6_fib_reclaim();
+    ip4_rule_reclaim();
+    ip4_acl_reclaim();
+    return count;
+}
+
+
 /**
  * @ingroup ethernet
  * Send an ethernet packet on the network using netif->linkoutput().
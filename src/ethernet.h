@@ -9,6 +9,7 @@
 #include <ethernet.h>
 #include <mac_address.h>
 #include <cstring>
+#include <vector>
 
 
 /// Ethernet header
@@ -52,6 +53,13 @@ inline bool cmp_eth_addr(const MacAddress* addr1, const MacAddress* addr2)
 ///
 LwipStatus ethernet_input(PacketBuffer& pkt_buf, NetworkInterface& net_ifc);
 
+struct EtharpEntry;
+
+///
+size_t ethernet_input_burst(NetworkInterface& net_ifc,
+                            std::vector<NetworkInterface>& netifs,
+                            std::vector<EtharpEntry>& arp_entries);
+
 ///
 LwipStatus send_ethernet_pkt(NetworkInterface& netif,
                            PacketBuffer& p,
@@ -14,6 +14,13 @@ enum IpProto
     IP_PROTO_TCP= 6,
 };
 
+/* ECN field: the two low bits of the IPv4 TOS / IPv6 traffic class (RFC 3168) */
+constexpr auto IP_ECN_MASK = 0x03U;
+constexpr auto IP_ECN_NOT_ECT = 0x00U;
+constexpr auto IP_ECN_ECT1 = 0x01U;
+constexpr auto IP_ECN_ECT0 = 0x02U;
+constexpr auto IP_ECN_CE = 0x03U;
+
 
 /** This operates on a void* by loading the first byte */
 inline uint8_t get_ip_hdr_version(void* ptr)
@@ -279,12 +286,13 @@ inline LwipStatus
 ip_route(const IpAddrInfo& src,
          const IpAddrInfo& dest,
          NetworkInterface& out_ifc,
-         const std::vector<NetworkInterface>& interfaces)
+         const std::vector<NetworkInterface>& interfaces,
+         const uint32_t flow_hash = 0)
 {
     if (is_ip_addr_v6(dest)) {
-        return route_ip6_packet(src.u_addr.ip6, dest.u_addr.ip6, out_ifc, interfaces);
+        return route_ip6_packet(src.u_addr.ip6, dest.u_addr.ip6, out_ifc, interfaces, flow_hash);
     }
-    return source_route_ip4_addr(src.u_addr.ip4, dest.u_addr.ip4, out_ifc, interfaces);
+    return source_route_ip4_addr(src.u_addr.ip4, dest.u_addr.ip4, out_ifc, interfaces, flow_hash);
 }
 
 
@@ -8,7 +8,12 @@
 #include <icmp.h>
 #include <inet_chksum.h>
 #include <ip.h>
+#include <ip4_acl.h>
+#include <ip4_fib.h>
 #include <ip4_frag.h>
+#include <ip4_nat.h>
+#include <ip4_rule.h>
+#include <ip_ecmp.h>
 #include <network_interface.h>
 #include <tcp_priv.h>
 #include <udp.h>
@@ -18,17 +23,43 @@
 
 
 /**
- * Source based IPv4 routing must be fully implemented in
- * LWIP_HOOK_IP4_ROUTE_SRC(). This function only provides the parameters.
+ * Find the outgoing interface for a packet: the routing policy (see
+ * ip4_rule.h) picks the forwarding table, the longest prefix in it (see
+ * ip4_fib.h) decides; destinations without a route go to the interface
+ * whose network they are on.
+ *
+ * @param flow_hash picks the next hop of multipath routes (see ip_ecmp.h)
+ * @param rule_key ingress interface, TOS and mark of the packet
+ * @return STATUS_E_ROUTING if a rule makes the destination unreachable
  */
 LwipStatus
 source_route_ip4_addr(const Ip4AddrInfo& src,
                       const Ip4AddrInfo& dest,
                       NetworkInterface& out_netif,
-                      const std::vector<NetworkInterface>& netifs)
+                      const std::vector<NetworkInterface>& netifs,
+                      const uint32_t flow_hash,
+                      const Ip4RuleKey& rule_key)
 {
-    // todo: lookup source in ip rules for routing and then get the appropriate next hop, using that to find the appropriate netif.
-    return STATUS_E_NOT_IMPLEMENTED;
+    Ip4FibNextHop next_hop{};
+    const LwipStatus status = ip4_rule_route(src.address, dest.address, rule_key, flow_hash, next_hop);
+    if (status == STATUS_E_ROUTING)
+    {
+        return status;
+    }
+    if (status == STATUS_SUCCESS)
+    {
+        for (const auto& netif : netifs)
+        {
+            if (netif.if_num == next_hop.if_num)
+            {
+                out_netif = netif;
+                return STATUS_SUCCESS;
+            }
+        }
+        Logf(true, "source_route_ip4_addr: route to unknown interface %d\n", next_hop.if_num);
+        return STATUS_E_ROUTING;
+    }
+    return get_netif_for_dst_ip4_addr(dest.address, netifs, out_netif);
 }
 
 ///
@@ -134,10 +165,25 @@ forward_ip4_pkt(PacketBuffer& pkt_buf, const std::vector<NetworkInterface>& neti
         return STATUS_E_ROUTING;
     } /* Find network interface where to forward this IP packet to. */
     NetworkInterface out_netif{};
-    const auto rc = source_route_ip4_addr(src_addr, dst_addr, out_netif, netifs);
+    const uint32_t flow_hash = ip_ecmp_hash_ip4_pkt(pkt_buf.data.data(), pkt_buf.data.size());
+    Ip4RuleKey rule_key{};
+    if (pkt_buf.input_netif_idx != NETIF_NO_INDEX)
+    {
+        rule_key.in_if_num = pkt_buf.input_netif_idx - 1;
+    }
+    if (pkt_buf.data.size() > 1)
+    {
+        rule_key.tos = pkt_buf.data[1];
+    }
+    rule_key.fwmark = pkt_buf.mark;
+    const auto rc = source_route_ip4_addr(src_addr, dst_addr, out_netif, netifs, flow_hash, rule_key);
     if (rc != STATUS_SUCCESS)
     {
         return rc;
+    }
+    if (ip4_acl_filter(IP4_ACL_FORWARD, pkt_buf, rule_key.in_if_num, out_netif.if_num) == IP4_ACL_DENY)
+    {
+        return STATUS_SUCCESS;
     } /* decrement TTL */ // todo: get ip4 hdr from packet
     Ip4Hdr hdr{};
     set_ip4_hdr_ttl(hdr, get_ip4_hdr_ttl(hdr) - 1); /* send ICMP if TTL == 0 */
@@ -159,6 +205,10 @@ forward_ip4_pkt(PacketBuffer& pkt_buf, const std::vector<NetworkInterface>& neti
     {
         set_ip4_hdr_checksum(hdr,
                              (uint16_t)(get_ip4_hdr_checksum(hdr) + pp_htons(0x100)));
+    } /* translate the source for the outgoing interface */
+    if (ip4_nat_postrouting(pkt_buf, out_netif) == IP4_NAT_DROP)
+    {
+        return STATUS_SUCCESS;
     } /* don't fragment if interface has mtu set to 0 [loopif] */
     if (out_netif.mtu && pkt_buf.data.size() > out_netif.mtu)
     {
@@ -284,6 +334,27 @@ ip4_input(PacketBuffer& pkt_buf, NetworkInterface& netif, std::vector<NetworkInt
         {
             return false;
         }
+    } /* filter before NAT and routing, which see the mark the filter sets */
+    if (ip4_acl_filter(IP4_ACL_INGRESS, pkt_buf, netif.if_num, IP4_ACL_ANY_IF) == IP4_ACL_DENY)
+    {
+        return false;
+    } /* conntrack needs the ports, which only the first fragment has: while
+         there are NAT rules, fragments are put together first, whether they
+         are for us or not. Forwarding fragments the datagram again if it
+         does not fit the egress MTU. */
+    if (ip4_nat_enabled() && (get_ip4_hdr_offset(*ip4_hdr_ptr) & pp_htons(IP4_OFF_MASK | IP4_MF_FLAG)) != 0)
+    {
+        if (!ip4_reass(pkt_buf))
+        {
+            return STATUS_SUCCESS;
+        }
+        ip4_hdr_ptr = reinterpret_cast<Ip4Hdr *>(pkt_buf.data.data());
+        iphdr_hlen = get_ip4_hdr_hdr_len_bytes2(ip4_hdr_ptr);
+    } /* track the connection and translate the destination before the packet is
+         matched against our addresses and routed */
+    if (ip4_nat_prerouting(pkt_buf, netif.if_num) == IP4_NAT_DROP)
+    {
+        return false;
     } /* copy IP addresses to aligned IpAddr */
     // copy_ip4_addr_to_ip_addr(&curr_dst_hdr->dest, &iphdr->dest);
     // copy_ip4_addr_to_ip_addr(curr_src_hdr->src, iphdr->src);
@@ -389,8 +460,7 @@ ip4_input(PacketBuffer& pkt_buf, NetworkInterface& netif, std::vector<NetworkInt
         //    Logf(true, ("IP packet is a fragment (id=0x%04"X16_F" tot_len=%d len=%d MF=%d offset=%d), calling ip4_reass()\n",
         //                           lwip_ntohs(IPH_ID(iphdr)), p->tot_len, lwip_ntohs(IPH_LEN(iphdr)), (uint16_t)!!(IPH_OFFSET(iphdr) & PpHtons(IP_MF)), (uint16_t)((lwip_ntohs(IPH_OFFSET(iphdr)) & IP_OFFMASK) * 8)));
         /* reassemble the packet*/
-        pkt_buf = ip4_reass(pkt_buf); /* packet not fully reassembled yet? */
-        if (pkt_buf == nullptr)
+        if (!ip4_reass(pkt_buf)) /* packet not fully reassembled yet? */
         {
             return STATUS_SUCCESS;
         }
@@ -409,6 +479,7 @@ ip4_input(PacketBuffer& pkt_buf, NetworkInterface& netif, std::vector<NetworkInt
     // ip_data.current_ip4_header = iphdr;
     // ip_data.current_ip_header_tot_len = IPH_HL_BYTES(iphdr);
     /* raw input did not eat the packet? */
+    pkt_buf.ip_ecn = get_ip4_hdr_tos(*ip4_hdr_ptr) & IP_ECN_MASK;
     raw_input_state_t raw_status = raw_input(pkt_buf, netif);
     if (raw_status != RAW_INPUT_EATEN)
     {
@@ -471,6 +542,7 @@ ip4_input(PacketBuffer& pkt_buf, NetworkInterface& netif, std::vector<NetworkInt
  * @param netif the netif on which to send this packet
  * @return ERR_OK if the packet was sent OK
  *         ERR_BUF if p doesn't have enough space for IP/LINK headers
+ *         STATUS_E_ROUTING if the egress filter (ip4_acl.h) denies it
  *         returns errors returned by netif->output
  *
  * @note ip_id: RFC791 "some host may be able to simply use
@@ -686,6 +758,11 @@ ip4_output_if_opt_src(struct PacketBuffer *p, const Ip4Addr *src, const Ip4Addr
   // }
 
 
+      if (ip4_acl_filter(IP4_ACL_EGRESS, *p, IP4_ACL_LOCAL_IF, netif->if_num) == IP4_ACL_DENY)
+      {
+          return STATUS_E_ROUTING;
+      }
+
       /* don't fragment if interface has mtu set to 0 [loopif] */
       if (netif->mtu && p->tot_len > netif->mtu)
       {
@@ -726,7 +803,12 @@ ip4_output_if_opt_src(struct PacketBuffer *p, const Ip4Addr *src, const Ip4Addr
 
       // LWIP_IP_CHECK_PBUF_REF_COUNT_FOR_TX(p);
 
-      if ((netif = source_route_ip4_addr(src, dest,,)) == nullptr)
+      const uint32_t flow_hash = ip_ecmp_hash4(src.address,
+                                               dest.address,
+                                               proto,
+                                               ip_ecmp_ports(proto, p.data.data(), p.data.size()));
+      const Ip4RuleKey rule_key{IP4_RULE_LOCAL_IF, tos, p.mark};
+      if ((netif = source_route_ip4_addr(src, dest,,, flow_hash, rule_key)) == nullptr)
       {
           //    Logf(true, ("ip4_output: No route to %d.%d.%d.%d\n",
           //                           ip4_addr1_16(dest), ip4_addr2_16(dest), ip4_addr3_16(dest), ip4_addr4_16(dest)));
@@ -769,7 +851,12 @@ ip4_output_hinted(struct PacketBuffer* pkt_buf,
 
     // LWIP_IP_CHECK_PBUF_REF_COUNT_FOR_TX(p);
 
-    if ((netif = source_route_ip4_addr(src, dest,,)) == nullptr) {
+    const uint32_t flow_hash = ip_ecmp_hash4(*src,
+                                             *dest,
+                                             proto,
+                                             ip_ecmp_ports(proto, pkt_buf->data.data(), pkt_buf->data.size()));
+    const Ip4RuleKey rule_key{IP4_RULE_LOCAL_IF, tos, pkt_buf->mark};
+    if ((netif = source_route_ip4_addr(src, dest,,, flow_hash, rule_key)) == nullptr) {
         // Logf(true,
         //      ("ip4_output: No route to %d.%d.%d.%d\n",
         //          ip4_addr1_16(dest), ip4_addr2_16(dest), ip4_addr3_16(dest), ip4_addr4_16(dest)));
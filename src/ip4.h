@@ -2,6 +2,7 @@
 #include <network_interface.h>
 #include <packet_buffer.h>
 #include <ip4_addr.h>
+#include <ip4_rule.h>
 #include <lwip_status.h>
 
 /** This is the packed version of Ip4Addr,
@@ -166,7 +167,9 @@ LwipStatus
 source_route_ip4_addr(const Ip4AddrInfo& src,
                       const Ip4AddrInfo& dest,
                       NetworkInterface& out_netif,
-                      const std::vector<NetworkInterface>& netifs);
+                      const std::vector<NetworkInterface>& netifs,
+                      uint32_t flow_hash = 0,
+                      const Ip4RuleKey& rule_key = Ip4RuleKey{});
 
 
 bool
@@ -0,0 +1,362 @@
+///
+/// file: ip4_acl.cpp
+///
+/// IPv4 packet filter, see ip4_acl.h.
+///
+
+#include <algorithm>
+#include <cstddef>
+#include <ip4_acl.h>
+#include <lwip_debug.h>
+#include <map>
+#include <tuple>
+
+std::atomic<Ip4AclSet*> ip4_acl_current;
+
+/* the staged rules, in priority order */
+static std::multimap<uint32_t, Ip4AclRule> ip4_acl_list;
+
+/* the staged default action of each hook */
+static Ip4AclAction ip4_acl_defaults[IP4_ACL_HOOKS];
+
+/* rule sets replaced by a commit and not freed yet */
+static std::atomic<Ip4AclSet*> ip4_acl_retired;
+
+/* Mask of a prefix length of 0 to 32, host order */
+static uint32_t
+ip4_acl_prefix_mask(const uint8_t prefix_len)
+{
+    return prefix_len == 0 ? 0 : 0xffffffffU << (32 - prefix_len);
+}
+
+/* A rule with the bits its prefixes and mark mask ignore cleared, so that
+   equal rules compare equal */
+static Ip4AclRule
+ip4_acl_normalise(const Ip4AclRule& rule)
+{
+    Ip4AclRule normal = rule;
+    normal.src.addr = lwip_htonl(lwip_ntohl(rule.src.addr) & ip4_acl_prefix_mask(rule.src_len));
+    normal.dst.addr = lwip_htonl(lwip_ntohl(rule.dst.addr) & ip4_acl_prefix_mask(rule.dst_len));
+    normal.mark_value &= rule.mark_mask;
+    return normal;
+}
+
+static bool
+ip4_acl_equal(const Ip4AclRule& a, const Ip4AclRule& b)
+{
+    return a.hook == b.hook && a.priority == b.priority && a.src.addr == b.src.addr && a.src_len == b.src_len &&
+        a.dst.addr == b.dst.addr && a.dst_len == b.dst_len && a.proto == b.proto &&
+        a.src_port_min == b.src_port_min && a.src_port_max == b.src_port_max &&
+        a.dst_port_min == b.dst_port_min && a.dst_port_max == b.dst_port_max && a.in_if_num == b.in_if_num &&
+        a.out_if_num == b.out_if_num && a.action == b.action && a.mark_value == b.mark_value &&
+        a.mark_mask == b.mark_mask;
+}
+
+/* Whether a rule only matches on ports the protocols with ports have */
+static bool
+ip4_acl_ports_valid(const Ip4AclRule& rule)
+{
+    if (rule.src_port_min > rule.src_port_max || rule.dst_port_min > rule.dst_port_max)
+    {
+        return false;
+    }
+    const bool any_port = rule.src_port_min == 0 && rule.src_port_max == 0xffff && rule.dst_port_min == 0 &&
+        rule.dst_port_max == 0xffff;
+    return any_port || rule.proto == IP_PROTO_TCP || rule.proto == IP_PROTO_UDP || rule.proto == IP_PROTO_UDPLITE;
+}
+
+/* Build the hash table of a tuple from its buckets, whose rules are appended
+   to the chain */
+static void
+ip4_acl_fill_tuple(Ip4AclTuple& tuple,
+                   const std::map<std::tuple<uint32_t, uint32_t, uint8_t>, std::vector<uint32_t>>& keys,
+                   Ip4AclChain& chain)
+{
+    size_t size = 2;
+    while (size < keys.size() * 2)
+    {
+        size *= 2;
+    }
+    tuple.buckets.assign(size, Ip4AclBucket{});
+    for (const auto& key : keys)
+    {
+        const uint32_t src = std::get<0>(key.first);
+        const uint32_t dst = std::get<1>(key.first);
+        const uint8_t proto = std::get<2>(key.first);
+        size_t i = ip4_acl_hash(src, dst, proto) & (size - 1);
+        while (tuple.buckets[i].count != 0)
+        {
+            i = (i + 1) & (size - 1);
+        }
+        tuple.buckets[i] = Ip4AclBucket{src, dst, proto, uint32_t(chain.rules.size()), uint32_t(key.second.size())};
+        chain.rules.insert(chain.rules.end(), key.second.begin(), key.second.end());
+    }
+}
+
+/* Fill a new rule set from the staged rules */
+static void
+ip4_acl_compile(Ip4AclSet& set)
+{
+    for (const auto& rule : ip4_acl_list)
+    {
+        set.rules.push_back(rule.second);
+    }
+    set.packets = std::vector<std::atomic<uint64_t>>(set.rules.size());
+
+    for (size_t hook = 0; hook < IP4_ACL_HOOKS; hook++)
+    {
+        Ip4AclChain& chain = set.chains[hook];
+        chain.default_action = ip4_acl_defaults[hook];
+        chain.port_rules = false;
+
+        /* rules by tuple (prefix lengths, whether proto is given), then by
+           masked key; rule indices ascend in each */
+        std::map<std::tuple<uint8_t, uint8_t, bool>,
+                 std::map<std::tuple<uint32_t, uint32_t, uint8_t>, std::vector<uint32_t>>>
+            tuples;
+        for (uint32_t i = 0; i < set.rules.size(); i++)
+        {
+            const Ip4AclRule& rule = set.rules[i];
+            if (rule.hook != hook)
+            {
+                continue;
+            }
+            chain.port_rules = chain.port_rules || rule.src_port_min != 0 || rule.src_port_max != 0xffff ||
+                rule.dst_port_min != 0 || rule.dst_port_max != 0xffff;
+            tuples[std::make_tuple(rule.src_len, rule.dst_len, rule.proto != 0)]
+                  [std::make_tuple(lwip_ntohl(rule.src.addr), lwip_ntohl(rule.dst.addr), rule.proto)]
+                      .push_back(i);
+        }
+        for (const auto& keys : tuples)
+        {
+            Ip4AclTuple tuple;
+            tuple.src_mask = ip4_acl_prefix_mask(std::get<0>(keys.first));
+            tuple.dst_mask = ip4_acl_prefix_mask(std::get<1>(keys.first));
+            tuple.proto_mask = std::get<2>(keys.first) ? 0xff : 0;
+            tuple.best = IP4_ACL_NO_RULE;
+            for (const auto& key : keys.second)
+            {
+                tuple.best = std::min(tuple.best, key.second.front());
+            }
+            ip4_acl_fill_tuple(tuple, keys.second, chain);
+            chain.tuples.push_back(std::move(tuple));
+        }
+        std::sort(chain.tuples.begin(),
+                  chain.tuples.end(),
+                  [](const Ip4AclTuple& a, const Ip4AclTuple& b) { return a.best < b.best; });
+    }
+}
+
+/* Carry the counters of the rules of the current set that the new set keeps
+   over; packets the stack thread counts in the current set while this runs
+   are lost */
+static void
+ip4_acl_carry_counters(const Ip4AclSet& current, Ip4AclSet& set)
+{
+    std::vector<bool> carried(current.rules.size());
+    for (size_t i = 0; i < set.rules.size(); i++)
+    {
+        const auto from = std::lower_bound(current.rules.begin(),
+                                           current.rules.end(),
+                                           set.rules[i].priority,
+                                           [](const Ip4AclRule& rule, const uint32_t priority)
+                                           {
+                                               return rule.priority < priority;
+                                           });
+        for (auto it = from; it != current.rules.end() && it->priority == set.rules[i].priority; ++it)
+        {
+            const size_t j = it - current.rules.begin();
+            if (!carried[j] && ip4_acl_equal(*it, set.rules[i]))
+            {
+                set.packets[i].store(current.packets[j].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                carried[j] = true;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Stage a rule.
+ *
+ * @return ERR_VAL if the hook, a prefix length or a port range is invalid,
+ *         ERR_MEM if there are IP4_ACL_MAX rules
+ */
+LwipStatus
+ip4_acl_add(const Ip4AclRule& rule)
+{
+    if (rule.hook >= IP4_ACL_HOOKS || rule.src_len > 32 || rule.dst_len > 32 || !ip4_acl_ports_valid(rule))
+    {
+        return ERR_VAL;
+    }
+    if (ip4_acl_list.size() == IP4_ACL_MAX)
+    {
+        return ERR_MEM;
+    }
+    ip4_acl_list.emplace(rule.priority, ip4_acl_normalise(rule));
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage the removal of the first rule equal to rule.
+ *
+ * @return STATUS_NOT_FOUND if there is none
+ */
+LwipStatus
+ip4_acl_delete(const Ip4AclRule& rule)
+{
+    const Ip4AclRule normal = ip4_acl_normalise(rule);
+    const auto range = ip4_acl_list.equal_range(rule.priority);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (ip4_acl_equal(it->second, normal))
+        {
+            ip4_acl_list.erase(it);
+            return STATUS_SUCCESS;
+        }
+    }
+    return STATUS_NOT_FOUND;
+}
+
+/**
+ * Stage the removal of all rules. The default actions stay.
+ */
+void
+ip4_acl_clear()
+{
+    ip4_acl_list.clear();
+}
+
+/**
+ * Stage the action of the packets no rule of a hook matches.
+ */
+void
+ip4_acl_set_default(const Ip4AclHook hook, const Ip4AclAction action)
+{
+    if (hook < IP4_ACL_HOOKS)
+    {
+        ip4_acl_defaults[hook] = action;
+    }
+}
+
+/**
+ * Compile the staged rules and make lookups use them. The rule set they
+ * replace is freed by the next ip4_acl_reclaim().
+ */
+void
+ip4_acl_commit()
+{
+    const auto set = new Ip4AclSet;
+    ip4_acl_compile(*set);
+    set->retired_next = nullptr;
+    const Ip4AclSet* current = ip4_acl_current.load(std::memory_order_acquire);
+    if (current != nullptr)
+    {
+        ip4_acl_carry_counters(*current, *set);
+    }
+    Ip4AclSet* old = ip4_acl_current.exchange(set, std::memory_order_acq_rel);
+    if (old != nullptr)
+    {
+        old->retired_next = ip4_acl_retired.load(std::memory_order_relaxed);
+        while (!ip4_acl_retired.compare_exchange_weak(old->retired_next,
+                                                      old,
+                                                      std::memory_order_release,
+                                                      std::memory_order_relaxed))
+        {
+        }
+    }
+    Logf(true,
+         "ip4_acl_commit: %zu rules, %zu/%zu/%zu tuples\n",
+         set->rules.size(),
+         set->chains[IP4_ACL_INGRESS].tuples.size(),
+         set->chains[IP4_ACL_FORWARD].tuples.size(),
+         set->chains[IP4_ACL_EGRESS].tuples.size());
+}
+
+/**
+ * Free the rule sets replaced by earlier commits. Called by the stack thread
+ * while it is not in the middle of a lookup.
+ */
+void
+ip4_acl_reclaim()
+{
+    Ip4AclSet* set = ip4_acl_retired.exchange(nullptr, std::memory_order_acquire);
+    while (set != nullptr)
+    {
+        Ip4AclSet* next = set->retired_next;
+        delete set;
+        set = next;
+    }
+}
+
+/**
+ * Packets the first committed rule equal to rule matched.
+ *
+ * @return 0 if no committed rule is equal to rule
+ */
+uint64_t
+ip4_acl_rule_packets(const Ip4AclRule& rule)
+{
+    const Ip4AclSet* set = ip4_acl_current.load(std::memory_order_acquire);
+    if (set == nullptr)
+    {
+        return 0;
+    }
+    const Ip4AclRule normal = ip4_acl_normalise(rule);
+    for (size_t i = 0; i < set->rules.size(); i++)
+    {
+        if (ip4_acl_equal(set->rules[i], normal))
+        {
+            return set->packets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Filter an IPv4 packet at a hook: find the first rule it matches, count it
+ * and set its mark. Stack thread only.
+ *
+ * @param pkt_buf the packet, starting with its IP header
+ * @param in_if_num if_num of the interface it came in on, IP4_ACL_LOCAL_IF
+ *        if this host sends it
+ * @param out_if_num if_num of the interface it goes out on,
+ *        IP4_ACL_LOCAL_IF if it is for this host, IP4_ACL_ANY_IF if that is
+ *        not known yet
+ * @return the action of the rule, or the default action of the hook;
+ *         IP4_ACL_DENY for packets with an incomplete header while the hook
+ *         has rules
+ */
+Ip4AclAction
+ip4_acl_filter(const Ip4AclHook hook,
+               PacketBuffer& pkt_buf,
+               const uint32_t in_if_num,
+               const uint32_t out_if_num)
+{
+    const Ip4AclSet* set = ip4_acl_current.load(std::memory_order_acquire);
+    if (set == nullptr)
+    {
+        return IP4_ACL_PERMIT;
+    }
+    const Ip4AclChain& chain = set->chains[hook];
+    if (chain.tuples.empty())
+    {
+        return chain.default_action;
+    }
+    const size_t len = pkt_buf.data.size() >= 4
+                           ? std::min(pkt_buf.data.size(), size_t(pkt_buf.data[2] << 8 | pkt_buf.data[3]))
+                           : 0;
+    Ip4AclKey key{};
+    if (!ip4_acl_key(pkt_buf.data.data(), len, in_if_num, out_if_num, key) ||
+        ip4_acl_short_ports_denied(*set, hook, key))
+    {
+        return IP4_ACL_DENY;
+    }
+    const uint32_t rule = ip4_acl_find(*set, hook, key);
+    ip4_acl_count(*set, rule);
+    return ip4_acl_action(*set, hook, rule, pkt_buf.mark);
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,363 @@
+///
+/// file: ip4_acl.h
+///
+/// Stateless IPv4 packet filter: rules permitting or denying packets by
+/// source and destination prefix, protocol, source and destination port
+/// ranges and the interfaces they come in and go out on, at three hooks:
+///  - IP4_ACL_INGRESS: every packet ip4_input() receives, before NAT
+///    (ip4_nat.h) and routing; a mark set here is seen by policy routing;
+///  - IP4_ACL_FORWARD: packets routed to another interface, after
+///    destination NAT and before source NAT;
+///  - IP4_ACL_EGRESS: packets this host sends.
+/// The first matching rule of a hook, in priority order, decides; packets no
+/// rule matches get the default action of the hook, IP4_ACL_PERMIT unless set
+/// otherwise. Every rule counts the packets it matched, and may set bits of
+/// their mark (PacketBuffer::mark).
+///
+/// Packets do not walk the rule list (tuple space search). A commit sorts the
+/// rules of each hook into tuples, one per combination of source prefix
+/// length, destination prefix length and whether the protocol is given. The
+/// rules of a tuple are in a hash table keyed on their masked addresses and
+/// protocol, each bucket holding the rules of one key in priority order, with
+/// the ports and interfaces they check left to a scan of the bucket. A lookup
+/// probes one bucket per tuple and skips the tuples whose best rule comes
+/// after the best match so far, so its cost grows with the number of distinct
+/// prefix length pairs in the rules, not with the number of rules.
+///
+/// Updates are staged and published like those of ip4_rule.h: ip4_acl_add()
+/// and ip4_acl_delete() change the rule list, ip4_acl_commit() compiles it
+/// and publishes the result with one atomic pointer swap, and the stack
+/// thread frees the rule sets it replaced with ip4_acl_reclaim(). Rule
+/// counters carry over to the rule set of the next commit.
+///
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ip.h>
+#include <ip4_addr.h>
+#include <lwip_status.h>
+#include <packet_buffer.h>
+#include <vector>
+
+/// Most rules, over all hooks.
+constexpr size_t IP4_ACL_MAX = size_t(1) << 16;
+
+/// Rule interface matching any interface; key interface of packets whose
+/// outgoing interface is not known yet, which only such rules match.
+constexpr uint32_t IP4_ACL_ANY_IF = 0xffffffffU;
+
+/// Rule and key interface of packets from (in) or to (out) this host.
+constexpr uint32_t IP4_ACL_LOCAL_IF = 0xfffffffeU;
+
+/// No rule matched.
+constexpr uint32_t IP4_ACL_NO_RULE = 0xffffffffU;
+
+enum Ip4AclHook : uint8_t
+{
+    IP4_ACL_INGRESS,
+    IP4_ACL_FORWARD,
+    IP4_ACL_EGRESS,
+    IP4_ACL_HOOKS,
+};
+
+enum Ip4AclAction : uint8_t
+{
+    IP4_ACL_PERMIT,
+    IP4_ACL_DENY,
+};
+
+/// A filter rule.
+struct Ip4AclRule
+{
+    Ip4AclHook hook;
+    /// lower goes first; rules of the same priority in the order they were
+    /// added
+    uint32_t priority;
+    /// source and destination prefixes; host bits are ignored, a length of 0
+    /// matches any address
+    Ip4Addr src;
+    uint8_t src_len;
+    Ip4Addr dst;
+    uint8_t dst_len;
+    /// protocol, 0 for any
+    uint8_t proto;
+    /// inclusive port ranges; 0 to 0xffff matches any port, and packets
+    /// without ports (non-first fragments, other protocols). Narrower ranges
+    /// need proto to be TCP, UDP or UDP-Lite; a hook with such a rule denies
+    /// TCP and UDP packets too short for their ports.
+    uint16_t src_port_min;
+    uint16_t src_port_max;
+    uint16_t dst_port_min;
+    uint16_t dst_port_max;
+    /// if_num of the interface the packet came in and goes out on,
+    /// IP4_ACL_LOCAL_IF or IP4_ACL_ANY_IF
+    uint32_t in_if_num;
+    uint32_t out_if_num;
+    Ip4AclAction action;
+    /// mark bits set on permitted packets: mark = (mark & ~mark_mask) |
+    /// mark_value; a mark_mask of 0 leaves the mark alone
+    uint32_t mark_value;
+    uint32_t mark_mask;
+};
+
+/// What rules match on.
+struct Ip4AclKey
+{
+    /// host order
+    uint32_t src;
+    uint32_t dst;
+    uint8_t proto;
+    /// whether src_port and dst_port (host order) were found
+    bool has_ports;
+    /// TCP, UDP or UDP-Lite, first fragment, but too short to hold the
+    /// ports: a tiny first fragment (RFC 1858) or a truncated packet
+    bool short_ports;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t in_if_num;
+    uint32_t out_if_num;
+};
+
+/* A hash bucket of a tuple: the rules of one masked key, rules[first] to
+   rules[first + count - 1] of the chain, in priority order */
+struct Ip4AclBucket
+{
+    uint32_t src;
+    uint32_t dst;
+    uint8_t proto;
+    uint32_t first;
+    /* 0 for an empty bucket */
+    uint32_t count;
+};
+
+/* The rules of a hook sharing prefix lengths and whether proto is given */
+struct Ip4AclTuple
+{
+    /* host order */
+    uint32_t src_mask;
+    uint32_t dst_mask;
+    uint8_t proto_mask;
+    /* index of the first rule of the tuple in priority order */
+    uint32_t best;
+    /* open addressing, linear probing; a power of two, at most half full */
+    std::vector<Ip4AclBucket> buckets;
+};
+
+/* The compiled rules of a hook */
+struct Ip4AclChain
+{
+    /* by best rule, ascending */
+    std::vector<Ip4AclTuple> tuples;
+    /* rule indices, grouped by bucket */
+    std::vector<uint32_t> rules;
+    Ip4AclAction default_action;
+    /* whether a rule narrows the ports */
+    bool port_rules;
+};
+
+/// A compiled rule set. Rules are numbered in priority order over all hooks.
+struct Ip4AclSet
+{
+    Ip4AclChain chains[IP4_ACL_HOOKS];
+    std::vector<Ip4AclRule> rules;
+    /// packets each rule matched
+    mutable std::vector<std::atomic<uint64_t>> packets;
+    /* next rule set waiting for ip4_acl_reclaim() */
+    Ip4AclSet* retired_next;
+};
+
+LwipStatus
+ip4_acl_add(const Ip4AclRule& rule);
+
+LwipStatus
+ip4_acl_delete(const Ip4AclRule& rule);
+
+void
+ip4_acl_clear();
+
+void
+ip4_acl_set_default(Ip4AclHook hook, Ip4AclAction action);
+
+void
+ip4_acl_commit();
+
+void
+ip4_acl_reclaim();
+
+uint64_t
+ip4_acl_rule_packets(const Ip4AclRule& rule);
+
+Ip4AclAction
+ip4_acl_filter(Ip4AclHook hook, PacketBuffer& pkt_buf, uint32_t in_if_num, uint32_t out_if_num);
+
+/// The rule set lookups use, nullptr before the first commit.
+extern std::atomic<Ip4AclSet*> ip4_acl_current;
+
+///
+/// The key of an IPv4 packet.
+///
+/// @param ip the IP header
+/// @param len length of the packet, without link-layer padding
+/// @return false if the header is incomplete
+///
+inline bool
+ip4_acl_key(const uint8_t* ip,
+            const size_t len,
+            const uint32_t in_if_num,
+            const uint32_t out_if_num,
+            Ip4AclKey& key)
+{
+    if (len < 20)
+    {
+        return false;
+    }
+    const size_t hdr_len = size_t(ip[0] & 0x0f) * 4;
+    if (hdr_len < 20 || hdr_len > len)
+    {
+        return false;
+    }
+    key.src = uint32_t(ip[12]) << 24 | uint32_t(ip[13]) << 16 | uint32_t(ip[14]) << 8 | ip[15];
+    key.dst = uint32_t(ip[16]) << 24 | uint32_t(ip[17]) << 16 | uint32_t(ip[18]) << 8 | ip[19];
+    key.proto = ip[9];
+    key.in_if_num = in_if_num;
+    key.out_if_num = out_if_num;
+    /* only the first fragment has the ports */
+    const bool first_fragment = ((ip[6] & 0x1f) | ip[7]) == 0;
+    const bool port_proto = key.proto == IP_PROTO_TCP || key.proto == IP_PROTO_UDP || key.proto ==
+        IP_PROTO_UDPLITE;
+    key.has_ports = first_fragment && port_proto && len - hdr_len >= 4;
+    key.short_ports = first_fragment && port_proto && len - hdr_len < 4;
+    key.src_port = key.has_ports ? uint16_t(ip[hdr_len] << 8 | ip[hdr_len + 1]) : 0;
+    key.dst_port = key.has_ports ? uint16_t(ip[hdr_len + 2] << 8 | ip[hdr_len + 3]) : 0;
+    return true;
+}
+
+/* Bucket of a masked key in a tuple */
+inline size_t
+ip4_acl_hash(const uint32_t src, const uint32_t dst, const uint8_t proto)
+{
+    uint32_t hash = src * 0x9e3779b1U ^ dst;
+    hash = (hash ^ proto) * 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    return hash ^ hash >> 16;
+}
+
+/* Whether a rule of the bucket a key hashed to accepts its ports and
+   interfaces */
+inline bool
+ip4_acl_match_rest(const Ip4AclRule& rule, const Ip4AclKey& key)
+{
+    if ((rule.in_if_num != IP4_ACL_ANY_IF && rule.in_if_num != key.in_if_num) ||
+        (rule.out_if_num != IP4_ACL_ANY_IF && rule.out_if_num != key.out_if_num))
+    {
+        return false;
+    }
+    if (!key.has_ports)
+    {
+        return rule.src_port_min == 0 && rule.src_port_max == 0xffff && rule.dst_port_min == 0 &&
+            rule.dst_port_max == 0xffff;
+    }
+    return key.src_port >= rule.src_port_min && key.src_port <= rule.src_port_max &&
+        key.dst_port >= rule.dst_port_min && key.dst_port <= rule.dst_port_max;
+}
+
+///
+/// Whether a key is denied whatever the rules say: a packet too short for
+/// its ports would match the rules that ignore ports only, and so get past
+/// a port-specific deny, while the fragments after it still deliver the
+/// ports to the destination (RFC 1858). Only hooks with such rules deny it.
+///
+inline bool
+ip4_acl_short_ports_denied(const Ip4AclSet& set, const Ip4AclHook hook, const Ip4AclKey& key)
+{
+    return key.short_ports && set.chains[hook].port_rules;
+}
+
+///
+/// The first rule of a hook matching a key.
+///
+/// @return the index of the rule in set.rules, IP4_ACL_NO_RULE if none
+///         matches
+///
+inline uint32_t
+ip4_acl_find(const Ip4AclSet& set, const Ip4AclHook hook, const Ip4AclKey& key)
+{
+    const Ip4AclChain& chain = set.chains[hook];
+    uint32_t best = IP4_ACL_NO_RULE;
+    for (const auto& tuple : chain.tuples)
+    {
+        /* the tuples after this one only have worse rules either */
+        if (tuple.best >= best)
+        {
+            break;
+        }
+        const uint32_t src = key.src & tuple.src_mask;
+        const uint32_t dst = key.dst & tuple.dst_mask;
+        const uint8_t proto = key.proto & tuple.proto_mask;
+        const size_t mask = tuple.buckets.size() - 1;
+        for (size_t i = ip4_acl_hash(src, dst, proto) & mask; tuple.buckets[i].count != 0; i = (i + 1) & mask)
+        {
+            const Ip4AclBucket& bucket = tuple.buckets[i];
+            if (bucket.src != src || bucket.dst != dst || bucket.proto != proto)
+            {
+                continue;
+            }
+            for (uint32_t j = bucket.first; j < bucket.first + bucket.count; j++)
+            {
+                const uint32_t rule = chain.rules[j];
+                if (rule >= best)
+                {
+                    break;
+                }
+                if (ip4_acl_match_rest(set.rules[rule], key))
+                {
+                    best = rule;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    return best;
+}
+
+///
+/// What the outcome of ip4_acl_find() does to a packet.
+///
+/// @param rule what ip4_acl_find() returned
+/// @param mark the mark of the packet, updated if the rule permits it
+/// @return the action of the rule, or the default action of the hook
+///
+inline Ip4AclAction
+ip4_acl_action(const Ip4AclSet& set, const Ip4AclHook hook, const uint32_t rule, uint32_t& mark)
+{
+    if (rule == IP4_ACL_NO_RULE)
+    {
+        return set.chains[hook].default_action;
+    }
+    const Ip4AclRule& matched = set.rules[rule];
+    if (matched.action == IP4_ACL_PERMIT)
+    {
+        mark = (mark & ~matched.mark_mask) | (matched.mark_value & matched.mark_mask);
+    }
+    return matched.action;
+}
+
+///
+/// Count a packet against the rule ip4_acl_find() returned for it.
+///
+inline void
+ip4_acl_count(const Ip4AclSet& set, const uint32_t rule)
+{
+    if (rule != IP4_ACL_NO_RULE)
+    {
+        set.packets[rule].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,526 @@
+///
+/// file: ip4_conntrack.cpp
+///
+/// IPv4 connection tracking, see ip4_conntrack.h.
+///
+
+#include <array>
+#include <cstring>
+#include <icmp.h>
+#include <ip.h>
+#include <ip4.h>
+#include <ip4_conntrack.h>
+#include <ip4_nat.h>
+#include <lwip_debug.h>
+#include <tcp.h>
+#include <vector>
+
+uint32_t ip4_conntrack_seed = 0x9e3779b9U;
+
+size_t ip4_conntrack_count;
+
+/* the entries, reserved for IP4_CT_MAX on first use so that they never move */
+static std::vector<Ip4CtEntry> ip4_ct_entries;
+
+/* free entries, chained through hash_next[0] */
+static uint32_t ip4_ct_free = IP4_CT_NONE;
+
+/* tuple hash table */
+static std::vector<uint32_t> ip4_ct_hash;
+
+/* timer wheel; slot ip4_ct_now % IP4_CT_WHEEL_SLOTS is the one expired last */
+static std::array<uint32_t, IP4_CT_WHEEL_SLOTS> ip4_ct_wheel;
+static uint32_t ip4_ct_now;
+
+static uint16_t
+ip4_ct_read16(const uint8_t* p)
+{
+    return uint16_t(p[0] << 8 | p[1]);
+}
+
+static uint32_t
+ip4_ct_hash_tuple(const Ip4CtTuple& tuple)
+{
+    uint32_t hash = ip4_conntrack_seed;
+    for (const uint32_t word : {tuple.src.addr,
+                                tuple.dst.addr,
+                                uint32_t(tuple.src_port) << 16 | tuple.dst_port,
+                                uint32_t(tuple.proto)})
+    {
+        hash = (hash ^ word) * 0x9e3779b1U;
+        hash ^= hash >> 15;
+    }
+    return hash & (IP4_CT_HASH_SIZE - 1);
+}
+
+static bool
+ip4_ct_tuple_equal(const Ip4CtTuple& a, const Ip4CtTuple& b)
+{
+    return a.src.addr == b.src.addr && a.dst.addr == b.dst.addr && a.src_port == b.src_port &&
+        a.dst_port == b.dst_port && a.proto == b.proto;
+}
+
+static void
+ip4_ct_init()
+{
+    if (!ip4_ct_hash.empty())
+    {
+        return;
+    }
+    ip4_ct_entries.reserve(IP4_CT_MAX);
+    ip4_ct_hash.assign(IP4_CT_HASH_SIZE, IP4_CT_NONE);
+    ip4_ct_wheel.fill(IP4_CT_NONE);
+}
+
+static void
+ip4_ct_hash_insert(const uint32_t index, const Ip4CtDir dir)
+{
+    Ip4CtEntry& entry = ip4_ct_entries[index];
+    uint32_t& head = ip4_ct_hash[ip4_ct_hash_tuple(entry.tuple[dir])];
+    entry.hash_next[dir] = head;
+    head = index << 1 | dir;
+}
+
+static void
+ip4_ct_hash_remove(const uint32_t index, const Ip4CtDir dir)
+{
+    Ip4CtEntry& entry = ip4_ct_entries[index];
+    const uint32_t node = index << 1 | dir;
+    uint32_t* link = &ip4_ct_hash[ip4_ct_hash_tuple(entry.tuple[dir])];
+    while (*link != node)
+    {
+        lwip_assert("ip4_ct_hash_remove: tuple not hashed", *link != IP4_CT_NONE);
+        link = &ip4_ct_entries[*link >> 1].hash_next[*link & 1];
+    }
+    *link = entry.hash_next[dir];
+}
+
+/* Queue an entry in the slot that comes up first at or after its expiry, or
+   a turn of the wheel ahead if that is later */
+static void
+ip4_ct_wheel_insert(const uint32_t index)
+{
+    Ip4CtEntry& entry = ip4_ct_entries[index];
+    if (int32_t(entry.expires - ip4_ct_now) <= 0)
+    {
+        entry.wheel_due = ip4_ct_now + 1;
+    }
+    else
+    {
+        entry.wheel_due = ip4_ct_now + 1 + (entry.expires - ip4_ct_now - 1) % IP4_CT_WHEEL_SLOTS;
+    }
+    uint32_t& head = ip4_ct_wheel[entry.wheel_due % IP4_CT_WHEEL_SLOTS];
+    entry.wheel_prev = IP4_CT_NONE;
+    entry.wheel_next = head;
+    if (head != IP4_CT_NONE)
+    {
+        ip4_ct_entries[head].wheel_prev = index;
+    }
+    head = index;
+}
+
+static void
+ip4_ct_wheel_remove(const uint32_t index)
+{
+    const Ip4CtEntry& entry = ip4_ct_entries[index];
+    if (entry.wheel_prev != IP4_CT_NONE)
+    {
+        ip4_ct_entries[entry.wheel_prev].wheel_next = entry.wheel_next;
+    }
+    else
+    {
+        ip4_ct_wheel[entry.wheel_due % IP4_CT_WHEEL_SLOTS] = entry.wheel_next;
+    }
+    if (entry.wheel_next != IP4_CT_NONE)
+    {
+        ip4_ct_entries[entry.wheel_next].wheel_prev = entry.wheel_prev;
+    }
+}
+
+/* Unhash an entry that is off the wheel, release its NAT mapping and put it
+   on the free list */
+static void
+ip4_ct_release(const uint32_t index)
+{
+    Ip4CtEntry& entry = ip4_ct_entries[index];
+    ip4_nat_release(entry);
+    ip4_ct_hash_remove(index, IP4_CT_DIR_ORIGINAL);
+    ip4_ct_hash_remove(index, IP4_CT_DIR_REPLY);
+    entry.flags = 0;
+    entry.hash_next[IP4_CT_DIR_ORIGINAL] = ip4_ct_free;
+    ip4_ct_free = index;
+    ip4_conntrack_count--;
+}
+
+/* Timeout of an entry in its current state */
+static uint32_t
+ip4_ct_timeout(const Ip4CtEntry& entry)
+{
+    switch (entry.state)
+    {
+    case IP4_CT_TCP_SYN_SENT:
+        return IP4_CT_TIMEOUT_TCP_SYN_SENT;
+    case IP4_CT_TCP_SYN_RECV:
+        return IP4_CT_TIMEOUT_TCP_SYN_RECV;
+    case IP4_CT_TCP_ESTABLISHED:
+        return IP4_CT_TIMEOUT_TCP_ESTABLISHED;
+    case IP4_CT_TCP_FIN_WAIT:
+        return IP4_CT_TIMEOUT_TCP_FIN_WAIT;
+    case IP4_CT_TCP_TIME_WAIT:
+        return IP4_CT_TIMEOUT_TCP_TIME_WAIT;
+    case IP4_CT_TCP_CLOSE:
+        return IP4_CT_TIMEOUT_TCP_CLOSE;
+    case IP4_CT_UDP:
+        return entry.flags & IP4_CT_FLAG_SEEN_REPLY ? IP4_CT_TIMEOUT_UDP_REPLIED : IP4_CT_TIMEOUT_UDP;
+    case IP4_CT_ICMP:
+        return IP4_CT_TIMEOUT_ICMP;
+    default:
+        return IP4_CT_TIMEOUT_OTHER;
+    }
+}
+
+/* Follow a TCP connection through the flags of one of its segments */
+static void
+ip4_ct_tcp_update(Ip4CtEntry& entry, const Ip4CtDir dir, const uint8_t flags)
+{
+    if (flags & TCP_RST)
+    {
+        entry.state = IP4_CT_TCP_CLOSE;
+    }
+    else if (flags & TCP_SYN)
+    {
+        if (!(flags & TCP_ACK) && dir == IP4_CT_DIR_ORIGINAL &&
+            (entry.state == IP4_CT_TCP_CLOSE || entry.state == IP4_CT_TCP_TIME_WAIT))
+        {
+            /* the tuple is reused by a new connection */
+            entry.state = IP4_CT_TCP_SYN_SENT;
+            entry.flags &= ~(IP4_CT_FLAG_FIN_ORIGINAL | IP4_CT_FLAG_FIN_REPLY);
+        }
+        else if ((flags & TCP_ACK) && dir == IP4_CT_DIR_REPLY && entry.state == IP4_CT_TCP_SYN_SENT)
+        {
+            entry.state = IP4_CT_TCP_SYN_RECV;
+        }
+    }
+    else if (flags & TCP_FIN)
+    {
+        entry.flags |= dir == IP4_CT_DIR_ORIGINAL ? IP4_CT_FLAG_FIN_ORIGINAL : IP4_CT_FLAG_FIN_REPLY;
+        const bool both = (entry.flags & IP4_CT_FLAG_FIN_ORIGINAL) && (entry.flags & IP4_CT_FLAG_FIN_REPLY);
+        entry.state = both ? IP4_CT_TCP_TIME_WAIT : IP4_CT_TCP_FIN_WAIT;
+    }
+    else if ((flags & TCP_ACK) && dir == IP4_CT_DIR_ORIGINAL && entry.state == IP4_CT_TCP_SYN_RECV)
+    {
+        entry.state = IP4_CT_TCP_ESTABLISHED;
+    }
+}
+
+/* Make room in a full table: drop an entry that has not seen a reply from the
+   chain the new tuple goes into, unanswered connections being the most
+   likely to be unwanted (SYN floods, scans) */
+static bool
+ip4_ct_early_drop(const Ip4CtTuple& tuple)
+{
+    for (uint32_t node = ip4_ct_hash[ip4_ct_hash_tuple(tuple)]; node != IP4_CT_NONE;)
+    {
+        Ip4CtEntry& entry = ip4_ct_entries[node >> 1];
+        if (!(entry.flags & IP4_CT_FLAG_SEEN_REPLY))
+        {
+            ip4_conntrack_delete(entry);
+            return true;
+        }
+        node = entry.hash_next[node & 1];
+    }
+    return false;
+}
+
+///
+/// Whether an ICMP type is a query (1) or the reply to one (-1); 0 for other
+/// messages.
+///
+int
+ip4_conntrack_icmp_query(const uint8_t type)
+{
+    switch (type)
+    {
+    case ICMP_ECHO: case ICMP_TS: case ICMP_IRQ: case ICMP_AM:
+        return 1;
+    case ICMP_ER: case ICMP_TSR: case ICMP_IR: case ICMP_AMR:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+///
+/// Tuple of the IPv4 packet at ip.
+///
+/// @return false for packets that are not tracked: truncated ones, fragments
+///         but the first, and ICMP messages other than queries and replies
+///
+bool
+ip4_conntrack_tuple(const uint8_t* ip, const size_t len, Ip4CtTuple& tuple)
+{
+    if (len < IP4_HDR_LEN)
+    {
+        return false;
+    }
+    const size_t hdr_len = size_t(ip[0] & 0x0f) * 4;
+    if (hdr_len < IP4_HDR_LEN || hdr_len > len || ((ip[6] & 0x1f) | ip[7]) != 0)
+    {
+        return false;
+    }
+    memcpy(&tuple.src.addr, ip + 12, sizeof tuple.src.addr);
+    memcpy(&tuple.dst.addr, ip + 16, sizeof tuple.dst.addr);
+    tuple.proto = ip[9];
+    tuple.src_port = 0;
+    tuple.dst_port = 0;
+    const uint8_t* l4 = ip + hdr_len;
+    const size_t l4_len = len - hdr_len;
+    switch (tuple.proto)
+    {
+    case IP_PROTO_TCP: case IP_PROTO_UDP: case IP_PROTO_UDPLITE:
+        if (l4_len < 4)
+        {
+            return false;
+        }
+        tuple.src_port = ip4_ct_read16(l4);
+        tuple.dst_port = ip4_ct_read16(l4 + 2);
+        return true;
+    case IP_PROTO_ICMP:
+        if (l4_len < 8 || ip4_conntrack_icmp_query(l4[0]) == 0)
+        {
+            return false;
+        }
+        if (ip4_conntrack_icmp_query(l4[0]) > 0)
+        {
+            tuple.src_port = ip4_ct_read16(l4 + 4);
+        }
+        else
+        {
+            tuple.dst_port = ip4_ct_read16(l4 + 4);
+        }
+        return true;
+    default:
+        return true;
+    }
+}
+
+///
+/// Whether the packet at ip, which has no entry, may start a connection: TCP
+/// segments have to be SYNs, ICMP messages queries.
+///
+bool
+ip4_conntrack_may_create(const uint8_t* ip, const size_t len)
+{
+    const size_t hdr_len = size_t(ip[0] & 0x0f) * 4;
+    const uint8_t* l4 = ip + hdr_len;
+    switch (ip[9])
+    {
+    case IP_PROTO_TCP:
+        return len >= hdr_len + 14 && (l4[13] & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN;
+    case IP_PROTO_ICMP:
+        return len >= hdr_len + 8 && ip4_conntrack_icmp_query(l4[0]) > 0;
+    default:
+        return true;
+    }
+}
+
+///
+/// Find the entry of a tuple.
+///
+/// @param dir set to the direction the tuple is of
+/// @return nullptr if there is none
+///
+Ip4CtEntry*
+ip4_conntrack_find(const Ip4CtTuple& tuple, Ip4CtDir& dir)
+{
+    if (ip4_ct_hash.empty())
+    {
+        return nullptr;
+    }
+    for (uint32_t node = ip4_ct_hash[ip4_ct_hash_tuple(tuple)]; node != IP4_CT_NONE;)
+    {
+        Ip4CtEntry& entry = ip4_ct_entries[node >> 1];
+        const auto node_dir = Ip4CtDir(node & 1);
+        if (ip4_ct_tuple_equal(entry.tuple[node_dir], tuple))
+        {
+            dir = node_dir;
+            return &entry;
+        }
+        node = entry.hash_next[node_dir];
+    }
+    return nullptr;
+}
+
+///
+/// Track a new connection, tuple being that of its first packet, which has
+/// no entry. The entry expires unless ip4_conntrack_seen() is called for the
+/// packets of the connection.
+///
+/// @return nullptr if the reply tuple is taken by another connection, or the
+///         table is full and has no unanswered connection to drop
+///
+Ip4CtEntry*
+ip4_conntrack_create(const Ip4CtTuple& tuple)
+{
+    ip4_ct_init();
+    Ip4CtDir dir;
+    const Ip4CtTuple reply = ip4_conntrack_invert(tuple);
+    if (ip4_conntrack_find(reply, dir) != nullptr)
+    {
+        return nullptr;
+    }
+    if (ip4_ct_free == IP4_CT_NONE && ip4_ct_entries.size() == IP4_CT_MAX && !ip4_ct_early_drop(tuple))
+    {
+        Logf(true, "ip4_conntrack_create: table full\n");
+        return nullptr;
+    }
+    uint32_t index;
+    if (ip4_ct_free != IP4_CT_NONE)
+    {
+        index = ip4_ct_free;
+        ip4_ct_free = ip4_ct_entries[index].hash_next[IP4_CT_DIR_ORIGINAL];
+    }
+    else
+    {
+        index = uint32_t(ip4_ct_entries.size());
+        ip4_ct_entries.emplace_back();
+    }
+    Ip4CtEntry& entry = ip4_ct_entries[index];
+    entry.tuple[IP4_CT_DIR_ORIGINAL] = tuple;
+    entry.tuple[IP4_CT_DIR_REPLY] = reply;
+    entry.flags = IP4_CT_FLAG_IN_USE;
+    switch (tuple.proto)
+    {
+    case IP_PROTO_TCP:
+        entry.state = IP4_CT_TCP_SYN_SENT;
+        break;
+    case IP_PROTO_UDP: case IP_PROTO_UDPLITE:
+        entry.state = IP4_CT_UDP;
+        break;
+    case IP_PROTO_ICMP:
+        entry.state = IP4_CT_ICMP;
+        break;
+    default:
+        entry.state = IP4_CT_OTHER;
+        break;
+    }
+    entry.expires = ip4_ct_now + ip4_ct_timeout(entry);
+    ip4_ct_hash_insert(index, IP4_CT_DIR_ORIGINAL);
+    ip4_ct_hash_insert(index, IP4_CT_DIR_REPLY);
+    ip4_ct_wheel_insert(index);
+    ip4_conntrack_count++;
+    return &entry;
+}
+
+///
+/// Change what the replies of a connection look like, as NAT does.
+///
+/// @return false if the tuple is taken by another connection
+///
+bool
+ip4_conntrack_set_reply(Ip4CtEntry& entry, const Ip4CtTuple& reply)
+{
+    Ip4CtDir dir;
+    const Ip4CtEntry* other = ip4_conntrack_find(reply, dir);
+    if (other != nullptr)
+    {
+        return other == &entry && dir == IP4_CT_DIR_REPLY;
+    }
+    const auto index = uint32_t(&entry - ip4_ct_entries.data());
+    ip4_ct_hash_remove(index, IP4_CT_DIR_REPLY);
+    entry.tuple[IP4_CT_DIR_REPLY] = reply;
+    ip4_ct_hash_insert(index, IP4_CT_DIR_REPLY);
+    return true;
+}
+
+///
+/// Account for a packet of a connection going in direction dir: update the
+/// protocol state and push the expiry back.
+///
+void
+ip4_conntrack_seen(Ip4CtEntry& entry, const Ip4CtDir dir, const uint8_t* ip, const size_t len)
+{
+    if (dir == IP4_CT_DIR_REPLY)
+    {
+        entry.flags |= IP4_CT_FLAG_SEEN_REPLY;
+    }
+    const size_t hdr_len = size_t(ip[0] & 0x0f) * 4;
+    if (entry.tuple[IP4_CT_DIR_ORIGINAL].proto == IP_PROTO_TCP && len >= hdr_len + 14)
+    {
+        ip4_ct_tcp_update(entry, dir, ip[hdr_len + 13]);
+    }
+    const uint32_t expires = ip4_ct_now + ip4_ct_timeout(entry);
+    if (expires == entry.expires)
+    {
+        return;
+    }
+    entry.expires = expires;
+    /* the entry moves when its slot comes up, unless that is too late */
+    if (int32_t(entry.wheel_due - expires) > 0)
+    {
+        const auto index = uint32_t(&entry - ip4_ct_entries.data());
+        ip4_ct_wheel_remove(index);
+        ip4_ct_wheel_insert(index);
+    }
+}
+
+///
+/// Stop tracking a connection, releasing its NAT mapping.
+///
+void
+ip4_conntrack_delete(Ip4CtEntry& entry)
+{
+    const auto index = uint32_t(&entry - ip4_ct_entries.data());
+    ip4_ct_wheel_remove(index);
+    ip4_ct_release(index);
+}
+
+///
+/// Stop tracking all connections.
+///
+void
+ip4_conntrack_flush()
+{
+    for (Ip4CtEntry& entry : ip4_ct_entries)
+    {
+        if (entry.flags & IP4_CT_FLAG_IN_USE)
+        {
+            ip4_conntrack_delete(entry);
+        }
+    }
+}
+
+///
+/// Called every IP4_CT_TMR_INTERVAL milliseconds: expire the entries of the
+/// next wheel slot, and move on those whose expiry was pushed back.
+///
+void
+ip4_conntrack_tmr()
+{
+    ip4_ct_now++;
+    if (ip4_ct_hash.empty())
+    {
+        return;
+    }
+    /* entries that stay may go back into this slot, so it is emptied first */
+    uint32_t& head = ip4_ct_wheel[ip4_ct_now % IP4_CT_WHEEL_SLOTS];
+    uint32_t index = head;
+    head = IP4_CT_NONE;
+    while (index != IP4_CT_NONE)
+    {
+        const uint32_t next = ip4_ct_entries[index].wheel_next;
+        if (int32_t(ip4_ct_entries[index].expires - ip4_ct_now) <= 0)
+        {
+            ip4_ct_release(index);
+        }
+        else
+        {
+            ip4_ct_wheel_insert(index);
+        }
+        index = next;
+    }
+}
+
+//
+// END OF FILE
+//
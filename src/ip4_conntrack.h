@@ -0,0 +1,173 @@
+///
+/// file: ip4_conntrack.h
+///
+/// IPv4 connection tracking, for the NAT of ip4_nat.h.
+///
+/// An entry follows one connection: the tuple (addresses, ports, protocol) of
+/// each direction, as its packets arrive before NAT rewrites them, and the
+/// state of the protocol. The original tuple is that of the first packet; the
+/// reply tuple is its inverse, until NAT changes what replies are addressed
+/// to. Both tuples are in one hash table, so that a packet finds its entry,
+/// and which direction it goes in, with one lookup whichever way it travels.
+/// ICMP queries are tracked by their identifier: the requests carry it as
+/// source port and the replies as destination port. Protocols without ports
+/// are tracked by their addresses.
+///
+/// Entries live in one array and link to each other by index, which keeps
+/// them small enough for IP4_CT_MAX (a million) concurrent connections. Each
+/// waits for its expiry in one slot of a timer wheel ticked by
+/// ip4_conntrack_tmr(). Packets only move the expiry time forward; an entry
+/// whose slot comes up before it has expired is moved to the slot of its new
+/// expiry time, so that most packets do not touch the wheel at all.
+///
+/// TCP is followed through its handshake and teardown to pick timeouts (RFC
+/// 5382); sequence numbers are not checked. UDP entries time out sooner until
+/// a reply has been seen (RFC 4787).
+///
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ip4_addr.h>
+
+/// Most entries.
+constexpr size_t IP4_CT_MAX = size_t(1) << 20;
+
+/// Hash buckets, a power of two; there are two tuples per entry.
+constexpr size_t IP4_CT_HASH_SIZE = size_t(1) << 21;
+
+/// Interval of ip4_conntrack_tmr() in milliseconds, one tick.
+constexpr uint32_t IP4_CT_TMR_INTERVAL = 1000;
+
+/// Slots of the timer wheel, a power of two.
+constexpr size_t IP4_CT_WHEEL_SLOTS = 512;
+
+/// Timeouts in ticks.
+constexpr uint32_t IP4_CT_TIMEOUT_TCP_SYN_SENT = 120;
+constexpr uint32_t IP4_CT_TIMEOUT_TCP_SYN_RECV = 60;
+constexpr uint32_t IP4_CT_TIMEOUT_TCP_ESTABLISHED = 7440;
+constexpr uint32_t IP4_CT_TIMEOUT_TCP_FIN_WAIT = 120;
+constexpr uint32_t IP4_CT_TIMEOUT_TCP_TIME_WAIT = 120;
+constexpr uint32_t IP4_CT_TIMEOUT_TCP_CLOSE = 10;
+constexpr uint32_t IP4_CT_TIMEOUT_UDP = 30;
+constexpr uint32_t IP4_CT_TIMEOUT_UDP_REPLIED = 180;
+constexpr uint32_t IP4_CT_TIMEOUT_ICMP = 30;
+constexpr uint32_t IP4_CT_TIMEOUT_OTHER = 600;
+
+/// No entry, end of a chain.
+constexpr uint32_t IP4_CT_NONE = 0xffffffffU;
+
+enum Ip4CtDir : uint8_t
+{
+    IP4_CT_DIR_ORIGINAL,
+    IP4_CT_DIR_REPLY,
+    IP4_CT_DIRS,
+};
+
+enum Ip4CtState : uint8_t
+{
+    IP4_CT_TCP_SYN_SENT,
+    IP4_CT_TCP_SYN_RECV,
+    IP4_CT_TCP_ESTABLISHED,
+    /// one side has sent a FIN
+    IP4_CT_TCP_FIN_WAIT,
+    /// both sides have
+    IP4_CT_TCP_TIME_WAIT,
+    /// reset
+    IP4_CT_TCP_CLOSE,
+    IP4_CT_UDP,
+    IP4_CT_ICMP,
+    IP4_CT_OTHER,
+};
+
+/// Entry flags.
+constexpr uint8_t IP4_CT_FLAG_IN_USE = 0x01U;
+/// a packet has gone in the reply direction
+constexpr uint8_t IP4_CT_FLAG_SEEN_REPLY = 0x02U;
+/// FIN seen in the original or reply direction
+constexpr uint8_t IP4_CT_FLAG_FIN_ORIGINAL = 0x04U;
+constexpr uint8_t IP4_CT_FLAG_FIN_REPLY = 0x08U;
+/// NAT has picked the source of the original direction (see ip4_nat.h)
+constexpr uint8_t IP4_CT_FLAG_NAT_DONE = 0x10U;
+/// the source, destination of the original direction is translated
+constexpr uint8_t IP4_CT_FLAG_SRC_NAT = 0x20U;
+constexpr uint8_t IP4_CT_FLAG_DST_NAT = 0x40U;
+
+/// What identifies the packets of one direction of a connection.
+struct Ip4CtTuple
+{
+    Ip4Addr src;
+    Ip4Addr dst;
+    /// host order; ICMP queries: identifier as source port of requests and
+    /// destination port of replies
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t proto;
+};
+
+struct Ip4CtEntry
+{
+    Ip4CtTuple tuple[IP4_CT_DIRS];
+    /* next in the hash chain of each tuple; chains link tuples, as entry
+       index << 1 | direction */
+    uint32_t hash_next[IP4_CT_DIRS];
+    /* neighbours in the wheel slot */
+    uint32_t wheel_prev;
+    uint32_t wheel_next;
+    /// tick the entry expires at
+    uint32_t expires;
+    /* tick the wheel slot the entry is in comes up */
+    uint32_t wheel_due;
+    Ip4CtState state;
+    /// IP4_CT_FLAG_*
+    uint8_t flags;
+};
+
+/// Mixed into the tuple hash. Set it to a random number at startup, so that
+/// the buckets of connections cannot be predicted.
+extern uint32_t ip4_conntrack_seed;
+
+/// Entries in use.
+extern size_t ip4_conntrack_count;
+
+bool
+ip4_conntrack_tuple(const uint8_t* ip, size_t len, Ip4CtTuple& tuple);
+
+bool
+ip4_conntrack_may_create(const uint8_t* ip, size_t len);
+
+Ip4CtEntry*
+ip4_conntrack_find(const Ip4CtTuple& tuple, Ip4CtDir& dir);
+
+Ip4CtEntry*
+ip4_conntrack_create(const Ip4CtTuple& tuple);
+
+bool
+ip4_conntrack_set_reply(Ip4CtEntry& entry, const Ip4CtTuple& reply);
+
+void
+ip4_conntrack_seen(Ip4CtEntry& entry, Ip4CtDir dir, const uint8_t* ip, size_t len);
+
+void
+ip4_conntrack_delete(Ip4CtEntry& entry);
+
+void
+ip4_conntrack_flush();
+
+void
+ip4_conntrack_tmr();
+
+int
+ip4_conntrack_icmp_query(uint8_t type);
+
+/// Inverse of a tuple: that of the packets going the other way.
+inline Ip4CtTuple
+ip4_conntrack_invert(const Ip4CtTuple& tuple)
+{
+    return Ip4CtTuple{tuple.dst, tuple.src, tuple.dst_port, tuple.src_port, tuple.proto};
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,410 @@
+///
+/// file: ip4_fib.cpp
+///
+/// IPv4 forwarding table, see ip4_fib.h.
+///
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <dst_cache.h>
+#include <ip4_fib.h>
+#include <lwip_debug.h>
+#include <map>
+
+std::atomic<Ip4FibTable*> ip4_fib_current[IP4_FIB_MAX_TABLES];
+
+/* a staged route: its next hops, and which of them each bucket uses */
+struct Ip4FibRoute
+{
+    std::vector<Ip4FibNextHop> next_hops;
+    IpEcmpBuckets buckets;
+};
+
+/* the staged routes of each table, keyed on prefix length << 32 | prefix
+   (host order), so that they are walked from the shortest prefix to the
+   longest */
+static std::map<uint64_t, Ip4FibRoute> ip4_fib_routes[IP4_FIB_MAX_TABLES];
+
+/* tables with changes staged since the last commit */
+static std::bitset<IP4_FIB_MAX_TABLES> ip4_fib_dirty;
+
+/* tables replaced by a commit and not freed yet */
+static std::atomic<Ip4FibTable*> ip4_fib_retired;
+
+static uint32_t ip4_fib_generation;
+
+/* Key of a route in ip4_fib_routes; false if prefix_len or the table is
+   invalid */
+static bool
+ip4_fib_key(const Ip4Addr& prefix, const uint8_t prefix_len, const uint8_t table, uint64_t& key)
+{
+    if (prefix_len > 32 || table >= IP4_FIB_MAX_TABLES)
+    {
+        return false;
+    }
+    const uint32_t mask = prefix_len == 0 ? 0 : 0xffffffffU << (32 - prefix_len);
+    key = uint64_t(prefix_len) << 32 | (lwip_ntohl(prefix.addr) & mask);
+    return true;
+}
+
+/* Key of a next hop in the maps below */
+static uint64_t
+ip4_fib_hop_key(const Ip4FibNextHop& next_hop)
+{
+    return uint64_t(next_hop.gateway.addr) << 32 | next_hop.if_num;
+}
+
+/* Fill a new table from the staged routes of a table */
+static LwipStatus
+ip4_fib_build(const std::map<uint64_t, Ip4FibRoute>& routes, Ip4FibTable& table)
+{
+    table.tbl24.assign(size_t(1) << 24, IP4_FIB_ENTRY_NONE);
+    /* next hops are shared by all the paths using them, paths by all the
+       routes using them */
+    std::map<uint64_t, uint16_t> hop_entries;
+    std::map<std::array<uint16_t, IP_ECMP_BUCKETS>, uint16_t> path_entries;
+    for (const auto& route : routes)
+    {
+        const auto prefix_len = uint8_t(route.first >> 32);
+        const auto prefix = uint32_t(route.first);
+        std::array<uint16_t, IP_ECMP_MAX_NEXT_HOPS> members{};
+        for (size_t m = 0; m < route.second.next_hops.size(); m++)
+        {
+            const Ip4FibNextHop& next_hop = route.second.next_hops[m];
+            auto hop = hop_entries.find(ip4_fib_hop_key(next_hop));
+            if (hop == hop_entries.end())
+            {
+                if (table.next_hops.size() == IP4_FIB_MAX_NEXT_HOPS)
+                {
+                    Logf(true, "ip4_fib_build: too many next hops\n");
+                    return ERR_MEM;
+                }
+                table.next_hops.push_back(next_hop);
+                hop = hop_entries.emplace(ip4_fib_hop_key(next_hop), uint16_t(table.next_hops.size() - 1)).first;
+            }
+            members[m] = hop->second;
+        }
+        std::array<uint16_t, IP_ECMP_BUCKETS> path_key{};
+        for (size_t b = 0; b < IP_ECMP_BUCKETS; b++)
+        {
+            path_key[b] = members[route.second.buckets[b]];
+        }
+        auto path = path_entries.find(path_key);
+        if (path == path_entries.end())
+        {
+            if (path_entries.size() == IP4_FIB_MAX_PATHS)
+            {
+                Logf(true, "ip4_fib_build: too many paths\n");
+                return ERR_MEM;
+            }
+            table.paths.insert(table.paths.end(), path_key.begin(), path_key.end());
+            path = path_entries.emplace(path_key, uint16_t(path_entries.size() + 1)).first;
+        }
+        const uint16_t entry = path->second;
+        if (prefix_len <= 24)
+        {
+            /* all /25 and longer prefixes come later, so no group is
+               overwritten here */
+            std::fill_n(table.tbl24.data() + (prefix >> 8), size_t(1) << (24 - prefix_len), entry);
+            continue;
+        }
+        uint16_t& slot = table.tbl24[prefix >> 8];
+        if (!(slot & IP4_FIB_ENTRY_GROUP))
+        {
+            const size_t group = table.tbl8.size() >> 8;
+            if (group == IP4_FIB_MAX_GROUPS)
+            {
+                Logf(true, "ip4_fib_build: too many tbl8 groups\n");
+                return ERR_MEM;
+            }
+            /* the group starts out with the route of the /24 covering it */
+            table.tbl8.resize(table.tbl8.size() + 256, slot);
+            slot = uint16_t(IP4_FIB_ENTRY_GROUP | group);
+        }
+        const size_t base = size_t(slot & ~IP4_FIB_ENTRY_GROUP) << 8;
+        std::fill_n(table.tbl8.data() + base + (prefix & 0xff), size_t(1) << (32 - prefix_len), entry);
+    }
+    table.packets = std::vector<std::atomic<uint64_t>>(table.next_hops.size());
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage a route with a single next hop, replacing the one with the same
+ * prefix.
+ *
+ * @param prefix network of the route, host bits are ignored
+ * @param prefix_len 0 (default route) to 32
+ * @param next_hop where the route sends packets
+ * @param table table of the route
+ * @return ERR_VAL if prefix_len or table is invalid
+ */
+LwipStatus
+ip4_fib_add(const Ip4Addr& prefix, const uint8_t prefix_len, const Ip4FibNextHop& next_hop, const uint8_t table)
+{
+    uint64_t key;
+    if (!ip4_fib_key(prefix, prefix_len, table, key))
+    {
+        return ERR_VAL;
+    }
+    ip4_fib_dirty.set(table);
+    Ip4FibRoute& route = ip4_fib_routes[table][key];
+    route.next_hops.assign(1, next_hop);
+    route.buckets.fill(0);
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage a next hop joining the next hop group of a route, creating the
+ * route if there is none with that prefix. The flows of the other next hops
+ * only move to the new one as far as needed to balance the group.
+ *
+ * @return ERR_MEM if the group has IP_ECMP_MAX_NEXT_HOPS next hops
+ */
+LwipStatus
+ip4_fib_add_next_hop(const Ip4Addr& prefix,
+                     const uint8_t prefix_len,
+                     const Ip4FibNextHop& next_hop,
+                     const uint8_t table)
+{
+    uint64_t key;
+    if (!ip4_fib_key(prefix, prefix_len, table, key))
+    {
+        return ERR_VAL;
+    }
+    ip4_fib_dirty.set(table);
+    Ip4FibRoute& route = ip4_fib_routes[table][key];
+    for (const auto& member : route.next_hops)
+    {
+        if (ip4_fib_hop_key(member) == ip4_fib_hop_key(next_hop))
+        {
+            return STATUS_SUCCESS;
+        }
+    }
+    if (route.next_hops.size() == IP_ECMP_MAX_NEXT_HOPS)
+    {
+        return ERR_MEM;
+    }
+    route.next_hops.push_back(next_hop);
+    ip_ecmp_add_member(route.buckets, route.next_hops.size());
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage the removal of a route.
+ *
+ * @return STATUS_NOT_FOUND if there is no route with that prefix
+ */
+LwipStatus
+ip4_fib_delete(const Ip4Addr& prefix, const uint8_t prefix_len, const uint8_t table)
+{
+    uint64_t key;
+    if (!ip4_fib_key(prefix, prefix_len, table, key))
+    {
+        return ERR_VAL;
+    }
+    ip4_fib_dirty.set(table);
+    return ip4_fib_routes[table].erase(key) != 0 ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+/**
+ * Stage a next hop leaving the next hop group of a route; only its flows move
+ * to other next hops. The route goes away with its last next hop.
+ *
+ * @return STATUS_NOT_FOUND if the route does not have that next hop
+ */
+LwipStatus
+ip4_fib_delete_next_hop(const Ip4Addr& prefix,
+                        const uint8_t prefix_len,
+                        const Ip4FibNextHop& next_hop,
+                        const uint8_t table)
+{
+    uint64_t key;
+    if (!ip4_fib_key(prefix, prefix_len, table, key))
+    {
+        return ERR_VAL;
+    }
+    ip4_fib_dirty.set(table);
+    const auto it = ip4_fib_routes[table].find(key);
+    if (it == ip4_fib_routes[table].end())
+    {
+        return STATUS_NOT_FOUND;
+    }
+    Ip4FibRoute& route = it->second;
+    for (size_t m = 0; m < route.next_hops.size(); m++)
+    {
+        if (ip4_fib_hop_key(route.next_hops[m]) != ip4_fib_hop_key(next_hop))
+        {
+            continue;
+        }
+        if (route.next_hops.size() == 1)
+        {
+            ip4_fib_routes[table].erase(it);
+            return STATUS_SUCCESS;
+        }
+        ip_ecmp_remove_member(route.buckets, route.next_hops.size(), m);
+        route.next_hops.erase(route.next_hops.begin() + m);
+        return STATUS_SUCCESS;
+    }
+    return STATUS_NOT_FOUND;
+}
+
+/**
+ * Stage the removal of all routes of a table.
+ *
+ * @return ERR_VAL if table is invalid
+ */
+LwipStatus
+ip4_fib_clear(const uint8_t table)
+{
+    if (table >= IP4_FIB_MAX_TABLES)
+    {
+        return ERR_VAL;
+    }
+    ip4_fib_routes[table].clear();
+    ip4_fib_dirty.set(table);
+    return STATUS_SUCCESS;
+}
+
+/* Carry the counters of the next hops that stay in a table over to its
+   replacement; packets the stack thread counts in the old table while this
+   runs are lost */
+static void
+ip4_fib_carry_counters(const Ip4FibTable& current, Ip4FibTable& table)
+{
+    std::map<uint64_t, uint64_t> counts;
+    for (size_t i = 0; i < current.next_hops.size(); i++)
+    {
+        counts[ip4_fib_hop_key(current.next_hops[i])] = current.packets[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < table.next_hops.size(); i++)
+    {
+        const auto count = counts.find(ip4_fib_hop_key(table.next_hops[i]));
+        if (count != counts.end())
+        {
+            table.packets[i].store(count->second, std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Build new tables from the staged routes of the tables that changed and make
+ * lookups use them. The tables they replace are freed by the next
+ * ip4_fib_reclaim().
+ *
+ * @return ERR_MEM if the routes of a table need more next hops or tbl8 groups
+ *         than a table can hold; lookups keep using the current tables, and
+ *         the changes stay staged
+ */
+LwipStatus
+ip4_fib_commit()
+{
+    /* all tables are built before any is published, so that lookups see all
+       of the changes or none */
+    std::array<Ip4FibTable*, IP4_FIB_MAX_TABLES> tables{};
+    for (size_t t = 0; t < IP4_FIB_MAX_TABLES; t++)
+    {
+        if (!ip4_fib_dirty.test(t) || ip4_fib_routes[t].empty())
+        {
+            continue;
+        }
+        tables[t] = new Ip4FibTable;
+        const LwipStatus err = ip4_fib_build(ip4_fib_routes[t], *tables[t]);
+        if (err != STATUS_SUCCESS)
+        {
+            for (const Ip4FibTable* table : tables)
+            {
+                delete table;
+            }
+            return err;
+        }
+    }
+    ++ip4_fib_generation;
+    for (size_t t = 0; t < IP4_FIB_MAX_TABLES; t++)
+    {
+        if (!ip4_fib_dirty.test(t))
+        {
+            continue;
+        }
+        Ip4FibTable* table = tables[t];
+        if (table != nullptr)
+        {
+            table->generation = ip4_fib_generation;
+            table->retired_next = nullptr;
+            const Ip4FibTable* current = ip4_fib_current[t].load(std::memory_order_acquire);
+            if (current != nullptr)
+            {
+                ip4_fib_carry_counters(*current, *table);
+            }
+            Logf(true,
+                 "ip4_fib_commit: table %zu generation %u, %zu routes, %zu paths, %zu next hops, %zu tbl8 groups\n",
+                 t,
+                 table->generation,
+                 ip4_fib_routes[t].size(),
+                 table->paths.size() / IP_ECMP_BUCKETS,
+                 table->next_hops.size(),
+                 table->tbl8.size() >> 8);
+        }
+        Ip4FibTable* old = ip4_fib_current[t].exchange(table, std::memory_order_acq_rel);
+        if (old != nullptr)
+        {
+            old->retired_next = ip4_fib_retired.load(std::memory_order_relaxed);
+            while (!ip4_fib_retired.compare_exchange_weak(old->retired_next,
+                                                          old,
+                                                          std::memory_order_release,
+                                                          std::memory_order_relaxed))
+            {
+            }
+        }
+    }
+    ip4_fib_dirty.reset();
+    dst_cache_invalidate_all();
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Free the tables replaced by earlier commits. Called by the stack thread
+ * while it is not in the middle of a lookup, which is when no reference to a
+ * replaced table can be left.
+ */
+void
+ip4_fib_reclaim()
+{
+    Ip4FibTable* table = ip4_fib_retired.exchange(nullptr, std::memory_order_acquire);
+    while (table != nullptr)
+    {
+        Ip4FibTable* next = table->retired_next;
+        delete table;
+        table = next;
+    }
+}
+
+/**
+ * Packets sent to a next hop of a table through ip4_fib_route() since it was
+ * first committed; 0 if no route of the published table uses it.
+ */
+uint64_t
+ip4_fib_next_hop_packets(const Ip4FibNextHop& next_hop, const uint8_t table_id)
+{
+    if (table_id >= IP4_FIB_MAX_TABLES)
+    {
+        return 0;
+    }
+    const Ip4FibTable* table = ip4_fib_current[table_id].load(std::memory_order_acquire);
+    if (table == nullptr)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < table->next_hops.size(); i++)
+    {
+        if (ip4_fib_hop_key(table->next_hops[i]) == ip4_fib_hop_key(next_hop))
+        {
+            return table->packets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,195 @@
+///
+/// file: ip4_fib.h
+///
+/// The IPv4 forwarding table: longest prefix match over any number of routes,
+/// each with its own gateway and interface.
+///
+/// Lookups use a DIR-24-8 table: the top 24 bits of the destination index
+/// tbl24, whose entry is either the next hop of the longest prefix of up to
+/// 24 bits covering those addresses, or a group of 256 tbl8 entries that
+/// the last 8 bits index, for the /25 to /32 prefixes below it. A lookup is
+/// thus one or two memory reads, whatever the number of routes.
+///
+/// Updates are staged: ip4_fib_add() and ip4_fib_delete() change the route
+/// set only, ip4_fib_commit() builds a new table from it and publishes it with
+/// one atomic pointer swap, so lookups see either all or none of a batch of
+/// updates and never wait for them. The replaced table is retired, not freed:
+/// lookups run on the stack thread only, which calls ip4_fib_reclaim() when
+/// it holds no table (between packets) to free retired tables.
+///
+/// A route may have several next hops (ip4_fib_add_next_hop()); lookups then
+/// pick one by flow hash, see ip_ecmp.h. Table entries name a path: the next
+/// hop of each of the IP_ECMP_BUCKETS hash buckets, which all name the same
+/// next hop for single-path routes. Routes with the same next hops share a
+/// path.
+///
+/// There are IP4_FIB_MAX_TABLES tables, numbered from 0; the routing policy
+/// (ip4_rule.h) picks the one a packet is routed by, IP4_FIB_TABLE_MAIN when
+/// no rule applies. Each table is staged and published on its own, and costs
+/// the 32 MiB of its tbl24 once it has routes; tables without routes are not
+/// built and lookups in them miss.
+///
+/// The route set is not locked; updates come from one thread at a time.
+///
+
+#pragma once
+
+#include <atomic>
+#include <def.h>
+#include <ip4_addr.h>
+#include <ip_ecmp.h>
+#include <lwip_status.h>
+#include <vector>
+
+/// Where a route sends packets.
+struct Ip4FibNextHop
+{
+    /// gateway to send to, the any address for directly connected networks
+    Ip4Addr gateway;
+    /// if_num of the outgoing interface
+    uint32_t if_num;
+};
+
+/// A published table.
+struct Ip4FibTable
+{
+    /// 2^24 entries, see IP4_FIB_ENTRY_*
+    std::vector<uint16_t> tbl24;
+    /// groups of 256 entries
+    std::vector<uint16_t> tbl8;
+    /// IP_ECMP_BUCKETS indices in next_hops per path
+    std::vector<uint16_t> paths;
+    std::vector<Ip4FibNextHop> next_hops;
+    /// packets ip4_fib_route() sent to each next hop
+    mutable std::vector<std::atomic<uint64_t>> packets;
+    /// bumped by every commit
+    uint32_t generation;
+    /* next table waiting for ip4_fib_reclaim() */
+    Ip4FibTable* retired_next;
+};
+
+/* tbl24 entries with this bit set hold the number of a tbl8 group */
+constexpr uint16_t IP4_FIB_ENTRY_GROUP = 0x8000;
+
+/* other entries hold a path index + 1, 0 is no route */
+constexpr uint16_t IP4_FIB_ENTRY_NONE = 0;
+
+/// Most distinct paths, next hops and tbl8 groups a table can have.
+constexpr size_t IP4_FIB_MAX_PATHS = IP4_FIB_ENTRY_GROUP - 1;
+constexpr size_t IP4_FIB_MAX_NEXT_HOPS = 0xffff;
+constexpr size_t IP4_FIB_MAX_GROUPS = IP4_FIB_ENTRY_GROUP;
+
+/// Number of tables.
+constexpr size_t IP4_FIB_MAX_TABLES = 16;
+
+/// The table routes go to unless told otherwise.
+constexpr uint8_t IP4_FIB_TABLE_MAIN = 0;
+
+LwipStatus
+ip4_fib_add(const Ip4Addr& prefix,
+            uint8_t prefix_len,
+            const Ip4FibNextHop& next_hop,
+            uint8_t table = IP4_FIB_TABLE_MAIN);
+
+LwipStatus
+ip4_fib_add_next_hop(const Ip4Addr& prefix,
+                     uint8_t prefix_len,
+                     const Ip4FibNextHop& next_hop,
+                     uint8_t table = IP4_FIB_TABLE_MAIN);
+
+LwipStatus
+ip4_fib_delete(const Ip4Addr& prefix, uint8_t prefix_len, uint8_t table = IP4_FIB_TABLE_MAIN);
+
+LwipStatus
+ip4_fib_delete_next_hop(const Ip4Addr& prefix,
+                        uint8_t prefix_len,
+                        const Ip4FibNextHop& next_hop,
+                        uint8_t table = IP4_FIB_TABLE_MAIN);
+
+LwipStatus
+ip4_fib_clear(uint8_t table = IP4_FIB_TABLE_MAIN);
+
+LwipStatus
+ip4_fib_commit();
+
+void
+ip4_fib_reclaim();
+
+uint64_t
+ip4_fib_next_hop_packets(const Ip4FibNextHop& next_hop, uint8_t table = IP4_FIB_TABLE_MAIN);
+
+/// The published tables lookups use, nullptr while a table has no routes.
+extern std::atomic<Ip4FibTable*> ip4_fib_current[IP4_FIB_MAX_TABLES];
+
+/* Index in table->next_hops of the next hop of the longest prefix covering
+   dst for flow_hash, -1 if there is none */
+inline int32_t
+ip4_fib_find(const Ip4FibTable* table, const Ip4Addr& dst, const uint32_t flow_hash)
+{
+    if (table == nullptr)
+    {
+        return -1;
+    }
+    const uint32_t addr = lwip_ntohl(dst.addr);
+    uint16_t entry = table->tbl24[addr >> 8];
+    if (entry & IP4_FIB_ENTRY_GROUP)
+    {
+        entry = table->tbl8[size_t(entry & ~IP4_FIB_ENTRY_GROUP) << 8 | (addr & 0xff)];
+    }
+    if (entry == IP4_FIB_ENTRY_NONE)
+    {
+        return -1;
+    }
+    return table->paths[size_t(entry - 1) * IP_ECMP_BUCKETS + ip_ecmp_bucket(flow_hash)];
+}
+
+///
+/// Longest prefix match of dst in a published table. Stack thread only.
+///
+/// @param flow_hash picks one of the next hops of multipath routes, see
+///        ip_ecmp.h
+/// @param table_id a table below IP4_FIB_MAX_TABLES
+/// @return false if no route covers dst
+///
+inline bool
+ip4_fib_lookup(const Ip4Addr& dst,
+               Ip4FibNextHop& next_hop,
+               const uint32_t flow_hash = 0,
+               const uint8_t table_id = IP4_FIB_TABLE_MAIN)
+{
+    const Ip4FibTable* table = ip4_fib_current[table_id].load(std::memory_order_acquire);
+    const int32_t hop = ip4_fib_find(table, dst, flow_hash);
+    if (hop < 0)
+    {
+        return false;
+    }
+    next_hop = table->next_hops[hop];
+    return true;
+}
+
+///
+/// ip4_fib_lookup() for a packet that is sent to the next hop found, which
+/// counts it (see ip4_fib_next_hop_packets()). The counters are accurate for
+/// forwarded packets; a flow whose route a pcb caches (dst_cache.h) is only
+/// counted when the route is looked up.
+///
+inline bool
+ip4_fib_route(const Ip4Addr& dst,
+              const uint32_t flow_hash,
+              Ip4FibNextHop& next_hop,
+              const uint8_t table_id = IP4_FIB_TABLE_MAIN)
+{
+    const Ip4FibTable* table = ip4_fib_current[table_id].load(std::memory_order_acquire);
+    const int32_t hop = ip4_fib_find(table, dst, flow_hash);
+    if (hop < 0)
+    {
+        return false;
+    }
+    table->packets[hop].fetch_add(1, std::memory_order_relaxed);
+    next_hop = table->next_hops[hop];
+    return true;
+}
+
+//
+// END OF FILE
+//
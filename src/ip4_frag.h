@@ -42,6 +42,26 @@
 #include <network_interface.h>
 #include <ip_addr.h>
 #include <ip.h>
+#include <map>
+#include <vector>
+
+/*
+ * Reassembly keeps the datagrams in progress in a hash table keyed on
+ * (source, destination, identification, protocol), so a fragment finds its
+ * datagram without scanning the others. The fragments of a datagram are kept
+ * in a map of the byte ranges they cover, so placing one and checking it for
+ * overlap costs O(log k) in the k fragments queued; a byte count tells when
+ * the ranges cover the datagram without walking them. The complete datagram
+ * is then copied into one buffer in a single pass over the map.
+ *
+ * Queued fragments are limited by bytes (IP4_REASS_MAX_BYTES) over all
+ * datagrams, not by buffers: when a fragment does not fit, the oldest other
+ * datagrams are dropped until it does. Datagrams expire IP_REASS_MAXAGE ticks
+ * of ip_reass_tmr() after their first fragment arrived, from a timer wheel
+ * with one slot per tick, so the timer only looks at the datagrams that
+ * expire. An ICMP time exceeded goes back for those whose first fragment
+ * arrived (RFC 792).
+ */
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,21 +70,70 @@ extern "C" {
 /* The IP reassembly timer interval in milliseconds. */
 #define IP_TMR_INTERVAL 1000
 
-/** IP reassembly helper struct.
- * This is exported because memp needs to know the size.
- */
-struct ip_reassdata {
-  struct ip_reassdata *next;
-  struct PacketBuffer *p;
-  struct Ip4Hdr iphdr;
-  uint16_t datagram_len;
-  uint8_t flags;
-  uint8_t timer;
+/* Most bytes the queued fragments and their datagrams may use. */
+constexpr size_t IP4_REASS_MAX_BYTES = size_t(4) << 20;
+
+/* Hash buckets of the datagrams in progress, a power of two. */
+constexpr size_t IP4_REASS_HASH_SIZE = 1024;
+
+/* Slots of the expiry wheel, a power of two above IP_REASS_MAXAGE. */
+constexpr size_t IP4_REASS_WHEEL_SLOTS = 16;
+
+/* A queued fragment: its payload, from the key of the map it is in to end. */
+struct Ip4ReassFragment
+{
+    uint16_t end;
+    std::vector<uint8_t> data;
+};
+
+/* A datagram in progress. */
+struct Ip4ReassDatagram
+{
+    Ip4Addr src;
+    Ip4Addr dst;
+    uint16_t id;
+    uint8_t proto;
+    /* next in the hash chain */
+    Ip4ReassDatagram* hash_next;
+    /* neighbours in the wheel slot, oldest first */
+    Ip4ReassDatagram* wheel_prev;
+    Ip4ReassDatagram* wheel_next;
+    /* tick the datagram expires at */
+    uint32_t expires;
+    /* fragments by offset, not overlapping */
+    std::map<uint16_t, Ip4ReassFragment> fragments;
+    /* payload bytes queued, and the payload length once the last fragment
+       (MF clear) arrived, 0 before */
+    size_t received;
+    size_t datagram_len;
+    /* IP header of the first fragment, with its options; of another fragment
+       until the first arrives */
+    std::vector<uint8_t> header;
+    /* bytes charged to IP4_REASS_MAX_BYTES */
+    size_t bytes;
+    uint32_t input_netif_idx;
 };
 
+/* Counters of the reassembly. */
+struct Ip4ReassStats
+{
+    /* datagrams completed */
+    size_t reassembled;
+    /* datagrams expired, and dropped to make room */
+    size_t timed_out;
+    size_t evicted;
+    /* fragments dropped: malformed, overlapping or not fitting */
+    size_t dropped;
+};
+
+extern Ip4ReassStats ip4_reass_stats;
+
+/* Bytes the queued fragments use. */
+extern size_t ip4_reass_bytes;
+
 void ip_reass_init(void);
 void ip_reass_tmr(void);
-struct PacketBuffer * ip4_reass(struct PacketBuffer *p);
+bool ip4_reass(PacketBuffer& pkt_buf);
 
 #ifndef LWIP_PBUF_CUSTOM_REF_DEFINED
 #define LWIP_PBUF_CUSTOM_REF_DEFINED
@@ -0,0 +1,500 @@
+///
+/// file: ip4_nat.cpp
+///
+/// NAT44, see ip4_nat.h.
+///
+
+#include <algorithm>
+#include <cstring>
+#include <icmp.h>
+#include <initializer_list>
+#include <ip.h>
+#include <ip4.h>
+#include <ip4_nat.h>
+#include <port_alloc.h>
+#include <unordered_map>
+#include <vector>
+
+Ip4NatStats ip4_nat_stats;
+
+static std::vector<Ip4NatRule> ip4_nat_rules;
+
+/* ports source NAT uses on an external address, per protocol */
+struct Ip4NatPorts
+{
+    PortAllocator tcp;
+    PortAllocator udp;
+    PortAllocator icmp;
+    /* connections translated to the address; it is forgotten with the last */
+    size_t users;
+};
+
+/* keyed on the external address */
+static std::unordered_map<uint32_t, Ip4NatPorts> ip4_nat_ports;
+
+static uint16_t
+ip4_nat_read16(const uint8_t* p)
+{
+    return uint16_t(p[0] << 8 | p[1]);
+}
+
+static void
+ip4_nat_write16(uint8_t* p, const uint16_t value)
+{
+    p[0] = uint8_t(value >> 8);
+    p[1] = uint8_t(value);
+}
+
+/* Update the checksum at csum for a 16-bit word of the data it covers going
+   from one value to another (RFC 1624, eqn. 3) */
+static void
+ip4_nat_csum_update(uint8_t* csum, const uint16_t from, const uint16_t to)
+{
+    uint32_t sum = uint32_t(uint16_t(~ip4_nat_read16(csum))) + uint16_t(~from) + to;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    ip4_nat_write16(csum, uint16_t(~sum));
+}
+
+/* Set a 16-bit word and update the checksums covering it; nullptr entries
+   are skipped */
+static void
+ip4_nat_set16(uint8_t* field, const uint16_t to, const std::initializer_list<uint8_t*> csums)
+{
+    const uint16_t from = ip4_nat_read16(field);
+    if (from == to)
+    {
+        return;
+    }
+    ip4_nat_write16(field, to);
+    for (uint8_t* csum : csums)
+    {
+        if (csum != nullptr)
+        {
+            ip4_nat_csum_update(csum, from, to);
+        }
+    }
+}
+
+/* Translate the source (src) or destination address and port of the IPv4
+   packet at ip, updating the checksums covering them. outer is the checksum
+   of the ICMP error the packet is embedded in, nullptr if it is not: embedded
+   packets are truncated, so their transport checksum is left alone, but every
+   word changed in them counts in the ICMP checksum. */
+static void
+ip4_nat_rewrite(uint8_t* ip,
+                const size_t len,
+                const bool src,
+                const Ip4Addr& addr,
+                const uint16_t port,
+                uint8_t* outer)
+{
+    const size_t hdr_len = size_t(ip[0] & 0x0f) * 4;
+    uint8_t* l4 = ip + hdr_len;
+    const size_t l4_len = len - hdr_len;
+    uint8_t* l4_csum = nullptr;
+    uint8_t* port_field = nullptr;
+    uint8_t* port_csum = nullptr;
+    switch (ip[9])
+    {
+    case IP_PROTO_TCP:
+        if (outer == nullptr && l4_len >= 18)
+        {
+            l4_csum = l4 + 16;
+        }
+        if (l4_len >= 4)
+        {
+            port_field = l4 + (src ? 0 : 2);
+            port_csum = l4_csum;
+        }
+        break;
+    case IP_PROTO_UDP: case IP_PROTO_UDPLITE:
+        /* a zero UDP checksum is no checksum */
+        if (outer == nullptr && l4_len >= 8 && ip4_nat_read16(l4 + 6) != 0)
+        {
+            l4_csum = l4 + 6;
+        }
+        if (l4_len >= 4)
+        {
+            port_field = l4 + (src ? 0 : 2);
+            port_csum = l4_csum;
+        }
+        break;
+    case IP_PROTO_ICMP:
+        /* the identifier is the source port of queries and the destination
+           port of replies; the ICMP checksum has no pseudo header */
+        if (l4_len >= 8 && ip4_conntrack_icmp_query(l4[0]) == (src ? 1 : -1))
+        {
+            port_field = l4 + 4;
+            port_csum = outer == nullptr ? l4 + 2 : nullptr;
+        }
+        break;
+    default:
+        break;
+    }
+    const uint16_t ip_csum = ip4_nat_read16(ip + 10);
+    uint8_t* addr_field = ip + (src ? 12 : 16);
+    uint8_t to[4];
+    memcpy(to, &addr.addr, sizeof to);
+    ip4_nat_set16(addr_field, ip4_nat_read16(to), {ip + 10, l4_csum, outer});
+    ip4_nat_set16(addr_field + 2, ip4_nat_read16(to + 2), {ip + 10, l4_csum, outer});
+    if (port_field != nullptr)
+    {
+        ip4_nat_set16(port_field, port, {port_csum, outer});
+    }
+    if (outer != nullptr)
+    {
+        ip4_nat_csum_update(outer, ip_csum, ip4_nat_read16(ip + 10));
+    }
+    if (l4_csum != nullptr && ip[9] != IP_PROTO_TCP && ip4_nat_read16(l4_csum) == 0)
+    {
+        ip4_nat_write16(l4_csum, 0xffff);
+    }
+}
+
+/* Length of the IPv4 packet in pkt_buf without link-layer padding, 0 if its
+   header is not all there */
+static size_t
+ip4_nat_len(const PacketBuffer& pkt_buf)
+{
+    const std::vector<uint8_t>& data = pkt_buf.data;
+    if (data.size() < IP4_HDR_LEN)
+    {
+        return 0;
+    }
+    const size_t hdr_len = size_t(data[0] & 0x0f) * 4;
+    const size_t len = std::min(data.size(), size_t(data[2] << 8 | data[3]));
+    return hdr_len >= IP4_HDR_LEN && hdr_len <= len ? len : 0;
+}
+
+static bool
+ip4_nat_prefix_match(const Ip4Addr& addr, const Ip4Addr& prefix, const uint8_t prefix_len)
+{
+    const uint32_t mask = prefix_len == 0 ? 0 : 0xffffffffU << (32 - prefix_len);
+    return ((lwip_ntohl(addr.addr) ^ lwip_ntohl(prefix.addr)) & mask) == 0;
+}
+
+/* First destination (dnat) or source NAT rule a connection matches */
+static const Ip4NatRule*
+ip4_nat_match(const bool dnat, const Ip4CtTuple& tuple, const uint32_t if_num)
+{
+    for (const auto& rule : ip4_nat_rules)
+    {
+        if ((rule.type == IP4_NAT_DNAT) != dnat || (rule.if_num != IP4_NAT_ANY_IF && rule.if_num != if_num) ||
+            (rule.proto != 0 && rule.proto != tuple.proto) || (rule.dst_port != 0 && rule.dst_port != tuple.dst_port))
+        {
+            continue;
+        }
+        if (ip4_nat_prefix_match(tuple.src, rule.src, rule.src_len) &&
+            ip4_nat_prefix_match(tuple.dst, rule.dst, rule.dst_len))
+        {
+            return &rule;
+        }
+    }
+    return nullptr;
+}
+
+/* Port bitmap of a protocol, nullptr for protocols without ports */
+static PortAllocator*
+ip4_nat_allocator(Ip4NatPorts& ports, const uint8_t proto)
+{
+    switch (proto)
+    {
+    case IP_PROTO_TCP:
+        return &ports.tcp;
+    case IP_PROTO_UDP: case IP_PROTO_UDPLITE:
+        return &ports.udp;
+    case IP_PROTO_ICMP:
+        return &ports.icmp;
+    default:
+        return nullptr;
+    }
+}
+
+/* Give a connection the external address of a source NAT rule and a port on
+   it; false if no port is free */
+static bool
+ip4_nat_map_source(Ip4CtEntry& entry, const Ip4NatRule& rule, const NetworkInterface& out_netif)
+{
+    Ip4Addr addr = rule.to_addr;
+    if (rule.type == IP4_NAT_MASQUERADE)
+    {
+        if (out_netif.ip4_addresses.empty())
+        {
+            return false;
+        }
+        addr = out_netif.ip4_addresses[0].address;
+    }
+    auto it = ip4_nat_ports.find(addr.addr);
+    if (it == ip4_nat_ports.end())
+    {
+        it = ip4_nat_ports.emplace(addr.addr, Ip4NatPorts{}).first;
+        port_alloc_init(it->second.tcp, IP4_NAT_PORT_MIN, IP4_NAT_PORT_MAX);
+        port_alloc_init(it->second.udp, IP4_NAT_PORT_MIN, IP4_NAT_PORT_MAX);
+        port_alloc_init(it->second.icmp, IP4_NAT_PORT_MIN, IP4_NAT_PORT_MAX);
+    }
+    Ip4NatPorts& ports = it->second;
+    PortAllocator* allocator = ip4_nat_allocator(ports, entry.tuple[IP4_CT_DIR_ORIGINAL].proto);
+    Ip4CtTuple reply = entry.tuple[IP4_CT_DIR_REPLY];
+    reply.dst = addr;
+    bool mapped = true;
+    if (allocator != nullptr)
+    {
+        /* the source port (ICMP identifier) stays if it is free */
+        uint16_t port = reply.dst_port;
+        if (port < IP4_NAT_PORT_MIN || port > IP4_NAT_PORT_MAX || port_alloc_in_use(*allocator, port))
+        {
+            port = port_alloc_pick(*allocator);
+        }
+        reply.dst_port = port;
+        mapped = port != 0;
+    }
+    mapped = mapped && ip4_conntrack_set_reply(entry, reply);
+    if (!mapped)
+    {
+        if (ports.users == 0)
+        {
+            ip4_nat_ports.erase(it);
+        }
+        return false;
+    }
+    if (allocator != nullptr)
+    {
+        port_alloc_ref(*allocator, reply.dst_port);
+    }
+    ports.users++;
+    entry.flags |= IP4_CT_FLAG_SRC_NAT;
+    ip4_nat_stats.mapped++;
+    return true;
+}
+
+/* Translate an ICMP error about a tracked connection. The packet it embeds
+   went the other way: it is put back the way it was before translation, and
+   the error goes to where that packet came from. */
+static void
+ip4_nat_icmp_error(uint8_t* ip, const size_t len)
+{
+    const size_t hdr_len = size_t(ip[0] & 0x0f) * 4;
+    if (ip[9] != IP_PROTO_ICMP || len < hdr_len + 8 + IP4_HDR_LEN)
+    {
+        return;
+    }
+    uint8_t* icmp = ip + hdr_len;
+    if (icmp[0] != ICMP_DUR && icmp[0] != ICMP_TE && icmp[0] != ICMP_PP)
+    {
+        return;
+    }
+    uint8_t* inner = icmp + 8;
+    const size_t inner_len = len - hdr_len - 8;
+    Ip4CtTuple tuple;
+    Ip4CtDir dir;
+    if (!ip4_conntrack_tuple(inner, inner_len, tuple))
+    {
+        return;
+    }
+    const Ip4CtEntry* entry = ip4_conntrack_find(ip4_conntrack_invert(tuple), dir);
+    if (entry == nullptr)
+    {
+        return;
+    }
+    const Ip4CtTuple& original = entry->tuple[dir ^ 1];
+    /* an error from the destination itself comes from where the embedded
+       packet was sent to before translation */
+    const bool from_dst = memcmp(ip + 12, inner + 16, 4) == 0;
+    ip4_nat_rewrite(inner, inner_len, true, original.src, original.src_port, icmp + 2);
+    ip4_nat_rewrite(inner, inner_len, false, original.dst, original.dst_port, icmp + 2);
+    ip4_nat_rewrite(ip, len, false, original.src, 0, nullptr);
+    if (from_dst)
+    {
+        ip4_nat_rewrite(ip, len, true, original.dst, 0, nullptr);
+    }
+}
+
+/**
+ * Add a rule after the others.
+ *
+ * @return ERR_VAL if a prefix length is invalid
+ */
+LwipStatus
+ip4_nat_add_rule(const Ip4NatRule& rule)
+{
+    if (rule.src_len > 32 || rule.dst_len > 32)
+    {
+        return ERR_VAL;
+    }
+    ip4_nat_rules.push_back(rule);
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Remove all rules. Connections keep the translation they have.
+ */
+void
+ip4_nat_clear_rules()
+{
+    ip4_nat_rules.clear();
+}
+
+/**
+ * Whether there are rules, and connections are tracked.
+ */
+bool
+ip4_nat_enabled()
+{
+    return !ip4_nat_rules.empty();
+}
+
+/**
+ * Track a received IPv4 packet and translate its destination, before it is
+ * matched against the addresses of this host and routed.
+ *
+ * @param pkt_buf the packet, starting with its IP header
+ * @param in_if_num if_num of the interface it came in on
+ * @return IP4_NAT_DROP for fragments, and for connections that cannot be
+ *         tracked or given a translation
+ */
+Ip4NatVerdict
+ip4_nat_prerouting(PacketBuffer& pkt_buf, const uint32_t in_if_num)
+{
+    pkt_buf.ct = nullptr;
+    const size_t len = ip4_nat_len(pkt_buf);
+    if (ip4_nat_rules.empty() || len == 0)
+    {
+        return IP4_NAT_ACCEPT;
+    }
+    uint8_t* ip = pkt_buf.data.data();
+    /* ip4_input() reassembles while there are rules; anything else cannot be
+       tracked */
+    if (((ip[6] & 0x3f) | ip[7]) != 0)
+    {
+        ip4_nat_stats.dropped++;
+        return IP4_NAT_DROP;
+    }
+    Ip4CtTuple tuple;
+    if (!ip4_conntrack_tuple(ip, len, tuple))
+    {
+        ip4_nat_icmp_error(ip, len);
+        return IP4_NAT_ACCEPT;
+    }
+    Ip4CtDir dir;
+    Ip4CtEntry* entry = ip4_conntrack_find(tuple, dir);
+    if (entry == nullptr)
+    {
+        if (!ip4_conntrack_may_create(ip, len))
+        {
+            return IP4_NAT_ACCEPT;
+        }
+        entry = ip4_conntrack_create(tuple);
+        if (entry == nullptr)
+        {
+            ip4_nat_stats.exhausted++;
+            return IP4_NAT_DROP;
+        }
+        dir = IP4_CT_DIR_ORIGINAL;
+        const Ip4NatRule* rule = ip4_nat_match(true, tuple, in_if_num);
+        if (rule != nullptr)
+        {
+            Ip4CtTuple reply = entry->tuple[IP4_CT_DIR_REPLY];
+            reply.src = rule->to_addr;
+            if (rule->to_port != 0 && tuple.proto != IP_PROTO_ICMP)
+            {
+                reply.src_port = rule->to_port;
+            }
+            if (!ip4_conntrack_set_reply(*entry, reply))
+            {
+                ip4_conntrack_delete(*entry);
+                ip4_nat_stats.exhausted++;
+                return IP4_NAT_DROP;
+            }
+            entry->flags |= IP4_CT_FLAG_DST_NAT;
+            ip4_nat_stats.mapped++;
+        }
+    }
+    ip4_conntrack_seen(*entry, dir, ip, len);
+    pkt_buf.ct = entry;
+    pkt_buf.ct_dir = dir;
+    const Ip4CtTuple target = ip4_conntrack_invert(entry->tuple[dir ^ 1]);
+    ip4_nat_rewrite(ip, len, false, target.dst, target.dst_port, nullptr);
+    return IP4_NAT_ACCEPT;
+}
+
+/**
+ * Translate the source of a forwarded IPv4 packet, once it is routed. The
+ * first packet of a connection picks its source NAT rule.
+ *
+ * @param pkt_buf the packet, as ip4_nat_prerouting() left it
+ * @param out_netif the interface it leaves through
+ * @return IP4_NAT_DROP if the connection cannot be given an external port,
+ *         or an untracked packet would leave through a source NAT rule
+ *         untranslated
+ */
+Ip4NatVerdict
+ip4_nat_postrouting(PacketBuffer& pkt_buf, const NetworkInterface& out_netif)
+{
+    const size_t len = ip4_nat_len(pkt_buf);
+    uint8_t* ip = pkt_buf.data.data();
+    Ip4CtEntry* entry = pkt_buf.ct;
+    if (entry == nullptr)
+    {
+        Ip4CtTuple tuple;
+        if (!ip4_nat_rules.empty() && len != 0 && ip4_conntrack_tuple(ip, len, tuple) &&
+            ip4_nat_match(false, tuple, out_netif.if_num) != nullptr)
+        {
+            ip4_nat_stats.dropped++;
+            return IP4_NAT_DROP;
+        }
+        return IP4_NAT_ACCEPT;
+    }
+    const Ip4CtDir dir = pkt_buf.ct_dir;
+    if (dir == IP4_CT_DIR_ORIGINAL && !(entry->flags & IP4_CT_FLAG_NAT_DONE))
+    {
+        entry->flags |= IP4_CT_FLAG_NAT_DONE;
+        /* the rules see the destination after destination NAT */
+        Ip4CtTuple tuple = entry->tuple[IP4_CT_DIR_ORIGINAL];
+        tuple.dst = entry->tuple[IP4_CT_DIR_REPLY].src;
+        tuple.dst_port = entry->tuple[IP4_CT_DIR_REPLY].src_port;
+        const Ip4NatRule* rule = ip4_nat_match(false, tuple, out_netif.if_num);
+        if (rule != nullptr && !ip4_nat_map_source(*entry, *rule, out_netif))
+        {
+            ip4_conntrack_delete(*entry);
+            pkt_buf.ct = nullptr;
+            ip4_nat_stats.exhausted++;
+            return IP4_NAT_DROP;
+        }
+    }
+    const Ip4CtTuple target = ip4_conntrack_invert(entry->tuple[dir ^ 1]);
+    ip4_nat_rewrite(ip, len, true, target.src, target.src_port, nullptr);
+    return IP4_NAT_ACCEPT;
+}
+
+/**
+ * Release the external port of a connection that goes away; called by
+ * ip4_conntrack.cpp.
+ */
+void
+ip4_nat_release(const Ip4CtEntry& entry)
+{
+    if (!(entry.flags & IP4_CT_FLAG_SRC_NAT))
+    {
+        return;
+    }
+    const Ip4CtTuple& reply = entry.tuple[IP4_CT_DIR_REPLY];
+    const auto it = ip4_nat_ports.find(reply.dst.addr);
+    if (it == ip4_nat_ports.end())
+    {
+        return;
+    }
+    PortAllocator* allocator = ip4_nat_allocator(it->second, reply.proto);
+    if (allocator != nullptr)
+    {
+        port_alloc_unref(*allocator, reply.dst_port);
+    }
+    if (--it->second.users == 0)
+    {
+        ip4_nat_ports.erase(it);
+    }
+}
+
+//
+// END OF FILE
+//
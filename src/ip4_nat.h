@@ -0,0 +1,128 @@
+///
+/// file: ip4_nat.h
+///
+/// NAT44 for forwarded traffic: source NAT to a fixed address or to that of
+/// the outgoing interface (masquerade), and destination NAT, on top of the
+/// connection tracking of ip4_conntrack.h.
+///
+/// Rules are only matched by the first packet of a connection; the
+/// translation they pick is kept in its conntrack entry, as the tuple replies
+/// come back with, and applied to every later packet in both directions
+/// without looking at the rules again. Destination NAT is decided and applied
+/// before routing (ip4_nat_prerouting(), from ip4_input()), so that the route
+/// is that of the new destination and replies to translated connections,
+/// addressed to this host, are recognised. Source NAT is decided and applied
+/// after routing (ip4_nat_postrouting(), from the forwarding path), once the
+/// outgoing interface is known.
+///
+/// Source NAT keeps the source port if it is free on the external address and
+/// takes a free one from IP4_NAT_PORT_MIN to IP4_NAT_PORT_MAX otherwise, from
+/// one bitmap per external address and protocol (port_alloc.h); the ports are
+/// released when the connection expires. The range stays below the ephemeral
+/// ports of the stack, so that connections of this host and translated ones
+/// do not collide on an external address of this host. ICMP queries are
+/// translated by their identifier.
+///
+/// Checksums are updated incrementally (RFC 1624): the IP header checksum for
+/// addresses, the TCP and UDP checksums for addresses and ports. ICMP errors
+/// about a translated connection get their embedded header translated as well.
+///
+/// Connections are only tracked while there are rules. As only the first
+/// fragment has the ports, ip4_input() then reassembles fragments before
+/// ip4_nat_prerouting(), forwarded ones included; fragments that reach NAT
+/// anyway are dropped.
+/// The forwarding fast path (ip_fwd.h) leaves IPv4 to the regular path while
+/// there are rules.
+///
+
+#pragma once
+
+#include <cstdint>
+#include <ip4_addr.h>
+#include <ip4_conntrack.h>
+#include <lwip_status.h>
+#include <network_interface.h>
+#include <packet_buffer.h>
+
+/// Ports source NAT picks from, below the ephemeral ports of tcp.cpp and
+/// udp.cpp.
+constexpr uint16_t IP4_NAT_PORT_MIN = 1024;
+constexpr uint16_t IP4_NAT_PORT_MAX = 0xbfff;
+
+/// Rule interface matching any interface.
+constexpr uint32_t IP4_NAT_ANY_IF = 0xffffffffU;
+
+enum Ip4NatType : uint8_t
+{
+    /// translate the source to to_addr
+    IP4_NAT_SNAT,
+    /// translate the source to the first address of the outgoing interface
+    IP4_NAT_MASQUERADE,
+    /// translate the destination to to_addr and to_port
+    IP4_NAT_DNAT,
+};
+
+/// A NAT rule. Rules are matched in the order they were added, source NAT
+/// rules against the connections leaving an interface, destination NAT rules
+/// against those coming in.
+struct Ip4NatRule
+{
+    Ip4NatType type;
+    /// source and destination prefixes; a length of 0 matches any address
+    Ip4Addr src;
+    uint8_t src_len;
+    Ip4Addr dst;
+    uint8_t dst_len;
+    /// protocol, 0 for any
+    uint8_t proto;
+    /// TCP or UDP destination port, 0 for any
+    uint16_t dst_port;
+    /// if_num of the outgoing (source NAT) or incoming (destination NAT)
+    /// interface, IP4_NAT_ANY_IF
+    uint32_t if_num;
+    /// address to translate to, unused by IP4_NAT_MASQUERADE
+    Ip4Addr to_addr;
+    /// destination port to translate to, 0 keeps the port
+    uint16_t to_port;
+};
+
+enum Ip4NatVerdict : uint8_t
+{
+    IP4_NAT_ACCEPT,
+    IP4_NAT_DROP,
+};
+
+/// Counters of the NAT.
+struct Ip4NatStats
+{
+    /// connections given a translation
+    size_t mapped;
+    /// no conntrack entry or port could be had
+    size_t exhausted;
+    /// fragments and untracked packets a source NAT rule matched
+    size_t dropped;
+};
+
+extern Ip4NatStats ip4_nat_stats;
+
+LwipStatus
+ip4_nat_add_rule(const Ip4NatRule& rule);
+
+void
+ip4_nat_clear_rules();
+
+bool
+ip4_nat_enabled();
+
+Ip4NatVerdict
+ip4_nat_prerouting(PacketBuffer& pkt_buf, uint32_t in_if_num);
+
+Ip4NatVerdict
+ip4_nat_postrouting(PacketBuffer& pkt_buf, const NetworkInterface& out_netif);
+
+void
+ip4_nat_release(const Ip4CtEntry& entry);
+
+//
+// END OF FILE
+//
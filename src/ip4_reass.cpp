@@ -0,0 +1,339 @@
+#include <opt.h>
+#include <def.h>
+#include <icmp.h>
+#include <inet_chksum.h>
+#include <ip4_frag.h>
+#include <network_interface.h>
+#include <ip4.h>
+#include <lwip_debug.h>
+#include <cstring>
+#include <iterator>
+
+static_assert(IP4_REASS_WHEEL_SLOTS > IP_REASS_MAXAGE, "a datagram must expire within one turn of the wheel");
+
+Ip4ReassStats ip4_reass_stats;
+
+size_t ip4_reass_bytes;
+
+/* the datagrams in progress, by hash of their key */
+static std::vector<Ip4ReassDatagram*> ip4_reass_hash;
+
+/* the datagrams expiring at each tick, oldest first */
+static Ip4ReassDatagram* ip4_reass_wheel[IP4_REASS_WHEEL_SLOTS];
+static Ip4ReassDatagram* ip4_reass_wheel_tail[IP4_REASS_WHEEL_SLOTS];
+
+/* ticks of ip_reass_tmr() */
+static uint32_t ip4_reass_now;
+
+/* Hash bucket of a datagram key */
+static size_t
+ip4_reass_bucket(const Ip4Addr& src, const Ip4Addr& dst, const uint16_t id, const uint8_t proto)
+{
+    uint32_t hash = src.addr * 0x9e3779b1U ^ dst.addr;
+    hash = (hash ^ (uint32_t(id) << 8 | proto)) * 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    return (hash ^ hash >> 16) & (IP4_REASS_HASH_SIZE - 1);
+}
+
+static void
+ip4_reass_wheel_remove(Ip4ReassDatagram* ipr)
+{
+    const size_t slot = ipr->expires & (IP4_REASS_WHEEL_SLOTS - 1);
+    if (ipr->wheel_prev != nullptr)
+    {
+        ipr->wheel_prev->wheel_next = ipr->wheel_next;
+    }
+    else
+    {
+        ip4_reass_wheel[slot] = ipr->wheel_next;
+    }
+    if (ipr->wheel_next != nullptr)
+    {
+        ipr->wheel_next->wheel_prev = ipr->wheel_prev;
+    }
+    else
+    {
+        ip4_reass_wheel_tail[slot] = ipr->wheel_prev;
+    }
+}
+
+/**
+ * Unlink a datagram from the hash table and the wheel and free it with its
+ * fragments.
+ */
+static void
+ip4_reass_free(Ip4ReassDatagram* ipr)
+{
+    Ip4ReassDatagram** link = &ip4_reass_hash[ip4_reass_bucket(ipr->src, ipr->dst, ipr->id, ipr->proto)];
+    while (*link != ipr)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = ipr->hash_next;
+    ip4_reass_wheel_remove(ipr);
+    lwip_assert("ip4_reass_bytes >= ipr->bytes", ip4_reass_bytes >= ipr->bytes);
+    ip4_reass_bytes -= ipr->bytes;
+    delete ipr;
+}
+
+/**
+ * Drop the oldest datagram other than keep, to make room for a fragment.
+ *
+ * @return false if there is no other datagram
+ */
+static bool
+ip4_reass_evict_oldest(const Ip4ReassDatagram* keep)
+{
+    /* the slot that comes up next holds the oldest datagrams */
+    for (size_t i = 1; i <= IP4_REASS_WHEEL_SLOTS; i++)
+    {
+        for (Ip4ReassDatagram* ipr = ip4_reass_wheel[(ip4_reass_now + i) & (IP4_REASS_WHEEL_SLOTS - 1)];
+             ipr != nullptr;
+             ipr = ipr->wheel_next)
+        {
+            if (ipr != keep)
+            {
+                ip4_reass_free(ipr);
+                ip4_reass_stats.evicted++;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Initialise reassembly, dropping the datagrams in progress.
+ */
+void
+ip_reass_init(void)
+{
+    for (auto& slot : ip4_reass_wheel)
+    {
+        while (slot != nullptr)
+        {
+            ip4_reass_free(slot);
+        }
+    }
+    ip4_reass_hash.assign(IP4_REASS_HASH_SIZE, nullptr);
+    ip4_reass_bytes = 0;
+}
+
+/**
+ * Reassembly timer base function
+ * for both NO_SYS == 0 and 1 (!).
+ *
+ * Should be called every 1000 msec (defined by IP_TMR_INTERVAL). Drops the
+ * datagrams of the wheel slot of the new tick, which have all expired.
+ */
+void
+ip_reass_tmr(void)
+{
+    ip4_reass_now++;
+    const size_t slot = ip4_reass_now & (IP4_REASS_WHEEL_SLOTS - 1);
+    while (ip4_reass_wheel[slot] != nullptr)
+    {
+        Ip4ReassDatagram* ipr = ip4_reass_wheel[slot];
+        lwip_assert("ipr->expires == ip4_reass_now", ipr->expires == ip4_reass_now);
+        const auto first = ipr->fragments.find(0);
+        if (first != ipr->fragments.end())
+        {
+            /* The first fragment was received, send ICMP time exceeded. */
+            PacketBuffer p{};
+            p.data = ipr->header;
+            p.data.insert(p.data.end(), first->second.data.begin(), first->second.data.end());
+            p.input_netif_idx = ipr->input_netif_idx;
+            icmp_time_exceeded(p, ICMP_TE_FRAG);
+        }
+        ip4_reass_free(ipr);
+        ip4_reass_stats.timed_out++;
+    }
+}
+
+/**
+ * Copy the fragments of a complete datagram into one packet, after the
+ * header of its first fragment.
+ */
+static void
+ip4_reass_assemble(const Ip4ReassDatagram& ipr, PacketBuffer& pkt_buf)
+{
+    const size_t hdr_len = ipr.header.size();
+    std::vector<uint8_t> data;
+    data.reserve(hdr_len + ipr.datagram_len);
+    data.insert(data.end(), ipr.header.begin(), ipr.header.end());
+    for (const auto& fragment : ipr.fragments)
+    {
+        data.insert(data.end(), fragment.second.data.begin(), fragment.second.data.end());
+    }
+    const size_t len = data.size();
+    data[2] = uint8_t(len >> 8);
+    data[3] = uint8_t(len);
+    data[6] = 0;
+    data[7] = 0;
+    data[10] = 0;
+    data[11] = 0;
+    const uint16_t chksum = inet_chksum(data.data(), uint16_t(hdr_len));
+    memcpy(&data[10], &chksum, sizeof chksum);
+    pkt_buf.data = std::move(data);
+    pkt_buf.input_netif_idx = ipr.input_netif_idx;
+}
+
+/**
+ * Reassembles incoming IP fragments into an IP datagram.
+ *
+ * @param pkt_buf a fragment, starting with its IP header; replaced by the
+ *        datagram once it is complete
+ * @return true if pkt_buf now holds the complete datagram, false if the
+ *         fragment was queued or dropped
+ */
+bool
+ip4_reass(PacketBuffer& pkt_buf)
+{
+    if (ip4_reass_hash.empty())
+    {
+        ip4_reass_hash.assign(IP4_REASS_HASH_SIZE, nullptr);
+    }
+    const std::vector<uint8_t>& data = pkt_buf.data;
+    if (data.size() < IP4_HDR_LEN)
+    {
+        ip4_reass_stats.dropped++;
+        return false;
+    }
+    const size_t hdr_len = size_t(data[0] & 0x0f) * 4;
+    const size_t len = size_t(data[2] << 8 | data[3]);
+    if (hdr_len < IP4_HDR_LEN || len < hdr_len || len > data.size())
+    {
+        ip4_reass_stats.dropped++;
+        return false;
+    }
+    const size_t offset = size_t((data[6] & 0x1f) << 8 | data[7]) * 8;
+    const bool is_last = (data[6] & 0x20) == 0;
+    const size_t frag_len = len - hdr_len;
+    /* all fragments but the last carry a multiple of 8 bytes (RFC 791) */
+    if (frag_len == 0 || offset + frag_len > 0xffff - IP4_HDR_LEN || (!is_last && frag_len % 8 != 0))
+    {
+        ip4_reass_stats.dropped++;
+        return false;
+    }
+
+    Ip4Addr src{};
+    Ip4Addr dst{};
+    memcpy(&src.addr, &data[12], sizeof src.addr);
+    memcpy(&dst.addr, &data[16], sizeof dst.addr);
+    const uint16_t id = uint16_t(data[4] << 8 | data[5]);
+    const uint8_t proto = data[9];
+    Ip4ReassDatagram** bucket = &ip4_reass_hash[ip4_reass_bucket(src, dst, id, proto)];
+    Ip4ReassDatagram* ipr = *bucket;
+    while (ipr != nullptr &&
+           (ipr->src.addr != src.addr || ipr->dst.addr != dst.addr || ipr->id != id || ipr->proto != proto))
+    {
+        ipr = ipr->hash_next;
+    }
+
+    /* make room for the fragment, and for the datagram if it is new */
+    const size_t frag_cost = sizeof(Ip4ReassFragment) + frag_len;
+    size_t cost = frag_cost;
+    if (ipr == nullptr)
+    {
+        cost += sizeof(Ip4ReassDatagram) + hdr_len;
+    }
+    while (ip4_reass_bytes + cost > IP4_REASS_MAX_BYTES)
+    {
+        if (!ip4_reass_evict_oldest(ipr))
+        {
+            Logf(true, "ip4_reass: no room for %zu bytes, %zu queued\n", cost, ip4_reass_bytes);
+            ip4_reass_stats.dropped++;
+            return false;
+        }
+    }
+
+    if (ipr == nullptr)
+    {
+        ipr = new Ip4ReassDatagram{};
+        ipr->src = src;
+        ipr->dst = dst;
+        ipr->id = id;
+        ipr->proto = proto;
+        ipr->header.assign(data.begin(), data.begin() + hdr_len);
+        ipr->bytes = sizeof(Ip4ReassDatagram) + hdr_len;
+        ipr->input_netif_idx = pkt_buf.input_netif_idx;
+        ipr->hash_next = *bucket;
+        *bucket = ipr;
+        /* datagrams expire in the order they arrive: append to the slot */
+        ipr->expires = ip4_reass_now + IP_REASS_MAXAGE;
+        const size_t slot = ipr->expires & (IP4_REASS_WHEEL_SLOTS - 1);
+        ipr->wheel_prev = ip4_reass_wheel_tail[slot];
+        ipr->wheel_next = nullptr;
+        if (ipr->wheel_prev != nullptr)
+        {
+            ipr->wheel_prev->wheel_next = ipr;
+        }
+        else
+        {
+            ip4_reass_wheel[slot] = ipr;
+        }
+        ip4_reass_wheel_tail[slot] = ipr;
+        ip4_reass_bytes += ipr->bytes;
+    }
+
+    /* drop fragments overlapping queued ones, and ends that disagree */
+    const size_t end = offset + frag_len;
+    const auto next = ipr->fragments.lower_bound(uint16_t(offset));
+    const bool overlaps = (next != ipr->fragments.end() && next->first < end) ||
+        (next != ipr->fragments.begin() && std::prev(next)->second.end > offset);
+    const size_t queued_end = ipr->fragments.empty() ? 0 : ipr->fragments.rbegin()->second.end;
+    const bool bad_end =
+        (ipr->datagram_len != 0 && (end > ipr->datagram_len || (is_last && end != ipr->datagram_len))) ||
+        (is_last && queued_end > end);
+    if (overlaps || bad_end)
+    {
+        ip4_reass_stats.dropped++;
+        if (ipr->fragments.empty())
+        {
+            ip4_reass_free(ipr);
+        }
+        return false;
+    }
+
+    ipr->fragments.emplace_hint(next,
+                                uint16_t(offset),
+                                Ip4ReassFragment{uint16_t(end),
+                                                 std::vector<uint8_t>(data.begin() + hdr_len, data.begin() + len)});
+    ipr->received += frag_len;
+    ipr->bytes += frag_cost;
+    ip4_reass_bytes += frag_cost;
+    if (offset == 0)
+    {
+        /* the header of the first fragment is that of the datagram */
+        ipr->bytes = ipr->bytes - ipr->header.size() + hdr_len;
+        ip4_reass_bytes = ip4_reass_bytes - ipr->header.size() + hdr_len;
+        ipr->header.assign(data.begin(), data.begin() + hdr_len);
+        ipr->input_netif_idx = pkt_buf.input_netif_idx;
+    }
+    if (is_last)
+    {
+        ipr->datagram_len = end;
+    }
+
+    /* the fragments do not overlap, so they cover the datagram once they add
+       up to its length */
+    if (ipr->datagram_len == 0 || ipr->received != ipr->datagram_len)
+    {
+        return false;
+    }
+    if (ipr->header.size() + ipr->datagram_len > 0xffff)
+    {
+        ip4_reass_stats.dropped++;
+        ip4_reass_free(ipr);
+        return false;
+    }
+    ip4_reass_assemble(*ipr, pkt_buf);
+    ip4_reass_free(ipr);
+    ip4_reass_stats.reassembled++;
+    return true;
+}
+
+//
+// END OF FILE
+//
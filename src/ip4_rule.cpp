@@ -0,0 +1,242 @@
+///
+/// file: ip4_rule.cpp
+///
+/// IPv4 policy routing rules, see ip4_rule.h.
+///
+
+#include <cstddef>
+#include <dst_cache.h>
+#include <ip4_rule.h>
+#include <lwip_debug.h>
+#include <map>
+#include <set>
+
+std::atomic<Ip4RuleSet*> ip4_rule_current;
+
+/* the staged rules, in priority order */
+static std::multimap<uint32_t, Ip4Rule> ip4_rule_list;
+
+/* rule sets replaced by a commit and not freed yet */
+static std::atomic<Ip4RuleSet*> ip4_rule_retired;
+
+/* Mask of a prefix length of 0 to 32, host order */
+static uint32_t
+ip4_rule_prefix_mask(const uint8_t prefix_len)
+{
+    return prefix_len == 0 ? 0 : 0xffffffffU << (32 - prefix_len);
+}
+
+/* A rule with the bits its masks ignore cleared, so that equal rules compare
+   equal */
+static Ip4Rule
+ip4_rule_normalise(const Ip4Rule& rule)
+{
+    Ip4Rule normal = rule;
+    normal.src.addr = lwip_htonl(lwip_ntohl(rule.src.addr) & ip4_rule_prefix_mask(rule.src_len));
+    normal.tos &= rule.tos_mask;
+    normal.fwmark &= rule.fwmark_mask;
+    if (normal.action != IP4_RULE_LOOKUP)
+    {
+        normal.table = 0;
+    }
+    return normal;
+}
+
+static bool
+ip4_rule_equal(const Ip4Rule& a, const Ip4Rule& b)
+{
+    return a.priority == b.priority && a.src.addr == b.src.addr && a.src_len == b.src_len &&
+        a.in_if_num == b.in_if_num && a.tos == b.tos && a.tos_mask == b.tos_mask && a.fwmark == b.fwmark &&
+        a.fwmark_mask == b.fwmark_mask && a.action == b.action && a.table == b.table;
+}
+
+/* Fill a new rule set from the staged rules */
+static void
+ip4_rule_compile(Ip4RuleSet& set)
+{
+    std::vector<const Ip4Rule*> rules;
+    for (const auto& rule : ip4_rule_list)
+    {
+        rules.push_back(&rule.second);
+    }
+
+    /* the source ranges start at 0 and where a rule prefix starts or ends */
+    std::set<uint32_t> starts{0};
+    std::set<uint32_t> in_ifs;
+    for (const Ip4Rule* rule : rules)
+    {
+        const uint32_t first = lwip_ntohl(rule->src.addr);
+        const uint32_t last = first | ~ip4_rule_prefix_mask(rule->src_len);
+        starts.insert(first);
+        if (last != 0xffffffffU)
+        {
+            starts.insert(last + 1);
+        }
+        if (rule->in_if_num != IP4_RULE_ANY_IF)
+        {
+            in_ifs.insert(rule->in_if_num);
+        }
+    }
+    set.src_starts.assign(starts.begin(), starts.end());
+    set.src_rules.assign(set.src_starts.size(), 0);
+    set.in_ifs.assign(in_ifs.begin(), in_ifs.end());
+    set.in_if_rules.assign(set.in_ifs.size(), 0);
+    set.in_if_other = 0;
+    set.tos_rules.fill(0);
+    set.mark_any = 0;
+
+    for (size_t i = 0; i < rules.size(); i++)
+    {
+        const Ip4Rule& rule = *rules[i];
+        const uint64_t bit = uint64_t(1) << i;
+        set.actions.push_back(rule.action);
+        set.tables.push_back(rule.table);
+
+        /* a prefix covers whole ranges, as its ends are range boundaries */
+        const uint32_t first = lwip_ntohl(rule.src.addr);
+        const uint32_t last = first | ~ip4_rule_prefix_mask(rule.src_len);
+        const auto from = std::lower_bound(set.src_starts.begin(), set.src_starts.end(), first);
+        const auto to = std::upper_bound(set.src_starts.begin(), set.src_starts.end(), last);
+        for (auto range = from; range != to; ++range)
+        {
+            set.src_rules[range - set.src_starts.begin()] |= bit;
+        }
+
+        if (rule.in_if_num == IP4_RULE_ANY_IF)
+        {
+            for (uint64_t& in_if_rules : set.in_if_rules)
+            {
+                in_if_rules |= bit;
+            }
+            set.in_if_other |= bit;
+        }
+        else
+        {
+            const auto in_if = std::lower_bound(set.in_ifs.begin(), set.in_ifs.end(), rule.in_if_num);
+            set.in_if_rules[in_if - set.in_ifs.begin()] |= bit;
+        }
+
+        for (size_t tos = 0; tos < set.tos_rules.size(); tos++)
+        {
+            if ((tos & rule.tos_mask) == rule.tos)
+            {
+                set.tos_rules[tos] |= bit;
+            }
+        }
+
+        if (rule.fwmark_mask == 0)
+        {
+            set.mark_any |= bit;
+            continue;
+        }
+        auto mark_class = std::find_if(set.mark_classes.begin(),
+                                       set.mark_classes.end(),
+                                       [&rule](const Ip4RuleMarkClass& c) { return c.mask == rule.fwmark_mask; });
+        if (mark_class == set.mark_classes.end())
+        {
+            set.mark_classes.push_back(Ip4RuleMarkClass{rule.fwmark_mask, {}});
+            mark_class = set.mark_classes.end() - 1;
+        }
+        mark_class->rules[rule.fwmark] |= bit;
+    }
+}
+
+/**
+ * Stage a rule.
+ *
+ * @return ERR_VAL if the source prefix length or the table is invalid,
+ *         ERR_MEM if there are IP4_RULE_MAX rules
+ */
+LwipStatus
+ip4_rule_add(const Ip4Rule& rule)
+{
+    if (rule.src_len > 32 || (rule.action == IP4_RULE_LOOKUP && rule.table >= IP4_FIB_MAX_TABLES))
+    {
+        return ERR_VAL;
+    }
+    if (ip4_rule_list.size() == IP4_RULE_MAX)
+    {
+        return ERR_MEM;
+    }
+    ip4_rule_list.emplace(rule.priority, ip4_rule_normalise(rule));
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage the removal of the first rule equal to rule.
+ *
+ * @return STATUS_NOT_FOUND if there is none
+ */
+LwipStatus
+ip4_rule_delete(const Ip4Rule& rule)
+{
+    const Ip4Rule normal = ip4_rule_normalise(rule);
+    const auto range = ip4_rule_list.equal_range(rule.priority);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (ip4_rule_equal(it->second, normal))
+        {
+            ip4_rule_list.erase(it);
+            return STATUS_SUCCESS;
+        }
+    }
+    return STATUS_NOT_FOUND;
+}
+
+/**
+ * Stage the removal of all rules.
+ */
+void
+ip4_rule_clear()
+{
+    ip4_rule_list.clear();
+}
+
+/**
+ * Compile the staged rules and make lookups use them. The rule set they
+ * replace is freed by the next ip4_rule_reclaim().
+ */
+void
+ip4_rule_commit()
+{
+    const auto set = new Ip4RuleSet;
+    ip4_rule_compile(*set);
+    set->retired_next = nullptr;
+    Ip4RuleSet* old = ip4_rule_current.exchange(set, std::memory_order_acq_rel);
+    if (old != nullptr)
+    {
+        old->retired_next = ip4_rule_retired.load(std::memory_order_relaxed);
+        while (!ip4_rule_retired.compare_exchange_weak(old->retired_next,
+                                                       old,
+                                                       std::memory_order_release,
+                                                       std::memory_order_relaxed))
+        {
+        }
+    }
+    dst_cache_invalidate_all();
+    Logf(true,
+         "ip4_rule_commit: %zu rules, %zu source ranges, %zu fwmark masks\n",
+         set->actions.size(),
+         set->src_starts.size(),
+         set->mark_classes.size());
+}
+
+/**
+ * Free the rule sets replaced by earlier commits. Called by the stack thread
+ * while it is not in the middle of a lookup.
+ */
+void
+ip4_rule_reclaim()
+{
+    Ip4RuleSet* set = ip4_rule_retired.exchange(nullptr, std::memory_order_acquire);
+    while (set != nullptr)
+    {
+        Ip4RuleSet* next = set->retired_next;
+        delete set;
+        set = next;
+    }
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,263 @@
+///
+/// file: ip4_rule.h
+///
+/// IPv4 policy routing: an ordered list of rules choosing the table of
+/// ip4_fib.h a packet is routed by, from its source address, the interface it
+/// came in on, its TOS byte and its fwmark (PacketBuffer::mark).
+///
+/// The rules are evaluated in priority order. An IP4_RULE_LOOKUP rule routes
+/// the packet by its table if that has a route to the destination; if it has
+/// none, evaluation goes on with the next matching rule. An
+/// IP4_RULE_UNREACHABLE rule ends evaluation with no route, which keeps
+/// traffic a tenant's rules did not route out of the main table. Packets no
+/// rule routes are routed by IP4_FIB_TABLE_MAIN.
+///
+/// Packets do not walk the rule list. A commit compiles the rules into one
+/// bitmap per value of each field, bit i being set if the i-th rule in
+/// priority order accepts that value: the source address space is cut into
+/// the ranges between the boundaries of the rule prefixes, which a binary
+/// search finds; interfaces are found the same way and TOS values index an
+/// array; fwmarks are looked up in one hash per distinct fwmark mask, of which
+/// there is usually one. The AND of the bitmaps of a packet holds the rules
+/// matching it, its lowest bit the first of them. Rule sets hold at most
+/// IP4_RULE_MAX rules, the width of the bitmaps.
+///
+/// Updates are staged and published like those of ip4_fib.h: ip4_rule_add()
+/// and ip4_rule_delete() change the rule list, ip4_rule_commit() compiles it
+/// and publishes the result with one atomic pointer swap, and the stack
+/// thread frees the rule sets it replaced with ip4_rule_reclaim().
+///
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ip4_addr.h>
+#include <ip4_fib.h>
+#include <lwip_status.h>
+#include <unordered_map>
+#include <vector>
+
+/// Most rules a rule set can hold.
+constexpr size_t IP4_RULE_MAX = 64;
+
+/// Rule interface matching packets from any interface and from this host.
+constexpr uint32_t IP4_RULE_ANY_IF = 0xffffffffU;
+
+/// Rule and key interface of packets this host sends.
+constexpr uint32_t IP4_RULE_LOCAL_IF = 0xfffffffeU;
+
+/// What a matching rule does.
+enum Ip4RuleAction : uint8_t
+{
+    /// route by the rule's table, go on with the next rule if it has no route
+    IP4_RULE_LOOKUP,
+    /// there is no route
+    IP4_RULE_UNREACHABLE,
+};
+
+/// A policy routing rule.
+struct Ip4Rule
+{
+    /// lower goes first; rules of the same priority in the order they were
+    /// added
+    uint32_t priority;
+    /// source prefix; host bits are ignored, a src_len of 0 matches any source
+    Ip4Addr src;
+    uint8_t src_len;
+    /// if_num of the interface the packet came in on, IP4_RULE_LOCAL_IF or
+    /// IP4_RULE_ANY_IF
+    uint32_t in_if_num;
+    /// matches packets whose TOS byte ANDed with tos_mask is tos: 0xfc
+    /// matches on the DSCP, 0 matches any
+    uint8_t tos;
+    uint8_t tos_mask;
+    /// matches packets whose mark ANDed with fwmark_mask is fwmark
+    uint32_t fwmark;
+    uint32_t fwmark_mask;
+    Ip4RuleAction action;
+    /// table IP4_RULE_LOOKUP routes by
+    uint8_t table;
+};
+
+/// What rules match on besides the source address.
+struct Ip4RuleKey
+{
+    /// if_num of the interface the packet came in on
+    uint32_t in_if_num = IP4_RULE_LOCAL_IF;
+    uint8_t tos = 0;
+    uint32_t fwmark = 0;
+};
+
+/// Rules accepting each value of a fwmark mask.
+struct Ip4RuleMarkClass
+{
+    uint32_t mask;
+    std::unordered_map<uint32_t, uint64_t> rules;
+};
+
+/// A compiled rule set. Bit i of the bitmaps is the i-th rule in priority
+/// order.
+struct Ip4RuleSet
+{
+    /// action and table of each rule
+    std::vector<Ip4RuleAction> actions;
+    std::vector<uint8_t> tables;
+    /// first address (host order) of each source range, ascending from 0,
+    /// and the rules accepting the range
+    std::vector<uint32_t> src_starts;
+    std::vector<uint64_t> src_rules;
+    /// interfaces rules name, ascending, the rules accepting each, and the
+    /// rules accepting all others
+    std::vector<uint32_t> in_ifs;
+    std::vector<uint64_t> in_if_rules;
+    uint64_t in_if_other;
+    /// rules accepting each TOS byte
+    std::array<uint64_t, 256> tos_rules;
+    /// one class per distinct nonzero fwmark mask, and the rules that do not
+    /// match on fwmark
+    std::vector<Ip4RuleMarkClass> mark_classes;
+    uint64_t mark_any;
+    /* next rule set waiting for ip4_rule_reclaim() */
+    Ip4RuleSet* retired_next;
+};
+
+LwipStatus
+ip4_rule_add(const Ip4Rule& rule);
+
+LwipStatus
+ip4_rule_delete(const Ip4Rule& rule);
+
+void
+ip4_rule_clear();
+
+void
+ip4_rule_commit();
+
+void
+ip4_rule_reclaim();
+
+/// The rule set lookups use, nullptr before the first commit.
+extern std::atomic<Ip4RuleSet*> ip4_rule_current;
+
+/* Index of the lowest bit set in rules, which is not 0 */
+inline size_t
+ip4_rule_first(const uint64_t rules)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return size_t(__builtin_ctzll(rules));
+#else
+    size_t bit = 0;
+    while (!(rules >> bit & 1))
+    {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+///
+/// The rules of a set matching a packet, as a bitmap.
+///
+inline uint64_t
+ip4_rule_match(const Ip4RuleSet& set, const Ip4Addr& src, const Ip4RuleKey& key)
+{
+    const uint32_t addr = lwip_ntohl(src.addr);
+    const size_t range = std::upper_bound(set.src_starts.begin(), set.src_starts.end(), addr) -
+        set.src_starts.begin() - 1;
+    uint64_t rules = set.src_rules[range] & set.tos_rules[key.tos];
+    const auto in_if = std::lower_bound(set.in_ifs.begin(), set.in_ifs.end(), key.in_if_num);
+    if (in_if != set.in_ifs.end() && *in_if == key.in_if_num)
+    {
+        rules &= set.in_if_rules[in_if - set.in_ifs.begin()];
+    }
+    else
+    {
+        rules &= set.in_if_other;
+    }
+    if (rules == 0)
+    {
+        return 0;
+    }
+    uint64_t marks = set.mark_any;
+    for (const auto& mark_class : set.mark_classes)
+    {
+        const auto it = mark_class.rules.find(key.fwmark & mark_class.mask);
+        if (it != mark_class.rules.end())
+        {
+            marks |= it->second;
+        }
+    }
+    return rules & marks;
+}
+
+///
+/// Find the route of a packet under the routing policy. Stack thread only.
+///
+/// @param flow_hash picks one of the next hops of multipath routes
+/// @param table set to the table the route was found in
+/// @param hop set to the index of the next hop in table->next_hops
+/// @return STATUS_NOT_FOUND if no table has a route to dst,
+///         STATUS_E_ROUTING if an IP4_RULE_UNREACHABLE rule matched
+///
+inline LwipStatus
+ip4_rule_find(const Ip4Addr& src,
+              const Ip4Addr& dst,
+              const Ip4RuleKey& key,
+              const uint32_t flow_hash,
+              const Ip4FibTable*& table,
+              int32_t& hop)
+{
+    const Ip4RuleSet* set = ip4_rule_current.load(std::memory_order_acquire);
+    if (set != nullptr)
+    {
+        uint64_t rules = ip4_rule_match(*set, src, key);
+        while (rules != 0)
+        {
+            const size_t rule = ip4_rule_first(rules);
+            rules &= rules - 1;
+            if (set->actions[rule] == IP4_RULE_UNREACHABLE)
+            {
+                return STATUS_E_ROUTING;
+            }
+            table = ip4_fib_current[set->tables[rule]].load(std::memory_order_acquire);
+            hop = ip4_fib_find(table, dst, flow_hash);
+            if (hop >= 0)
+            {
+                return STATUS_SUCCESS;
+            }
+        }
+    }
+    table = ip4_fib_current[IP4_FIB_TABLE_MAIN].load(std::memory_order_acquire);
+    hop = ip4_fib_find(table, dst, flow_hash);
+    return hop >= 0 ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+///
+/// ip4_fib_route() under the routing policy: ip4_rule_find() for a packet
+/// that is sent to the next hop found, which counts it.
+///
+inline LwipStatus
+ip4_rule_route(const Ip4Addr& src,
+               const Ip4Addr& dst,
+               const Ip4RuleKey& key,
+               const uint32_t flow_hash,
+               Ip4FibNextHop& next_hop)
+{
+    const Ip4FibTable* table = nullptr;
+    int32_t hop = -1;
+    const LwipStatus status = ip4_rule_find(src, dst, key, flow_hash, table, hop);
+    if (status != STATUS_SUCCESS)
+    {
+        return status;
+    }
+    table->packets[hop].fetch_add(1, std::memory_order_relaxed);
+    next_hop = table->next_hops[hop];
+    return STATUS_SUCCESS;
+}
+
+//
+// END OF FILE
+//
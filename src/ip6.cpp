@@ -42,6 +42,8 @@
 #include <ip.h>
 #include <ip6.h>
 #include <ip6_addr.h>
+#include <ip6_fib.h>
+#include <ip_ecmp.h>
 #include <ip6_frag.h>
 #include <mld6.h>
 #include <nd6.h>
@@ -70,13 +72,15 @@
  * @param dest the destination IPv6 address for which to find the route
  * @param out_netif Retrieved netif on success, empy on failure
  * @param interfaces a collection of interfaces to check.
+ * @param flow_hash picks the next hop of multipath routes (see ip_ecmp.h)
  * @return STATUS_OK if suitable interface found, STATUS_NOT_FOUND otherwise.
  */
 LwipStatus
 route_ip6_packet(const Ip6AddrInfo& src,
                  const Ip6AddrInfo& dest,
                  NetworkInterface& out_netif,
-                 std::vector<NetworkInterface> interfaces)
+                 std::vector<NetworkInterface> interfaces,
+                 const uint32_t flow_hash)
 {
     if (interfaces.size() == 1) {
         out_netif = interfaces[0];
@@ -134,6 +138,17 @@ route_ip6_packet(const Ip6AddrInfo& src,
         }
     }
 
+    /* longest matching static, learned or on-link route */
+    Ip6FibNextHop next_hop{};
+    if (ip6_fib_route(dest.addr, flow_hash, next_hop)) {
+        for (auto& it : interfaces) {
+            if (it.if_num == next_hop.if_num && is_netif_up(it) && is_netif_link_up(it)) {
+                out_netif = it;
+                return STATUS_SUCCESS;
+            }
+        }
+    }
+
     NetworkInterface nd6_route_found_if{};
     const auto nd6_find_route_status = nd6_find_route(dest, nd6_route_found_if);
     if (nd6_find_route_status == STATUS_SUCCESS) {
@@ -182,7 +197,8 @@ forward_ip6_packet(PacketBuffer& pkt_buf,
     Ip6AddrInfo ip6_any_addr{};
     set_ip6_addr_any(ip6_any_addr);
     NetworkInterface dest_netif{};
-    if(route_ip6_packet(ip6_any_addr, dest_addr, dest_netif, interfaces) !=STATUS_SUCCESS) {
+    const uint32_t flow_hash = ip_ecmp_hash_ip6_pkt(pkt_buf.data.data(), pkt_buf.data.size());
+    if(route_ip6_packet(ip6_any_addr, dest_addr, dest_netif, interfaces, flow_hash) !=STATUS_SUCCESS) {
         if (get_ip6_hdr_next_hop(iphdr) != IP6_NEXTH_ICMP6) {
             // todo: send to queue for ICMP to handle
             icmp6_dest_unreach(pkt_buf, ICMP6_DUR_NO_ROUTE);
@@ -871,6 +887,7 @@ recv_ip6_pkt(PacketBuffer& pkt_buf, NetworkInterface& in_netif)
                 /* p points to IPv6 header again for raw_input. */
                 // pbuf_add_header_force(p, hlen_tot);
                 /* raw input did not eat the packet? */
+                pkt_buf.ip_ecn = get_ip6_hdr_tc(*ip6_hdr) & IP_ECN_MASK;
                 raw_input_state_t raw_status = raw_input(pkt_buf, in_netif);
                 if (raw_status != RAW_INPUT_EATEN) {
                     /* Point to payload. */
@@ -1119,14 +1136,15 @@ ip6_output(struct PacketBuffer* p,
     Ip6Addr dest_addr{};
     // LWIP_IP_CHECK_PBUF_REF_COUNT_FOR_TX(p);
     if (dest) {
-        netif = route_ip6_packet(src, dest,,);
+        const uint32_t flow_hash = ip_ecmp_hash6(*src, *dest, nexth, ip_ecmp_ports(nexth, p->data.data(), p->data.size()));
+        netif = route_ip6_packet(src, dest,,, flow_hash);
     }
     else {
         /* IP header included in p, read addresses. */
         struct Ip6Hdr* ip6hdr = (struct Ip6Hdr *)p->payload;
         ip6_addr_copy_from_packed(&src_addr, &ip6hdr->src);
         ip6_addr_copy_from_packed(&dest_addr, &ip6hdr->dest);
-        netif = route_ip6_packet(&src_addr, &dest_addr,,);
+        netif = route_ip6_packet(&src_addr, &dest_addr,,, ip_ecmp_hash_ip6_pkt(p->data.data(), p->data.size()));
     }
     if (netif == nullptr) {
         Logf(true,
@@ -1168,14 +1186,15 @@ ip6_output_hinted(struct PacketBuffer* p,
     NetworkInterface* netif;
     Ip6Addr src_addr, dest_addr;
     if (dest) {
-        netif = route_ip6_packet(src, dest,,);
+        const uint32_t flow_hash = ip_ecmp_hash6(*src, *dest, nexth, ip_ecmp_ports(nexth, p->data.data(), p->data.size()));
+        netif = route_ip6_packet(src, dest,,, flow_hash);
     }
     else {
         /* IP header included in p, read addresses. */
         struct Ip6Hdr* ip6hdr = (struct Ip6Hdr *)p->payload;
         ip6_addr_copy_from_packed(&src_addr, &ip6hdr->src);
         ip6_addr_copy_from_packed(&dest_addr, &ip6hdr->dest);
-        netif = route_ip6_packet(&src_addr, &dest_addr,,);
+        netif = route_ip6_packet(&src_addr, &dest_addr,,, ip_ecmp_hash_ip6_pkt(p->data.data(), p->data.size()));
     }
     if (netif == nullptr) {
         Logf(true,
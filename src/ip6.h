@@ -299,7 +299,7 @@ IP6_FRAG_ID(Ip6FragHdr* hdr)
 //#if LWIP_IPV6  /* don't build if not configured for use in lwipopts.h */
 LwipStatus
 route_ip6_packet(const Ip6AddrInfo& src, const Ip6AddrInfo& dest, NetworkInterface& out_netif, std::vector
-                 <NetworkInterface> interfaces);
+                 <NetworkInterface> interfaces, uint32_t flow_hash = 0);
 
 
 LwipStatus         recv_ip6_pkt(PacketBuffer& pkt_buf, NetworkInterface& in_netif);
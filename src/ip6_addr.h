@@ -133,7 +133,7 @@ struct Ip6AddrInfo
 };
 
 
-bool ip6_addr_is_static(Ip6AddrInfo& addr_info)
+inline bool ip6_addr_is_static(Ip6AddrInfo& addr_info)
 {
     return addr_info.valid_life > 0;
 }
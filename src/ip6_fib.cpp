@@ -0,0 +1,439 @@
+///
+/// file: ip6_fib.cpp
+///
+/// IPv6 forwarding table, see ip6_fib.h.
+///
+
+#include <algorithm>
+#include <array>
+#include <iterator>
+#include <dst_cache.h>
+#include <ip6_fib.h>
+#include <lwip_debug.h>
+#include <map>
+
+std::atomic<Ip6FibTable*> ip6_fib_current;
+
+/* key of a staged route; ordered on prefix length first so that routes are
+   walked from the shortest prefix to the longest, then on origin so that the
+   route of the highest origin is written last */
+struct Ip6FibKey
+{
+    uint8_t prefix_len;
+    /* host order, host bits cleared */
+    std::array<uint32_t, 4> prefix;
+    Ip6FibOrigin origin;
+
+    bool
+    operator<(const Ip6FibKey& other) const
+    {
+        if (prefix_len != other.prefix_len)
+        {
+            return prefix_len < other.prefix_len;
+        }
+        if (prefix != other.prefix)
+        {
+            return prefix < other.prefix;
+        }
+        return origin < other.origin;
+    }
+};
+
+/* a staged route: its next hops, and which of them each bucket uses */
+struct Ip6FibRoute
+{
+    std::vector<Ip6FibNextHop> next_hops;
+    IpEcmpBuckets buckets;
+};
+
+static std::map<Ip6FibKey, Ip6FibRoute> ip6_fib_routes;
+
+/* tries replaced by a commit and not freed yet */
+static std::atomic<Ip6FibTable*> ip6_fib_retired;
+
+static uint32_t ip6_fib_generation;
+
+/* Key of a route in ip6_fib_routes; false if prefix_len is invalid */
+static bool
+ip6_fib_key(const Ip6Addr& prefix, const uint8_t prefix_len, const Ip6FibOrigin origin, Ip6FibKey& key)
+{
+    if (prefix_len > 128)
+    {
+        return false;
+    }
+    key.prefix_len = prefix_len;
+    key.origin = origin;
+    for (size_t i = 0; i < 4; i++)
+    {
+        const int bits = std::min(std::max(int(prefix_len) - int(i) * 32, 0), 32);
+        const uint32_t mask = bits == 0 ? 0 : 0xffffffffU << (32 - bits);
+        key.prefix[i] = lwip_ntohl(prefix.word[i]) & mask;
+    }
+    return true;
+}
+
+/* Key of a next hop in the maps below */
+static std::array<uint32_t, 5>
+ip6_fib_hop_key(const Ip6FibNextHop& next_hop)
+{
+    return {next_hop.gateway.word[0],
+            next_hop.gateway.word[1],
+            next_hop.gateway.word[2],
+            next_hop.gateway.word[3],
+            next_hop.if_num};
+}
+
+/* The 4 bits of prefix a node at depth indexes its slots with */
+static uint32_t
+ip6_fib_nibble(const std::array<uint32_t, 4>& prefix, const size_t depth)
+{
+    return (prefix[depth >> 3] >> (28 - 4 * (depth & 7))) & 0xf;
+}
+
+/* Fill a new trie from the staged routes */
+static LwipStatus
+ip6_fib_build(Ip6FibTable& table)
+{
+    table.nodes.assign(1, Ip6FibNode{});
+    /* next hops are shared by all the paths using them, paths by all the
+       routes using them */
+    std::map<std::array<uint32_t, 5>, uint32_t> hop_entries;
+    std::map<std::array<uint32_t, IP_ECMP_BUCKETS>, uint32_t> path_entries;
+    for (const auto& route : ip6_fib_routes)
+    {
+        const Ip6FibKey& key = route.first;
+        std::array<uint32_t, IP_ECMP_MAX_NEXT_HOPS> members{};
+        for (size_t m = 0; m < route.second.next_hops.size(); m++)
+        {
+            const Ip6FibNextHop& next_hop = route.second.next_hops[m];
+            auto hop = hop_entries.find(ip6_fib_hop_key(next_hop));
+            if (hop == hop_entries.end())
+            {
+                table.next_hops.push_back(next_hop);
+                hop = hop_entries.emplace(ip6_fib_hop_key(next_hop), uint32_t(table.next_hops.size() - 1)).first;
+            }
+            members[m] = hop->second;
+        }
+        std::array<uint32_t, IP_ECMP_BUCKETS> path_key{};
+        for (size_t b = 0; b < IP_ECMP_BUCKETS; b++)
+        {
+            path_key[b] = members[route.second.buckets[b]];
+        }
+        auto path = path_entries.find(path_key);
+        if (path == path_entries.end())
+        {
+            table.paths.insert(table.paths.end(), path_key.begin(), path_key.end());
+            path = path_entries.emplace(path_key, uint32_t(path_entries.size() + 1)).first;
+        }
+        /* the node the prefix ends in, and the slots it covers there */
+        const size_t last = key.prefix_len == 0 ? 0 : (key.prefix_len - 1) / 4;
+        size_t node = 0;
+        for (size_t depth = 0; depth < last; depth++)
+        {
+            const uint32_t nibble = ip6_fib_nibble(key.prefix, depth);
+            const uint32_t entry = table.nodes[node].slot[nibble];
+            if (entry & IP6_FIB_ENTRY_NODE)
+            {
+                node = entry & ~IP6_FIB_ENTRY_NODE;
+                continue;
+            }
+            if (table.nodes.size() == IP6_FIB_ENTRY_NODE)
+            {
+                Logf(true, "ip6_fib_build: too many nodes\n");
+                return ERR_MEM;
+            }
+            /* push the route of the slot down into its new child */
+            Ip6FibNode child{};
+            std::fill_n(child.slot, 16, entry);
+            table.nodes.push_back(child);
+            table.nodes[node].slot[nibble] = IP6_FIB_ENTRY_NODE | uint32_t(table.nodes.size() - 1);
+            node = table.nodes.size() - 1;
+        }
+        /* longer prefixes come later, so none of these slots holds a node */
+        const size_t count = size_t(1) << (4 * (last + 1) - key.prefix_len);
+        const uint32_t first = ip6_fib_nibble(key.prefix, last) & ~uint32_t(count - 1);
+        std::fill_n(table.nodes[node].slot + first, count, path->second);
+    }
+    table.packets = std::vector<std::atomic<uint64_t>>(table.next_hops.size());
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage a route with a single next hop, replacing the one with the same
+ * prefix and origin.
+ *
+ * @param prefix network of the route, host bits are ignored
+ * @param prefix_len 0 (default route) to 128
+ * @param next_hop where the route sends packets
+ * @param origin who adds the route
+ * @return ERR_VAL if prefix_len is invalid
+ */
+LwipStatus
+ip6_fib_add(const Ip6Addr& prefix,
+            const uint8_t prefix_len,
+            const Ip6FibNextHop& next_hop,
+            const Ip6FibOrigin origin)
+{
+    Ip6FibKey key{};
+    if (!ip6_fib_key(prefix, prefix_len, origin, key))
+    {
+        return ERR_VAL;
+    }
+    Ip6FibRoute& route = ip6_fib_routes[key];
+    route.next_hops.assign(1, next_hop);
+    route.buckets.fill(0);
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage a next hop joining the next hop group of a route, creating the
+ * route if there is none with that prefix and origin. The flows of the other
+ * next hops only move to the new one as far as needed to balance the group.
+ *
+ * @return ERR_MEM if the group has IP_ECMP_MAX_NEXT_HOPS next hops
+ */
+LwipStatus
+ip6_fib_add_next_hop(const Ip6Addr& prefix,
+                     const uint8_t prefix_len,
+                     const Ip6FibNextHop& next_hop,
+                     const Ip6FibOrigin origin)
+{
+    Ip6FibKey key{};
+    if (!ip6_fib_key(prefix, prefix_len, origin, key))
+    {
+        return ERR_VAL;
+    }
+    Ip6FibRoute& route = ip6_fib_routes[key];
+    for (const auto& member : route.next_hops)
+    {
+        if (ip6_fib_hop_key(member) == ip6_fib_hop_key(next_hop))
+        {
+            return STATUS_SUCCESS;
+        }
+    }
+    if (route.next_hops.size() == IP_ECMP_MAX_NEXT_HOPS)
+    {
+        return ERR_MEM;
+    }
+    route.next_hops.push_back(next_hop);
+    ip_ecmp_add_member(route.buckets, route.next_hops.size());
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Stage the removal of a route.
+ *
+ * @return STATUS_NOT_FOUND if there is no route with that prefix and origin
+ */
+LwipStatus
+ip6_fib_delete(const Ip6Addr& prefix, const uint8_t prefix_len, const Ip6FibOrigin origin)
+{
+    Ip6FibKey key{};
+    if (!ip6_fib_key(prefix, prefix_len, origin, key))
+    {
+        return ERR_VAL;
+    }
+    return ip6_fib_routes.erase(key) != 0 ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+/* Take a next hop out of the group of a staged route, or the route out if
+   it was the last one; false in the latter case */
+static bool
+ip6_fib_remove_member(std::map<Ip6FibKey, Ip6FibRoute>::iterator it, const size_t member)
+{
+    Ip6FibRoute& route = it->second;
+    if (route.next_hops.size() == 1)
+    {
+        ip6_fib_routes.erase(it);
+        return false;
+    }
+    ip_ecmp_remove_member(route.buckets, route.next_hops.size(), member);
+    route.next_hops.erase(route.next_hops.begin() + member);
+    return true;
+}
+
+/**
+ * Stage a next hop leaving the next hop group of a route; only its flows move
+ * to other next hops. The route goes away with its last next hop.
+ *
+ * @return STATUS_NOT_FOUND if the route does not have that next hop
+ */
+LwipStatus
+ip6_fib_delete_next_hop(const Ip6Addr& prefix,
+                        const uint8_t prefix_len,
+                        const Ip6FibNextHop& next_hop,
+                        const Ip6FibOrigin origin)
+{
+    Ip6FibKey key{};
+    if (!ip6_fib_key(prefix, prefix_len, origin, key))
+    {
+        return ERR_VAL;
+    }
+    const auto it = ip6_fib_routes.find(key);
+    if (it == ip6_fib_routes.end())
+    {
+        return STATUS_NOT_FOUND;
+    }
+    for (size_t m = 0; m < it->second.next_hops.size(); m++)
+    {
+        if (ip6_fib_hop_key(it->second.next_hops[m]) == ip6_fib_hop_key(next_hop))
+        {
+            ip6_fib_remove_member(it, m);
+            return STATUS_SUCCESS;
+        }
+    }
+    return STATUS_NOT_FOUND;
+}
+
+/**
+ * Stage the removal of all next hops of an origin through an interface, e.g.
+ * when the interface goes away, and of the routes left without next hops.
+ */
+void
+ip6_fib_flush(const Ip6FibOrigin origin, const uint32_t if_num)
+{
+    for (auto it = ip6_fib_routes.begin(); it != ip6_fib_routes.end();)
+    {
+        const auto next = std::next(it);
+        if (it->first.origin == origin)
+        {
+            /* backwards, so that removing a member does not skip the next */
+            for (size_t m = it->second.next_hops.size(); m-- > 0;)
+            {
+                if (it->second.next_hops[m].if_num == if_num && !ip6_fib_remove_member(it, m))
+                {
+                    break;
+                }
+            }
+        }
+        it = next;
+    }
+}
+
+/**
+ * Build a trie from the staged routes and make lookups use it. The trie it
+ * replaces is freed by the next ip6_fib_reclaim().
+ *
+ * @return ERR_MEM if the trie would have too many nodes; lookups keep using
+ *         the current one
+ */
+LwipStatus
+ip6_fib_commit()
+{
+    const auto table = new Ip6FibTable;
+    const LwipStatus err = ip6_fib_build(*table);
+    if (err != STATUS_SUCCESS)
+    {
+        delete table;
+        return err;
+    }
+    table->generation = ++ip6_fib_generation;
+    table->retired_next = nullptr;
+    /* the counters of next hops that stay carry over, see ip4_fib_commit() */
+    const Ip6FibTable* current = ip6_fib_current.load(std::memory_order_acquire);
+    if (current != nullptr)
+    {
+        std::map<std::array<uint32_t, 5>, uint64_t> counts;
+        for (size_t i = 0; i < current->next_hops.size(); i++)
+        {
+            counts[ip6_fib_hop_key(current->next_hops[i])] = current->packets[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < table->next_hops.size(); i++)
+        {
+            const auto count = counts.find(ip6_fib_hop_key(table->next_hops[i]));
+            if (count != counts.end())
+            {
+                table->packets[i].store(count->second, std::memory_order_relaxed);
+            }
+        }
+    }
+    Ip6FibTable* old = ip6_fib_current.exchange(table, std::memory_order_acq_rel);
+    if (old != nullptr)
+    {
+        old->retired_next = ip6_fib_retired.load(std::memory_order_relaxed);
+        while (!ip6_fib_retired.compare_exchange_weak(old->retired_next,
+                                                      old,
+                                                      std::memory_order_release,
+                                                      std::memory_order_relaxed))
+        {
+        }
+    }
+    dst_cache_invalidate_all();
+    Logf(true,
+         "ip6_fib_commit: generation %u, %zu routes, %zu paths, %zu nodes\n",
+         table->generation,
+         ip6_fib_routes.size(),
+         table->paths.size() / IP_ECMP_BUCKETS,
+         table->nodes.size());
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Free the tries replaced by earlier commits. Called by the stack thread
+ * while it is not in the middle of a lookup.
+ */
+void
+ip6_fib_reclaim()
+{
+    Ip6FibTable* table = ip6_fib_retired.exchange(nullptr, std::memory_order_acquire);
+    while (table != nullptr)
+    {
+        Ip6FibTable* next = table->retired_next;
+        delete table;
+        table = next;
+    }
+}
+
+/**
+ * Packets sent to a next hop through ip6_fib_route() since it was first
+ * committed; 0 if no route of the published trie uses it.
+ */
+uint64_t
+ip6_fib_next_hop_packets(const Ip6FibNextHop& next_hop)
+{
+    const Ip6FibTable* table = ip6_fib_current.load(std::memory_order_acquire);
+    if (table == nullptr)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < table->next_hops.size(); i++)
+    {
+        if (ip6_fib_hop_key(table->next_hops[i]) == ip6_fib_hop_key(next_hop))
+        {
+            return table->packets[i].load(std::memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Longest prefix match of dst restricted to next hops through one interface,
+ * for callers that already picked the interface and cache per destination
+ * rather than per flow (the neighbor discovery destination cache).
+ *
+ * @return false if no route covers dst or its next hops use other interfaces
+ */
+bool
+ip6_fib_lookup_on(const Ip6Addr& dst, const uint32_t if_num, Ip6FibNextHop& next_hop)
+{
+    const Ip6FibTable* table = ip6_fib_current.load(std::memory_order_acquire);
+    const uint32_t entry = ip6_fib_find(table, dst);
+    if (entry == IP6_FIB_ENTRY_NONE)
+    {
+        return false;
+    }
+    for (size_t b = 0; b < IP_ECMP_BUCKETS; b++)
+    {
+        const Ip6FibNextHop& hop = table->next_hops[table->paths[size_t(entry - 1) * IP_ECMP_BUCKETS + b]];
+        if (hop.if_num == if_num)
+        {
+            next_hop = hop;
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,197 @@
+///
+/// file: ip6_fib.h
+///
+/// The IPv6 forwarding table: longest prefix match over static routes,
+/// routes learned from router advertisements and on-link prefixes.
+///
+/// Lookups walk a multibit trie with a stride of 4 bits. Every node has 16
+/// slots, each holding either the next hop of the longest prefix covering
+/// it or a child node. Routes are leaf-pushed: a node created below a slot
+/// inherits the next hop of that slot, so a lookup ends at the first slot
+/// that is not a child and never has to remember a match on the way. A
+/// lookup reads at most 32 nodes, however many routes there are.
+///
+/// Updates work like those of ip4_fib.h: ip6_fib_add(), ip6_fib_delete() and
+/// ip6_fib_flush() stage changes, ip6_fib_commit() builds and publishes a new
+/// trie with one atomic swap, and the stack thread frees replaced tries with
+/// ip6_fib_reclaim() between packets. Readers never lock.
+///
+/// Routes with the same prefix but different origins coexist; the one of the
+/// highest origin is used.
+///
+/// Routes may have several next hops, as in ip4_fib.h: slots name a path,
+/// whose IP_ECMP_BUCKETS buckets name the next hop for each flow hash.
+///
+
+#pragma once
+
+#include <atomic>
+#include <def.h>
+#include <ip6_addr.h>
+#include <ip_ecmp.h>
+#include <lwip_status.h>
+#include <vector>
+
+/// Who put a route in, in ascending precedence.
+enum Ip6FibOrigin : uint8_t
+{
+    /// route information option of a router advertisement
+    IP6_FIB_ORIGIN_RA,
+    /// on-link prefix of a router advertisement
+    IP6_FIB_ORIGIN_ONLINK,
+    /// configured
+    IP6_FIB_ORIGIN_STATIC,
+};
+
+/// Where a route sends packets.
+struct Ip6FibNextHop
+{
+    /// router to send to, the any address for on-link destinations
+    Ip6Addr gateway;
+    /// if_num of the outgoing interface
+    uint32_t if_num;
+};
+
+struct Ip6FibNode
+{
+    /// see IP6_FIB_ENTRY_*
+    uint32_t slot[16];
+};
+
+/// A published trie.
+struct Ip6FibTable
+{
+    /// nodes[0] is the root
+    std::vector<Ip6FibNode> nodes;
+    /// IP_ECMP_BUCKETS indices in next_hops per path
+    std::vector<uint32_t> paths;
+    std::vector<Ip6FibNextHop> next_hops;
+    /// packets ip6_fib_route() sent to each next hop
+    mutable std::vector<std::atomic<uint64_t>> packets;
+    /// bumped by every commit
+    uint32_t generation;
+    /* next table waiting for ip6_fib_reclaim() */
+    Ip6FibTable* retired_next;
+};
+
+/* slots with this bit set hold the index of a child node */
+constexpr uint32_t IP6_FIB_ENTRY_NODE = 0x80000000U;
+
+/* other slots hold a path index + 1, 0 is no route */
+constexpr uint32_t IP6_FIB_ENTRY_NONE = 0;
+
+LwipStatus
+ip6_fib_add(const Ip6Addr& prefix, uint8_t prefix_len, const Ip6FibNextHop& next_hop, Ip6FibOrigin origin);
+
+LwipStatus
+ip6_fib_add_next_hop(const Ip6Addr& prefix, uint8_t prefix_len, const Ip6FibNextHop& next_hop, Ip6FibOrigin origin);
+
+LwipStatus
+ip6_fib_delete(const Ip6Addr& prefix, uint8_t prefix_len, Ip6FibOrigin origin);
+
+LwipStatus
+ip6_fib_delete_next_hop(const Ip6Addr& prefix, uint8_t prefix_len, const Ip6FibNextHop& next_hop, Ip6FibOrigin origin);
+
+void
+ip6_fib_flush(Ip6FibOrigin origin, uint32_t if_num);
+
+LwipStatus
+ip6_fib_commit();
+
+void
+ip6_fib_reclaim();
+
+uint64_t
+ip6_fib_next_hop_packets(const Ip6FibNextHop& next_hop);
+
+bool
+ip6_fib_lookup_on(const Ip6Addr& dst, uint32_t if_num, Ip6FibNextHop& next_hop);
+
+/// The trie lookups use, nullptr before the first commit.
+extern std::atomic<Ip6FibTable*> ip6_fib_current;
+
+/// Whether a next hop is the destination itself rather than a router.
+inline bool
+ip6_fib_is_onlink(const Ip6FibNextHop& next_hop)
+{
+    return (next_hop.gateway.word[0] | next_hop.gateway.word[1] | next_hop.gateway.word[2] |
+        next_hop.gateway.word[3]) == 0;
+}
+
+/// Generation of the published trie, 0 before the first commit. Caches of
+/// lookup results are stale once it changes.
+inline uint32_t
+ip6_fib_current_generation()
+{
+    const Ip6FibTable* table = ip6_fib_current.load(std::memory_order_acquire);
+    return table != nullptr ? table->generation : 0;
+}
+
+/* Slot value of the longest prefix covering dst, IP6_FIB_ENTRY_NONE if
+   there is none */
+inline uint32_t
+ip6_fib_find(const Ip6FibTable* table, const Ip6Addr& dst)
+{
+    if (table == nullptr)
+    {
+        return IP6_FIB_ENTRY_NONE;
+    }
+    uint32_t node = 0;
+    for (size_t depth = 0; depth < 32; depth++)
+    {
+        const uint32_t word = lwip_ntohl(dst.word[depth >> 3]);
+        const uint32_t entry = table->nodes[node].slot[(word >> (28 - 4 * (depth & 7))) & 0xf];
+        if (!(entry & IP6_FIB_ENTRY_NODE))
+        {
+            return entry;
+        }
+        node = entry & ~IP6_FIB_ENTRY_NODE;
+    }
+    /* the slots of the deepest level never hold nodes */
+    return IP6_FIB_ENTRY_NONE;
+}
+
+///
+/// Longest prefix match of dst in the published trie. Stack thread only.
+///
+/// @param flow_hash picks one of the next hops of multipath routes, see
+///        ip_ecmp.h
+/// @return false if no route covers dst
+///
+inline bool
+ip6_fib_lookup(const Ip6Addr& dst, Ip6FibNextHop& next_hop, const uint32_t flow_hash = 0)
+{
+    const Ip6FibTable* table = ip6_fib_current.load(std::memory_order_acquire);
+    const uint32_t entry = ip6_fib_find(table, dst);
+    if (entry == IP6_FIB_ENTRY_NONE)
+    {
+        return false;
+    }
+    next_hop = table->next_hops[table->paths[size_t(entry - 1) * IP_ECMP_BUCKETS + ip_ecmp_bucket(flow_hash)]];
+    return true;
+}
+
+///
+/// ip6_fib_lookup() for a packet that is sent to the next hop found, which
+/// counts it (see ip6_fib_next_hop_packets()). The counters are accurate for
+/// forwarded packets; a flow whose route a pcb caches (dst_cache.h) is only
+/// counted when the route is looked up.
+///
+inline bool
+ip6_fib_route(const Ip6Addr& dst, const uint32_t flow_hash, Ip6FibNextHop& next_hop)
+{
+    const Ip6FibTable* table = ip6_fib_current.load(std::memory_order_acquire);
+    const uint32_t entry = ip6_fib_find(table, dst);
+    if (entry == IP6_FIB_ENTRY_NONE)
+    {
+        return false;
+    }
+    const uint32_t hop = table->paths[size_t(entry - 1) * IP_ECMP_BUCKETS + ip_ecmp_bucket(flow_hash)];
+    table->packets[hop].fetch_add(1, std::memory_order_relaxed);
+    next_hop = table->next_hops[hop];
+    return true;
+}
+
+//
+// END OF FILE
+//
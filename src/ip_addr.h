@@ -331,7 +331,7 @@ is_ip_addr_link_local(const IpAddrInfo& ipaddr)
     {
         return ip6_addr_is_linklocal(ipaddr.u_addr.ip6);
     }
-    return is_ip4_addr_link_local(ipaddr.u_addr.ip4);
+    return is_ip4_addr_link_local(ipaddr.u_addr.ip4.address);
 }
 
 
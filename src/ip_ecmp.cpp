@@ -0,0 +1,217 @@
+///
+/// file: ip_ecmp.cpp
+///
+/// Next hop groups and flow hashing, see ip_ecmp.h.
+///
+
+#include <cstring>
+#include <ip.h>
+#include <ip4.h>
+#include <ip6.h>
+#include <ip_ecmp.h>
+
+uint32_t ip_ecmp_seed = 0x5bd1e995U;
+
+/* One round of murmur3 */
+static uint32_t
+ip_ecmp_mix(uint32_t hash, uint32_t word)
+{
+    word *= 0xcc9e2d51U;
+    word = word << 15 | word >> 17;
+    word *= 0x1b873593U;
+    hash ^= word;
+    hash = hash << 13 | hash >> 19;
+    return hash * 5 + 0xe6546b64U;
+}
+
+/* murmur3 finalizer, so that every bit of the flow affects the bucket */
+static uint32_t
+ip_ecmp_finish(uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    return hash ^ hash >> 16;
+}
+
+///
+/// Give a member that just joined a group its share of the buckets.
+///
+/// @param buckets the buckets of the group
+/// @param count number of members, the new one being the last
+///
+void
+ip_ecmp_add_member(IpEcmpBuckets& buckets, const size_t count)
+{
+    const auto member = uint8_t(count - 1);
+    if (member == 0)
+    {
+        buckets.fill(0);
+        return;
+    }
+    std::array<size_t, IP_ECMP_MAX_NEXT_HOPS> held{};
+    for (const uint8_t owner : buckets)
+    {
+        held[owner]++;
+    }
+    /* only members above the share give up buckets; they hold at least the
+       share of the new member between them */
+    const size_t share = IP_ECMP_BUCKETS / count;
+    for (size_t b = 0; b < IP_ECMP_BUCKETS && held[member] < share; b++)
+    {
+        const uint8_t owner = buckets[b];
+        if (held[owner] > share)
+        {
+            held[owner]--;
+            held[member]++;
+            buckets[b] = member;
+        }
+    }
+}
+
+///
+/// Hand the buckets of a member leaving a group to the other members, and
+/// renumber the members after it as it is taken out of their list.
+///
+/// @param buckets the buckets of the group
+/// @param count number of members, including the leaving one
+/// @param member the leaving member
+///
+void
+ip_ecmp_remove_member(IpEcmpBuckets& buckets, const size_t count, const size_t member)
+{
+    if (count <= 1)
+    {
+        return;
+    }
+    std::array<size_t, IP_ECMP_MAX_NEXT_HOPS> held{};
+    for (const uint8_t owner : buckets)
+    {
+        held[owner]++;
+    }
+    for (uint8_t& owner : buckets)
+    {
+        if (owner != member)
+        {
+            continue;
+        }
+        size_t least = member == 0 ? 1 : 0;
+        for (size_t m = 0; m < count; m++)
+        {
+            if (m != member && held[m] < held[least])
+            {
+                least = m;
+            }
+        }
+        owner = uint8_t(least);
+        held[least]++;
+    }
+    for (uint8_t& owner : buckets)
+    {
+        if (owner > member)
+        {
+            owner--;
+        }
+    }
+}
+
+///
+/// Flow hash of IPv4 traffic.
+///
+/// @param ports source port << 16 | destination port, 0 if there are none
+///
+uint32_t
+ip_ecmp_hash4(const Ip4Addr& src, const Ip4Addr& dst, const uint8_t proto, const uint32_t ports)
+{
+    uint32_t hash = ip_ecmp_mix(ip_ecmp_seed, src.addr);
+    hash = ip_ecmp_mix(hash, dst.addr);
+    hash = ip_ecmp_mix(hash, proto);
+    return ip_ecmp_finish(ip_ecmp_mix(hash, ports));
+}
+
+///
+/// Flow hash of IPv6 traffic.
+///
+/// @param ports_or_label source port << 16 | destination port, or the flow
+///        label if there are no ports
+///
+uint32_t
+ip_ecmp_hash6(const Ip6Addr& src, const Ip6Addr& dst, const uint8_t proto, const uint32_t ports_or_label)
+{
+    uint32_t hash = ip_ecmp_seed;
+    for (size_t i = 0; i < 4; i++)
+    {
+        hash = ip_ecmp_mix(hash, src.word[i]);
+        hash = ip_ecmp_mix(hash, dst.word[i]);
+    }
+    hash = ip_ecmp_mix(hash, proto);
+    return ip_ecmp_finish(ip_ecmp_mix(hash, ports_or_label));
+}
+
+///
+/// Ports of a TCP or UDP header, as the ports argument of the hashes above.
+///
+/// @return 0 for other protocols or a truncated header
+///
+uint32_t
+ip_ecmp_ports(const uint8_t proto, const uint8_t* l4, const size_t l4_len)
+{
+    if ((proto != IP_PROTO_TCP && proto != IP_PROTO_UDP && proto != IP_PROTO_UDPLITE) || l4_len < 4)
+    {
+        return 0;
+    }
+    return uint32_t(l4[0]) << 24 | uint32_t(l4[1]) << 16 | uint32_t(l4[2]) << 8 | l4[3];
+}
+
+///
+/// Flow hash of an IPv4 packet, ip pointing to its header.
+///
+uint32_t
+ip_ecmp_hash_ip4_pkt(const uint8_t* ip, const size_t len)
+{
+    if (len < IP4_HDR_LEN)
+    {
+        return 0;
+    }
+    Ip4Addr src{};
+    Ip4Addr dst{};
+    memcpy(&src.addr, ip + 12, sizeof src.addr);
+    memcpy(&dst.addr, ip + 16, sizeof dst.addr);
+    const size_t hdr_len = size_t(ip[0] & 0x0f) * 4;
+    /* fragment offset or more fragments set */
+    const bool fragment = ((ip[6] & 0x3f) | ip[7]) != 0;
+    uint32_t ports = 0;
+    if (!fragment && hdr_len < len)
+    {
+        ports = ip_ecmp_ports(ip[9], ip + hdr_len, len - hdr_len);
+    }
+    return ip_ecmp_hash4(src, dst, ip[9], ports);
+}
+
+///
+/// Flow hash of an IPv6 packet, ip pointing to its header.
+///
+uint32_t
+ip_ecmp_hash_ip6_pkt(const uint8_t* ip, const size_t len)
+{
+    if (len < IP6_HDR_LEN)
+    {
+        return 0;
+    }
+    Ip6Addr src{};
+    Ip6Addr dst{};
+    memcpy(src.word, ip + 8, sizeof src.word);
+    memcpy(dst.word, ip + 24, sizeof dst.word);
+    uint32_t ports = ip_ecmp_ports(ip[6], ip + IP6_HDR_LEN, len - IP6_HDR_LEN);
+    if (ports == 0)
+    {
+        /* extension headers, fragments and other protocols */
+        ports = uint32_t(ip[1] & 0x0f) << 16 | uint32_t(ip[2]) << 8 | ip[3];
+    }
+    return ip_ecmp_hash6(src, dst, ip[6], ports);
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,86 @@
+///
+/// file: ip_ecmp.h
+///
+/// Equal-cost multipath: spreading the flows of a route over its next hops.
+///
+/// A route with several next hops holds a next hop group, in which each of
+/// IP_ECMP_BUCKETS hash buckets names one member. A packet goes to the member
+/// of the bucket its flow hash falls into, so all packets of a flow take the
+/// same path. The buckets are resilient: a member joining the group takes
+/// its share of buckets from the members holding the most, and the buckets of
+/// a member leaving are handed to the members holding the fewest, so only
+/// the flows of the buckets that changed hands move to another path.
+///
+/// The flow hash covers addresses, protocol and, for TCP and UDP, ports. For
+/// other IPv6 traffic it covers the flow label instead of the ports (RFC 6438).
+/// Fragments are hashed without ports, so that all fragments of a datagram
+/// take the same path.
+///
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ip_addr.h>
+
+/// Hash buckets of a next hop group, a power of two.
+constexpr size_t IP_ECMP_BUCKETS = 64;
+
+/// Most next hops of a group.
+constexpr size_t IP_ECMP_MAX_NEXT_HOPS = 16;
+
+/// Member of the group each bucket sends to.
+using IpEcmpBuckets = std::array<uint8_t, IP_ECMP_BUCKETS>;
+
+/// Mixed into every flow hash. Set it to a random number at startup, so that
+/// routers in a chain do not all split flows the same way (hash polarisation).
+extern uint32_t ip_ecmp_seed;
+
+void
+ip_ecmp_add_member(IpEcmpBuckets& buckets, size_t count);
+
+void
+ip_ecmp_remove_member(IpEcmpBuckets& buckets, size_t count, size_t member);
+
+uint32_t
+ip_ecmp_hash4(const Ip4Addr& src, const Ip4Addr& dst, uint8_t proto, uint32_t ports);
+
+uint32_t
+ip_ecmp_hash6(const Ip6Addr& src, const Ip6Addr& dst, uint8_t proto, uint32_t ports_or_label);
+
+uint32_t
+ip_ecmp_ports(uint8_t proto, const uint8_t* l4, size_t l4_len);
+
+uint32_t
+ip_ecmp_hash_ip4_pkt(const uint8_t* ip, size_t len);
+
+uint32_t
+ip_ecmp_hash_ip6_pkt(const uint8_t* ip, size_t len);
+
+/// Bucket a flow hash falls into.
+inline size_t
+ip_ecmp_bucket(const uint32_t flow_hash)
+{
+    return flow_hash & (IP_ECMP_BUCKETS - 1);
+}
+
+/// Flow hash of a transport connection.
+inline uint32_t
+ip_ecmp_hash(const IpAddrInfo& src,
+             const IpAddrInfo& dst,
+             const uint8_t proto,
+             const uint16_t src_port,
+             const uint16_t dst_port)
+{
+    const uint32_t ports = uint32_t(src_port) << 16 | dst_port;
+    if (is_ip_addr_v6(dst))
+    {
+        return ip_ecmp_hash6(src.u_addr.ip6.addr, dst.u_addr.ip6.addr, proto, ports);
+    }
+    return ip_ecmp_hash4(src.u_addr.ip4.address, dst.u_addr.ip4.address, proto, ports);
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,581 @@
+///
+/// file: ip_fwd.cpp
+///
+/// Batched forwarding fast path, see ip_fwd.h.
+///
+
+#include <algorithm>
+#include <cstring>
+#include <ieee.h>
+#include <inet_chksum.h>
+#include <ip4.h>
+#include <ip4_acl.h>
+#include <ip4_fib.h>
+#include <ip4_nat.h>
+#include <ip4_rule.h>
+#include <ip6.h>
+#include <ip6_fib.h>
+#include <ip_ecmp.h>
+#include <ip_fwd.h>
+#include <nd6.h>
+#include <utility>
+
+IpFwdStats ip_fwd_stats;
+
+/* offsets in a frame */
+constexpr size_t IP_FWD_ETH_DST = ETH_PAD_SIZE;
+constexpr size_t IP_FWD_ETH_SRC = ETH_PAD_SIZE + ETH_ADDR_LEN;
+constexpr size_t IP_FWD_ETH_TYPE = ETH_PAD_SIZE + 2 * ETH_ADDR_LEN;
+constexpr size_t IP_FWD_IP = kSizeofEthHdr;
+
+enum IpFwdVerdict : uint8_t
+{
+    IP_FWD_CONTINUE,
+    IP_FWD_PUNT,
+    IP_FWD_DROP,
+};
+
+/* what the stages learned about a frame of the burst */
+struct IpFwdFrame
+{
+    IpFwdVerdict verdict;
+    bool ip6;
+    /* length of the IP packet, without link-layer padding */
+    size_t ip_len;
+    /* index of the egress netif in netifs */
+    size_t out;
+    /* packet counter of the next hop in the table it was found in */
+    std::atomic<uint64_t>* packets;
+    /* ingress and forward filter rules an IPv4 frame matched, and its mark
+       after them; counted and set once the frame is forwarded or dropped */
+    uint32_t acl_rules[2];
+    uint32_t mark;
+    Ip4Addr next_hop4;
+    Ip6Addr next_hop6;
+    MacAddress dst_mac;
+};
+
+/* addresses of this host, whose frames go to the regular input path */
+struct IpFwdLocal
+{
+    /* host order, including directed broadcasts */
+    std::vector<uint32_t> ip4;
+    std::vector<Ip6Addr> ip6;
+    /* link address of each netif, with its input_netif_idx */
+    std::vector<std::pair<uint32_t, MacAddress>> macs;
+};
+
+static uint16_t
+ip_fwd_read16(const uint8_t* p)
+{
+    return uint16_t(p[0] << 8 | p[1]);
+}
+
+static uint32_t
+ip_fwd_read32(const uint8_t* p)
+{
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+/* Have the header of a frame a later iteration works on loaded into the cache */
+static void
+ip_fwd_prefetch(const std::vector<PacketBuffer>& frames, const size_t i)
+{
+#if defined(__GNUC__)
+    if (i < frames.size())
+    {
+        __builtin_prefetch(frames[i].data.data(), 1);
+    }
+#endif
+}
+
+static IpFwdLocal
+ip_fwd_collect_local(const std::vector<NetworkInterface>& netifs)
+{
+    IpFwdLocal local;
+    for (const auto& netif : netifs)
+    {
+        local.macs.emplace_back(get_and_inc_netif_num(netif), netif.mac_address);
+        for (const auto& addr_info : netif.ip4_addresses)
+        {
+            const uint32_t addr = lwip_ntohl(addr_info.address.addr);
+            const uint32_t mask = lwip_ntohl(addr_info.netmask.addr);
+            if (addr != 0)
+            {
+                local.ip4.push_back(addr);
+                local.ip4.push_back((addr & mask) | ~mask);
+            }
+        }
+        for (const auto& addr_info : netif.ip6_addresses)
+        {
+            local.ip6.push_back(addr_info.addr);
+        }
+    }
+    return local;
+}
+
+/* true if a unicast frame was sent to the link address of the netif it
+   came in on; the adapter is promiscuous, so frames for other stations on
+   the segment and our own transmitted frames show up as well */
+static bool
+ip_fwd_to_us(const uint8_t* dst, const uint32_t input_netif_idx, const IpFwdLocal& local)
+{
+    for (const auto& mac : local.macs)
+    {
+        if (mac.first == input_netif_idx)
+        {
+            return memcmp(dst, mac.second.bytes, ETH_ADDR_LEN) == 0;
+        }
+    }
+    return false;
+}
+
+/* IPv6 addresses the fast path leaves alone: multicast, link-local, loopback
+   and unspecified */
+static bool
+ip_fwd_ip6_special(const uint8_t* addr)
+{
+    if (addr[0] == 0xff || (addr[0] == 0xfe && (addr[1] & 0xc0) == 0x80))
+    {
+        return true;
+    }
+    return std::all_of(addr, addr + 15, [](const uint8_t b) { return b == 0; }) && addr[15] <= 1;
+}
+
+static IpFwdVerdict
+ip_fwd_validate4(const uint8_t* ip, const size_t len, const IpFwdLocal& local, IpFwdFrame& frame)
+{
+    if (len < IP4_HDR_LEN)
+    {
+        return IP_FWD_DROP;
+    }
+    /* options are processed by the regular path */
+    if (ip[0] != 0x45)
+    {
+        return IP_FWD_PUNT;
+    }
+    const size_t tot_len = ip_fwd_read16(ip + 2);
+    if (tot_len < IP4_HDR_LEN || tot_len > len || inet_chksum(ip, IP4_HDR_LEN) != 0)
+    {
+        return IP_FWD_DROP;
+    }
+    /* time exceeded is sent by the regular path */
+    if (ip[8] <= 1)
+    {
+        return IP_FWD_PUNT;
+    }
+    const uint32_t src = ip_fwd_read32(ip + 12);
+    const uint32_t dst = ip_fwd_read32(ip + 16);
+    /* multicast, broadcast and experimental destinations, "this network",
+       loopback, and link-local addresses (RFC 3927 2.7) */
+    if (dst >= 0xe0000000U || dst >> 24 == 0 || dst >> 24 == IP_LOOPBACKNET || dst >> 16 == 0xa9fe ||
+        src >= 0xe0000000U || src >> 24 == IP_LOOPBACKNET)
+    {
+        return IP_FWD_PUNT;
+    }
+    if (std::find(local.ip4.begin(), local.ip4.end(), dst) != local.ip4.end())
+    {
+        return IP_FWD_PUNT;
+    }
+    frame.ip_len = tot_len;
+    return IP_FWD_CONTINUE;
+}
+
+static IpFwdVerdict
+ip_fwd_validate6(const uint8_t* ip, const size_t len, const IpFwdLocal& local, IpFwdFrame& frame)
+{
+    if (len < IP6_HDR_LEN)
+    {
+        return IP_FWD_DROP;
+    }
+    if (ip[0] >> 4 != 6)
+    {
+        return IP_FWD_PUNT;
+    }
+    const size_t ip_len = IP6_HDR_LEN + ip_fwd_read16(ip + 4);
+    if (ip_len > len)
+    {
+        return IP_FWD_DROP;
+    }
+    /* hop-by-hop options (and jumbograms) are processed by the regular path,
+       as is time exceeded */
+    if (ip[6] == IP6_NEXTH_HOPBYHOP || ip[7] <= 1)
+    {
+        return IP_FWD_PUNT;
+    }
+    /* zoned and loopback sources must not leave their zone, see
+       forward_ip6_packet() */
+    if (ip_fwd_ip6_special(ip + 8) || ip_fwd_ip6_special(ip + 24))
+    {
+        return IP_FWD_PUNT;
+    }
+    for (const auto& addr : local.ip6)
+    {
+        if (memcmp(addr.word, ip + 24, sizeof addr.word) == 0)
+        {
+            return IP_FWD_PUNT;
+        }
+    }
+    frame.ip_len = ip_len;
+    return IP_FWD_CONTINUE;
+}
+
+/* Stage 1: decide which frames the fast path can forward */
+static void
+ip_fwd_validate(const std::vector<PacketBuffer>& frames,
+                const size_t first,
+                const size_t count,
+                const IpFwdLocal& local,
+                IpFwdFrame* ctx)
+{
+    /* NAT tracks and rewrites IPv4 connections on the regular path */
+    const bool nat = ip4_nat_enabled();
+    for (size_t k = 0; k < count; k++)
+    {
+        ip_fwd_prefetch(frames, first + k + IP_FWD_PREFETCH_AHEAD);
+        const PacketBuffer& pkt = frames[first + k];
+        const std::vector<uint8_t>& data = pkt.data;
+        IpFwdFrame& frame = ctx[k];
+        frame.acl_rules[0] = IP4_ACL_NO_RULE;
+        frame.acl_rules[1] = IP4_ACL_NO_RULE;
+        if (data.size() < IP_FWD_IP)
+        {
+            frame.verdict = IP_FWD_DROP;
+            continue;
+        }
+        /* link-layer broadcasts and multicasts are not routed */
+        if (data[IP_FWD_ETH_DST] & 1)
+        {
+            frame.verdict = IP_FWD_PUNT;
+            continue;
+        }
+        /* nor is unicast for another station, which would be sent twice */
+        if (!ip_fwd_to_us(data.data() + IP_FWD_ETH_DST, pkt.input_netif_idx, local))
+        {
+            frame.verdict = IP_FWD_DROP;
+            continue;
+        }
+        const uint16_t type = ip_fwd_read16(data.data() + IP_FWD_ETH_TYPE);
+        const uint8_t* ip = data.data() + IP_FWD_IP;
+        const size_t len = data.size() - IP_FWD_IP;
+        if (type == ETHTYPE_IP && nat)
+        {
+            frame.verdict = IP_FWD_PUNT;
+        }
+        else if (type == ETHTYPE_IP)
+        {
+            frame.ip6 = false;
+            frame.verdict = ip_fwd_validate4(ip, len, local, frame);
+        }
+        else if (type == ETHTYPE_IPV6)
+        {
+            frame.ip6 = true;
+            frame.verdict = ip_fwd_validate6(ip, len, local, frame);
+        }
+        else
+        {
+            frame.verdict = IP_FWD_PUNT;
+        }
+    }
+}
+
+/* Filter an IPv4 frame at a hook; false if it is denied, which drops it */
+static bool
+ip_fwd_acl(const Ip4AclSet& acl,
+           const Ip4AclHook hook,
+           const uint8_t* ip,
+           const uint32_t in_if_num,
+           const uint32_t out_if_num,
+           IpFwdFrame& frame)
+{
+    if (acl.chains[hook].tuples.empty() && acl.chains[hook].default_action == IP4_ACL_PERMIT)
+    {
+        return true;
+    }
+    Ip4AclKey key{};
+    ip4_acl_key(ip, frame.ip_len, in_if_num, out_if_num, key);
+    if (ip4_acl_short_ports_denied(acl, hook, key))
+    {
+        frame.verdict = IP_FWD_DROP;
+        return false;
+    }
+    const uint32_t rule = ip4_acl_find(acl, hook, key);
+    frame.acl_rules[hook == IP4_ACL_FORWARD] = rule;
+    if (ip4_acl_action(acl, hook, rule, frame.mark) == IP4_ACL_DENY)
+    {
+        frame.verdict = IP_FWD_DROP;
+        return false;
+    }
+    return true;
+}
+
+/* Stage 2: find the egress netif and next hop of each frame */
+static void
+ip_fwd_lookup(const std::vector<PacketBuffer>& frames,
+              const size_t first,
+              const size_t count,
+              const std::vector<NetworkInterface>& netifs,
+              const Ip6FibTable* fib6,
+              const Ip4AclSet* acl,
+              IpFwdFrame* ctx)
+{
+    size_t out = netifs.size();
+    for (size_t k = 0; k < count; k++)
+    {
+        IpFwdFrame& frame = ctx[k];
+        if (frame.verdict != IP_FWD_CONTINUE)
+        {
+            continue;
+        }
+        const PacketBuffer& pkt = frames[first + k];
+        const uint8_t* ip = pkt.data.data() + IP_FWD_IP;
+        uint32_t if_num;
+        if (!frame.ip6)
+        {
+            Ip4Addr src{};
+            Ip4Addr dst{};
+            memcpy(&src.addr, ip + 12, sizeof src.addr);
+            memcpy(&dst.addr, ip + 16, sizeof dst.addr);
+            frame.mark = pkt.mark;
+            if (acl != nullptr && !ip_fwd_acl(*acl, IP4_ACL_INGRESS, ip, pkt.input_netif_idx - 1, IP4_ACL_ANY_IF, frame))
+            {
+                continue;
+            }
+            const Ip4RuleKey key{pkt.input_netif_idx - 1, ip[1], frame.mark};
+            const Ip4FibTable* table = nullptr;
+            int32_t hop = -1;
+            if (ip4_rule_find(src, dst, key, ip_ecmp_hash_ip4_pkt(ip, frame.ip_len), table, hop) != STATUS_SUCCESS)
+            {
+                frame.verdict = IP_FWD_PUNT;
+                continue;
+            }
+            const Ip4FibNextHop& next_hop = table->next_hops[hop];
+            frame.packets = &table->packets[hop];
+            frame.next_hop4 = next_hop.gateway.addr != 0 ? next_hop.gateway : dst;
+            if_num = next_hop.if_num;
+        }
+        else
+        {
+            Ip6Addr dst{};
+            memcpy(dst.word, ip + 24, sizeof dst.word);
+            const uint32_t entry = ip6_fib_find(fib6, dst);
+            if (entry == IP6_FIB_ENTRY_NONE)
+            {
+                frame.verdict = IP_FWD_PUNT;
+                continue;
+            }
+            const uint32_t hop = fib6->paths[size_t(entry - 1) * IP_ECMP_BUCKETS +
+                ip_ecmp_bucket(ip_ecmp_hash_ip6_pkt(ip, frame.ip_len))];
+            const Ip6FibNextHop& next_hop = fib6->next_hops[hop];
+            frame.packets = &fib6->packets[hop];
+            frame.next_hop6 = ip6_fib_is_onlink(next_hop) ? dst : next_hop.gateway;
+            if_num = next_hop.if_num;
+        }
+        if (out == netifs.size() || netifs[out].if_num != if_num)
+        {
+            out = std::find_if(netifs.begin(),
+                               netifs.end(),
+                               [if_num](const NetworkInterface& netif) { return netif.if_num == if_num; }) -
+                netifs.begin();
+        }
+        if (out == netifs.size())
+        {
+            frame.verdict = IP_FWD_PUNT;
+            continue;
+        }
+        const NetworkInterface& netif = netifs[out];
+        /* fragmenting and packet too big are left to the regular path, as
+           are IPv6 packets that would go back out of their ingress netif */
+        if (!netif.ethernet || !is_netif_up(netif) || !is_netif_link_up(netif) ||
+            (netif.mtu != 0 && frame.ip_len > netif.mtu) ||
+            (frame.ip6 && get_and_inc_netif_num(netif) == pkt.input_netif_idx))
+        {
+            frame.verdict = IP_FWD_PUNT;
+            continue;
+        }
+        if (!frame.ip6 && acl != nullptr &&
+            !ip_fwd_acl(*acl, IP4_ACL_FORWARD, ip, pkt.input_netif_idx - 1, if_num, frame))
+        {
+            continue;
+        }
+        frame.out = out;
+    }
+}
+
+/* Stage 3: find the link-layer address of each next hop */
+static void
+ip_fwd_neighbour(const size_t count,
+                 const std::vector<NetworkInterface>& netifs,
+                 std::vector<EtharpEntry>& arp_entries,
+                 IpFwdFrame* ctx)
+{
+    const IpFwdFrame* last = nullptr;
+    bool found = false;
+    for (size_t k = 0; k < count; k++)
+    {
+        IpFwdFrame& frame = ctx[k];
+        if (frame.verdict != IP_FWD_CONTINUE)
+        {
+            continue;
+        }
+        const bool same = last != nullptr && last->ip6 == frame.ip6 && last->out == frame.out &&
+        (frame.ip6
+             ? memcmp(last->next_hop6.word, frame.next_hop6.word, sizeof frame.next_hop6.word) == 0
+             : last->next_hop4.addr == frame.next_hop4.addr);
+        if (same)
+        {
+            frame.dst_mac = last->dst_mac;
+        }
+        else if (!frame.ip6)
+        {
+            Ip4AddrInfo next_hop{};
+            next_hop.address = frame.next_hop4;
+            size_t idx;
+            found = false;
+            if (etharp_find_entry(next_hop, netifs[frame.out], arp_entries, false, true, false, idx) ==
+                STATUS_SUCCESS)
+            {
+                /* entries about to expire are re-requested by etharp_output() */
+                const EtharpEntry& entry = arp_entries[idx];
+                found = entry.state == ETHARP_STATE_STATIC ||
+                    (entry.state >= ETHARP_STATE_STABLE && entry.ctime < ARP_AGE_REREQUEST_USED_UNICAST);
+                frame.dst_mac = entry.mac_address;
+            }
+        }
+        else
+        {
+            /* unreachability detection is up to nd6_get_next_hop_addr_or_queue() */
+            found = nd6_get_reachable_lladdr(&frame.next_hop6, &netifs[frame.out], &frame.dst_mac);
+        }
+        last = &frame;
+        if (!found)
+        {
+            frame.verdict = IP_FWD_PUNT;
+        }
+    }
+}
+
+/* Stage 4: turn the frames into the ones to send */
+static void
+ip_fwd_rewrite(std::vector<PacketBuffer>& frames,
+               const size_t first,
+               const size_t count,
+               const std::vector<NetworkInterface>& netifs,
+               const IpFwdFrame* ctx)
+{
+    for (size_t k = 0; k < count; k++)
+    {
+        const IpFwdFrame& frame = ctx[k];
+        if (frame.verdict != IP_FWD_CONTINUE)
+        {
+            continue;
+        }
+        uint8_t* data = frames[first + k].data.data();
+        uint8_t* ip = data + IP_FWD_IP;
+        if (!frame.ip6)
+        {
+            ip[8]--;
+            /* the TTL is the high byte of its 16 bit word, so the checksum
+               goes up by 0x100 in one's complement (RFC 1624) */
+            uint32_t sum = ip_fwd_read16(ip + 10) + 0x100U;
+            sum = (sum & 0xffff) + (sum >> 16);
+            ip[10] = uint8_t(sum >> 8);
+            ip[11] = uint8_t(sum);
+        }
+        else
+        {
+            ip[7]--;
+        }
+        memcpy(data + IP_FWD_ETH_DST, frame.dst_mac.bytes, ETH_ADDR_LEN);
+        memcpy(data + IP_FWD_ETH_SRC, netifs[frame.out].mac_address.bytes, ETH_ADDR_LEN);
+    }
+}
+
+/* Stage 5: hand the frames to their egress netif */
+static size_t
+ip_fwd_enqueue(std::vector<PacketBuffer>& frames,
+               const size_t first,
+               const size_t count,
+               std::vector<NetworkInterface>& netifs,
+               const Ip4AclSet* acl,
+               const IpFwdFrame* ctx,
+               std::vector<size_t>& punted)
+{
+    size_t forwarded = 0;
+    for (size_t k = 0; k < count; k++)
+    {
+        PacketBuffer& pkt = frames[first + k];
+        if (acl != nullptr && ctx[k].verdict != IP_FWD_PUNT)
+        {
+            ip4_acl_count(*acl, ctx[k].acl_rules[0]);
+            ip4_acl_count(*acl, ctx[k].acl_rules[1]);
+        }
+        switch (ctx[k].verdict)
+        {
+        case IP_FWD_CONTINUE:
+            /* see ip4_fib_route() */
+            ctx[k].packets->fetch_add(1, std::memory_order_relaxed);
+            if (!ctx[k].ip6)
+            {
+                pkt.mark = ctx[k].mark;
+            }
+            pkt.direction = DIR_OUT;
+            netifs[ctx[k].out].tx_buffer.push(std::move(pkt));
+            pkt.data.clear();
+            forwarded++;
+            break;
+        case IP_FWD_PUNT:
+            punted.push_back(first + k);
+            ip_fwd_stats.punted++;
+            break;
+        case IP_FWD_DROP:
+            pkt.data.clear();
+            ip_fwd_stats.dropped++;
+            break;
+        }
+    }
+    ip_fwd_stats.forwarded += forwarded;
+    return forwarded;
+}
+
+/**
+ * Forward a burst of received Ethernet frames, see ip_fwd.h.
+ *
+ * @param frames the frames, with input_netif_idx set as by ethernet_input()
+ * @param netifs all interfaces; forwarded frames are moved onto the
+ *        tx_buffer of their egress netif
+ * @param arp_entries the ARP cache
+ * @param punted receives the indices of the frames left for
+ *        ethernet_input(), in ascending order
+ * @return the number of frames forwarded. Frames neither forwarded nor
+ *         punted were malformed and dropped; both are left empty.
+ */
+size_t
+ip_fwd_burst(std::vector<PacketBuffer>& frames,
+             std::vector<NetworkInterface>& netifs,
+             std::vector<EtharpEntry>& arp_entries,
+             std::vector<size_t>& punted)
+{
+    punted.clear();
+    const IpFwdLocal local = ip_fwd_collect_local(netifs);
+    IpFwdFrame ctx[IP_FWD_BURST_SIZE];
+    size_t forwarded = 0;
+    for (size_t first = 0; first < frames.size(); first += IP_FWD_BURST_SIZE)
+    {
+        const size_t count = std::min(frames.size() - first, IP_FWD_BURST_SIZE);
+        ip_fwd_validate(frames, first, count, local, ctx);
+        /* tables are held until the frames are enqueued; ip*_fib_reclaim(),
+           ip4_rule_reclaim() and ip4_acl_reclaim() run between bursts on
+           this thread, at the end of ethernet_input_burst() */
+        const Ip4AclSet* acl = ip4_acl_current.load(std::memory_order_acquire);
+        ip_fwd_lookup(frames, first, count, netifs, ip6_fib_current.load(std::memory_order_acquire), acl, ctx);
+        ip_fwd_neighbour(count, netifs, arp_entries, ctx);
+        ip_fwd_rewrite(frames, first, count, netifs, ctx);
+        forwarded += ip_fwd_enqueue(frames, first, count, netifs, acl, ctx, punted);
+    }
+    return forwarded;
+}
+
+//
+// END OF FILE
+//
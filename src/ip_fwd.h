@@ -0,0 +1,76 @@
+///
+/// file: ip_fwd.h
+///
+/// Batched forwarding fast path for IPv4 and IPv6.
+///
+/// ip_fwd_burst() forwards a burst of received Ethernet frames the way a
+/// vector packet processor does: rather than taking each frame through the
+/// whole input and forwarding path before looking at the next, it takes the
+/// whole burst through one stage at a time, so that the code and tables of a
+/// stage stay in cache while it works on the burst. The first stage
+/// prefetches the frames a few iterations ahead of the one it works on, so
+/// that the later stages find the headers in the cache:
+///
+///  1. validate: Ethernet destination (frames for other stations, seen
+///     because the adapter is promiscuous, are dropped), Ethernet type, IP
+///     version and header length, IPv4 header checksum, TTL or hop limit,
+///     and addresses that may be forwarded;
+///  2. lookup: IPv4 ingress filter (ip4_acl.h), routing policy
+///     (ip4_rule.h), longest prefix match in ip4_fib.h or ip6_fib.h, next hop
+///     of multipath routes by flow hash (ip_ecmp.h); egress MTU check; IPv4
+///     forward filter;
+///  3. neighbour: link-layer address of the next hop from a resolved ARP
+///     entry or a REACHABLE neighbour cache entry;
+///  4. rewrite: TTL or hop limit decrement, incremental IPv4 checksum update
+///     and Ethernet addresses, in place;
+///  5. enqueue: frames are moved onto the tx_buffer of their egress netif.
+///
+/// Whatever the fast path does not handle (frames for this host, IPv4
+/// options, IPv6 hop-by-hop options, expiring TTLs, missing routes,
+/// unresolved or stale neighbours, frames that need fragmenting, IPv4 while
+/// there are NAT rules, see ip4_nat.h) is left
+/// unmodified in the burst and its index reported back, so that the caller
+/// hands it to ethernet_input() and the regular path sends ICMP errors,
+/// fragments or resolves the neighbour. A frame is only modified once it is
+/// certain to be forwarded.
+///
+/// ethernet_input_burst() runs the frames a driver queued on a netif through
+/// it, and hands the punted ones to ethernet_input().
+///
+
+#pragma once
+
+#include <etharp.h>
+#include <network_interface.h>
+#include <packet_buffer.h>
+#include <vector>
+
+/// Most frames the stages work on at once; longer bursts are split.
+constexpr size_t IP_FWD_BURST_SIZE = 64;
+
+/// How many frames ahead of the current one a stage prefetches.
+constexpr size_t IP_FWD_PREFETCH_AHEAD = 4;
+
+/// Counters of the fast path.
+struct IpFwdStats
+{
+    /// moved onto the tx_buffer of their egress netif
+    size_t forwarded;
+    /// left for the regular path
+    size_t punted;
+    /// truncated, bad checksum, sent to another station's link address or
+    /// denied by the IPv4 filter
+    size_t dropped;
+};
+
+extern IpFwdStats ip_fwd_stats;
+
+size_t
+ip_fwd_burst(std::vector<PacketBuffer>& frames,
+             std::vector<NetworkInterface>& netifs,
+             std::vector<EtharpEntry>& arp_entries,
+             std::vector<size_t>& punted);
+
+//
+// END OF FILE
+//
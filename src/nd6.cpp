@@ -49,11 +49,13 @@
 #include <packet_buffer.h>
 #include <ip6.h>
 #include <ip6_addr.h>
+#include <ip6_fib.h>
 #include <inet_chksum.h>
 #include <network_interface.h>
 #include <mld6.h>
 #include <dhcp6.h>
 #include <dns.h>
+#include <dst_cache.h>
 
 #include <cstring>
 #include <algorithm>
@@ -938,6 +940,7 @@ nd6_input(struct PacketBuffer* p, NetworkInterface* inp)
             /* Change the Path MTU. */
             pmtu = lwip_htonl(icmp6hdr->data);
             destination_cache[dest_idx].pmtu = (uint16_t)std::min((uint16_t)pmtu, (uint16_t)0xFFFF);
+            dst_cache_invalidate_all();
 
             break; /* ICMP6_TYPE_PTB */
         }
@@ -1054,6 +1057,7 @@ nd6_tmr(void)
                 default_router_list[i].neighbor_entry = nullptr;
                 default_router_list[i].invalidation_timer = 0;
                 default_router_list[i].flags = 0;
+                dst_cache_invalidate_all();
             }
             else {
                 default_router_list[i].invalidation_timer -= ND6_TMR_INTERVAL / 1000;
@@ -1062,10 +1066,13 @@ nd6_tmr(void)
     }
 
     /* Process prefix entries. */
+    bool prefixes_expired = false;
     for (i = 0; i < LWIP_ND6_NUM_PREFIXES; i++) {
         if (prefix_list[i].netif != nullptr) {
             if (prefix_list[i].invalidation_timer <= ND6_TMR_INTERVAL / 1000) {
                 /* Entry timed out, remove it */
+                ip6_fib_delete(prefix_list[i].prefix, 64, IP6_FIB_ORIGIN_ONLINK);
+                prefixes_expired = true;
                 prefix_list[i].invalidation_timer = 0;
                 prefix_list[i].netif = nullptr;
             }
@@ -1074,6 +1081,9 @@ nd6_tmr(void)
             }
         }
     }
+    if (prefixes_expired) {
+        ip6_fib_commit();
+    }
 
     /* Process our own addresses, updating address lifetimes and/or DAD state. */
     for ((netif) = netif_list; (netif) != nullptr; (netif) = (netif)->next) {
@@ -1589,6 +1599,7 @@ nd6_free_neighbor_cache_entry(int8_t i)
     neighbor_cache[i].netif = nullptr;
     neighbor_cache[i].counter.reachable_time = 0;
     zero_ip6_addr(&(neighbor_cache[i].next_hop_address));
+    dst_cache_invalidate_all();
 }
 
 
@@ -1605,6 +1616,11 @@ nd6_find_destination_cache_entry(const Ip6Addr* ip6addr)
 
     for (int16_t i = 0; i < LWIP_ND6_NUM_DESTINATIONS; i++) {
         if (ip6_addr_equal(ip6addr, &(destination_cache[i].destination_addr))) {
+            if (destination_cache[i].fib_generation != ip6_fib_current_generation()) {
+                /* the routes changed since the next hop was looked up */
+                set_ip6_addr_any(&destination_cache[i].destination_addr);
+                return -1;
+            }
             return i;
         }
     }
@@ -1654,6 +1670,7 @@ nd6_clear_destination_cache(void)
     for (int i = 0; i < LWIP_ND6_NUM_DESTINATIONS; i++) {
         set_ip6_addr_any(&destination_cache[i].destination_addr);
     }
+    dst_cache_invalidate_all();
 }
 
 
@@ -1670,12 +1687,9 @@ nd6_is_prefix_in_netif(const Ip6Addr* ip6addr, NetworkInterface* netif)
     int8_t i;
 
     /* Check to see if the address matches an on-link prefix. */
-    for (i = 0; i < LWIP_ND6_NUM_PREFIXES; i++) {
-        if ((prefix_list[i].netif == netif) &&
-            (prefix_list[i].invalidation_timer > 0) &&
-            ip6_addr_on_same_net(ip6addr, &(prefix_list[i].prefix))) {
-            return 1;
-        }
+    Ip6FibNextHop next_hop{};
+    if (ip6_fib_lookup_on(*ip6addr, netif->if_num, next_hop) && ip6_fib_is_onlink(next_hop)) {
+        return 1;
     }
     /* Check to see if address prefix matches a manually configured (= static)
      * address. Static addresses have an implied /64 subnet assignment. Dynamic
@@ -1785,19 +1799,8 @@ nd6_find_route(const Ip6AddrInfo& addr_info, NetworkInterface& out_addr)
 {
     int8_t i;
 
-    /* @todo decide if it makes sense to check the destination cache first */
-
-    /* Check if there is a matching on-link prefix. There may be multiple
-     * matches. Pick the first one that is associated with a suitable netif. */
-    for (i = 0; i < LWIP_ND6_NUM_PREFIXES; ++i) {
-        NetworkInterface* netif = prefix_list[i].netif;
-        if ((netif != nullptr) && ip6_addr_on_same_net(&prefix_list[i].prefix, addr_info) &&
-            is_netif_up(netif) && is_netif_link_up(netif)) {
-            return netif;
-        }
-    }
-
-    /* No on-link prefix match. Find a router that can forward the packet. */
+    /* On-link prefixes are in the forwarding table, which route_ip6_packet()
+     * looks at before calling here. Find a router that can forward the packet. */
     i = nd6_select_router(addr_info, nullptr);
     if (i >= 0) {
         lwip_assert("selected router must have a neighbor entry",
@@ -1933,8 +1936,15 @@ nd6_new_onlink_prefix(const Ip6Addr* prefix, NetworkInterface* netif)
         if ((prefix_list[i].netif == nullptr) ||
             (prefix_list[i].invalidation_timer == 0)) {
             /* Found empty prefix entry. */
+            if (prefix_list[i].netif != nullptr) {
+                /* expired, but the timer did not remove it yet */
+                ip6_fib_delete(prefix_list[i].prefix, 64, IP6_FIB_ORIGIN_ONLINK);
+            }
             prefix_list[i].netif = netif;
             set_ip6_addr(&(prefix_list[i].prefix), prefix);
+            /* make the prefix on-link for routing */
+            ip6_fib_add(*prefix, 64, Ip6FibNextHop{{}, netif->if_num}, IP6_FIB_ORIGIN_ONLINK);
+            ip6_fib_commit();
             return i;
         }
     }
@@ -1975,7 +1985,8 @@ nd6_get_next_hop_entry(const Ip6Addr* ip6addr, NetworkInterface* netif)
 
 
     /* Look for ip6addr in destination cache. */
-    if (ip6_addr_equal(ip6addr, &(destination_cache[nd6_cached_destination_index].destination_addr))) {
+    if (ip6_addr_equal(ip6addr, &(destination_cache[nd6_cached_destination_index].destination_addr)) &&
+        destination_cache[nd6_cached_destination_index].fib_generation == ip6_fib_current_generation()) {
         /* the cached entry index is the right one! */
         /* do nothing. */
         // ND6_STATS_INC(nd6.cachehit);
@@ -2003,8 +2014,12 @@ nd6_get_next_hop_entry(const Ip6Addr* ip6addr, NetworkInterface* netif)
 
             /* Copy dest address to destination cache. */
             set_ip6_addr(&(destination_cache[nd6_cached_destination_index].destination_addr), ip6addr);
+            destination_cache[nd6_cached_destination_index].fib_generation = ip6_fib_current_generation();
 
             /* Now find the next hop. is it a neighbor? */
+            Ip6FibNextHop fib_hop{};
+            const bool fib_routed = !ip6_addr_is_linklocal(ip6addr) &&
+                ip6_fib_lookup_on(*ip6addr, netif->if_num, fib_hop);
             if (ip6_addr_is_linklocal(ip6addr) ||
                 nd6_is_prefix_in_netif(ip6addr, netif)) {
                 /* Destination in local link. */
@@ -2013,6 +2028,12 @@ nd6_get_next_hop_entry(const Ip6Addr* ip6addr, NetworkInterface* netif)
                               &destination_cache[nd6_cached_destination_index].destination_addr);
 
             }
+            else if (fib_routed && !ip6_fib_is_onlink(fib_hop)) {
+                /* Next hop is the router of the longest matching route. */
+                destination_cache[nd6_cached_destination_index].pmtu = get_netif_mtu6(netif);
+                copy_ip6_addr(&destination_cache[nd6_cached_destination_index].next_hop_addr,
+                              &fib_hop.gateway);
+            }
             // else if ((next_hop_addr = LWIP_HOOK_ND6_GET_GW(netif, ip6addr)) != NULL) {
             //     /* Next hop for destination provided by hook function. */
             //     destination_cache[nd6_cached_destination_index].pmtu = netif->mtu;
@@ -2271,6 +2292,18 @@ nd6_get_next_hop_addr_or_queue(NetworkInterface* netif,
                                const Ip6Addr* ip6addr,
                                const uint8_t** hwaddrp)
 {
+    /* Same next hop as the last packet of the sending pcb, still reachable? */
+    DstCache* cache = dst_cache_ll(netif);
+    if (cache != nullptr && cache->ll_idx < LWIP_ND6_NUM_NEIGHBORS) {
+        struct nd6_neighbor_cache_entry* entry = &neighbor_cache[cache->ll_idx];
+        if (entry->state == ND6_REACHABLE && entry->netif == netif &&
+            ip6_addr_equal(&entry->next_hop_address, &cache->next_hop.u_addr.ip6.addr) &&
+            memcmp(entry->lladdr, cache->hwaddr.bytes, ETH_ADDR_LEN) == 0) {
+            *hwaddrp = entry->lladdr;
+            return STATUS_SUCCESS;
+        }
+    }
+
     /* Get next hop record. */
     int8_t i = nd6_get_next_hop_entry(ip6addr, netif);
     if (i < 0) {
@@ -2292,6 +2325,14 @@ nd6_get_next_hop_addr_or_queue(NetworkInterface* netif,
 
         /* Tell the caller to send out the packet now. */
         *hwaddrp = neighbor_cache[i].lladdr;
+        if (neighbor_cache[i].state == ND6_REACHABLE && dst_cache_current != nullptr &&
+            dst_cache_current->netif == netif) {
+            /* remember the neighbour in the route cache of the sending pcb */
+            IpAddrInfo next_hop{};
+            next_hop.type = IPADDR_TYPE_V6;
+            next_hop.u_addr.ip6.addr = neighbor_cache[i].next_hop_address;
+            dst_cache_set_ll(*dst_cache_current, i, next_hop, neighbor_cache[i].lladdr);
+        }
         return STATUS_SUCCESS;
     }
 
@@ -2326,6 +2367,30 @@ nd6_get_destination_mtu(const Ip6Addr* ip6addr, NetworkInterface* netif)
 }
 
 
+/**
+ * Get the link-layer address of a neighbor that can be sent to right away,
+ * without queueing or neighbor unreachability detection. Used by the
+ * forwarding fast path, which leaves all other cases to
+ * nd6_get_next_hop_addr_or_queue().
+ *
+ * @param ip6addr the neighbor's address
+ * @param netif the netif the neighbor must be on
+ * @param lladdr receives the link-layer address
+ * @return true if the neighbor is REACHABLE on netif
+ */
+bool
+nd6_get_reachable_lladdr(const Ip6Addr* ip6addr, const NetworkInterface* netif, MacAddress* lladdr)
+{
+    int8_t i = nd6_find_neighbor_cache_entry(ip6addr);
+    if (i < 0 || neighbor_cache[i].state != ND6_REACHABLE ||
+        neighbor_cache[i].netif == nullptr || neighbor_cache[i].netif->if_num != netif->if_num) {
+        return false;
+    }
+    memcpy(lladdr->bytes, neighbor_cache[i].lladdr, ETH_ADDR_LEN);
+    return true;
+}
+
+
 /**
  * Provide the Neighbor discovery process with a hint that a
  * destination is reachable. Called by tcp_receive when ACKs are
@@ -2391,6 +2456,9 @@ nd6_cleanup_netif(NetworkInterface* netif)
             prefix_list[i].netif = nullptr;
         }
     }
+    ip6_fib_flush(IP6_FIB_ORIGIN_ONLINK, netif->if_num);
+    ip6_fib_flush(IP6_FIB_ORIGIN_RA, netif->if_num);
+    ip6_fib_commit();
     for (i = 0; i < LWIP_ND6_NUM_NEIGHBORS; i++) {
         if (neighbor_cache[i].netif == netif) {
             for (int8_t router_index = 0; router_index < LWIP_ND6_NUM_ROUTERS; router_index++) {
@@ -198,6 +198,7 @@ LwipStatus nd6_get_next_hop_addr_or_queue(NetworkInterface* netif,
                                           const Ip6Addr* ip6addr,
                                           const uint8_t** hwaddrp);
 uint16_t nd6_get_destination_mtu(const Ip6Addr* ip6addr, NetworkInterface* netif);
+bool nd6_get_reachable_lladdr(const Ip6Addr* ip6addr, const NetworkInterface* netif, MacAddress* lladdr);
 void nd6_reachability_hint(const Ip6Addr* ip6addr);
 void nd6_cleanup_netif(NetworkInterface* netif);
 void nd6_adjust_mld_membership(NetworkInterface* netif, int8_t addr_idx, uint8_t new_state);
@@ -80,6 +80,8 @@ struct nd6_destination_cache_entry {
   Ip6Addr next_hop_addr;
   uint16_t pmtu;
   uint32_t age;
+  /* ip6_fib_current_generation() when next_hop_addr was looked up */
+  uint32_t fib_generation;
 };
 
 struct nd6_prefix_list_entry {
@@ -2,6 +2,7 @@
  * @file network_interface.cpp
  */
 #include <dhcp6.h>
+#include <dst_cache.h>
 #include <etharp.h>
 #include <ip6_addr.h>
 #include <ip_addr.h>
@@ -86,6 +87,7 @@ bool set_netif_ip4_addr(NetworkInterface& netif, const Ip4Addr& new_ip4_addr, co
         if (is_ip4_addr_equal(addr_it->address, old_ip4_addr)) {
             addr_it->address = new_ip4_addr;
             result = true;
+            dst_cache_invalidate_all();
             break;
         }
     }
@@ -104,6 +106,7 @@ set_netif_ip4_netmask(NetworkInterface& netif, const Ip4Addr& new_netmask, const
         if (is_ip4_addr_equal(addr_it->netmask, old_netmask)) {
             addr_it->netmask = new_netmask;
             result = true;
+            dst_cache_invalidate_all();
             break;
         }
     }
@@ -122,6 +125,7 @@ set_netif_ip4_gw(NetworkInterface& netif, const Ip4Addr& new_gw, const Ip4Addr&
         if (is_ip4_addr_equal(addr_it->gateway, old_gw)) {
             addr_it->netmask = new_gw;
             result = true;
+            dst_cache_invalidate_all();
             break;
         }
     }
@@ -153,6 +157,7 @@ remove_netif(NetworkInterface& netif, std::vector<NetworkInterface> interfaces)
     if (matching_index >= 0) {
         interfaces.erase(interfaces.begin()+matching_index);
         result = true;
+        dst_cache_invalidate_all();
     }
 
     return result;
@@ -212,6 +217,7 @@ set_netif_default(NetworkInterface& netif, std::vector<NetworkInterface> interfa
     else
     {
         result = true;
+        dst_cache_invalidate_all();
     }
     return result;
 }
@@ -229,6 +235,7 @@ set_netif_up(NetworkInterface& netif, std::vector<NetworkInterface> interfaces)
         if (interface.if_name == netif.if_name) {
             interface.up = true;
             result = true;
+            dst_cache_invalidate_all();
             break;
 
         }
@@ -249,6 +256,7 @@ set_netif_down(NetworkInterface& netif, std::vector<NetworkInterface> interfaces
         if (interface.if_name == netif.if_name) {
             interface.up = false;
             result = true;
+            dst_cache_invalidate_all();
             break;
 
         }
@@ -269,6 +277,7 @@ set_netif_link_up(NetworkInterface& netif, std::vector<NetworkInterface> interfa
         if (interface.if_name == netif.if_name) {
             interface.link_up = true;
             result = true;
+            dst_cache_invalidate_all();
             break;
 
         }
@@ -288,6 +297,7 @@ set_netif_link_down(NetworkInterface& netif, std::vector<NetworkInterface> inter
         if (interface.if_name == netif.if_name) {
             interface.link_up = false;
             result = true;
+            dst_cache_invalidate_all();
             break;
 
         }
@@ -355,6 +365,7 @@ set_netif_ip6_addr_info(NetworkInterface& netif,
             it.preferred_life = new_addr_info.preferred_life;
             it.zone = new_addr_info.zone;
             result = true;
+            dst_cache_invalidate_all();
             break;
         }
     }
@@ -5,10 +5,14 @@
 #pragma once
 #define NOMINMAX
 #include <algorithm>
+#include <climits>
 
 
 constexpr auto MEM_SIZE = 1600;
 
+/* Used to lay out structures touched in the fast path (TcpPcb) */
+constexpr auto CACHE_LINE_SIZE = 64;
+
 constexpr auto MEMP_NUM_PBUF = 16;
 
 constexpr auto MEMP_NUM_RAW_PCB = 4;
@@ -89,17 +93,50 @@ constexpr auto LWIP_DNS_SECURE_NO_MULTIPLE_OUTSTANDING = 2;
 constexpr auto LWIP_DNS_SECURE_RAND_SRC_PORT = 4;
 
 constexpr auto UDP_TTL = IP_DEFAULT_TTL;
+/* Buckets of each UDP demultiplexing table (see udp_demux.h) */
+constexpr auto UDP_HASH_SIZE = 256; /* power of two */
+/* Pcbs with a recv_batch callback that can get datagrams held back during one
+   input batch, and datagrams held per pcb (see udp_input_batch_begin()) */
+constexpr auto UDP_INPUT_BATCH_PCBS = 8;
+constexpr auto UDP_INPUT_BATCH_MSGS = 32;
+/* Datagrams one segmentation offload send is cut into, and receive
+   aggregation coalesces, at most (see udp_set_gso_size(), UDP_FLAGS_GRO) */
+constexpr auto UDP_GSO_MAX_SEGS = 64;
+/* Largest payload receive aggregation builds */
+constexpr auto UDP_GRO_MAX_SIZE = 65507;
+/* Fill level, in percent, from which udp_ring_pressure() reports a receive
+   ring as congested */
+constexpr auto UDP_RING_HIGH_WATER = 75;
 
 constexpr auto TCP_TTL = IP_DEFAULT_TTL;
 
 constexpr auto TCP_MSS = 536;
 
 constexpr auto TCP_WND = (4 * TCP_MSS);
+/* Receive windows grow from TCP_WND up to this (see tcp_rcvbuf.h) */
+constexpr auto TCP_WND_AUTOTUNE_MAX = 4 * 1024 * 1024;
+/* Total growth over TCP_WND allowed for all receive windows together */
+constexpr auto TCP_RCVBUF_BUDGET = size_t(32) * 1024 * 1024;
+/* Milliseconds without the application reading before a grown window shrinks */
+constexpr auto TCP_RCVBUF_IDLE = 5000U;
+/* Ask for ECN (RFC 3168) on connections using loss-based congestion control;
+   DCTCP connections always do. Requests from peers are accepted on the same terms */
+constexpr auto TCP_ECN = false;
+/* Use DCTCP (RFC 8257) instead of Reno for new connections, see tcp_ecn.h */
+constexpr auto TCP_DCTCP = false;
+/* Servers remembered by the TCP Fast Open cookie cache of clients */
+constexpr auto TCP_FASTOPEN_CACHE_SIZE = 64;
 
 constexpr auto TCP_MAXRTX = 12;
 
 constexpr auto TCP_SYNMAXRTX = 6;
 constexpr auto LWIP_TCP_MAX_SACK_NUM = 4;
+/* In-sequence segments one ACK may cover (RFC 1122 asks for every second
+   one); larger values allow stretch ACKs on bulk transfers */
+constexpr auto TCP_STRETCH_ACK_SEGS = 2;
+/* Connections whose ACK can be held back during one input batch
+   (see tcp_input_batch_begin()) */
+constexpr auto TCP_INPUT_BATCH_PCBS = 16;
 
 
 constexpr auto TCP_SND_BUF = (2 * TCP_MSS);
@@ -107,7 +144,16 @@ constexpr auto TCP_SND_BUF = (2 * TCP_MSS);
 constexpr auto TCP_SND_QUEUELEN = ((4 * (TCP_SND_BUF) + (TCP_MSS - 1)) / (TCP_MSS));
 constexpr auto TCP_SNDLOWAT = (std::min)((std::max)(((TCP_SND_BUF) / 2), (2 * TCP_MSS) + 1), (TCP_SND_BUF) - 1);
 constexpr auto TCP_SNDQUEUELOWAT = (std::max)(((TCP_SND_QUEUELEN) / 2), 5);
-constexpr auto TCP_OOSEQ_MAX_BYTES = 0;
+/* Out-of-sequence data one connection may queue, 0 for no limit; above it
+   the highest queued data is dropped (see tcp_free_ooseq_excess()). A
+   quarter of the largest receive window, and as many segments as that
+   holds in TCP_MSS-sized ones, so a flood of tiny segments is bounded too */
+constexpr auto TCP_OOSEQ_MAX_BYTES = TCP_WND_AUTOTUNE_MAX / 4;
+constexpr auto TCP_OOSEQ_MAX_PBUFS = TCP_OOSEQ_MAX_BYTES / TCP_MSS;
+constexpr auto TCP_TW_HASH_SIZE = 1024; /* power of two */
+constexpr auto TCP_SYNQ_SIZE = 256; /* power of two */
+constexpr auto TCP_SYNQ_LISTEN_MAX = 64;
+constexpr auto TCP_SYN_COOKIES = true;
 
 constexpr auto TCP_DEFAULT_LISTEN_BACKLOG = 0xff;
 constexpr auto TCP_OVERSIZE = TCP_MSS;
@@ -35,6 +35,7 @@ void
 copy_pkt_buf(PacketBuffer& dst_pbuf, PacketBuffer& src_pbuf)
 {
     dst_pbuf = src_pbuf;
+    pbuf_flatten(dst_pbuf);
 }
 
 
@@ -119,6 +120,7 @@ pbuf_clone(
     PacketBuffer q{};
 
     q = pbuf_to_copy;
+    pbuf_flatten(q);
 
     return q;
 } 
@@ -136,10 +138,34 @@ pbuf_clone(
 uint8_t
 get_pbuf_byte_at(const PacketBuffer& p, size_t offset)
 {
+    if (offset >= p.data.size()) {
+        return p.ext_data[offset - p.data.size()];
+    }
     return p.data[offset];
 } 
 
 
+/**
+ * @ingroup PacketBuffer
+ * Copy the external payload of a PacketBuffer (ext_data/ext_len) to the end
+ * of its own data, so the buffer no longer references memory it does not
+ * own. Used where a buffer outlives the sender's reference, e.g. when it is
+ * queued or cloned.
+ *
+ * @param p PacketBuffer to flatten
+ */
+void
+pbuf_flatten(PacketBuffer& p)
+{
+    if (p.ext_len == 0) {
+        return;
+    }
+    p.data.insert(p.data.end(), p.ext_data, p.ext_data + p.ext_len);
+    p.ext_data = nullptr;
+    p.ext_len = 0;
+}
+
+
 /**
  * @ingroup PacketBuffer
  * Put one byte to the specified position in a PacketBuffer
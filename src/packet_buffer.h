@@ -8,6 +8,9 @@
 #include <lwip_status.h>
 #include <vector>
 
+struct Ip4CtEntry;
+enum Ip4CtDir : uint8_t;
+
 enum Direction
 {
     DIR_IN,
@@ -20,6 +23,22 @@ struct PacketBuffer
     std::vector<uint8_t> data;
     uint32_t input_netif_idx;
     Direction direction;
+    /* ECN bits of the IP header the packet arrived with (IP_ECN_*), set by
+       ip4_input() and recv_ip6_pkt(); Not-ECT for any other packet */
+    uint8_t ip_ecn = 0;
+    /* set by filters or the application; policy routing rules match on it
+       (see ip4_rule.h) */
+    uint32_t mark = 0;
+    /* connection the packet belongs to and the direction it goes in, set by
+       ip4_nat_prerouting() (see ip4_conntrack.h); none and
+       IP4_CT_DIR_ORIGINAL until then */
+    Ip4CtEntry* ct = nullptr;
+    Ip4CtDir ct_dir{};
+    /* payload that follows 'data' on the wire but is not owned by the buffer
+       (see tcp_write_zc); whoever sets it keeps the memory alive until the
+       buffer is freed */
+    const uint8_t* ext_data = nullptr;
+    size_t ext_len = 0;
     // todo: add an {offset : header/framing} map for processing
 };
 
@@ -51,6 +70,8 @@ uint8_t get_pbuf_byte_at(const PacketBuffer& p, size_t offset);
 
 LwipStatus pbuf_put_at(PacketBuffer& p, size_t offset, uint8_t data);
 
+void pbuf_flatten(PacketBuffer& p);
+
 
 
 //
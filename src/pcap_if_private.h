@@ -3,6 +3,8 @@
 #include <string>
 #include <queue>
 #include <pcap.h>
+#include <packet_buffer.h>
+#include <pcapif_helper.h>
 
 
 struct PcapInterface
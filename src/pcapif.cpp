@@ -39,7 +39,7 @@ pcapif_compare_packets(PcapIfPendingPacket& pending_pkt, std::vector<uint8_t>& t
     if (pending_pkt.data.size() == target_pkt.size())
     {
         if (!memcmp(pending_pkt.data.data(),
-                    target_pkt.data.data(),
+                    target_pkt.data(),
                     pending_pkt.data.size()))
         {
             return true;
@@ -469,21 +469,32 @@ pcapif_low_level_output(NetworkInterface& netif, PacketBuffer& pkt_buf)
     // char buffer[ETH_MAX_FRAME_LEN + ETH_PAD_SIZE];
     // uint8_t* buf = buffer;
     std::vector<uint8_t> buffer;
-    uint16_t tot_len = pkt_buf.data.size() - ETH_PAD_SIZE;
     // struct pcapif_private* pa = (struct pcapif_private*)PCAPIF_GET_STATE_PTR(netif);
     PcapIfPrivate pa{};
+    /* pcap_sendpacket() takes one contiguous frame: payload referenced by
+       ext_data (zero-copy TCP data) is gathered behind the headers here,
+       the only place it is copied */
+    const std::vector<uint8_t>* frame = &pkt_buf.data;
+    if (pkt_buf.ext_len != 0)
+    {
+        buffer.reserve(pkt_buf.data.size() + pkt_buf.ext_len);
+        buffer.assign(pkt_buf.data.begin(), pkt_buf.data.end());
+        buffer.insert(buffer.end(), pkt_buf.ext_data, pkt_buf.ext_data + pkt_buf.ext_len);
+        frame = &buffer;
+    }
+    uint16_t tot_len = frame->size() - ETH_PAD_SIZE;
 
     /* signal that packet should be sent */
-    if (pcap_sendpacket(pa.adapter, pkt_buf.data.data(), tot_len) < 0)
+    if (pcap_sendpacket(pa.adapter, frame->data(), tot_len) < 0)
     {
         return false;
     }
 
     if (is_netif_link_up(netif))
     {
-        pcapif_add_tx_packet(pa, pkt_buf.data);
+        pcapif_add_tx_packet(pa, *frame);
     }
-    EthHdr* ethhdr = reinterpret_cast<EthHdr *>(pkt_buf.data.data());
+    const EthHdr* ethhdr = reinterpret_cast<const EthHdr *>(frame->data());
     if ((ethhdr->dest.bytes[0] & 1) != 0)
     {
         /* broadcast or multicast packet*/
@@ -581,7 +592,10 @@ pcapif_init(NetworkInterface& netif,
 
 
 bool
-pcapif_poll(NetworkInterface& netif, PcapIfPrivate& pa)
+pcapif_poll(NetworkInterface& netif,
+            PcapIfPrivate& pa,
+            std::vector<NetworkInterface>& interfaces,
+            std::vector<EtharpEntry>& arp_entries)
 {
     // todo: re-write
     // int ret;
@@ -602,6 +616,9 @@ pcapif_poll(NetworkInterface& netif, PcapIfPrivate& pa)
     //     }
     // }
     // while (ret > 0);
+    /* process what pcapif_input() queued */
+    ethernet_input_burst(netif, interfaces, arp_entries);
+    return true;
 }
 
 
@@ -1,5 +1,7 @@
 #pragma once
-#include <xstring>
+#include <cstdint>
+#include <string>
+#include <tuple>
 
 #ifndef WIN32
 struct pcapifh_linkstate
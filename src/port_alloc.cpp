@@ -0,0 +1,111 @@
+///
+/// file: port_alloc.cpp
+///
+/// Local port usage tracking and ephemeral port selection, see port_alloc.h.
+///
+
+#include <algorithm>
+#include <arch.h>
+#include <cstring>
+#include <lwip_debug.h>
+#include <port_alloc.h>
+
+///
+/// Reset a port table to "no port in use" with the given ephemeral range.
+///
+void
+port_alloc_init(PortAllocator& ports, const uint16_t range_start, const uint16_t range_end)
+{
+    lwip_assert("port_alloc_init: invalid range", range_start != 0 && range_start <= range_end);
+    ports.range_start = range_start;
+    ports.range_end = range_end;
+    memset(ports.used, 0, sizeof(ports.used));
+    ports.shared.clear();
+}
+
+///
+/// Record one more user of a local port (a pcb bound to it, a listener, a
+/// TIME-WAIT record...).
+///
+void
+port_alloc_ref(PortAllocator& ports, const uint16_t port)
+{
+    if (port == 0)
+    {
+        return;
+    }
+    if (!port_alloc_in_use(ports, port))
+    {
+        ports.used[port / 64] |= uint64_t(1) << (port % 64);
+        return;
+    }
+    /* the first user is implied by the bit */
+    auto& count = ports.shared[port];
+    count = count == 0 ? 2 : count + 1;
+}
+
+///
+/// Drop one user of a local port; the port becomes free with the last one.
+///
+void
+port_alloc_unref(PortAllocator& ports, const uint16_t port)
+{
+    if (port == 0)
+    {
+        return;
+    }
+    lwip_assert("port_alloc_unref: port not in use", port_alloc_in_use(ports, port));
+    const auto it = ports.shared.find(port);
+    if (it != ports.shared.end())
+    {
+        if (--it->second == 1)
+        {
+            ports.shared.erase(it);
+        }
+        return;
+    }
+    ports.used[port / 64] &= ~(uint64_t(1) << (port % 64));
+}
+
+///
+/// Pick a free port in the ephemeral range (RFC 6056, algorithm 1): start at
+/// a random offset and take the next port nobody uses, wrapping around the
+/// range once.
+///
+/// @return a free port, or 0 if the range is exhausted
+///
+uint16_t
+port_alloc_pick(const PortAllocator& ports)
+{
+    const uint32_t num = uint32_t(ports.range_end) - ports.range_start + 1;
+    uint32_t offset = lwip_rand() % num;
+    uint32_t left = num;
+    while (left > 0)
+    {
+        const uint32_t port = ports.range_start + offset;
+        /* free ports at or above 'port' in this word, clipped to the range */
+        uint64_t free_bits = ~ports.used[port / 64] >> (port % 64);
+        const uint32_t span = std::min(64 - port % 64, std::min(left, num - offset));
+        if (span < 64)
+        {
+            free_bits &= (uint64_t(1) << span) - 1;
+        }
+        if (free_bits != 0)
+        {
+            uint32_t bit = 0;
+            while ((free_bits & 1) == 0)
+            {
+                free_bits >>= 1;
+                bit++;
+            }
+            return uint16_t(port + bit);
+        }
+        left -= span;
+        offset = (offset + span) % num;
+    }
+    return 0;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,48 @@
+///
+/// file: port_alloc.h
+///
+/// Local port usage tracking and ephemeral port selection for TCP and UDP.
+/// Each protocol keeps a bitmap of the ports in use by any pcb (plus a use
+/// count for ports shared through SO_REUSEADDR, listeners and TIME-WAIT), so
+/// picking a free ephemeral port never walks the pcb lists. Selection follows
+/// RFC 6056 algorithm 1: start at a random port in the range and take the
+/// next free one, skipping 64 used ports per bitmap word.
+///
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+
+struct PortAllocator
+{
+    /// Ephemeral range handed out by port_alloc_pick(), inclusive.
+    uint16_t range_start;
+    uint16_t range_end;
+    /// One bit per port, set while the port has at least one user.
+    uint64_t used[0x10000 / 64];
+    /// Number of users of ports with more than one.
+    std::unordered_map<uint16_t, uint32_t> shared;
+};
+
+void
+port_alloc_init(PortAllocator& ports, uint16_t range_start, uint16_t range_end);
+
+inline bool
+port_alloc_in_use(const PortAllocator& ports, const uint16_t port)
+{
+    return (ports.used[port / 64] >> (port % 64) & 1) != 0;
+}
+
+void
+port_alloc_ref(PortAllocator& ports, uint16_t port);
+
+void
+port_alloc_unref(PortAllocator& ports, uint16_t port);
+
+uint16_t
+port_alloc_pick(const PortAllocator& ports);
+
+//
+// END OF FILE
+//
@@ -369,7 +369,7 @@ inline void Timeout(SysTimeoutHandler timeout_fn, void* arg, const uint32_t time
 inline void timeout_ms(SysTimeoutHandler time_fn, void* arg, const uint32_t time)
 {
     sys_untimeout(time_fn, arg);
-    sys_timeout(time * 1000, time_fn, arg);
+    sys_timeout(time, time_fn, arg);
 }
 
 
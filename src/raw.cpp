@@ -43,6 +43,7 @@
  *
  */
 #include "opt.h"
+#include "bpf_prog.h"
 #include "def.h"
 #include "inet_chksum.h"
 #include "ip.h"
@@ -55,6 +56,8 @@
 #include <cstring>
 /** The list of RAW PCBs */ // static struct raw_pcb *raw_pcbs;
 
+size_t raw_filtered;
+
 inline bool
 match_pcb_ip_addr(RawPcb* pcb, IpAddrInfo* ipaddr)
 {
@@ -149,8 +152,14 @@ raw_input(struct PacketBuffer* p, NetworkInterface* inp)
             &pcb->remote_ip,
             curr_src_addr)))
         {
+            /* let the filter look at the packet before the callback gets it */
+            if (pcb->filter != nullptr &&
+                bpf_prog_run(*pcb->filter, p->data.data(), p->data.size()) == 0)
+            {
+                raw_filtered++;
+            }
             /* receive callback function available? */
-            if (pcb->recv != nullptr)
+            else if (pcb->recv != nullptr)
             {
                 void* old_payload = p->payload;
                 ret = RAW_INPUT_DELIVERED;
@@ -309,6 +318,45 @@ raw_recv(struct RawPcb* pcb, raw_recv_fn recv, void* recv_arg)
     /* remember recv() callback and user data */
     pcb->recv = recv;
     pcb->recv_arg = recv_arg;
+}
+
+/**
+ * @ingroup raw_raw
+ * Attach a classic BPF program to a RAW PCB, replacing the one it had. The
+ * program sees every packet the PCB matches, starting at the IP header;
+ * packets it returns 0 for never reach the receive callback.
+ *
+ * @param pcb RAW PCB to filter the packets of
+ * @param insns the program, e.g. as compiled by pcap_compile()
+ * @param len number of instructions
+ *
+ * @return lwIP error code.
+ * - ERR_VAL. The program is invalid, the PCB keeps its filter.
+ * - ERR_MEM. The program could not be allocated.
+ */
+LwipStatus
+raw_attach_filter(struct RawPcb* pcb, const struct BpfInsn* insns, const size_t len)
+{
+    BpfProgram* prog = nullptr;
+    const LwipStatus err = bpf_prog_create(insns, len, prog);
+    if (err != STATUS_SUCCESS)
+    {
+        return err;
+    }
+    raw_detach_filter(pcb);
+    pcb->filter = prog;
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @ingroup raw_raw
+ * Remove the BPF program of a RAW PCB, it receives all matching packets again.
+ */
+void
+raw_detach_filter(struct RawPcb* pcb)
+{
+    bpf_prog_free(pcb->filter);
+    pcb->filter = nullptr;
 } /**
  * @ingroup raw_raw
  * Send the raw IP packet to the given address. An IP header will be prepended
@@ -524,6 +572,7 @@ raw_send(struct RawPcb* pcb, struct PacketBuffer* p)
 void
 raw_remove(struct RawPcb* pcb)
 {
+    raw_detach_filter(pcb);
     // todo: fixme
     /* pcb to be removed is first in list? */ // if (raw_pcbs == pcb) {
     //   /* make list start at 2nd pcb */
@@ -54,6 +54,8 @@ extern "C" {
 #define RAW_FLAGS_MULTICAST_LOOP 0x04U
 
 struct RawPcb;
+struct BpfInsn;
+struct BpfProgram;
 
 /** Function prototype for raw pcb receive callback functions.
  * @param arg user supplied argument (raw_pcb.recv_arg)
@@ -97,6 +99,8 @@ struct RawPcb
     /* fields for handling checksum computations as per RFC3542. */
     uint16_t chksum_offset;
     uint8_t chksum_reqd;
+    /** packet filter run before recv, see raw_attach_filter() */
+    struct BpfProgram* filter;
 };
 
 /* The following functions is the application layer interface to the
@@ -116,6 +120,12 @@ LwipStatus            raw_send       (struct RawPcb *pcb, struct PacketBuffer *p
 
 void             raw_recv       (struct RawPcb *pcb, raw_recv_fn recv, void *recv_arg);
 
+LwipStatus            raw_attach_filter(struct RawPcb *pcb, const struct BpfInsn *insns, size_t len);
+void             raw_detach_filter(struct RawPcb *pcb);
+
+/** packets raw pcb filters rejected */
+extern size_t raw_filtered;
+
 #define          raw_flags(pcb) ((pcb)->flags)
 #define          raw_setflags(pcb,f)  ((pcb)->flags = (f))
 
@@ -99,6 +99,7 @@
 
 #include <algorithm>
 #include <cstring>
+#include <new>
 #include <def.h>
 #include <ip6.h>
 #include <ip6_addr.h>
@@ -107,7 +108,13 @@
 #include <opt.h>
 #include <sys.h>
 #include <tcp.h>
+#include <tcp_ooseq.h>
+#include <tcp_ecn.h>
+#include <tcp_fastopen.h>
 #include <tcp_priv.h>
+#include <tcp_rcvbuf.h>
+#include <tcp_synq.h>
+#include <tcp_timewait.h>
 #include <tcpip.h>
 
 
@@ -116,13 +123,8 @@
 constexpr auto TCP_LOCAL_PORT_RANGE_START = 0xc000;
 constexpr auto TCP_LOCAL_PORT_RANGE_END = 0xffff;
 
-inline bool tcp_ensure_local_port_range(const uint16_t port)
-{
-    return uint16_t(((port) & uint16_t(~TCP_LOCAL_PORT_RANGE_START)) + TCP_LOCAL_PORT_RANGE_START);
-}
-
-inline uint32_t tcp_keep_dur(TcpPcb* pcb) { return ((pcb)->keep_cnt * (pcb)->keep_intvl); }
-inline uint32_t tcp_keep_intvl(TcpPcb* pcb) { return ((pcb)->keep_intvl); }
+inline uint32_t tcp_keep_dur(TcpPcb* pcb) { return ((pcb)->cold.keep_cnt * (pcb)->cold.keep_intvl); }
+inline uint32_t tcp_keep_intvl(TcpPcb* pcb) { return ((pcb)->cold.keep_intvl); }
 
 
 /* As initial send MSS, we use TCP_MSS but limit it to 536. */
@@ -144,8 +146,8 @@ static const char* const tcp_state_str[] = {
     "TIME_WAIT"
 };
 
-/* last local TCP port */
-static uint16_t tcp_port = TCP_LOCAL_PORT_RANGE_START;
+/* local TCP ports in use, and the ephemeral range tcp_new_port() picks from */
+PortAllocator tcp_ports{TCP_LOCAL_PORT_RANGE_START, TCP_LOCAL_PORT_RANGE_END, {}, {}};
 
 /* Incremented every coarse grained timer shot (typically every 500 ms). */
 uint32_t tcp_ticks;
@@ -190,7 +192,19 @@ static void tcp_ext_arg_invoke_callbacks_destroyed(TcpPcbExtArgs* ext_args);
 void
 tcp_init()
 {
-    tcp_port = tcp_ensure_local_port_range(lwip_rand());
+    port_alloc_init(tcp_ports, TCP_LOCAL_PORT_RANGE_START, TCP_LOCAL_PORT_RANGE_END);
+    tcp_synq_init();
+}
+
+/** Give up the local port of a pcb so tcp_new_port() may hand it out again */
+static void
+tcp_release_local_port(struct TcpPcb* pcb)
+{
+    if (pcb->local_port != 0)
+    {
+        port_alloc_unref(tcp_ports, pcb->local_port);
+        pcb->local_port = 0;
+    }
 }
 
 /** Free a tcp pcb */
@@ -199,7 +213,20 @@ tcp_free(struct TcpPcb* pcb)
 {
     lwip_assert("tcp_free: LISTEN", pcb->state != LISTEN);
 
-    tcp_ext_arg_invoke_callbacks_destroyed(pcb->ext_args);
+    tcp_release_local_port(pcb);
+    tcp_rcvbuf_release(pcb);
+    tcp_fastopen_release(pcb);
+    tcp_input_batch_forget(pcb);
+
+    tcp_ext_arg_invoke_callbacks_destroyed(pcb->cold.ext_args);
+
+    /* slices still held by the application outlive the pcb: releasing
+       them later only frees the data */
+    for (struct TcpRxSlice* slice = pcb->cold.rx_slices; slice != nullptr; slice = slice->next)
+    {
+        slice->pcb = nullptr;
+    }
+    pcb->cold.rx_slices = nullptr;
 
     // memp_free(MEMP_TCP_PCB, pcb);
     delete pcb;
@@ -211,7 +238,9 @@ tcp_free_listen(struct TcpPcb* pcb)
 {
     lwip_assert("tcp_free_listen: !LISTEN", pcb->state != LISTEN);
 
-    tcp_ext_arg_invoke_callbacks_destroyed(pcb->ext_args);
+    tcp_release_local_port(pcb);
+
+    tcp_ext_arg_invoke_callbacks_destroyed(reinterpret_cast<struct TcpPcbListen*>(pcb)->ext_args);
 
     // memp_free(MEMP_TCP_PCB_LISTEN, pcb);
     delete pcb;
@@ -236,7 +265,7 @@ tcp_tmr()
 }
 
 /** Called when a listen pcb is closed. Iterates one pcb list and removes the
- * closed listener pcb from pcb->listener if matching.
+ * closed listener pcb from pcb->cold.listener if matching.
  */
 static void
 tcp_remove_listener(struct TcpPcb* list, struct TcpPcbListen* lpcb)
@@ -245,16 +274,17 @@ tcp_remove_listener(struct TcpPcb* list, struct TcpPcbListen* lpcb)
 
     for (auto pcb = list; pcb != nullptr; pcb = pcb->next)
     {
-        if (pcb->listener == lpcb)
+        if (pcb->cold.listener == lpcb)
         {
-            pcb->listener = nullptr;
+            pcb->cold.listener = nullptr;
         }
     }
 }
 
 
 /** Called when a listen pcb is closed. Iterates all pcb lists and removes the
- * closed listener pcb from pcb->listener if matching.
+ * closed listener pcb from pcb->cold.listener if matching, and drops the
+ * connection requests still queued for it.
  */
 static void
 tcp_listen_closed(struct TcpPcb* pcb)
@@ -265,6 +295,7 @@ tcp_listen_closed(struct TcpPcb* pcb)
     {
         tcp_remove_listener(*tcp_pcb_lists[i], (struct TcpPcbListen *)pcb);
     }
+    tcp_synq_purge((struct TcpPcbListen *)pcb);
 }
 
 /** @ingroup tcp_raw
@@ -284,10 +315,10 @@ tcp_backlog_delayed(struct TcpPcb* pcb)
 
     if ((pcb->flags & TF_BACKLOGPEND) == 0)
     {
-        if (pcb->listener != nullptr)
+        if (pcb->cold.listener != nullptr)
         {
-            pcb->listener->accepts_pending++;
-            lwip_assert("accepts_pending != 0", pcb->listener->accepts_pending != 0);
+            pcb->cold.listener->accepts_pending++;
+            lwip_assert("accepts_pending != 0", pcb->cold.listener->accepts_pending != 0);
             tcp_set_flags(pcb, TF_BACKLOGPEND);
         }
     }
@@ -309,10 +340,10 @@ tcp_backlog_accepted(struct TcpPcb* pcb)
 
     if ((pcb->flags & TF_BACKLOGPEND) != 0)
     {
-        if (pcb->listener != nullptr)
+        if (pcb->cold.listener != nullptr)
         {
-            lwip_assert("accepts_pending != 0", pcb->listener->accepts_pending != 0);
-            pcb->listener->accepts_pending--;
+            lwip_assert("accepts_pending != 0", pcb->cold.listener->accepts_pending != 0);
+            pcb->cold.listener->accepts_pending--;
             tcp_clear_flags(pcb, TF_BACKLOGPEND);
         }
     }
@@ -588,7 +619,7 @@ tcp_abandon(struct TcpPcb* pcb, int reset)
         uint32_t seqno = pcb->snd_nxt;
         uint32_t ackno = pcb->rcv_nxt;
 
-        tcp_err_fn errf = pcb->errf;
+        tcp_err_fn errf = pcb->cold.errf;
 
         void* errf_arg = pcb->callback_arg;
         if (pcb->state == CLOSED)
@@ -614,10 +645,7 @@ tcp_abandon(struct TcpPcb* pcb, int reset)
             tcp_segs_free(pcb->unsent);
         }
 
-        if (pcb->ooseq != nullptr)
-        {
-            tcp_segs_free(pcb->ooseq);
-        }
+        tcp_free_ooseq(pcb);
 
         tcp_backlog_accepted(pcb);
         if (send_rst)
@@ -727,6 +755,10 @@ tcp_bind(struct TcpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
                 }
             }
         }
+        if (max_pcb_list == NUM_TCP_PCB_LISTS && tcp_timewait_port_used(port, ipaddr))
+        {
+            return ERR_USE;
+        }
     }
 
     if (!is_ip_addr_any(ipaddr)
@@ -738,6 +770,7 @@ tcp_bind(struct TcpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
         set_ip_addr(&pcb->local_ip, ipaddr);
     }
     pcb->local_port = port;
+    port_alloc_ref(tcp_ports, port);
     reg_tcp_pcb(&tcp_bound_pcbs, pcb);
     Logf(true, "tcp_bind: bind to port %d\n", port);
     return STATUS_SUCCESS;
@@ -877,6 +910,8 @@ tcp_listen_with_backlog_and_err(struct TcpPcb* pcb, uint8_t backlog, LwipStatus*
     }
     lpcb->callback_arg = pcb->callback_arg;
     lpcb->local_port = pcb->local_port;
+    /* the listener takes over the port, tcp_free(pcb) below drops the pcb's use */
+    port_alloc_ref(tcp_ports, lpcb->local_port);
     lpcb->state = LISTEN;
     lpcb->prio = pcb->prio;
     lpcb->so_options = pcb->so_options;
@@ -893,13 +928,17 @@ tcp_listen_with_backlog_and_err(struct TcpPcb* pcb, uint8_t backlog, LwipStatus*
     }
 
     /* copy over ext_args to listening pcb  */
-    memcpy(&lpcb->ext_args, &pcb->ext_args, sizeof(pcb->ext_args));
+    memcpy(&lpcb->ext_args, &pcb->cold.ext_args, sizeof(pcb->cold.ext_args));
 
     tcp_free(pcb);
 
     lpcb->accept_fn = tcp_accept_null;
 
     lpcb->accepts_pending = 0;
+    lpcb->syn_pending = 0;
+    lpcb->cc = pcb->cc;
+    lpcb->tfo_pending = 0;
+    lpcb->tfo_max = 0;
     tcp_backlog_set(reinterpret_cast<TcpPcb*>(lpcb), backlog);
 
     reg_tcp_pcb(&tcp_listen_pcbs.pcbs, reinterpret_cast<TcpPcb*>(lpcb));
@@ -965,6 +1004,8 @@ tcp_recved(struct TcpPcb* pcb, uint16_t len)
     lwip_assert("don't call tcp_recved for listen-pcbs",
                 pcb->state != LISTEN);
 
+    tcp_rcvbuf_drained(pcb, len);
+
     TcpWndSize rcv_wnd = (TcpWndSize)(pcb->rcv_wnd + len);
     if ((rcv_wnd > TCP_WND_MAX(pcb)) || (rcv_wnd < pcb->rcv_wnd))
     {
@@ -998,35 +1039,16 @@ tcp_recved(struct TcpPcb* pcb, uint16_t len)
 /**
  * Allocate a new local TCP port.
  *
- * @return a new (free) local TCP port number
+ * The port is picked at random from the ephemeral range among those not used
+ * by any pcb or TIME-WAIT record (RFC 6056, algorithm 1). The caller takes a
+ * reference on it with port_alloc_ref() once it is assigned to the pcb.
+ *
+ * @return a new (free) local TCP port number, 0 if the range is exhausted
  */
 static uint16_t
 tcp_new_port(void)
 {
-    uint16_t n = 0;
-again:
-    tcp_port++;
-    if (tcp_port == TCP_LOCAL_PORT_RANGE_END)
-    {
-        tcp_port = TCP_LOCAL_PORT_RANGE_START;
-    }
-    /* Check all PCB lists. */
-    for (uint8_t i = 0; i < NUM_TCP_PCB_LISTS; i++)
-    {
-        for (struct TcpPcb* pcb = *tcp_pcb_lists[i]; pcb != nullptr; pcb = pcb->next)
-        {
-            if (pcb->local_port == tcp_port)
-            {
-                n++;
-                if (n > (TCP_LOCAL_PORT_RANGE_END - TCP_LOCAL_PORT_RANGE_START))
-                {
-                    return 0;
-                }
-                goto again;
-            }
-        }
-    }
-    return tcp_port;
+    return port_alloc_pick(tcp_ports);
 }
 
 /**
@@ -1109,6 +1131,7 @@ LwipStatus tcp_connect(struct TcpPcb* pcb,
         {
             return ERR_BUF;
         }
+        port_alloc_ref(tcp_ports, pcb->local_port);
     }
     else
     {
@@ -1129,6 +1152,10 @@ LwipStatus tcp_connect(struct TcpPcb* pcb,
                     }
                 }
             }
+            if (tcp_timewait_lookup(pcb->local_ip, pcb->local_port, *ipaddr, port) != nullptr)
+            {
+                return ERR_USE;
+            }
         }
     }
     auto iss = tcp_next_iss(pcb);
@@ -1140,6 +1167,7 @@ LwipStatus tcp_connect(struct TcpPcb* pcb,
     /* Start with a window that does not need scaling. When window scaling is
        enabled and used, the window is enlarged when both sides agree on scaling. */
     pcb->rcv_wnd = pcb->rcv_ann_wnd = TCPWND_MIN16(TCP_WND);
+    tcp_rcvbuf_init(pcb);
     pcb->rcv_ann_right_edge = pcb->rcv_nxt;
     pcb->snd_wnd = TCP_WND;
     /* As initial send MSS, we use TCP_MSS but limit it to 536.
@@ -1150,11 +1178,14 @@ LwipStatus tcp_connect(struct TcpPcb* pcb,
 
     pcb->cwnd = 1;
 
-    pcb->connected = connected;
+    pcb->cold.connected = connected;
 
 
-    /* Send a SYN together with the MSS option. */
-    LwipStatus ret = tcp_enqueue_flags(pcb, TCP_SYN);
+    /* Send a SYN together with the MSS option (and with Fast Open, the data
+       written so far). */
+    LwipStatus ret = (pcb->cold.tfo & TCP_TFO_CLIENT)
+                         ? tcp_fastopen_enqueue_syn(pcb)
+                         : tcp_enqueue_flags(pcb, TCP_SYN);
     if (ret == STATUS_SUCCESS)
     {
         /* SYN segment was enqueued, changed the pcbs state now */
@@ -1201,14 +1232,14 @@ tcp_slowtmr_start:
         lwip_assert("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
         lwip_assert("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
         lwip_assert("tcp_slowtmr: active pcb->state != TIME-WAIT\n", pcb->state != TIME_WAIT);
-        // if (pcb->last_timer == tcp_timer_ctr)
+        // if (pcb->cold.last_timer == tcp_timer_ctr)
         // {
         //     /* skip this pcb, we have already processed it */
         //     prev = pcb;
         //     pcb = pcb->next;
         //     continue;
         // }
-        // pcb->last_timer = tcp_timer_ctr;
+        // pcb->cold.last_timer = tcp_timer_ctr;
 
         pcb_remove = 0;
         uint8_t pcb_reset = 0;
@@ -1349,7 +1380,7 @@ tcp_slowtmr_start:
                 (pcb->state == CLOSE_WAIT)))
         {
             if (uint32_t(tcp_ticks - pcb->tmr) >
-                (pcb->keep_idle + tcp_keep_dur(pcb)) / TCP_SLOW_INTERVAL)
+                (pcb->cold.keep_idle + tcp_keep_dur(pcb)) / TCP_SLOW_INTERVAL)
             {
                 Logf(true, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to "));
                 // ip_addr_debug_print_val(true, pcb->remote_ip);
@@ -1359,7 +1390,7 @@ tcp_slowtmr_start:
                 ++pcb_reset;
             }
             else if (uint32_t(tcp_ticks - pcb->tmr) >
-                (pcb->keep_idle + pcb->keep_cnt_sent * tcp_keep_intvl(pcb))
+                (pcb->cold.keep_idle + pcb->keep_cnt_sent * tcp_keep_intvl(pcb))
                 / TCP_SLOW_INTERVAL)
             {
                 err = tcp_keepalive(pcb);
@@ -1406,7 +1437,7 @@ tcp_slowtmr_start:
         /* If the PCB should be removed, do it. */
         if (pcb_remove)
         {
-            tcp_err_fn err_fn = pcb->errf;
+            tcp_err_fn err_fn = pcb->cold.errf;
             tcp_pcb_purge(pcb);
             /* Remove PCB from tcp_active_pcbs list. */
             if (prev != nullptr)
@@ -1446,9 +1477,11 @@ tcp_slowtmr_start:
             prev = pcb;
             pcb = pcb->next;
 
+            tcp_rcvbuf_tmr(prev);
+
             /* We check if we should poll the connection. */
             ++prev->polltmr;
-            if (prev->polltmr >= prev->pollinterval)
+            if (prev->polltmr >= prev->cold.pollinterval)
             {
                 prev->polltmr = 0;
                 Logf(true, ("tcp_slowtmr: polling application\n"));
@@ -1468,7 +1501,12 @@ tcp_slowtmr_start:
     }
 
 
-    /* Steps through all of the TIME-WAIT PCBs. */
+    /* Retransmit SYN-ACKs of pending connection requests */
+    tcp_synq_tmr();
+
+    /* Expire TIME-WAIT records, then step through the TIME-WAIT PCBs that
+       could not be compacted. */
+    tcp_timewait_tmr();
     prev = nullptr;
     pcb = tcp_tw_pcbs;
     while (pcb != nullptr)
@@ -1526,9 +1564,9 @@ tcp_fasttmr_start:
 
     while (pcb != nullptr)
     {
-        // if (pcb->last_timer != tcp_timer_ctr)
+        // if (pcb->cold.last_timer != tcp_timer_ctr)
         // {
-        //     pcb->last_timer = tcp_timer_ctr;
+        //     pcb->cold.last_timer = tcp_timer_ctr;
         //     /* send delayed ACKs */
         //     if (pcb->flags & TF_ACK_DELAY)
         //     {
@@ -1683,6 +1721,11 @@ tcp_seg_free(struct TcpSeg* seg)
       seg->p = nullptr;
 #endif /* true */
         }
+        if (seg->zc != nullptr)
+        {
+            tcp_zc_buf_unref(seg->zc);
+            seg->zc = nullptr;
+        }
         // memp_free(MEMP_TCP_SEG, seg);
         delete seg;
     }
@@ -1704,6 +1747,23 @@ tcp_setprio(struct TcpPcb* pcb, uint8_t prio)
     pcb->prio = prio;
 }
 
+/**
+ * @ingroup tcp
+ * Sets the congestion control of a connection. Must be called before
+ * tcp_connect() or tcp_listen(), as DCTCP needs ECN to be negotiated in the
+ * handshake. A listening pcb passes it on to the connections it accepts.
+ *
+ * @param pcb the TcpProtoCtrlBlk to manipulate
+ * @param cc new congestion control
+ */
+void
+tcp_set_congestion_control(struct TcpPcb* pcb, const TcpCongestionControl cc)
+{
+    lwip_assert("tcp_set_congestion_control: handshake already started",
+                pcb->state == CLOSED);
+    pcb->cc = cc;
+}
+
 /**
  * Returns a copy of the given TCP segment.
  * The PacketBuffer and data are not copied, only the pointers
@@ -1724,9 +1784,78 @@ tcp_seg_copy(struct TcpSeg* seg)
     }
     memcpy((uint8_t *)cseg, (const uint8_t *)seg, sizeof(struct TcpSeg));
     // pbuf_ref(cseg->p);
+    if (cseg->zc != nullptr)
+    {
+        tcp_zc_buf_ref(cseg->zc);
+    }
     return cseg;
 }
 
+/**
+ * @ingroup tcp_raw
+ * Wrap application memory for zero-copy sending with @ref tcp_write_zc.
+ * The returned buffer holds one reference owned by the caller, which must be
+ * dropped with @ref tcp_zc_buf_unref once the caller is done queueing it.
+ * 'complete' is called when the last reference is gone.
+ *
+ * @param data the data to send; must not change until 'complete' is called
+ * @param len length of data in bytes
+ * @param complete completion callback (may be NULL)
+ * @param arg argument passed to 'complete'
+ * @return the new buffer, or NULL on out of memory
+ */
+struct TcpZcBuf*
+tcp_zc_buf_new(const void* data, size_t len, tcp_zc_complete_fn complete, void* arg)
+{
+    lwip_assert("tcp_zc_buf_new: invalid data", data != nullptr || len == 0);
+    const auto buf = new (std::nothrow) TcpZcBuf;
+    if (buf == nullptr)
+    {
+        return nullptr;
+    }
+    buf->data = static_cast<const uint8_t *>(data);
+    buf->len = len;
+    buf->refcnt = 1;
+    buf->acked = 0;
+    buf->complete = complete;
+    buf->arg = arg;
+    return buf;
+}
+
+/** Take an additional reference on a zero-copy buffer. */
+void
+tcp_zc_buf_ref(struct TcpZcBuf* buf)
+{
+    lwip_assert("tcp_zc_buf_ref: invalid buf", buf != nullptr);
+    lwip_assert("tcp_zc_buf_ref: refcnt overflow", buf->refcnt < 0xFFFFFFFF);
+    buf->refcnt++;
+}
+
+/**
+ * Drop a reference on a zero-copy buffer. Dropping the last one reports
+ * completion to the application and frees the buffer.
+ */
+void
+tcp_zc_buf_unref(struct TcpZcBuf* buf)
+{
+    lwip_assert("tcp_zc_buf_unref: invalid buf", buf != nullptr);
+    lwip_assert("tcp_zc_buf_unref: refcnt underflow", buf->refcnt > 0);
+    if (--buf->refcnt != 0)
+    {
+        return;
+    }
+    Logf(true,
+         "tcp_zc_buf_unref: buf %p complete, %zu of %zu bytes acked\n",
+         (void *)buf,
+         buf->acked,
+         buf->len);
+    if (buf->complete != nullptr)
+    {
+        buf->complete(buf->arg, buf, buf->acked == buf->len ? STATUS_SUCCESS : ERR_ABRT);
+    }
+    delete buf;
+}
+
 
 /**
  * Default receive callback that is called if the user didn't register
@@ -1852,6 +1981,12 @@ tcp_kill_timewait(void)
         //                            (void *)inactive, inactivity));
         tcp_abort(inactive);
     }
+    else
+    {
+        /* no TIME-WAIT pcb to free, compact records only take little memory
+           but are all we have left */
+        tcp_timewait_kill_oldest();
+    }
 }
 
 /* Called when allocating a pcb fails.
@@ -1957,6 +2092,8 @@ tcp_alloc(uint8_t prio)
         /* Start with a window that does not need scaling. When window scaling is
            enabled and used, the window is enlarged when both sides agree on scaling. */
         pcb->rcv_wnd = pcb->rcv_ann_wnd = TCPWND_MIN16(TCP_WND);
+        tcp_rcvbuf_init(pcb);
+        tcp_ecn_init(pcb);
         pcb->ttl = TCP_TTL;
         /* As initial send MSS, we use TCP_MSS but limit it to 536.
            The send MSS is updated when an MSS option is received. */
@@ -1966,7 +2103,7 @@ tcp_alloc(uint8_t prio)
         pcb->rtime = -1;
         pcb->cwnd = 1;
         pcb->tmr = tcp_ticks;
-        // pcb->last_timer = tcp_timer_ctr;
+        // pcb->cold.last_timer = tcp_timer_ctr;
 
         /* RFC 5681 recommends setting ssthresh abritrarily high and gives an example
         of using the largest advertised receive window.  We've seen complications with
@@ -1977,15 +2114,15 @@ tcp_alloc(uint8_t prio)
         pcb->ssthresh = TCP_SND_BUF;
 
 
-        pcb->recv = tcp_recv_null;
+        pcb->cold.recv = tcp_recv_null;
 
 
         /* Init KEEPALIVE timer */
-        pcb->keep_idle = TCP_KEEPIDLE_DEFAULT;
+        pcb->cold.keep_idle = TCP_KEEPIDLE_DEFAULT;
 
 
-        pcb->keep_intvl = TCP_KEEPINTVL_DEFAULT;
-        pcb->keep_cnt = TCP_KEEPCNT_DEFAULT;
+        pcb->cold.keep_intvl = TCP_KEEPINTVL_DEFAULT;
+        pcb->cold.keep_cnt = TCP_KEEPCNT_DEFAULT;
     }
     return pcb;
 }
@@ -2073,10 +2210,127 @@ tcp_recv(struct TcpPcb* pcb, tcp_recv_fn recv)
     if (pcb != nullptr)
     {
         lwip_assert("invalid socket state for recv callback", pcb->state != LISTEN);
-        pcb->recv = recv;
+        pcb->cold.recv = recv;
     }
 }
 
+/**
+ * @ingroup tcp_raw
+ * Switch a connection to zero-copy receive. Received data is handed to
+ * 'recv_zc' as read-only slices pointing into the received frames instead of
+ * PacketBuffers, and the receive window is only reopened (as by tcp_recved())
+ * when the application releases a slice with @ref tcp_rx_slice_release.
+ * Passing NULL switches back to the tcp_recv() callback.
+ *
+ * @param pcb tcp_pcb to set the zero-copy recv callback
+ * @param recv_zc callback function to call for this pcb when data is received
+ */
+void
+tcp_recv_zc(struct TcpPcb* pcb, tcp_recv_zc_fn recv_zc)
+{
+    if (pcb != nullptr)
+    {
+        lwip_assert("invalid socket state for recv callback", pcb->state != LISTEN);
+        pcb->cold.recv_zc = recv_zc;
+    }
+}
+
+/**
+ * Wrap received data in a slice and pass it to the pcb's recv_zc callback.
+ * Called through TCP_EVENT_RECV. If no slice can be allocated, ERR_MEM makes
+ * tcp_input() keep the data as refused_data and try again later. The same
+ * happens when the callback refuses the data: the slice is taken back, and
+ * the next attempt wraps refused_data in a new one. A callback returning
+ * ERR_ABRT has aborted the pcb and keeps the slice, as it would keep p.
+ *
+ * tcp_receive() has already stripped the headers, so p holds only stream
+ * data and one slice covers all of it.
+ */
+LwipStatus
+tcp_rx_slice_deliver(struct TcpPcb* pcb, struct PacketBuffer* p, LwipStatus err)
+{
+    lwip_assert("tcp_rx_slice_deliver: invalid pcb", pcb != nullptr && pcb->cold.recv_zc != nullptr);
+    lwip_assert("tcp_rx_slice_deliver: invalid p", p != nullptr);
+    const auto slice = new (std::nothrow) TcpRxSlice;
+    if (slice == nullptr)
+    {
+        return ERR_MEM;
+    }
+    slice->data = p->data.data();
+    slice->len = p->data.size();
+    slice->p = p;
+    slice->pcb = pcb;
+    slice->prev = nullptr;
+    slice->next = pcb->cold.rx_slices;
+    if (pcb->cold.rx_slices != nullptr)
+    {
+        pcb->cold.rx_slices->prev = slice;
+    }
+    pcb->cold.rx_slices = slice;
+    const LwipStatus ret = pcb->cold.recv_zc(pcb->callback_arg, pcb, slice, err);
+    if (ret != STATUS_SUCCESS && ret != ERR_ABRT)
+    {
+        /* p stays with tcp_input() as refused_data; only the slice goes */
+        if (slice->prev != nullptr)
+        {
+            slice->prev->next = slice->next;
+        }
+        else
+        {
+            pcb->cold.rx_slices = slice->next;
+        }
+        if (slice->next != nullptr)
+        {
+            slice->next->prev = slice->prev;
+        }
+        delete slice;
+    }
+    return ret;
+}
+
+/**
+ * @ingroup tcp_raw
+ * Hand a slice received through the zero-copy recv callback back to the
+ * stack. The frame it points into is freed and its length is credited to
+ * the receive window, just like tcp_recved() in copying mode.
+ *
+ * @param slice the slice to release; must not be used afterwards
+ */
+void
+tcp_rx_slice_release(struct TcpRxSlice* slice)
+{
+    lwip_assert("tcp_rx_slice_release: invalid slice", slice != nullptr);
+    struct TcpPcb* pcb = slice->pcb;
+    if (pcb != nullptr)
+    {
+        if (slice->prev != nullptr)
+        {
+            slice->prev->next = slice->next;
+        }
+        else
+        {
+            pcb->cold.rx_slices = slice->next;
+        }
+        if (slice->next != nullptr)
+        {
+            slice->next->prev = slice->prev;
+        }
+    }
+    free_pkt_buf(slice->p);
+    if (pcb != nullptr && pcb->state != LISTEN)
+    {
+        /* the window is credited in 64K steps, as tcp_recved takes a uint16_t */
+        size_t len = slice->len;
+        while (len > 0)
+        {
+            const auto len16 = uint16_t(std::min(len, size_t(0xffff)));
+            len -= len16;
+            tcp_recved(pcb, len16);
+        }
+    }
+    delete slice;
+}
+
 /**
  * @ingroup tcp_raw
  * Specifies the callback function that should be called when data has
@@ -2094,7 +2348,7 @@ tcp_sent(struct TcpPcb* pcb, tcp_sent_fn sent)
     if (pcb != nullptr)
     {
         lwip_assert("invalid socket state for sent callback", pcb->state != LISTEN);
-        pcb->sent = sent;
+        pcb->cold.sent = sent;
     }
 }
 
@@ -2121,7 +2375,7 @@ tcp_err(struct TcpPcb* pcb, tcp_err_fn err)
     if (pcb != nullptr)
     {
         lwip_assert("invalid socket state for err callback", pcb->state != LISTEN);
-        pcb->errf = err;
+        pcb->cold.errf = err;
     }
 }
 
@@ -2172,9 +2426,9 @@ tcp_poll(struct TcpPcb* pcb, tcp_poll_fn poll, uint8_t interval)
     lwip_assert("invalid socket state for poll", pcb->state != LISTEN);
 
 
-    pcb->poll = poll;
+    pcb->cold.poll = poll;
 
-    pcb->pollinterval = interval;
+    pcb->cold.pollinterval = interval;
 }
 
 /**
@@ -2263,7 +2517,7 @@ tcp_pcb_remove(struct TcpPcb** pcblist, struct TcpPcb* pcb)
 
     pcb->state = CLOSED;
     /* reset the local port to prevent the pcb from being 'bound' */
-    pcb->local_port = 0;
+    tcp_release_local_port(pcb);
 
     lwip_assert("tcp_pcb_remove: tcp_pcbs_sane()", tcp_pcbs_sane());
 }
@@ -2277,8 +2531,27 @@ uint32_t
 tcp_next_iss(struct TcpPcb* pcb)
 {
     lwip_assert("tcp_next_iss: invalid pcb", pcb != nullptr);
-    // return LWIP_HOOK_TCP_ISN(&pcb->local_ip, pcb->local_port, &pcb->remote_ip, pcb->remote_port);
-    return 0;
+    return tcp_next_iss(pcb->local_ip, pcb->local_port, pcb->remote_ip, pcb->remote_port);
+}
+
+/**
+ * Calculates the initial sequence number of a connection that has no pcb
+ * yet, as for a SYN received by a listener (RFC 6528): a clock ticking every
+ * 4 microseconds plus a keyed hash of the 4-tuple. The ISNs of one 4-tuple
+ * keep moving forward, those of other 4-tuples cannot be told from them.
+ *
+ * @return uint32_t initial sequence number
+ */
+uint32_t
+tcp_next_iss(const IpAddrInfo& local_ip,
+             const uint16_t local_port,
+             const IpAddrInfo& remote_ip,
+             const uint16_t remote_port)
+{
+    uint32_t words[TCP_SYNQ_TUPLE_WORDS];
+    tcp_synq_tuple_words(words, local_ip, local_port, remote_ip, remote_port);
+    /* the low half of the hash indexes the SYN queue, use the high half */
+    return sys_now() * 250 + uint32_t(tcp_synq_siphash(words, TCP_SYNQ_TUPLE_WORDS) >> 32);
 }
 
 
@@ -2446,13 +2719,36 @@ tcp_free_ooseq(struct TcpPcb* pcb)
 {
     if (pcb->ooseq)
     {
-        tcp_segs_free(pcb->ooseq);
+        tcp_ooseq_free(pcb->ooseq);
         pcb->ooseq = nullptr;
 
         memset(pcb->rcv_sacks, 0, sizeof(pcb->rcv_sacks));
     }
 }
 
+/* Free the ooseq data above TCP_OOSEQ_MAX_BYTES / TCP_OOSEQ_MAX_PBUFS and
+   rebuild the SACK state from what is left on the queue */
+void
+tcp_free_ooseq_excess(struct TcpPcb* pcb)
+{
+    uint32_t cut_seq = 0;
+    if (!tcp_ooseq_trim_to_limit(pcb->ooseq, TCP_OOSEQ_MAX_BYTES, TCP_OOSEQ_MAX_PBUFS, &cut_seq))
+    {
+        return;
+    }
+    Logf(true, "tcp_free_ooseq_excess: dropped ooseq data from %u up\n", cut_seq);
+    if (tcp_ooseq_empty(pcb->ooseq))
+    {
+        tcp_free_ooseq(pcb);
+        return;
+    }
+    if (pcb->flags & TF_SACK)
+    {
+        memset(pcb->rcv_sacks, 0, sizeof(pcb->rcv_sacks));
+        tcp_ooseq_sack_blocks(pcb->ooseq, cut_seq - 1, pcb->rcv_sacks, LWIP_TCP_MAX_SACK_NUM);
+    }
+}
+
 
 /**
  * @defgroup tcp_raw_extargs ext arguments
@@ -2513,9 +2809,22 @@ tcp_ext_arg_alloc_id()
 //
 //
 //
-//     pcb->ext_args[id].callbacks = callbacks;
+//     pcb->cold.ext_args[id].callbacks = callbacks;
 // }
 
+/** ext_args of a pcb: connections keep them in their cold part, listen pcbs
+ * in the pcb itself.
+ */
+static TcpPcbExtArgs*
+tcp_pcb_ext_args(const struct TcpPcb* pcb)
+{
+    if (pcb->state == LISTEN)
+    {
+        return const_cast<struct TcpPcbListen*>(reinterpret_cast<const struct TcpPcbListen*>(pcb))->ext_args;
+    }
+    return const_cast<struct TcpPcb*>(pcb)->cold.ext_args;
+}
+
 /**
  * @ingroup tcp_raw_extargs
  * Set data for a given index of ext_args on the specified pcb.
@@ -2531,7 +2840,7 @@ void tcp_ext_arg_set(struct TcpPcb* pcb, uint8_t id, void* arg)
 
 
 
-    pcb->ext_args[id].data = arg;
+    tcp_pcb_ext_args(pcb)[id].data = arg;
 }
 
 /**
@@ -2549,7 +2858,7 @@ void* tcp_ext_arg_get(const struct TcpPcb* pcb, uint8_t id)
 
 
 
-    return pcb->ext_args[id].data;
+    return tcp_pcb_ext_args(pcb)[id].data;
 }
 
 /** This function calls the "destroy" callback for all ext_args once a pcb is
@@ -1,7 +1,9 @@
 #pragma once
 #define NOMINMAX
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <dst_cache.h>
 #include <icmp.h>
 #include <ip.h>
 #include <lwip_status.h>
@@ -58,6 +60,13 @@ tcph_flags(TcpHdr* phdr)
 {
     return uint8_t((lwip_ntohs((phdr)->_hdrlen_rsvd_flags) & TCP_FLAGS));
 } ///
+/// ECE and CWR, which tcph_flags() masks out
+///
+inline uint8_t
+tcph_ecn_flags(TcpHdr* phdr)
+{
+    return uint8_t(lwip_ntohs((phdr)->_hdrlen_rsvd_flags) & (TCP_ECE | TCP_CWR));
+} ///
 ///
 ///
 inline void
@@ -116,6 +125,21 @@ typedef LwipStatus
       */
 typedef LwipStatus
 (*tcp_recv_fn)(void* arg, struct TcpPcb* tpcb, struct PacketBuffer* p, LwipStatus err);
+struct TcpRxSlice;
+/** Function prototype for zero-copy tcp receive callback functions (@see tcp_recv_zc).
+      * Called instead of the tcp_recv_fn when data has been received.
+      *
+      * @param arg Additional argument to pass to the callback function (@see tcp_arg())
+      * @param tpcb The connection pcb which received data
+      * @param slice The received data (or NULL when the connection has been closed!).
+      *              The application owns it and must hand it back with
+      *              @see tcp_rx_slice_release
+      * @param err An error code if there has been an error receiving
+      *            Only return ERR_ABRT if you have called tcp_abort from within the
+      *            callback function!
+      */
+typedef LwipStatus
+(*tcp_recv_zc_fn)(void* arg, struct TcpPcb* tpcb, struct TcpRxSlice* slice, LwipStatus err);
 /** Function prototype for tcp sent callback functions. Called when sent data has
       * been acknowledged by the remote side. Use it to free corresponding resources.
       * This also means that the pcb has now space available to send new data.
@@ -129,6 +153,20 @@ typedef LwipStatus
       */
 typedef LwipStatus
 (*tcp_sent_fn)(void* arg, struct TcpPcb* tpcb, uint16_t len);
+struct TcpZcBuf;
+/** Function prototype for zero-copy send completion callbacks. Called once a
+      * buffer passed to @see tcp_write_zc is no longer referenced by the stack:
+      * all of its data has been ACKed (or the connection went away) and no
+      * segment on the unsent/unacked queues points into it any more, so the
+      * application may reuse the memory.
+      *
+      * @param arg Argument given to @see tcp_zc_buf_new
+      * @param buf The buffer that has completed (freed after the callback returns)
+      * @param err ERR_OK if every byte of the buffer was ACKed, ERR_ABRT if the
+      *            data was discarded before being ACKed
+      */
+typedef void
+(*tcp_zc_complete_fn)(void* arg, struct TcpZcBuf* buf, LwipStatus err);
 /** Function prototype for tcp poll callback functions. Called periodically as
       * specified by @see tcp_poll.
       *
@@ -216,6 +254,36 @@ struct TcpSackRange
     uint32_t left;
     /** Right edge of the SACK: the last acknowledged sequence number +1 (so first NOT acknowledged). */
     uint32_t right;
+};
+
+/** Application buffer sent without copying by @ref tcp_write_zc. Segments point
+ * into 'data' and hold a reference each; the creator holds the initial one. */
+struct TcpZcBuf
+{
+    const uint8_t* data;
+    size_t len;
+    /** Number of references: the application's plus one per queued segment. */
+    uint32_t refcnt;
+    /** Bytes of 'data' ACKed by the remote side so far. */
+    size_t acked;
+    tcp_zc_complete_fn complete;
+    void* arg;
+};
+
+/** Read-only view of received payload handed out by the zero-copy receive
+ * path. 'data' points straight into the received frame; the PacketBuffer
+ * stays alive until the slice is released. */
+struct TcpRxSlice
+{
+    const uint8_t* data;
+    size_t len;
+    /** Frame holding the data, freed on release. */
+    struct PacketBuffer* p;
+    /** Connection to credit the window of on release; NULL once it is gone. */
+    struct TcpPcb* pcb;
+    /** Unreleased slices of the same pcb. */
+    struct TcpRxSlice* prev;
+    struct TcpRxSlice* next;
 }; /** Function prototype for deallocation of arguments. Called *just before* the
          * pcb is freed, so don't expect to be able to do anything with this pcb!
          *
@@ -254,32 +322,101 @@ struct TcpPcbExtArgs
     void* data;
 }; // typedef uint16_t TcpFlags;
 constexpr auto TCP_ALLFLAGS = 0xffffU;
+/** Congestion control of a connection, see tcp_set_congestion_control() */
+enum TcpCongestionControl : uint8_t
+{
+    TCP_CC_RENO,
+    /* DCTCP (RFC 8257): ECN is always negotiated, cwnd shrinks in proportion
+       to the fraction of CE-marked bytes */
+    TCP_CC_DCTCP,
+};
 struct TcpPcbListen; /** the TCP protocol control block for listening pcbs */
-struct TcpPcbListen
+struct alignas(CACHE_LINE_SIZE) TcpPcbListen
 {
-    /** Common members of all PCB types */
+    /** Common members of all PCB types, must match the start of TcpPcb */
     IpAddrInfo local_ip; /* Bound netif index */
     IpAddrInfo remote_ip;
-    uint8_t netif_idx; /* Socket options */
+    int netif_idx; /* Socket options */
     uint8_t so_options; /* Type Of Service */
     uint8_t tos; /* Time To Live */
     uint8_t ttl;
     NetworkInterface* netif_hints; /** Protocol specific PCB members */
     TcpPcbListen* next; /* for the linked list */
     void* callback_arg;
-    TcpPcbExtArgs ext_args[LWIP_TCP_PCB_NUM_EXT_ARGS];
     enum TcpState state; /* TCP state */
     uint8_t prio; /* ports are in host byte order */
-    uint16_t local_port; /* Function to call when a listener has been connected. */
+    uint16_t local_port; /* end of the members shared with TcpPcb */
+    TcpPcbExtArgs ext_args[LWIP_TCP_PCB_NUM_EXT_ARGS];
+    /* Function to call when a listener has been connected. */
     tcp_accept_fn accept_fn;
     uint8_t backlog;
     uint8_t accepts_pending;
+    /* connection requests in the SYN queue, see tcp_synq.h */
+    uint16_t syn_pending;
+    /* congestion control of accepted connections */
+    TcpCongestionControl cc;
+    /* Fast Open connections accepted from a SYN and not yet established,
+       and how many of them may be (0: Fast Open disabled) */
+    uint16_t tfo_pending;
+    uint16_t tfo_max;
 };
 
 struct TcpSeg;
+struct TcpOoseq;
 struct NetIfcHint;
 
-struct TcpPcb
+/* Longest Fast Open cookie a client sends. RFC 7413 allows 16 bytes, which
+   would not fit next to the other options of a SYN. */
+constexpr auto TCP_FASTOPEN_COOKIE_MAX = 12;
+
+/** Members of a TcpPcb that are not needed to process a segment: application
+    callbacks, keepalive settings, ext args and bookkeeping done by timers or
+    on application calls. Kept at the end of the pcb, away from the lines
+    tcp_input() and tcp_output() touch. */
+struct TcpPcbCold
+{
+    /* Function to be called when more send buffer space is available. */
+    tcp_sent_fn sent;
+    /* Function to be called when (in-sequence) data has arrived. */
+    tcp_recv_fn recv;
+    /* Zero-copy variant of recv, used instead of it when set. */
+    tcp_recv_zc_fn recv_zc;
+    /* Function to be called when a connection has been set up. */
+    tcp_connected_fn connected;
+    /* Function which is called periodically. */
+    tcp_poll_fn poll;
+    /* Function to be called whenever a fatal error occurs. */
+    tcp_err_fn errf;
+    /* Slices handed to recv_zc and not released yet. */
+    TcpRxSlice* rx_slices;
+    /* The listener that accepted this connection until it is accepted. */
+    TcpPcbListen* listener;
+    TcpPcbExtArgs ext_args[LWIP_TCP_PCB_NUM_EXT_ARGS];
+    /* idle time before KEEPALIVE is sent */
+    uint32_t keep_idle;
+    uint32_t keep_intvl;
+    uint32_t keep_cnt;
+    /* receive buffer autotuning, see tcp_rcvbuf.h */
+    uint32_t rcv_space; /* bytes the application took in the last RTT */
+    uint32_t rcv_drained; /* bytes the application took since rcv_space_time */
+    uint32_t rcv_space_time; /* sys_now() when the current RTT started */
+    uint32_t rcv_rtt; /* receiver-side RTT estimate in ms, 0 if unknown */
+    /* TCP Fast Open, see tcp_fastopen.h */
+    uint8_t* tfo_data; /* data written before the handshake completed */
+    uint16_t tfo_len;
+    uint8_t tfo; /* TCP_TFO_* flags */
+    uint8_t tfo_cookie_len; /* 0: the SYN asks for a cookie */
+    uint8_t tfo_cookie[TCP_FASTOPEN_COOKIE_MAX];
+    uint8_t pollinterval;
+    uint8_t last_timer;
+};
+
+/** The TCP protocol control block. The layout is ordered by how often the
+    members are used: the members shared with IpPcb and TcpPcbListen (the
+    address pair alone takes 80 bytes), then the state read on every segment,
+    which ends on the third cache line (see the static_asserts below), then
+    state used by timers and less common paths, and the cold part last. */
+struct alignas(CACHE_LINE_SIZE) TcpPcb
 {
     /** common PCB members */
     IpAddrInfo local_ip; /* Bound netif index */
@@ -291,83 +428,106 @@ struct TcpPcb
     NetIfcHint* netif_hints; /** protocol specific PCB members */
     TcpPcb* next; /* for the linked list */
     void* callback_arg;
-    TcpPcbExtArgs ext_args[LWIP_TCP_PCB_NUM_EXT_ARGS];
     TcpState state; /* TCP state */
     uint8_t prio; /* ports are in host byte order */
     uint16_t local_port; /* ports are in host byte order */
+    /* per-segment state */
     uint16_t remote_port;
-    TcpFlags flags; /* the rest of the fields are in host byte order
-               as we have to do some math with them */ /* Timers */
-    uint8_t polltmr;
-
-    uint8_t pollinterval;
-
-    uint8_t last_timer;
-    uint32_t tmr; /* receiver variables */
+    TcpFlags flags;
+    uint8_t dupacks;
+    uint16_t mss; /* maximum segment size */
+    uint8_t snd_scale;
+    uint8_t rcv_scale;
+    /* receiver variables; the rest of the fields are in host byte order
+       as we have to do some math with them */
     uint32_t rcv_nxt; /* next seqno expected */
     TcpWndSize rcv_wnd; /* receiver window available */
     TcpWndSize rcv_ann_wnd; /* receiver window to announce */
     uint32_t rcv_ann_right_edge; /* announced right edge of window */
-    /* SACK ranges to include in ACK packets (entry is invalid if left==right) */
-    TcpSackRange rcv_sacks[LWIP_TCP_MAX_SACK_NUM]; /* Retransmission timer. */
-    int16_t rtime;
-    uint16_t mss; /* maximum segment size */
-    /* RTT (round trip time) estimation variables */
-    uint32_t rttest; /* RTT estimate in 500ms ticks */
-    uint32_t rtseq; /* sequence number being timed */
-    int16_t sa;
-
-    int16_t sv; /* @see "Congestion Avoidance and Control" by Van Jacobson and Karels */
-    int16_t rto; /* retransmission time-out (in ticks of TCP_SLOW_INTERVAL) */
-    uint8_t nrtx; /* number of retransmissions */ /* fast retransmit/recovery */
-    uint8_t dupacks;
-    uint32_t lastack; /* Highest acknowledged seqno. */
-    /* congestion avoidance/control variables */
-    TcpWndSize cwnd;
-    TcpWndSize ssthresh; /* first byte following last rto byte */
-    uint32_t rto_end; /* sender variables */
+    /* sender variables */
     uint32_t snd_nxt; /* next new seqno to be sent */
+    uint32_t lastack; /* Highest acknowledged seqno. */
+    TcpWndSize snd_wnd; /* sender window */
     uint32_t snd_wl1;
-
     uint32_t snd_wl2;
-
     uint32_t snd_lbb; /* Sequence number of next byte to be buffered. */
-    TcpWndSize snd_wnd; /* sender window */
+    /* congestion avoidance/control variables */
+    TcpWndSize cwnd;
+    TcpWndSize ssthresh;
+    /* These are ordered by sequence number: */
+    TcpSeg* unsent; /* Unsent (queued) segments. */
+    TcpSeg* unacked; /* Sent but unacknowledged segments. */
+    /* end of the per-segment state */
+    TcpOoseq* ooseq; /* Received out of sequence segments, see tcp_ooseq.h. */
+    /* Data previously received but not yet taken by upper layer */
+    PacketBuffer* refused_data;
     TcpWndSize snd_wnd_max; /* the maximum sender window announced by the remote host */
     TcpWndSize snd_buf; /* Available buffer space for sending (in bytes). */
     uint16_t snd_queuelen; /* Number of pbufs currently in the send buffer. */
+    /* Retransmission timer. */
+    int16_t rtime;
+    /* RTT (round trip time) estimation variables */
+    uint32_t rttest; /* RTT estimate in 500ms ticks */
+    uint32_t rtseq; /* sequence number being timed */
+    int16_t sa;
+    int16_t sv; /* @see "Congestion Avoidance and Control" by Van Jacobson and Karels */
+    int16_t rto; /* retransmission time-out (in ticks of TCP_SLOW_INTERVAL) */
+    uint8_t nrtx; /* number of retransmissions */
+    uint8_t polltmr;
+    uint8_t rcv_unacked_segs; /* in-sequence segments received since the last ACK */
+    uint32_t rto_end; /* first byte following last rto byte */
+    uint32_t tmr; /* tcp_ticks when the last segment arrived */
+    uint8_t persist_cnt; /* Persist timer counter */
+    uint8_t persist_backoff; /* Persist timer back-off */
+    uint8_t persist_probe; /* Number of persist probes */
+    uint8_t keep_cnt_sent; /* KEEPALIVE counter */
+    uint32_t ts_lastacksent;
+    uint32_t ts_recent;
     /* Extra bytes available at the end of the last pbuf in unsent. */
     size_t unsent_oversize;
-    size_t bytes_acked; /* These are ordered by sequence number: */
-    TcpSeg* unsent; /* Unsent (queued) segments. */
-    TcpSeg* unacked; /* Sent but unacknowledged segments. */
-    TcpSeg* ooseq; /* Received out of sequence segments. */
-    PacketBuffer* refused_data;
-    /* Data previously received but not yet taken by upper layer */
-    TcpPcbListen* listener;
-    /* Function to be called when more send buffer space is available. */
-    tcp_sent_fn sent; /* Function to be called when (in-sequence) data has arrived. */
-    tcp_recv_fn recv; /* Function to be called when a connection has been set up. */
-    tcp_connected_fn connected; /* Function which is called periodically. */
-    tcp_poll_fn poll; /* Function to be called whenever a fatal error occurs. */
-    tcp_err_fn errf;
-    uint32_t ts_lastacksent;
-    uint32_t ts_recent; /* idle time before KEEPALIVE is sent */
-    uint32_t keep_idle;
-    uint32_t keep_intvl;
-    uint32_t keep_cnt; /* Persist timer counter */
-    uint8_t persist_cnt; /* Persist timer back-off */
-    uint8_t persist_backoff; /* Number of persist probes */
-    uint8_t persist_probe; /* KEEPALIVE counter */
-    uint8_t keep_cnt_sent;
-    uint8_t snd_scale;
-    uint8_t rcv_scale;
+    size_t bytes_acked;
+    /* SACK ranges to include in ACK packets (entry is invalid if left==right) */
+    TcpSackRange rcv_sacks[LWIP_TCP_MAX_SACK_NUM];
+    TcpWndSize rcv_wnd_max; /* current receive buffer size, see tcp_rcvbuf.h */
+    uint32_t rcv_rtt_seq; /* rcv_nxt that ends the running RTT sample */
+    uint32_t rcv_rtt_time; /* sys_now() when the sample started, 0 if none */
+    TcpCongestionControl cc;
+    uint8_t ecn; /* TCP_ECN_* flags, see tcp_ecn.h */
+    uint16_t dctcp_alpha; /* fraction of marked bytes, scaled by TCP_DCTCP_ALPHA_MAX */
+    uint32_t ecn_recover; /* no new reduction for ECE until this is acked */
+    uint32_t dctcp_acked; /* bytes acked in the current observation window */
+    uint32_t dctcp_marked; /* bytes acked with ECE in that window */
+    uint32_t dctcp_next_seq; /* end of the current observation window */
+    DstCache dst_cache; /* route to remote_ip, see dst_cache.h */
+    TcpPcbCold cold;
 };
 
+/* Cache lines that hold the per-segment state of a TcpPcb */
+constexpr auto TCP_PCB_HOT_LINES = 3;
+
+/* TcpPcbListen and IpPcb are accessed through TcpPcb pointers (pcb lists,
+   tcp_arg(), ip_get_option()...) */
+static_assert(offsetof(TcpPcb, remote_ip) == offsetof(TcpPcbListen, remote_ip), "TcpPcbListen layout");
+static_assert(offsetof(TcpPcb, so_options) == offsetof(TcpPcbListen, so_options), "TcpPcbListen layout");
+static_assert(offsetof(TcpPcb, netif_hints) == offsetof(TcpPcbListen, netif_hints), "TcpPcbListen layout");
+static_assert(offsetof(TcpPcb, next) == offsetof(TcpPcbListen, next), "TcpPcbListen layout");
+static_assert(offsetof(TcpPcb, callback_arg) == offsetof(TcpPcbListen, callback_arg), "TcpPcbListen layout");
+static_assert(offsetof(TcpPcb, state) == offsetof(TcpPcbListen, state), "TcpPcbListen layout");
+static_assert(offsetof(TcpPcb, prio) == offsetof(TcpPcbListen, prio), "TcpPcbListen layout");
+static_assert(offsetof(TcpPcb, local_port) == offsetof(TcpPcbListen, local_port), "TcpPcbListen layout");
+
+/* Everything tcp_input(), tcp_receive() and tcp_output() read for a segment
+   fits in the first TCP_PCB_HOT_LINES lines, the sequence state sharing one */
+static_assert(offsetof(TcpPcb, unacked) + sizeof(TcpSeg*) <= TCP_PCB_HOT_LINES * CACHE_LINE_SIZE,
+              "TcpPcb per-segment state spills out of its cache lines");
+static_assert(offsetof(TcpPcb, rcv_nxt) / CACHE_LINE_SIZE == offsetof(TcpPcb, unacked) / CACHE_LINE_SIZE,
+              "TcpPcb sequence state split across cache lines");
+static_assert(offsetof(TcpPcb, cold) >= TCP_PCB_HOT_LINES * CACHE_LINE_SIZE, "TcpPcb cold part overlaps hot lines");
+
 inline TcpWndSize
 TCP_WND_MAX(TcpPcb* pcb)
 {
-    return TcpWndSize(((pcb)->flags & TF_WND_SCALE) ? TCP_WND : TCPWND16(TCP_WND));
+    return pcb->rcv_wnd_max;
 }
 
 inline unsigned int
@@ -406,6 +566,10 @@ tcp_arg(struct TcpPcb* pcb, void* arg);
 void
 tcp_recv(struct TcpPcb* pcb, tcp_recv_fn recv);
 void
+tcp_recv_zc(struct TcpPcb* pcb, tcp_recv_zc_fn recv_zc);
+void
+tcp_rx_slice_release(struct TcpRxSlice* slice);
+void
 tcp_sent(struct TcpPcb* pcb, tcp_sent_fn sent);
 void
 tcp_err(struct TcpPcb* pcb, tcp_err_fn err);
@@ -483,8 +647,22 @@ LwipStatus
 tcp_shutdown(struct TcpPcb* pcb, int shut_rx, int shut_tx);
 LwipStatus
 tcp_write(struct TcpPcb* pcb, const void* dataptr, size_t len, uint8_t apiflags);
+struct TcpZcBuf*
+tcp_zc_buf_new(const void* data, size_t len, tcp_zc_complete_fn complete, void* arg);
+void
+tcp_zc_buf_ref(struct TcpZcBuf* buf);
+void
+tcp_zc_buf_unref(struct TcpZcBuf* buf);
+LwipStatus
+tcp_write_zc(struct TcpPcb* pcb, struct TcpZcBuf* buf, uint8_t apiflags);
 void
 tcp_setprio(struct TcpPcb* pcb, uint8_t prio);
+void
+tcp_set_congestion_control(struct TcpPcb* pcb, TcpCongestionControl cc);
+void
+tcp_fastopen_connect(struct TcpPcb* pcb);
+void
+tcp_fastopen_listen(struct TcpPcb* pcb, uint16_t max_pending);
 LwipStatus
 tcp_output(struct TcpPcb* pcb);
 LwipStatus
@@ -0,0 +1,194 @@
+///
+/// file: tcp_ecn.cpp
+///
+/// ECN and DCTCP, see tcp_ecn.h.
+///
+
+#include <algorithm>
+#include <ip.h>
+#include <lwip_debug.h>
+#include <opt.h>
+#include <tcp_ecn.h>
+
+size_t tcp_ecn_reductions;
+
+///
+/// Set up the congestion control of a new pcb. Called from tcp_alloc().
+///
+void
+tcp_ecn_init(struct TcpPcb* pcb)
+{
+    pcb->cc = TCP_DCTCP ? TCP_CC_DCTCP : TCP_CC_RENO;
+    pcb->ecn = 0;
+    /* RFC 8257, section 3.3: start conservatively, as if every byte was marked */
+    pcb->dctcp_alpha = TCP_DCTCP_ALPHA_MAX;
+}
+
+///
+/// Record the outcome of the ECN negotiation when the handshake of pcb
+/// completes (SYN-ACK received, or connection request promoted to a pcb).
+///
+void
+tcp_ecn_established(struct TcpPcb* pcb, const bool agreed)
+{
+    pcb->ecn = agreed ? TCP_ECN_OK : 0;
+    pcb->ecn_recover = pcb->snd_nxt;
+    pcb->dctcp_acked = 0;
+    pcb->dctcp_marked = 0;
+    pcb->dctcp_next_seq = pcb->snd_nxt;
+    Logf(true, "tcp_ecn_established: ECN %s\n", agreed ? "on" : "off");
+}
+
+///
+/// Receiver side, called by tcp_receive() for every segment on a pcb that
+/// agreed to ECN, before its data is processed.
+///
+/// @param ip_ecn the ECN field of the IP header
+/// @param ecn_flags ECE and CWR of the TCP header
+/// @param has_data whether the segment carries data
+///
+void
+tcp_ecn_input(struct TcpPcb* pcb, const uint8_t ip_ecn, const uint8_t ecn_flags, const bool has_data)
+{
+    const bool ce = has_data && ip_ecn == IP_ECN_CE;
+    if (pcb->cc == TCP_CC_DCTCP)
+    {
+        if (!has_data || ce == ((pcb->ecn & TCP_ECN_ECE) != 0))
+        {
+            return;
+        }
+        /* the CE state changed: data received so far must be acked with the
+           old state, or the sender would count it wrongly */
+        if (pcb->flags & TF_ACK_DELAY)
+        {
+            tcp_send_empty_ack(pcb);
+        }
+    }
+    else if (ecn_flags & TCP_CWR)
+    {
+        /* the sender reacted, stop echoing (a CE mark on this very segment
+           starts a new echo below) */
+        pcb->ecn &= ~TCP_ECN_ECE;
+    }
+    if (ce)
+    {
+        pcb->ecn |= TCP_ECN_ECE;
+        /* do not hold back the news in a delayed or stretch ACK */
+        tcp_ack_now(pcb);
+    }
+    else if (pcb->cc == TCP_CC_DCTCP)
+    {
+        pcb->ecn &= ~TCP_ECN_ECE;
+    }
+}
+
+///
+/// Sender side, called by tcp_receive() on a pcb that agreed to ECN for an
+/// ACK that acknowledged new data, after lastack and cwnd were updated.
+///
+/// @param acked number of bytes the ACK acknowledged
+/// @param ece whether the ACK carried ECE
+///
+void
+tcp_ecn_acked(struct TcpPcb* pcb, const TcpWndSize acked, const bool ece)
+{
+    if (pcb->cc == TCP_CC_DCTCP)
+    {
+        pcb->dctcp_acked += acked;
+        if (ece)
+        {
+            pcb->dctcp_marked += acked;
+        }
+        if (TCP_SEQ_GEQ(pcb->lastack, pcb->dctcp_next_seq))
+        {
+            /* one window of data observed: alpha = (1 - g) * alpha + g * F */
+            uint32_t fraction = 0;
+            if (pcb->dctcp_acked > 0)
+            {
+                fraction = uint32_t(uint64_t(pcb->dctcp_marked) * TCP_DCTCP_ALPHA_MAX /
+                                    pcb->dctcp_acked);
+            }
+            uint32_t alpha = pcb->dctcp_alpha;
+            alpha = alpha - (alpha >> TCP_DCTCP_SHIFT_G) + (fraction >> TCP_DCTCP_SHIFT_G);
+            pcb->dctcp_alpha = uint16_t(std::min(alpha, uint32_t(TCP_DCTCP_ALPHA_MAX)));
+            pcb->dctcp_acked = 0;
+            pcb->dctcp_marked = 0;
+            pcb->dctcp_next_seq = pcb->snd_nxt;
+        }
+    }
+    /* react at most once per window, and not while fast recovery already
+       reduced the window */
+    if (!ece || tcp_seq_lt(pcb->lastack, pcb->ecn_recover) || (pcb->flags & TF_INFR))
+    {
+        return;
+    }
+    TcpWndSize cwnd;
+    if (pcb->cc == TCP_CC_DCTCP)
+    {
+        cwnd = TcpWndSize(pcb->cwnd - uint64_t(pcb->cwnd) * pcb->dctcp_alpha /
+                                          (2 * TCP_DCTCP_ALPHA_MAX));
+    }
+    else
+    {
+        cwnd = std::min(pcb->cwnd, pcb->snd_wnd) / 2;
+    }
+    /* never below 2 MSS, like ssthresh after a fast retransmit */
+    pcb->ssthresh = std::max(cwnd, TcpWndSize(2 * pcb->mss));
+    pcb->cwnd = pcb->ssthresh;
+    pcb->bytes_acked = 0;
+    pcb->ecn_recover = pcb->snd_nxt;
+    pcb->ecn |= TCP_ECN_CWR;
+    tcp_ecn_reductions++;
+    Logf(true,
+         "tcp_ecn_acked: ECE, cwnd %d alpha %d\n",
+         pcb->cwnd,
+         pcb->dctcp_alpha);
+}
+
+///
+/// Set ECE/CWR in the header of a segment about to be (re)transmitted by
+/// tcp_output_segment() and return the TOS to send it with.
+///
+uint8_t
+tcp_ecn_output(struct TcpPcb* pcb, const struct TcpSeg* seg)
+{
+    const uint8_t tos = pcb->tos & ~IP_ECN_MASK;
+    TCPH_UNSET_FLAG(seg->tcphdr, TCP_ECE | TCP_CWR);
+    const uint8_t hdr_flags = tcph_flags(seg->tcphdr);
+    if (hdr_flags & TCP_SYN)
+    {
+        /* a SYN asks for ECN, a SYN-ACK agrees to it */
+        if (!(hdr_flags & TCP_ACK) && tcp_ecn_wanted(pcb->cc))
+        {
+            TCPH_SET_FLAG(seg->tcphdr, TCP_ECE | TCP_CWR);
+        }
+        else if ((hdr_flags & TCP_ACK) && (pcb->ecn & TCP_ECN_OK))
+        {
+            TCPH_SET_FLAG(seg->tcphdr, TCP_ECE);
+        }
+        return tos;
+    }
+    if (!(pcb->ecn & TCP_ECN_OK))
+    {
+        return tos;
+    }
+    if (pcb->ecn & TCP_ECN_ECE)
+    {
+        TCPH_SET_FLAG(seg->tcphdr, TCP_ECE);
+    }
+    /* RFC 3168, section 6.1.5: retransmissions are not ECN-capable */
+    if (seg->len == 0 || tcp_seq_lt(lwip_ntohl(seg->tcphdr->seqno), pcb->snd_nxt))
+    {
+        return tos;
+    }
+    if (pcb->ecn & TCP_ECN_CWR)
+    {
+        TCPH_SET_FLAG(seg->tcphdr, TCP_CWR);
+        pcb->ecn &= ~TCP_ECN_CWR;
+    }
+    return tos | IP_ECN_ECT0;
+}
+
+//
+// END OF FILE
+//
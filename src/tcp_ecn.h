@@ -0,0 +1,78 @@
+///
+/// file: tcp_ecn.h
+///
+/// Explicit Congestion Notification for TCP (RFC 3168) and DCTCP congestion
+/// control (RFC 8257).
+///
+/// ECN is negotiated in the handshake: the SYN carries ECE|CWR, a SYN-ACK
+/// agreeing to it carries ECE only. Once agreed, new data leaves with ECT(0)
+/// in the IP header; retransmissions, pure ACKs and SYNs are not ECN-capable.
+///
+/// - With TCP_CC_RENO the receiver sets ECE on every ACK from the first
+///   CE-marked segment until a segment with CWR arrives, and the sender halves
+///   its window at most once per window of data, like for a fast retransmit.
+/// - With TCP_CC_DCTCP the receiver echoes the CE state of each segment
+///   exactly (an ACK covering data received before a change of state is sent
+///   at once), and the sender keeps alpha, a moving average of the fraction of
+///   bytes acked with ECE per window of data, and reduces cwnd by alpha / 2.
+///
+
+#pragma once
+
+#include <tcp_priv.h>
+
+/// pcb->ecn flags.
+enum TcpEcnFlags : uint8_t
+{
+    /* ECN was agreed in the handshake */
+    TCP_ECN_OK = 0x01U,
+    /* set ECE on outgoing segments */
+    TCP_ECN_ECE = 0x02U,
+    /* set CWR on the next new data segment */
+    TCP_ECN_CWR = 0x04U,
+};
+
+/// alpha == 1.0
+constexpr auto TCP_DCTCP_ALPHA_MAX = 1024U;
+/// Weight of a new sample in alpha, g = 1/2^TCP_DCTCP_SHIFT_G (RFC 8257: 1/16).
+constexpr auto TCP_DCTCP_SHIFT_G = 4;
+
+///
+/// Whether connections using congestion control cc ask for ECN.
+///
+inline bool
+tcp_ecn_wanted(const TcpCongestionControl cc)
+{
+    return TCP_ECN || cc == TCP_CC_DCTCP;
+}
+
+///
+/// ECE for control segments (pure ACKs, probes) sent on pcb.
+///
+inline uint8_t
+tcp_ecn_ack_flags(const struct TcpPcb* pcb)
+{
+    return (pcb->ecn & TCP_ECN_ECE) ? TCP_ECE : 0;
+}
+
+void
+tcp_ecn_init(struct TcpPcb* pcb);
+
+void
+tcp_ecn_established(struct TcpPcb* pcb, bool agreed);
+
+void
+tcp_ecn_input(struct TcpPcb* pcb, uint8_t ip_ecn, uint8_t ecn_flags, bool has_data);
+
+void
+tcp_ecn_acked(struct TcpPcb* pcb, TcpWndSize acked, bool ece);
+
+uint8_t
+tcp_ecn_output(struct TcpPcb* pcb, const struct TcpSeg* seg);
+
+/// Number of window reductions caused by ECE.
+extern size_t tcp_ecn_reductions;
+
+//
+// END OF FILE
+//
@@ -0,0 +1,317 @@
+///
+/// file: tcp_fastopen.cpp
+///
+/// TCP Fast Open, see tcp_fastopen.h.
+///
+
+#include <algorithm>
+#include <cstring>
+#include <lwip_debug.h>
+#include <opt.h>
+#include <tcp_fastopen.h>
+#include <tcp_synq.h>
+
+/// A server and the cookie it gave us. Direct-mapped on the address: a
+/// colliding server just replaces the entry and costs a cookie request.
+struct TcpFastopenCacheEntry
+{
+    Ip6Addr addr;
+    uint8_t addr_type;
+    /* 0 if the entry is unused */
+    uint8_t cookie_len;
+    uint8_t cookie[TCP_FASTOPEN_COOKIE_MAX];
+};
+
+static TcpFastopenCacheEntry tcp_fastopen_cache[TCP_FASTOPEN_CACHE_SIZE];
+
+size_t tcp_fastopen_accepts;
+
+/* Tells cookie MACs apart from SYN cookie MACs ("TFO") */
+constexpr uint32_t TCP_FASTOPEN_MAC_TAG = 0x54464f00;
+
+static void
+tcp_fastopen_addr_store(Ip6Addr& dst, const IpAddrInfo& src)
+{
+    if (is_ip_addr_v6(src))
+    {
+        dst = src.u_addr.ip6.addr;
+    }
+    else
+    {
+        memset(&dst, 0, sizeof(dst));
+        dst.word[0] = src.u_addr.ip4.address.addr;
+    }
+}
+
+static TcpFastopenCacheEntry&
+tcp_fastopen_cache_entry(const IpAddrInfo& addr, Ip6Addr& key)
+{
+    tcp_fastopen_addr_store(key, addr);
+    uint32_t h = key.word[0] ^ key.word[1] ^ key.word[2] ^ key.word[3];
+    h *= 0x9e3779b1U;
+    return tcp_fastopen_cache[(h >> 16) % TCP_FASTOPEN_CACHE_SIZE];
+}
+
+static const TcpFastopenCacheEntry*
+tcp_fastopen_cache_find(const IpAddrInfo& addr)
+{
+    Ip6Addr key{};
+    const auto& entry = tcp_fastopen_cache_entry(addr, key);
+    if (entry.cookie_len == 0 || entry.addr_type != uint8_t(get_ip_addr_type(addr)) ||
+        memcmp(&entry.addr, &key, sizeof(key)) != 0)
+    {
+        return nullptr;
+    }
+    return &entry;
+}
+
+static void
+tcp_fastopen_cache_store(const IpAddrInfo& addr, const uint8_t* cookie, const uint8_t len)
+{
+    Ip6Addr key{};
+    auto& entry = tcp_fastopen_cache_entry(addr, key);
+    entry.addr = key;
+    entry.addr_type = uint8_t(get_ip_addr_type(addr));
+    entry.cookie_len = len;
+    memcpy(entry.cookie, cookie, len);
+}
+
+static void
+tcp_fastopen_cache_drop(const IpAddrInfo& addr)
+{
+    Ip6Addr key{};
+    auto& entry = tcp_fastopen_cache_entry(addr, key);
+    if (memcmp(&entry.addr, &key, sizeof(key)) == 0)
+    {
+        entry.cookie_len = 0;
+    }
+}
+
+/**
+ * @ingroup tcp_raw
+ * Use Fast Open on a connection that is not connected yet: data written with
+ * tcp_write() before and during tcp_connect() is sent in the SYN if the
+ * server gave us a cookie earlier.
+ *
+ * @param pcb the pcb to connect
+ */
+void
+tcp_fastopen_connect(struct TcpPcb* pcb)
+{
+    lwip_assert("tcp_fastopen_connect: pcb already connected", pcb->state == CLOSED);
+    pcb->cold.tfo |= TCP_TFO_CLIENT;
+}
+
+/**
+ * @ingroup tcp_raw
+ * Accept data in the SYN on a listening pcb.
+ *
+ * @param pcb the listening pcb (as returned by tcp_listen())
+ * @param max_pending number of connections accepted from a SYN that may wait
+ *        for their final ACK at the same time, 0 disables Fast Open
+ */
+void
+tcp_fastopen_listen(struct TcpPcb* pcb, const uint16_t max_pending)
+{
+    lwip_assert("tcp_fastopen_listen: not a listening pcb", pcb->state == LISTEN);
+    reinterpret_cast<TcpPcbListen*>(pcb)->tfo_max = max_pending;
+}
+
+///
+/// Write a Fast Open option, padded in front with NOPs to a multiple of
+/// four bytes. An empty cookie asks the server for one.
+///
+/// @return the word following the option
+///
+uint32_t*
+tcp_fastopen_build_option(uint32_t* opts, const uint8_t* cookie, const uint8_t cookie_len)
+{
+    const uint8_t optlen = tcp_fastopen_optlen(cookie_len);
+    auto p = reinterpret_cast<uint8_t*>(opts);
+    memset(p, LWIP_TCP_OPT_NOP, optlen - 2 - cookie_len);
+    p += optlen - 2 - cookie_len;
+    *p++ = LWIP_TCP_OPT_TFO;
+    *p++ = uint8_t(2 + cookie_len);
+    memcpy(p, cookie, cookie_len);
+    return opts + optlen / 4;
+}
+
+///
+/// The cookie of a client: a MAC of both addresses under the SYN queue
+/// secret, so validating it needs no state.
+///
+void
+tcp_fastopen_make_cookie(const IpAddrInfo& local_ip, const IpAddrInfo& remote_ip, uint8_t* cookie)
+{
+    uint32_t words[10];
+    Ip6Addr local{};
+    Ip6Addr remote{};
+    tcp_fastopen_addr_store(local, local_ip);
+    tcp_fastopen_addr_store(remote, remote_ip);
+    memcpy(words, remote.word, 16);
+    memcpy(words + 4, local.word, 16);
+    words[8] = TCP_FASTOPEN_MAC_TAG;
+    words[9] = 0;
+    const uint64_t mac = tcp_synq_siphash(words, LWIP_ARRAYSIZE(words));
+    static_assert(TCP_FASTOPEN_COOKIE_LEN == sizeof(mac), "cookie is one MAC");
+    memcpy(cookie, &mac, TCP_FASTOPEN_COOKIE_LEN);
+}
+
+/* Compare two cookies in a time that does not depend on where they differ,
+   so a forged cookie cannot be found byte by byte */
+static bool
+tcp_fastopen_cookie_equal(const uint8_t* a, const uint8_t* b)
+{
+    volatile uint8_t diff = 0;
+    for (size_t i = 0; i < TCP_FASTOPEN_COOKIE_LEN; i++)
+    {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+bool
+tcp_fastopen_cookie_valid(const TcpFastopenOpt& opt,
+                          const IpAddrInfo& local_ip,
+                          const IpAddrInfo& remote_ip)
+{
+    if (!opt.present || opt.len != TCP_FASTOPEN_COOKIE_LEN)
+    {
+        return false;
+    }
+    uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN];
+    tcp_fastopen_make_cookie(local_ip, remote_ip, cookie);
+    return tcp_fastopen_cookie_equal(cookie, opt.cookie);
+}
+
+///
+/// Server side: pcb was just created from a SYN with data and a valid cookie.
+///
+void
+tcp_fastopen_accepted(struct TcpPcb* pcb)
+{
+    pcb->cold.tfo = TCP_TFO_ACCEPTED | TCP_TFO_SYN_DATA;
+    pcb->cold.listener->tfo_pending++;
+    tcp_fastopen_accepts++;
+}
+
+///
+/// Client side: tcp_write() before the SYN-ACK arrived, keep the data for
+/// the SYN (or for tcp_fastopen_synack()).
+///
+LwipStatus
+tcp_fastopen_write(struct TcpPcb* pcb, const void* data, const size_t len)
+{
+    const auto snd_buf = size_t(TCP_SND_BUF);
+    if (pcb->cold.tfo_len > snd_buf || len > snd_buf - pcb->cold.tfo_len)
+    {
+        Logf(true, "tcp_fastopen_write: too much data (len=%zu)\n", len);
+        tcp_set_flags(pcb, TF_NAGLEMEMERR);
+        return ERR_MEM;
+    }
+    auto buf = new uint8_t[pcb->cold.tfo_len + len];
+    if (pcb->cold.tfo_data != nullptr)
+    {
+        memcpy(buf, pcb->cold.tfo_data, pcb->cold.tfo_len);
+        delete[] pcb->cold.tfo_data;
+    }
+    memcpy(buf + pcb->cold.tfo_len, data, len);
+    pcb->cold.tfo_data = buf;
+    pcb->cold.tfo_len = uint16_t(pcb->cold.tfo_len + len);
+    return STATUS_SUCCESS;
+}
+
+///
+/// Client side: queue the SYN of tcp_connect(), with the cached cookie and
+/// the data written so far, or asking for a cookie.
+///
+LwipStatus
+tcp_fastopen_enqueue_syn(struct TcpPcb* pcb)
+{
+    uint16_t len = 0;
+    pcb->cold.tfo_cookie_len = 0;
+    const TcpFastopenCacheEntry* entry = tcp_fastopen_cache_find(pcb->remote_ip);
+    if (entry != nullptr)
+    {
+        pcb->cold.tfo_cookie_len = entry->cookie_len;
+        memcpy(pcb->cold.tfo_cookie, entry->cookie, entry->cookie_len);
+        len = pcb->cold.tfo_len;
+    }
+    const LwipStatus err = tcp_enqueue_syn_data(pcb, pcb->cold.tfo_data, &len);
+    if (err == STATUS_SUCCESS && len > 0)
+    {
+        pcb->cold.tfo |= TCP_TFO_SYN_DATA;
+        /* let tcp_output() send the data with the SYN */
+        pcb->cwnd = std::max(pcb->cwnd, TcpWndSize(len));
+    }
+    return err;
+}
+
+///
+/// Client side, called by tcp_process() once the SYN-ACK removed the SYN
+/// from the queues and set lastack. Updates the cookie cache and queues the
+/// buffered data the SYN-ACK did not acknowledge.
+///
+/// @param syn_seqno sequence number of the SYN
+/// @param opt the Fast Open option of the SYN-ACK
+/// @return number of bytes of SYN data acknowledged
+///
+uint32_t
+tcp_fastopen_synack(struct TcpPcb* pcb, const uint32_t syn_seqno, const TcpFastopenOpt& opt)
+{
+    if (!(pcb->cold.tfo & TCP_TFO_CLIENT))
+    {
+        return 0;
+    }
+    const uint32_t acked = pcb->lastack - syn_seqno - 1;
+    if (opt.present && opt.len >= TCP_FASTOPEN_COOKIE_MIN && opt.len <= TCP_FASTOPEN_COOKIE_MAX)
+    {
+        tcp_fastopen_cache_store(pcb->remote_ip, opt.cookie, opt.len);
+    }
+    else if ((pcb->cold.tfo & TCP_TFO_SYN_DATA) && acked == 0 && !opt.present)
+    {
+        /* the server ignored the cookie without sending a new one: it does
+           not do Fast Open (any more) */
+        tcp_fastopen_cache_drop(pcb->remote_ip);
+    }
+    Logf(true,
+         "tcp_fastopen_synack: %d of %d bytes acked with the SYN\n",
+         acked,
+         pcb->cold.tfo_len);
+    /* SYN data that was not acknowledged is sent again like new data */
+    pcb->snd_nxt = pcb->lastack;
+    pcb->snd_lbb = pcb->lastack;
+    pcb->cold.tfo = 0;
+    if (pcb->cold.tfo_len > acked &&
+        tcp_write(pcb, pcb->cold.tfo_data + acked, pcb->cold.tfo_len - acked, TCP_WRITE_FLAG_COPY) !=
+        STATUS_SUCCESS)
+    {
+        Logf(true, "tcp_fastopen_synack: could not queue %d bytes\n", pcb->cold.tfo_len - acked);
+    }
+    delete[] pcb->cold.tfo_data;
+    pcb->cold.tfo_data = nullptr;
+    pcb->cold.tfo_len = 0;
+    return acked;
+}
+
+///
+/// Drop the Fast Open state of a pcb that is freed or, for a server, got
+/// established.
+///
+void
+tcp_fastopen_release(struct TcpPcb* pcb)
+{
+    if ((pcb->cold.tfo & TCP_TFO_ACCEPTED) && pcb->cold.listener != nullptr)
+    {
+        lwip_assert("tfo_pending != 0", pcb->cold.listener->tfo_pending != 0);
+        pcb->cold.listener->tfo_pending--;
+    }
+    pcb->cold.tfo &= ~(TCP_TFO_ACCEPTED | TCP_TFO_SYN_DATA);
+    delete[] pcb->cold.tfo_data;
+    pcb->cold.tfo_data = nullptr;
+    pcb->cold.tfo_len = 0;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,96 @@
+///
+/// file: tcp_fastopen.h
+///
+/// TCP Fast Open (RFC 7413): data in the SYN, delivered to the server
+/// application one round trip before the handshake completes.
+///
+/// Server: tcp_fastopen_listen() enables Fast Open on a listening pcb. A SYN
+/// with an empty Fast Open option (or an invalid cookie) gets a cookie in the
+/// SYN-ACK: a keyed MAC of the client and server addresses, so nothing is
+/// stored per client. A SYN carrying data and a valid cookie creates the pcb at
+/// once: the application is handed the connection through the accept callback
+/// and then the data of the SYN through the recv callback, while the pcb sends
+/// (and retransmits) the SYN-ACK itself. At most tfo_max such connections may
+/// wait for their final ACK per listener; beyond that, and for SYN cookies,
+/// the data of the SYN is ignored and the client sends it again.
+///
+/// Client: after tcp_fastopen_connect(), tcp_write() before and during the
+/// handshake buffers the data in the pcb. tcp_connect() puts as much of it as
+/// fits in the SYN when a cookie for the server is cached, and asks for a
+/// cookie otherwise. When the SYN-ACK arrives, what the server did not
+/// acknowledge of the SYN data and everything written after it is queued like
+/// a normal tcp_write().
+///
+
+#pragma once
+
+#include <tcp_priv.h>
+
+/// pcb->cold.tfo flags.
+enum TcpFastopenFlags : uint8_t
+{
+    /* client: buffer writes until the SYN-ACK arrives */
+    TCP_TFO_CLIENT = 0x01U,
+    /* client: the SYN carries data; server: the data of the SYN is still to
+       be taken by tcp_process() */
+    TCP_TFO_SYN_DATA = 0x02U,
+    /* server: accepted from the SYN, counts against the listener's tfo_max
+       until established */
+    TCP_TFO_ACCEPTED = 0x04U,
+};
+
+/// Length of the cookies a server issues.
+constexpr auto TCP_FASTOPEN_COOKIE_LEN = 8;
+/// Shortest cookie allowed by RFC 7413.
+constexpr auto TCP_FASTOPEN_COOKIE_MIN = 4;
+
+/// The Fast Open option of the segment being processed by tcp_input().
+struct TcpFastopenOpt
+{
+    bool present;
+    uint8_t len;
+    uint8_t cookie[16];
+};
+
+///
+/// Bytes a Fast Open option with a cookie of 'cookie_len' takes in a header,
+/// NOP padding included.
+///
+inline uint8_t
+tcp_fastopen_optlen(const uint8_t cookie_len)
+{
+    return uint8_t((2 + cookie_len + 3) & ~3);
+}
+
+uint32_t*
+tcp_fastopen_build_option(uint32_t* opts, const uint8_t* cookie, uint8_t cookie_len);
+
+void
+tcp_fastopen_make_cookie(const IpAddrInfo& local_ip, const IpAddrInfo& remote_ip, uint8_t* cookie);
+
+bool
+tcp_fastopen_cookie_valid(const TcpFastopenOpt& opt,
+                          const IpAddrInfo& local_ip,
+                          const IpAddrInfo& remote_ip);
+
+void
+tcp_fastopen_accepted(struct TcpPcb* pcb);
+
+LwipStatus
+tcp_fastopen_write(struct TcpPcb* pcb, const void* data, size_t len);
+
+LwipStatus
+tcp_fastopen_enqueue_syn(struct TcpPcb* pcb);
+
+uint32_t
+tcp_fastopen_synack(struct TcpPcb* pcb, uint32_t syn_seqno, const TcpFastopenOpt& opt);
+
+void
+tcp_fastopen_release(struct TcpPcb* pcb);
+
+/// Number of connections accepted with data in the SYN.
+extern size_t tcp_fastopen_accepts;
+
+//
+// END OF FILE
+//
@@ -5,6 +5,7 @@
 #include <cstring>
 #include <def.h>
 #include <inet_chksum.h>
+#include <ip4.h>
 #include <ip6.h>
 #include <ip6_addr.h>
 #include <ip_addr.h>
@@ -12,8 +13,14 @@
 #include <nd6.h>
 #include <network_interface.h>
 #include <opt.h>
+#include <tcp_ecn.h>
+#include <tcp_fastopen.h>
+#include <tcp_ooseq.h>
 #include <tcp_priv.h>
 #include <tcp_in.h>
+#include <tcp_rcvbuf.h>
+#include <tcp_synq.h>
+#include <tcp_timewait.h>
 
 
 
@@ -31,6 +38,85 @@
  uint8_t recv_flags;
  struct PacketBuffer* recv_data;
 struct TcpPcb* tcp_input_pcb;
+
+/* addresses of the segment, from its IP header */
+static IpAddrInfo curr_src_addr;
+static IpAddrInfo curr_dst_addr;
+
+/* ECE/CWR of the segment and the ECN field of its IP header, see tcp_ecn.h */
+static uint8_t ecn_flags;
+static uint8_t ip_ecn;
+/* Fast Open option of the segment, see tcp_fastopen.h */
+static TcpFastopenOpt tfo_opt;
+
+/* ACKs held back during an input batch, see tcp_input_batch_begin() */
+static bool tcp_input_batching;
+static struct TcpPcb* tcp_input_batch_pcbs[TCP_INPUT_BATCH_PCBS];
+static size_t tcp_input_batch_count;
+
+static bool
+tcp_input_batch_hold(struct TcpPcb* pcb);
+static void
+tcp_input_output(struct TcpPcb* pcb);
+
+/* Read curr_src_addr and curr_dst_addr from the IP header in front of the
+   segment; false if there is no complete IPv4 or IPv6 header */
+static bool
+tcp_input_addrs(const struct PacketBuffer* p)
+{
+    const auto& data = p->data;
+    if (data.empty())
+    {
+        return false;
+    }
+    curr_src_addr = {};
+    curr_dst_addr = {};
+    if (data[0] >> 4 == 6)
+    {
+        if (data.size() < IP6_HDR_LEN)
+        {
+            return false;
+        }
+        curr_src_addr.type = IPADDR_TYPE_V6;
+        curr_dst_addr.type = IPADDR_TYPE_V6;
+        memcpy(&curr_src_addr.u_addr.ip6.addr, &data[8], sizeof(Ip6Addr));
+        memcpy(&curr_dst_addr.u_addr.ip6.addr, &data[24], sizeof(Ip6Addr));
+        return true;
+    }
+    if (data[0] >> 4 != 4 || data.size() < IP4_HDR_LEN)
+    {
+        return false;
+    }
+    curr_src_addr.type = IPADDR_TYPE_V4;
+    curr_dst_addr.type = IPADDR_TYPE_V4;
+    memcpy(&curr_src_addr.u_addr.ip4.address.addr, &data[12], sizeof(uint32_t));
+    memcpy(&curr_dst_addr.u_addr.ip4.address.addr, &data[16], sizeof(uint32_t));
+    return true;
+}
+
+/* Cut the payload of inseg, the last inseg.len bytes of its buffer, down to
+   its first 'len' bytes */
+static void
+tcp_inseg_trim_back(uint16_t len)
+{
+    std::vector<uint8_t>& data = inseg.p->data;
+    lwip_assert("tcp_inseg_trim_back: payload not in buffer", data.size() >= inseg.len);
+    lwip_assert("tcp_inseg_trim_back: insane length", len <= inseg.len);
+    data.resize(data.size() - (inseg.len - len));
+    inseg.len = len;
+}
+
+/* Drop everything in front of the payload, the last 'len' bytes of p: the IP
+   and TCP headers and data already received. Done before p becomes
+   recv_data, so recv callbacks, receive slices and tcp_recved() only ever
+   see stream data */
+static void
+tcp_input_strip(struct PacketBuffer* p, uint16_t len)
+{
+    std::vector<uint8_t>& data = p->data;
+    lwip_assert("tcp_input_strip: payload not in buffer", data.size() >= len);
+    data.erase(data.begin(), data.end() - len);
+}
  /**
  * The initial input processing of TCP. It verifies the TCP header, demultiplexes
  * the segment between the PCBs and passes it on to tcp_process(), which implements
@@ -43,14 +129,18 @@ struct TcpPcb* tcp_input_pcb;
 void
 tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
 {
-    IpAddrInfo* curr_dst_addr = nullptr;
-    IpAddrInfo* curr_src_addr = nullptr;
     NetworkInterface* curr_netif = nullptr;
     TcpPcb* pcb;
     TcpPcbListen* lpcb;
     TcpPcb* lpcb_prev = nullptr;
     TcpPcbListen* lpcb_any = nullptr;
     lwip_assert("tcp_input: invalid pbuf", p != nullptr);
+    if (!tcp_input_addrs(p))
+    {
+        Logf(true, ("tcp_input: no IP header, segment discarded\n"));
+        free_pkt_buf(p);
+        return;
+    }
     tcphdr = reinterpret_cast<struct TcpHdr *>(p->payload);
     /// Check that TCP header fits in payload
     if (p->len < TCP_HDR_LEN)
@@ -59,8 +149,8 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
         Logf(true, "tcp_input: short packet (%d bytes) discarded\n", p->tot_len);
         goto dropped;
     } /// Don't even process incoming broadcasts/multicasts.
-    if (is_netif_ip4_addr_bcast(curr_dst_addr, curr_netif) || is_ip_addr_mcast(
-        curr_dst_addr))
+    if (is_netif_ip4_addr_bcast(&curr_dst_addr, curr_netif) || is_ip_addr_mcast(
+        &curr_dst_addr))
     {
         goto dropped;
     } ///
@@ -70,8 +160,8 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
         const auto chksum = ip_chksum_pseudo(p,
                                              IP_PROTO_TCP,
                                              p->tot_len,
-                                             curr_src_addr,
-                                             curr_dst_addr);
+                                             &curr_src_addr,
+                                             &curr_dst_addr);
         if (chksum != 0)
         {
             Logf(true,
@@ -130,6 +220,9 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
     ackno = tcphdr->ackno = lwip_ntohl(tcphdr->ackno);
     tcphdr->wnd = lwip_ntohs(tcphdr->wnd);
     flags = tcph_flags(tcphdr);
+    ecn_flags = tcph_ecn_flags(tcphdr);
+    ip_ecn = p->ip_ecn;
+    tfo_opt.present = false;
     tcplen = p->tot_len;
     if ((flags & (TCP_FIN | TCP_SYN)) != 0)
     {
@@ -156,9 +249,9 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
             continue;
         }
         if (pcb->remote_port == tcphdr->src && pcb->local_port == tcphdr->dest &&
-            compare_ip_addr(&pcb->remote_ip, curr_src_addr) && compare_ip_addr(
+            compare_ip_addr(&pcb->remote_ip, &curr_src_addr) && compare_ip_addr(
                 &pcb->local_ip,
-                curr_dst_addr))
+                &curr_dst_addr))
         {
             /// Move this PCB to the front of the list so that subsequent lookups will be faster (we exploit locality in TCP segment arrivals).
             lwip_assert("tcp_input: pcb->next != pcb (before cache)", pcb->next != pcb);
@@ -179,7 +272,19 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
     if (pcb == nullptr)
     {
         /* If it did not go to an active connection, we check the connections
-           in the TIME-WAIT state. */
+           in the TIME-WAIT state: first the compact records, then the pcbs
+           that could not be compacted. */
+        TcpTwRecord* tw = tcp_timewait_lookup(curr_dst_addr,
+                                              tcphdr->dest,
+                                              curr_src_addr,
+                                              tcphdr->src);
+        if (tw != nullptr)
+        {
+            Logf(true, ("tcp_input: packed for TIME_WAITing connection.\n"));
+            tcp_timewait_input(tw);
+            free_pkt_buf(p);
+            return;
+        }
         for (pcb = tcp_tw_pcbs; pcb != nullptr; pcb = pcb->next)
         {
             lwip_assert("tcp_input: TIME-WAIT pcb->state == TIME-WAIT",
@@ -191,9 +296,9 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
                 continue;
             }
             if (pcb->remote_port == tcphdr->src && pcb->local_port == tcphdr->dest &&
-                compare_ip_addr(&pcb->remote_ip, curr_src_addr) && compare_ip_addr(
+                compare_ip_addr(&pcb->remote_ip, &curr_src_addr) && compare_ip_addr(
                     &pcb->local_ip,
-                    curr_dst_addr))
+                    &curr_dst_addr))
             {
                 /// We don't really care enough to move this PCB to the front of the list since we are not very likely to receive that many segments for connections in TIME-WAIT.
                 Logf(true, ("tcp_input: packed for TIME_WAITing connection.\n"));
@@ -228,9 +333,9 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
                     lpcb_any = lpcb;
                     lpcb_prev = prev;
                 }
-                else if (match_exact_ip_addr_pcb_vers((IpPcb*)lpcb, curr_dst_addr))
+                else if (match_exact_ip_addr_pcb_vers((IpPcb*)lpcb, &curr_dst_addr))
                 {
-                    if (compare_ip_addr(&lpcb->local_ip, curr_dst_addr))
+                    if (compare_ip_addr(&lpcb->local_ip, &curr_dst_addr))
                     {
                         /* found an exact match */
                         break;
@@ -268,8 +373,14 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
             {
             }
             Logf(true, ("tcp_input: packed for LISTENing connection.\n"));
-            free_pkt_buf(p);
-            return;
+            pcb = tcp_listen_input(lpcb);
+            if (pcb == nullptr)
+            {
+                free_pkt_buf(p);
+                return;
+            }
+            /* The segment completed a handshake and the connection now has a
+               pcb in SYN_RCVD: process the ACK (and any data) on it. */
         }
     } // if ((pcb != nullptr) && LWIP_HOOK_TCP_INPACKET_PCB(pcb,
     //                                                    tcphdr,
@@ -323,7 +434,7 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
                    end. We then call the error callback to inform the
                    application that the connection is dead before we
                    deallocate the PCB. */
-                // TCP_EVENT_ERR(pcb->state, pcb->errf, pcb->callback_arg, ERR_RST);
+                // TCP_EVENT_ERR(pcb->state, pcb->cold.errf, pcb->callback_arg, ERR_RST);
                 tcp_pcb_remove(&tcp_active_pcbs, pcb);
                 tcp_free(pcb);
             }
@@ -426,7 +537,16 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
                 {
                     goto aborted;
                 } /* Try to send something out. */
-                tcp_output(pcb);
+                if (!tcp_input_batch_hold(pcb))
+                {
+                    tcp_input_output(pcb);
+                }
+                if (pcb->state == TIME_WAIT)
+                {
+                    /* The final ACK is out and nothing is left to deliver: keep
+                       only a compact TIME-WAIT record of the connection. */
+                    tcp_timewait_compact(pcb);
+                }
             }
         } /* Jump target if pcb has been aborted in a callback (by calling tcp_abort()).
            Below this line, 'pcb' may not be dereferenced! */
@@ -448,8 +568,8 @@ tcp_input(struct PacketBuffer* p, NetworkInterface* inp)
             tcp_rst(nullptr,
                     ackno,
                     seqno + tcplen,
-                    curr_dst_addr,
-                    curr_src_addr,
+                    &curr_dst_addr,
+                    &curr_src_addr,
                     tcphdr->dest,
                     tcphdr->src);
         }
@@ -476,46 +596,319 @@ tcp_input_delayed_close(struct TcpPcb* pcb)
             /* Connection closed although the application has only shut down the
                 tx side: call the PCB's err callback and indicate the closure to
                 ensure the application doesn't continue using the PCB. */
-            // TCP_EVENT_ERR(pcb->state, pcb->errf, pcb->callback_arg, ERR_CLSD);
+            // TCP_EVENT_ERR(pcb->state, pcb->cold.errf, pcb->callback_arg, ERR_CLSD);
         }
         tcp_pcb_remove(&tcp_active_pcbs, pcb);
         tcp_free(pcb);
         return 1;
     }
     return 0;
-} /**
+}
+
+/* Send what tcp_input() left to send for pcb. SACK blocks only go out with
+   empty ACKs, so an ACK that has to carry them is sent on its own first. */
+static void
+tcp_input_output(struct TcpPcb* pcb)
+{
+    if ((pcb->flags & TF_ACK_NOW) && tcp_sack_valid(pcb, 0))
+    {
+        tcp_send_empty_ack(pcb);
+    }
+    tcp_output(pcb);
+}
+
+/* Keep the ACK pcb waits for until the input batch ends. Only pure ACKs are
+   held: data to send carries the ACK anyway, and without SACK every
+   duplicate ACK for out-of-order data must go out for the peer's fast
+   retransmit. */
+static bool
+tcp_input_batch_hold(struct TcpPcb* pcb)
+{
+    if (!tcp_input_batching || pcb->state != ESTABLISHED || !(pcb->flags & TF_ACK_NOW) ||
+        pcb->unsent != nullptr || (pcb->ooseq != nullptr && !(pcb->flags & TF_SACK)))
+    {
+        return false;
+    }
+    /* a burst mostly belongs to the connection that was added last */
+    for (size_t i = tcp_input_batch_count; i > 0; i--)
+    {
+        if (tcp_input_batch_pcbs[i - 1] == pcb)
+        {
+            return true;
+        }
+    }
+    if (tcp_input_batch_count == TCP_INPUT_BATCH_PCBS)
+    {
+        return false;
+    }
+    tcp_input_batch_pcbs[tcp_input_batch_count++] = pcb;
+    return true;
+}
+
+/**
+ * Open an input batch: until tcp_input_batch_end(), tcp_input() holds back
+ * the pure ACKs the segments it processes ask for, so a connection that gets
+ * several segments in one burst sends a single cumulative ACK (with the SACK
+ * blocks of the last one) instead of one per segment or two.
+ */
+void
+tcp_input_batch_begin()
+{
+    lwip_assert("tcp_input_batch_begin: batch already open", !tcp_input_batching);
+    tcp_input_batching = true;
+}
+
+/**
+ * Close the input batch and send the ACKs held back during it.
+ */
+void
+tcp_input_batch_end()
+{
+    tcp_input_batching = false;
+    for (size_t i = 0; i < tcp_input_batch_count; i++)
+    {
+        tcp_input_output(tcp_input_batch_pcbs[i]);
+    }
+    tcp_input_batch_count = 0;
+}
+
+/**
+ * Drop a pcb that is being freed from the input batch. Called by tcp_free().
+ */
+void
+tcp_input_batch_forget(struct TcpPcb* pcb)
+{
+    for (size_t i = 0; i < tcp_input_batch_count; i++)
+    {
+        if (tcp_input_batch_pcbs[i] == pcb)
+        {
+            tcp_input_batch_pcbs[i] = tcp_input_batch_pcbs[--tcp_input_batch_count];
+            return;
+        }
+    }
+}
+
+/* Activate window scaling once a SYN announced it */
+static void
+tcp_enable_wnd_scale(struct TcpPcb* pcb, const uint8_t snd_scale)
+{
+    pcb->snd_scale = std::min(snd_scale, uint8_t(14U));
+    pcb->rcv_scale = TCP_RCV_SCALE;
+    tcp_set_flags(pcb, TF_WND_SCALE);
+    /* window scaling is enabled, we can use the full receive window */
+    lwip_assert("window not at default value", pcb->rcv_wnd == TCPWND_MIN16(TCP_WND));
+    lwip_assert("window not at default value", pcb->rcv_ann_wnd == TCPWND_MIN16(TCP_WND));
+    pcb->rcv_wnd = pcb->rcv_ann_wnd = TCP_WND;
+    /* and let it grow beyond 64K */
+    tcp_rcvbuf_init(pcb);
+}
+
+static void
+tcp_parseopt_syn(TcpSynReq& req);
+static void
+tcp_parseopt_timewait(TcpTwRecord* tw);
+
+/**
+ * Create the pcb of a connection whose handshake completed, from its
+ * connection request (queued or decoded from a SYN cookie). The pcb is left
+ * in SYN_RCVD with the SYN-ACK already acknowledged by the segment being
+ * processed, so that tcp_process() establishes it and accepts it.
+ *
+ * @return the new pcb, nullptr if the backlog is full or no pcb could be
+ *         allocated (the peer retransmits its ACK or data)
+ */
+static struct TcpPcb*
+tcp_listen_promote(struct TcpPcbListen* pcb,
+                   const TcpSynReq& req,
+                   const IpAddrInfo* local_ip,
+                   const IpAddrInfo* remote_ip)
+{
+    if (pcb->accepts_pending >= pcb->backlog)
+    {
+        Logf(true,
+             "tcp_listen_promote: listen backlog exceeded for port %d\n", req.local_port);
+        return nullptr;
+    }
+    struct TcpPcb* npcb = tcp_alloc(pcb->prio);
+    if (npcb == nullptr)
+    {
+        LwipStatus err;
+        Logf(true, ("tcp_listen_promote: could not allocate PCB\n"));
+        // TCP_STATS_INC(tcp.memerr);
+        TCP_EVENT_ACCEPT(pcb, NULL, pcb->callback_arg, ERR_MEM, err); /* err not useful here */
+        return nullptr;
+    }
+    pcb->accepts_pending++;
+    tcp_set_flags(npcb, TF_BACKLOGPEND); /* Set up the new PCB. */
+    copy_ip_addr(&npcb->local_ip, local_ip);
+    copy_ip_addr(&npcb->remote_ip, remote_ip);
+    npcb->local_port = req.local_port;
+    port_alloc_ref(tcp_ports, npcb->local_port);
+    npcb->remote_port = req.remote_port;
+    npcb->state = SYN_RCVD;
+    npcb->rcv_nxt = req.irs + 1;
+    npcb->rcv_ann_right_edge = npcb->rcv_nxt;
+    /* the SYN-ACK went out without the pcb: it is sent, not yet acked */
+    npcb->snd_wl2 = req.iss;
+    npcb->snd_nxt = req.iss + 1;
+    npcb->lastack = req.iss;
+    npcb->snd_lbb = req.iss + 1;
+    npcb->snd_wl1 = req.irs; /* initialise to the ACK's seqno-1 to force window update */
+    npcb->callback_arg = pcb->callback_arg;
+    npcb->cold.listener = pcb; /* inherit socket options */
+    npcb->so_options = pcb->so_options & kSofInherited;
+    npcb->netif_idx = pcb->netif_idx;
+    /* Apply the options negotiated in the SYN. */
+    npcb->mss = req.mss;
+    if (req.flags & TCP_SYNQ_FLAG_WND_SCALE)
+    {
+        tcp_enable_wnd_scale(npcb, req.snd_scale);
+    }
+    if (req.flags & TCP_SYNQ_FLAG_SACK)
+    {
+        tcp_set_flags(npcb, TF_SACK);
+    }
+    if (req.flags & TCP_SYNQ_FLAG_TIMESTAMP)
+    {
+        tcp_set_flags(npcb, TF_TIMESTAMP);
+        npcb->ts_recent = req.ts_recent;
+        npcb->ts_lastacksent = npcb->rcv_nxt;
+    }
+    npcb->cc = pcb->cc;
+    tcp_ecn_established(npcb, (req.flags & TCP_SYNQ_FLAG_ECN) != 0);
+    npcb->snd_wnd = req.snd_wnd;
+    npcb->snd_wnd_max = npcb->snd_wnd;
+    npcb->mss = tcp_eff_send_mss(npcb->mss, &npcb->local_ip, &npcb->remote_ip);
+    /* Register the new PCB so that we can begin receiving segments
+          for it. */
+    // TCP_REG_ACTIVE(npcb);
+    if (tcp_ext_arg_invoke_callbacks_passive_open(pcb, npcb) != STATUS_SUCCESS)
+    {
+        tcp_abandon(npcb, 0);
+        return nullptr;
+    }
+    return npcb;
+}
+
+/**
+ * Create the pcb of a connection from a Fast Open SYN with data and a valid
+ * cookie, see tcp_fastopen.h. The application gets the connection at once;
+ * tcp_process() then passes the data of the SYN on to it.
+ *
+ * @return the new pcb in SYN_RCVD, to be processed by tcp_input() with the
+ *         SYN, nullptr if the connection could not be set up
+ */
+static struct TcpPcb*
+tcp_listen_fastopen(struct TcpPcbListen* pcb,
+                    TcpSynReq& syn,
+                    const IpAddrInfo* local_ip,
+                    const IpAddrInfo* remote_ip)
+{
+    syn.iss = tcp_next_iss(*local_ip, syn.local_port, *remote_ip, syn.remote_port);
+    struct TcpPcb* npcb = tcp_listen_promote(pcb, syn, local_ip, remote_ip);
+    if (npcb == nullptr)
+    {
+        return nullptr;
+    }
+    /* Unlike for a promoted request, the SYN-ACK has not been sent yet: the
+       pcb sends it, and retransmits it until the final ACK arrives. */
+    npcb->snd_nxt = syn.iss;
+    npcb->snd_lbb = syn.iss;
+    tcp_fastopen_accepted(npcb);
+    if (tcp_enqueue_flags(npcb, TCP_SYN | TCP_ACK) != STATUS_SUCCESS)
+    {
+        tcp_abandon(npcb, 0);
+        return nullptr;
+    }
+    Logf(true,
+         "tcp_listen_fastopen: %d bytes with the SYN for port %d\n",
+         tcplen - 1,
+         tcphdr->dest);
+    tcp_backlog_accepted(npcb); /* Call the accept function. */
+    LwipStatus err;
+    TCP_EVENT_ACCEPT(pcb, npcb, npcb->callback_arg, STATUS_SUCCESS, err);
+    if (err != STATUS_SUCCESS)
+    {
+        if (err != ERR_ABRT)
+        {
+            tcp_abort(npcb);
+        }
+        return nullptr;
+    }
+    return npcb;
+}
+
+/**
  * Called by tcp_input() when a segment arrives for a listening
  * connection (from tcp_input()).
  *
+ * A SYN is answered with a SYN|ACK without allocating a pcb: the handshake
+ * is kept as a compact request in the SYN queue, or, when the queue is full,
+ * only in the SYN cookie used as our ISS. The pcb is created once the final
+ * ACK arrives.
+ *
  * @param pcb the tcp_pcb_listen for which a segment arrived
+ * @return the pcb of a connection the segment completed the handshake of
+ *         (to be processed by tcp_input() like any SYN_RCVD pcb), nullptr
+ *         if the segment has been dealt with
  *
  * @note the segment which arrived is saved in global variables, therefore only the pcb
  *       involved is passed as a parameter to this function
  */
- void
+struct TcpPcb*
 tcp_listen_input(struct TcpPcbListen* pcb)
 {
-     IpAddrInfo* curr_dst_addr = nullptr;
-        IpAddrInfo* curr_src_addr = nullptr;
+    lwip_assert("tcp_listen_input: invalid pcb", pcb != nullptr);
+    TcpSynReq* req = tcp_synq_lookup(curr_dst_addr,
+                                     tcphdr->dest,
+                                     curr_src_addr,
+                                     tcphdr->src);
     if (flags & TCP_RST)
     {
-        /* An incoming RST should be ignored. Return. */
-        return;
+        /* An incoming RST only cancels a handshake in progress. */
+        if (req != nullptr && seqno == req->irs + 1)
+        {
+            tcp_synq_remove(req);
+        }
+        return nullptr;
     }
-    lwip_assert("tcp_listen_input: invalid pcb", pcb != nullptr);
-    /* In the LISTEN state, we check for incoming SYN segments,
-        creates a new PCB, and responds with a SYN|ACK. */
     if (flags & TCP_ACK)
     {
-        /* For incoming segments with the ACK flag set, respond with a
+        if (!(flags & TCP_SYN))
+        {
+            /* Final ACK of a handshake: queued, or only known from the cookie? */
+            TcpSynReq cookie_req{};
+            if (req == nullptr && TCP_SYN_COOKIES)
+            {
+                cookie_req.local_port = tcphdr->dest;
+                cookie_req.remote_port = tcphdr->src;
+                cookie_req.irs = seqno - 1;
+                cookie_req.snd_wnd = tcphdr->wnd;
+                if (tcp_syncookie_check(cookie_req, ackno - 1, curr_dst_addr, curr_src_addr))
+                {
+                    req = &cookie_req;
+                }
+            }
+            if (req != nullptr && uint32_t(ackno) == req->iss + 1 && uint32_t(seqno) == req->
+                irs + 1)
+            {
+                struct TcpPcb* npcb = tcp_listen_promote(pcb, *req, &curr_dst_addr, &curr_src_addr);
+                if (npcb != nullptr && req != &cookie_req)
+                {
+                    tcp_synq_remove(req);
+                }
+                return npcb;
+            }
+        }
+        /* For other incoming segments with the ACK flag set, respond with a
            RST. */
         Logf(true, ("tcp_listen_input: ACK in LISTEN, sending reset\n"));
 
         tcp_rst((const struct TcpPcb *)pcb,
                 ackno,
                 seqno + tcplen,
-                curr_dst_addr,
-                curr_src_addr,
+                &curr_dst_addr,
+                &curr_src_addr,
                 tcphdr->dest,
                 tcphdr->src);
     }
@@ -523,78 +916,87 @@ tcp_listen_input(struct TcpPcbListen* pcb)
     {
         Logf(true,
              "TCP connection request %d -> %d.\n", tcphdr->src, tcphdr->dest);
+        if (req != nullptr)
+        {
+            if (req->irs == uint32_t(seqno))
+            {
+                /* retransmitted SYN: our SYN|ACK got lost, send it again */
+                tcp_synq_send_synack(*req, curr_dst_addr, curr_src_addr);
+                return nullptr;
+            }
+            /* a new connection attempt from the same port replaces the old one */
+            tcp_synq_remove(req);
+            req = nullptr;
+        }
         if (pcb->accepts_pending >= pcb->backlog)
         {
             Logf(true,
                  "tcp_listen_input: listen backlog exceeded for port %d\n", tcphdr->dest
                  );
-            return;
+            return nullptr;
         }
-        struct TcpPcb* npcb = tcp_alloc(pcb->prio);
-        /* If a new PCB could not be created (probably due to lack of memory),
-              we don't do anything, but rely on the sender will retransmit the
-              SYN at a time when we have more memory available. */
-        if (npcb == nullptr)
-        {
-            LwipStatus err;
-            Logf(true, ("tcp_listen_input: could not allocate PCB\n"));
-            // TCP_STATS_INC(tcp.memerr);
-            TCP_EVENT_ACCEPT(pcb, NULL, pcb->callback_arg, ERR_MEM, err); /* err not useful here */
-            return;
+        TcpSynReq syn{};
+        syn.local_port = tcphdr->dest;
+        syn.remote_port = tcphdr->src;
+        syn.irs = seqno;
+        syn.snd_wnd = tcphdr->wnd;
+        syn.mss = 536;
+        tcp_parseopt_syn(syn);
+        if (ecn_flags == (TCP_ECE | TCP_CWR) && tcp_ecn_wanted(pcb->cc))
+        {
+            syn.flags |= TCP_SYNQ_FLAG_ECN;
         }
-        pcb->accepts_pending++;
-        tcp_set_flags(npcb, TF_BACKLOGPEND); /* Set up the new PCB. */
-        copy_ip_addr(&npcb->local_ip, curr_dst_addr);
-        copy_ip_addr(&npcb->remote_ip, curr_src_addr);
-        npcb->local_port = pcb->local_port;
-        npcb->remote_port = tcphdr->src;
-        npcb->state = SYN_RCVD;
-        npcb->rcv_nxt = seqno + 1;
-        npcb->rcv_ann_right_edge = npcb->rcv_nxt;
-        uint32_t iss = tcp_next_iss(npcb);
-        npcb->snd_wl2 = iss;
-        npcb->snd_nxt = iss;
-        npcb->lastack = iss;
-        npcb->snd_lbb = iss;
-        npcb->snd_wl1 = seqno - 1; /* initialise to seqno-1 to force window update */
-        npcb->callback_arg = pcb->callback_arg;
-        npcb->listener = pcb; /* inherit socket options */
-        npcb->so_options = pcb->so_options & kSofInherited;
-        npcb->netif_idx = pcb->netif_idx;
-        /* Register the new PCB so that we can begin receiving segments
-              for it. */
-        // TCP_REG_ACTIVE(npcb); /* Parse any options in the SYN. */
-        tcp_parseopt(npcb);
-        npcb->snd_wnd = tcphdr->wnd;
-        npcb->snd_wnd_max = npcb->snd_wnd;
-        npcb->mss = tcp_eff_send_mss(npcb->mss, &npcb->local_ip, &npcb->remote_ip);
-        if (tcp_ext_arg_invoke_callbacks_passive_open(pcb, npcb) != STATUS_SUCCESS)
-        {
-            tcp_abandon(npcb, 0);
-            return;
-        } /* Send a SYN|ACK together with the MSS option. */
-        LwipStatus rc = tcp_enqueue_flags(npcb, TCP_SYN | TCP_ACK);
-        if (rc != STATUS_SUCCESS)
+        if (pcb->tfo_max != 0 && tfo_opt.present)
         {
-            tcp_abandon(npcb, 0);
-            return;
+            if (tcplen > 1 && !(flags & TCP_FIN) && pcb->tfo_pending < pcb->tfo_max &&
+                !tcp_synq_full(pcb) &&
+                tcp_fastopen_cookie_valid(tfo_opt, curr_dst_addr, curr_src_addr))
+            {
+                return tcp_listen_fastopen(pcb, syn, &curr_dst_addr, &curr_src_addr);
+            }
+            if (!tcp_fastopen_cookie_valid(tfo_opt, curr_dst_addr, curr_src_addr))
+            {
+                /* a cookie request, or a cookie from another address or key */
+                syn.flags |= TCP_SYNQ_FLAG_TFO_COOKIE;
+            }
+        }
+        if (!tcp_synq_full(pcb))
+        {
+            syn.iss = tcp_next_iss(curr_dst_addr, syn.local_port, curr_src_addr, syn.remote_port);
+            req = tcp_synq_add(pcb, syn, curr_dst_addr, curr_src_addr);
+        }
+        if (req == nullptr)
+        {
+            /* Under pressure, keep no state at all and let the SYN|ACK carry
+               what we need to know. */
+            if (!TCP_SYN_COOKIES)
+            {
+                Logf(true,
+                     "tcp_listen_input: SYN queue full for port %d\n", tcphdr->dest);
+                return nullptr;
+            }
+            /* the cookie has no room for ECN: do not agree to it */
+            syn.flags &= ~TCP_SYNQ_FLAG_ECN;
+            syn.iss = tcp_syncookie_make(syn, curr_dst_addr, curr_src_addr);
+            req = &syn;
         }
-        tcp_output(npcb);
+        /* Send a SYN|ACK together with the MSS option. */
+        tcp_synq_send_synack(*req, curr_dst_addr, curr_src_addr);
     }
+    return nullptr;
 } /**
  * Called by tcp_input() when a segment arrives for a connection in
- * TIME_WAIT.
+ * TIME_WAIT. The connection only exists as a compact record at this point,
+ * so the reply is built from that record.
  *
- * @param pcb the TcpProtoCtrlBlk for which a segment arrived
+ * @param tw the TIME-WAIT record for which a segment arrived
  *
- * @note the segment which arrived is saved in global variables, therefore only the pcb
+ * @note the segment which arrived is saved in global variables, therefore only the record
  *       involved is passed as a parameter to this function
  */
  void
-tcp_timewait_input(struct TcpPcb* pcb)
+tcp_timewait_input(TcpTwRecord* tw)
 {
-    IpAddrInfo* curr_dst_addr = nullptr;
-    IpAddrInfo* curr_src_addr = nullptr;
     /* RFC 1337: in TIME_WAIT, ignore RST and ACK FINs + any 'acceptable' segments */
     /* RFC 793 3.9 Event Processing - Segment Arrives:
       * - first check sequence number - we skip that one in TIME_WAIT (always
@@ -604,20 +1006,27 @@ tcp_timewait_input(struct TcpPcb* pcb)
     {
         return;
     }
-    lwip_assert("tcp_timewait_input: invalid pcb", pcb != nullptr);
+    lwip_assert("tcp_timewait_input: invalid tw", tw != nullptr);
+    if (tw->flags & TCP_TW_FLAG_TIMESTAMP)
+    {
+        tcp_parseopt_timewait(tw);
+    }
     /* - fourth, check the SYN bit, */
     if (flags & TCP_SYN)
     {
         /* If an incoming segment is not acceptable, an acknowledgment
            should be sent in reply */
-        if (TCP_SEQ_BETWEEN(seqno, pcb->rcv_nxt, pcb->rcv_nxt + pcb->rcv_wnd))
+        if (TCP_SEQ_BETWEEN(seqno, tw->rcv_nxt, tw->rcv_nxt + tw->rcv_wnd))
         {
             /* If the SYN is in the window it is an error, send a reset */
-            tcp_rst(pcb,
+            IpAddrInfo local_ip{};
+            IpAddrInfo remote_ip{};
+            tcp_timewait_get_addrs(tw, local_ip, remote_ip);
+            tcp_rst(nullptr,
                     ackno,
                     seqno + tcplen,
-                    curr_dst_addr,
-                    curr_src_addr,
+                    &local_ip,
+                    &remote_ip,
                     tcphdr->dest,
                     tcphdr->src);
             return;
@@ -627,13 +1036,12 @@ tcp_timewait_input(struct TcpPcb* pcb)
     {
         /* - eighth, check the FIN bit: Remain in the TIME-WAIT state.
              Restart the 2 MSL time-wait timeout.*/
-        pcb->tmr = tcp_ticks;
+        tcp_timewait_restart(tw);
     }
     if ((tcplen > 0))
     {
         /* Acknowledge data, FIN or out-of-window SYN */
-        tcp_ack_now(pcb);
-        tcp_output(pcb);
+        tcp_timewait_send_ack(tw);
     }
 } /**
  * Implements the TCP state machine. Called by tcp_input. In some
@@ -649,8 +1057,6 @@ tcp_timewait_input(struct TcpPcb* pcb)
  LwipStatus
 tcp_process(struct TcpPcb* pcb)
 {
-    IpAddrInfo* curr_dst_addr = nullptr;
-    IpAddrInfo* curr_src_addr = nullptr;
     uint8_t acceptable = 0;
     LwipStatus err = STATUS_SUCCESS;
     lwip_assert("tcp_process: invalid pcb", pcb != nullptr);
@@ -723,9 +1129,13 @@ tcp_process(struct TcpPcb* pcb)
         Logf(true,
              "SYN-SENT: ackno %d pcb->snd_nxt %d unacked %d\n", ackno, pcb->snd_nxt,
                  lwip_ntohl(pcb->unacked->tcphdr->seqno));
-        /* received SYN ACK with expected sequence number? */
-        if ((flags & TCP_ACK) && (flags & TCP_SYN) && (ackno == pcb->lastack + 1))
+        /* received SYN ACK with expected sequence number? (with Fast Open,
+           it may acknowledge the data of the SYN as well) */
+        if ((flags & TCP_ACK) && (flags & TCP_SYN) && ((ackno == pcb->lastack + 1) ||
+            ((pcb->cold.tfo & TCP_TFO_SYN_DATA) &&
+                TCP_SEQ_BETWEEN(ackno, pcb->lastack + 1, pcb->snd_nxt))))
         {
+            const uint32_t syn_seqno = pcb->lastack;
             pcb->rcv_nxt = seqno + 1;
             pcb->rcv_ann_right_edge = pcb->rcv_nxt;
             pcb->lastack = ackno;
@@ -733,6 +1143,8 @@ tcp_process(struct TcpPcb* pcb)
             pcb->snd_wnd_max = pcb->snd_wnd;
             pcb->snd_wl1 = seqno - 1; /* initialise to seqno - 1 to force window update */
             pcb->state = ESTABLISHED;
+            /* a SYN-ACK agreeing to ECN has ECE but not CWR (RFC 3168) */
+            tcp_ecn_established(pcb, tcp_ecn_wanted(pcb->cc) && ecn_flags == TCP_ECE);
             pcb->mss = tcp_eff_send_mss(pcb->mss, &pcb->local_ip, &pcb->remote_ip);
             pcb->cwnd = lwip_tcp_calc_initial_cwnd(pcb->mss);
             Logf(true,
@@ -767,8 +1179,12 @@ tcp_process(struct TcpPcb* pcb)
             {
                 pcb->rtime = 0;
                 pcb->nrtx = 0;
-            } /* Call the user specified function to call when successfully
-         * connected. */
+            }
+            /* Queue what the SYN-ACK did not acknowledge of the data written
+               for Fast Open; what it did is reported as sent. */
+            recv_acked = TcpWndSize(tcp_fastopen_synack(pcb, syn_seqno, tfo_opt));
+            /* Call the user specified function to call when successfully
+             * connected. */
             TCP_EVENT_CONNECTED(pcb, STATUS_SUCCESS, err);
             if (err == ERR_ABRT)
             {
@@ -781,8 +1197,8 @@ tcp_process(struct TcpPcb* pcb)
             tcp_rst(pcb,
                     ackno,
                     seqno + tcplen,
-                    curr_dst_addr,
-                    curr_src_addr,
+                    &curr_dst_addr,
+                    &curr_src_addr,
                     tcphdr->dest,
                     tcphdr->src);
             /* Resend SYN immediately (don't wait for rto timeout) to establish
@@ -807,7 +1223,12 @@ tcp_process(struct TcpPcb* pcb)
                                                                                    .tcphdr
                                                                                    ->dest
                      );
-                if (pcb->listener == nullptr)
+                if (pcb->cold.tfo & TCP_TFO_ACCEPTED)
+                {
+                    /* accepted when its SYN arrived (tcp_listen_fastopen()) */
+                    tcp_fastopen_release(pcb);
+                }
+                else if (pcb->cold.listener == nullptr)
                 {
                     /* listen pcb might be closed by now */
                     err = ERR_VAL;
@@ -815,10 +1236,10 @@ tcp_process(struct TcpPcb* pcb)
                 else
 
                 {
-                    lwip_assert("pcb->listener->accept != NULL",
-                                pcb->listener->accept_fn != nullptr);
+                    lwip_assert("pcb->cold.listener->accept != NULL",
+                                pcb->cold.listener->accept_fn != nullptr);
                     tcp_backlog_accepted(pcb); /* Call the accept function. */
-                    TCP_EVENT_ACCEPT(pcb->listener, pcb, pcb->callback_arg, STATUS_SUCCESS, err);
+                    TCP_EVENT_ACCEPT(pcb->cold.listener, pcb, pcb->callback_arg, STATUS_SUCCESS, err);
                 }
                 if (err != STATUS_SUCCESS)
                 {
@@ -852,13 +1273,27 @@ tcp_process(struct TcpPcb* pcb)
                 tcp_rst(pcb,
                         ackno,
                         seqno + tcplen,
-                        curr_dst_addr,
-                        curr_src_addr,
+                        &curr_dst_addr,
+                        &curr_src_addr,
                         tcphdr->dest,
                         tcphdr->src);
             }
         }
-        else if ((flags & TCP_SYN) && (seqno == pcb->rcv_nxt - 1))
+        else if ((flags & TCP_SYN) && (pcb->cold.tfo & TCP_TFO_SYN_DATA))
+        {
+            /* The Fast Open SYN this pcb was created from: its data is in
+               sequence, pass it on like tcp_receive() would. The SYN-ACK
+               queued by tcp_listen_fastopen() acknowledges it. */
+            pcb->cold.tfo &= ~TCP_TFO_SYN_DATA;
+            pcb->rcv_nxt += tcplen - 1;
+            pcb->rcv_wnd -= tcplen - 1;
+            tcp_update_rcv_ann_wnd(pcb);
+            tcp_input_strip(inseg.p, inseg.len);
+            recv_data = inseg.p;
+            inseg.p = nullptr;
+        }
+        else if ((flags & TCP_SYN) && (seqno == pcb->rcv_nxt - 1 ||
+            ((pcb->cold.tfo & TCP_TFO_ACCEPTED) && tcp_seq_lt(seqno, pcb->rcv_nxt))))
         {
             /* Looks like another copy of the SYN - retransmit our SYN-ACK */
             tcp_rexmit(pcb);
@@ -945,45 +1380,6 @@ tcp_process(struct TcpPcb* pcb)
         break;
     }
     return STATUS_SUCCESS;
-} /**
- * Insert segment into the list (segments covered with new one will be deleted)
- *
- * Called from tcp_receive()
- */
- void
-tcp_oos_insert_segment(struct TcpSeg* cseg, struct TcpSeg* next)
-{
-    lwip_assert("tcp_oos_insert_segment: invalid cseg", cseg != nullptr);
-    if (tcph_flags(cseg->tcphdr) & TCP_FIN)
-    {
-        /* received segment overlaps all following segments */
-        tcp_segs_free(next);
-        next = nullptr;
-    }
-    else
-    {
-        /* delete some following segments
-           oos queue may have segments with FIN flag */
-        while (next && TCP_SEQ_GEQ((seqno + cseg->len), (next->tcphdr->seqno + next->len))
-        )
-        {
-            /* cseg with FIN already processed */
-            if (tcph_flags(next->tcphdr) & TCP_FIN)
-            {
-                TCPH_SET_FLAG(cseg->tcphdr, TCP_FIN);
-            }
-            struct TcpSeg* old_seg = next;
-            next = next->next;
-            tcp_seg_free(old_seg);
-        }
-        if (next && TCP_SEQ_GT(seqno + cseg->len, next->tcphdr->seqno))
-        {
-            /* We need to trim the incoming segment. */
-            cseg->len = (uint16_t)(next->tcphdr->seqno - seqno);
-            // pbuf_realloc(cseg->p);
-        }
-    }
-    cseg->next = next;
 } /** Remove segments from a list if the incoming ACK acknowledges them */
  struct TcpSeg*
 tcp_free_acked_segments(struct TcpPcb* pcb,
@@ -1008,6 +1404,11 @@ tcp_free_acked_segments(struct TcpPcb* pcb,
                     (pcb->snd_queuelen >= clen));
         pcb->snd_queuelen = (uint16_t)(pcb->snd_queuelen - clen);
         recv_acked = (TcpWndSize)(recv_acked + next->len);
+        if (next->zc != nullptr)
+        {
+            /* completion is reported once the last segment referencing it is freed */
+            next->zc->acked += next->len;
+        }
         tcp_seg_free(next);
         Logf(true,
              ("%d (after freeing %s)\n", pcb->snd_queuelen, dbg_list_name
@@ -1154,6 +1555,10 @@ tcp_receive(struct TcpPcb* pcb)
                     Logf(true,
                          "tcp_receive: congestion avoidance cwnd %d\n", pcb->cwnd);
                 }
+                if (pcb->ecn & TCP_ECN_OK)
+                {
+                    tcp_ecn_acked(pcb, acked, (ecn_flags & TCP_ECE) != 0);
+                }
             }
             Logf(true,
                  "tcp_receive: ACK for %d, unacked->seqno %d:%d\n",
@@ -1251,6 +1656,11 @@ tcp_receive(struct TcpPcb* pcb)
                      * TCP_SLOW_INTERVAL));
             pcb->rttest = 0;
         }
+    }
+    if (pcb->ecn & TCP_ECN_OK)
+    {
+        /* CE marks and CWR, before the data moves rcv_nxt */
+        tcp_ecn_input(pcb, ip_ecn, ecn_flags, (tcplen > 0) && (pcb->state < CLOSE_WAIT));
     } /* If the incoming segment contains data, we must process it
      further unless the pcb already received a FIN.
      (RFC 793, chapter 3.9, "SEGMENT ARRIVES" in states CLOSE-WAIT, CLOSING,
@@ -1358,19 +1768,19 @@ tcp_receive(struct TcpPcb* pcb)
                                        tcph_flags(inseg.tcphdr) & ~(unsigned int)TCP_FIN);
                     } /* Adjust length of segment to fit in the window. */
                     lwip_assert("window size > 0xFFFF", (pcb->rcv_wnd) <= 0xFFFF);
-                    inseg.len = (uint16_t)pcb->rcv_wnd;
+                    uint16_t len = (uint16_t)pcb->rcv_wnd;
                     if (tcph_flags(inseg.tcphdr) & TCP_SYN)
                     {
-                        inseg.len -= 1;
+                        len -= 1;
                     }
-                    // pbuf_realloc(inseg.p);
+                    tcp_inseg_trim_back(len);
                     tcplen = tcp_tcplen(&inseg);
                     lwip_assert("tcp_receive: segment not trimmed correctly to rcv_wnd\n",
                                 (seqno + tcplen) == (pcb->rcv_nxt + pcb->rcv_wnd));
                 } /* Received in-sequence data, adjust ooseq data if:
            - FIN has been received or
            - inseq overlaps with ooseq */
-                if (pcb->ooseq != nullptr)
+                if (!tcp_ooseq_empty(pcb->ooseq))
                 {
                     if (tcph_flags(inseg.tcphdr) & TCP_FIN)
                     {
@@ -1379,16 +1789,12 @@ tcp_receive(struct TcpPcb* pcb)
                              )); /* Received in-order FIN means anything that was received
              * out of order must now have been received in-order, so
              * bin the ooseq queue */
-                        while (pcb->ooseq != nullptr)
-                        {
-                            struct TcpSeg* old_ooseq = pcb->ooseq;
-                            pcb->ooseq = pcb->ooseq->next;
-                            tcp_seg_free(old_ooseq);
-                        }
+                        tcp_ooseq_free(pcb->ooseq);
+                        pcb->ooseq = nullptr;
                     }
                     else
                     {
-                        struct TcpSeg* next = pcb->ooseq;
+                        struct TcpSeg* next = tcp_ooseq_first(pcb->ooseq);
                         /* Remove all segments on ooseq that are covered by inseg already.
                                     * FIN is copied from ooseq to inseg if present. */
                         while (next && TCP_SEQ_GEQ(seqno + tcplen,
@@ -1401,32 +1807,31 @@ tcp_receive(struct TcpPcb* pcb)
                                 TCPH_SET_FLAG(inseg.tcphdr, TCP_FIN);
                                 tcplen = tcp_tcplen(&inseg);
                             }
-                            struct TcpSeg* tmp = next;
-                            next = next->next;
-                            tcp_seg_free(tmp);
+                            tcp_seg_free(tcp_ooseq_pop_front(pcb->ooseq));
+                            next = tcp_ooseq_first(pcb->ooseq);
                         } /* Now trim right side of inseg if it overlaps with the first
              * segment on ooseq */
                         if (next && TCP_SEQ_GT(seqno + tcplen, next->tcphdr->seqno))
                         {
                             /* inseg cannot have FIN here (already processed above) */
-                            inseg.len = (uint16_t)(next->tcphdr->seqno - seqno);
+                            uint16_t len = (uint16_t)(next->tcphdr->seqno - seqno);
                             if (tcph_flags(inseg.tcphdr) & TCP_SYN)
                             {
-                                inseg.len -= 1;
+                                len -= 1;
                             }
-                            // pbuf_realloc(inseg.p);
+                            tcp_inseg_trim_back(len);
                             tcplen = tcp_tcplen(&inseg);
                             lwip_assert(
                                 "tcp_receive: segment not trimmed correctly to ooseq queue\n",
                                 (seqno + tcplen) == next->tcphdr->seqno);
                         }
-                        pcb->ooseq = next;
                     }
                 }
                 pcb->rcv_nxt = seqno + tcplen; /* Update the receiver's (our) window. */
                 lwip_assert("tcp_receive: tcplen > rcv_wnd\n", pcb->rcv_wnd >= tcplen);
                 pcb->rcv_wnd -= tcplen;
                 tcp_update_rcv_ann_wnd(pcb);
+                tcp_rcvbuf_data(pcb);
                 /* If there is data in the segment, we make preparations to
                           pass this up to the application. The ->recv_data variable
                           is used for holding the PacketBuffer that goes to the
@@ -1438,6 +1843,7 @@ tcp_receive(struct TcpPcb* pcb)
                           closed its end of the connection. */
                 if (inseg.p->tot_len > 0)
                 {
+                    tcp_input_strip(inseg.p, inseg.len);
                     recv_data = inseg.p;
                     /* Since this PacketBuffer now is the responsibility of the
                                 application, we delete our reference to it so that we won't
@@ -1450,10 +1856,10 @@ tcp_receive(struct TcpPcb* pcb)
                     recv_flags |= TF_GOT_FIN;
                 } /* We now check if we have segments on the ->ooseq queue that
            are now in sequence. */
-                while (pcb->ooseq != nullptr && pcb->ooseq->tcphdr->seqno == pcb->rcv_nxt)
+                while (!tcp_ooseq_empty(pcb->ooseq) && tcp_ooseq_left(pcb->ooseq) == pcb->rcv_nxt)
                 {
-                    struct TcpSeg* cseg = pcb->ooseq;
-                    seqno = pcb->ooseq->tcphdr->seqno;
+                    struct TcpSeg* cseg = tcp_ooseq_pop_front(pcb->ooseq);
+                    seqno = cseg->tcphdr->seqno;
                     pcb->rcv_nxt += tcp_tcplen(cseg);
                     lwip_assert("tcp_receive: ooseq tcplen > rcv_wnd\n",
                                 pcb->rcv_wnd >= tcp_tcplen(cseg));
@@ -1466,9 +1872,13 @@ tcp_receive(struct TcpPcb* pcb)
                         /* With window scaling, this can overflow recv_data->tot_len, but
                                       that's not a problem since we explicitly fix that before passing
                                       recv_data to the application. */
+                        tcp_input_strip(cseg->p, cseg->len);
                         if (recv_data)
                         {
-                            // pbuf_cat(recv_data, cseg->p);
+                            recv_data->data.insert(recv_data->data.end(),
+                                                   cseg->p->data.begin(),
+                                                   cseg->p->data.end());
+                            free_pkt_buf(cseg->p);
                         }
                         else
                         {
@@ -1486,16 +1896,20 @@ tcp_receive(struct TcpPcb* pcb)
                             pcb->state = CLOSE_WAIT;
                         }
                     }
-                    pcb->ooseq = cseg->next;
                     tcp_seg_free(cseg);
                 }
+                if (tcp_ooseq_empty(pcb->ooseq))
+                {
+                    tcp_ooseq_free(pcb->ooseq);
+                    pcb->ooseq = nullptr;
+                }
                 if (pcb->flags & TF_SACK)
                 {
                     if (pcb->ooseq != nullptr)
                     {
                         /* Some segments may have been removed from ooseq, let's remove all SACKs that
-                           describe anything before the new beginning of that list. */
-                        tcp_remove_sacks_lt(pcb, pcb->ooseq->tcphdr->seqno);
+                           describe anything before the new beginning of that queue. */
+                        tcp_remove_sacks_lt(pcb, tcp_ooseq_left(pcb->ooseq));
                     }
                     else if (tcp_sack_valid(pcb, 0))
                     {
@@ -1509,8 +1923,16 @@ tcp_receive(struct TcpPcb* pcb)
                     /* Normally the ACK for the data received could be piggy-backed on a data packet,
                        but lwIP currently does not support including SACKs in data packets. So we force
                        it to respond with an empty ACK packet (only if there is at least one SACK to be sent).
-                       NOTE: tcp_send_empty_ack() on success clears the ACK flags (set by tcp_ack()) */
-                    tcp_send_empty_ack(pcb);
+                       NOTE: tcp_send_empty_ack() on success clears the ACK flags (set by tcp_ack()).
+                       In an input batch, the ACK is sent once the batch ends. */
+                    if (tcp_input_batching)
+                    {
+                        tcp_ack_now(pcb);
+                    }
+                    else
+                    {
+                        tcp_send_empty_ack(pcb);
+                    }
                 }
                 // if (ip_current_is_v6())
                 // {
@@ -1521,270 +1943,40 @@ tcp_receive(struct TcpPcb* pcb)
             else
             {
                 /* We get here if the incoming segment is out-of-sequence. */
-                /* We queue the segment on the ->ooseq queue. */
+                /* We queue the segment on the ->ooseq queue. The queue keeps
+                   merged sequence ranges ordered by their left edge, so the
+                   incoming segment is trimmed against the data already queued
+                   and linked into the range it touches without walking every
+                   queued segment. The range it ends up in is the most recent
+                   SACK block. */
                 if (pcb->ooseq == nullptr)
                 {
-                    pcb->ooseq = tcp_seg_copy(&inseg);
-                    if (pcb->flags & TF_SACK)
-                    {
-                        /* All the SACKs should be invalid, so we can simply store the most recent one: */
-                        pcb->rcv_sacks[0].left = seqno;
-                        pcb->rcv_sacks[0].right = seqno + inseg.len;
-                    }
+                    pcb->ooseq = tcp_ooseq_new();
                 }
-                else
+                TcpSackRange sack{};
+                if (tcp_ooseq_insert(pcb->ooseq, &inseg, pcb->rcv_nxt + pcb->rcv_wnd, &sack) ==
+                    STATUS_SUCCESS && (pcb->flags & TF_SACK))
                 {
-                    /* If the queue is not empty, we walk through the queue and
-                       try to find a place where the sequence number of the
-                       incoming segment is between the sequence numbers of the
-                       previous and the next segment on the ->ooseq queue. That is
-                       the place where we put the incoming segment. If needed, we
-                       trim the second edges of the previous and the incoming
-                       segment so that it will fit into the sequence.
-
-                       If the incoming segment has the same sequence number as a
-                       segment on the ->ooseq queue, we discard the segment that
-                       contains less data. */
-                    /* This is the left edge of the lowest possible SACK range.
-                                It may start before the newly received segment (possibly adjusted below). */
-                    uint32_t sackbeg = tcp_seq_lt(seqno, pcb->ooseq->tcphdr->seqno)
-                                           ? seqno
-                                           : pcb->ooseq->tcphdr->seqno;
-                    struct TcpSeg *next, *prev = nullptr;
-                    for (next = pcb->ooseq; next != nullptr; next = next->next)
-                    {
-                        if (seqno == next->tcphdr->seqno)
-                        {
-                            /* The sequence number of the incoming segment is the
-                               same as the sequence number of the segment on
-                               ->ooseq. We check the lengths to see which one to
-                               discard. */
-                            if (inseg.len > next->len)
-                            {
-                                /* The incoming segment is larger than the old
-                                   segment. We replace some segments with the new
-                                   one. */
-                                struct TcpSeg* cseg = tcp_seg_copy(&inseg);
-                                if (cseg != nullptr)
-                                {
-                                    if (prev != nullptr)
-                                    {
-                                        prev->next = cseg;
-                                    }
-                                    else
-                                    {
-                                        pcb->ooseq = cseg;
-                                    }
-                                    tcp_oos_insert_segment(cseg, next);
-                                }
-                                break;
-                            }
-                            else
-                            {
-                                /* Either the lengths are the same or the incoming
-                                   segment was smaller than the old one; in either
-                                   case, we ditch the incoming segment. */
-                                break;
-                            }
-                        }
-                        else
-                        {
-                            if (prev == nullptr)
-                            {
-                                if (tcp_seq_lt(seqno, next->tcphdr->seqno))
-                                {
-                                    /* The sequence number of the incoming segment is lower
-                                       than the sequence number of the first segment on the
-                                       queue. We put the incoming segment first on the
-                                       queue. */
-                                    struct TcpSeg* cseg = tcp_seg_copy(&inseg);
-                                    if (cseg != nullptr)
-                                    {
-                                        pcb->ooseq = cseg;
-                                        tcp_oos_insert_segment(cseg, next);
-                                    }
-                                    break;
-                                }
-                            }
-                            else
-                            {
-                                /*if (tcp_seq_lt(prev->tcphdr->seqno, seqno) &&
-                                  tcp_seq_lt(seqno, next->tcphdr->seqno)) {*/
-                                if (TCP_SEQ_BETWEEN(seqno,
-                                                    prev->tcphdr->seqno + 1,
-                                                    next->tcphdr->seqno - 1))
-                                {
-                                    /* The sequence number of the incoming segment is in
-                                       between the sequence numbers of the previous and
-                                       the next segment on ->ooseq. We trim trim the previous
-                                       segment, delete next segments that included in received segment
-                                       and trim received, if needed. */
-                                    struct TcpSeg* cseg = tcp_seg_copy(&inseg);
-                                    if (cseg != nullptr)
-                                    {
-                                        if (TCP_SEQ_GT(
-                                            prev->tcphdr->seqno + prev->len,
-                                            seqno))
-                                        {
-                                            /* We need to trim the prev segment. */
-                                            prev->len = (uint16_t)(seqno - prev
-                                                                           ->tcphdr->seqno
-                                            );
-                                            // pbuf_realloc(prev->p);
-                                        }
-                                        prev->next = cseg;
-                                        tcp_oos_insert_segment(cseg, next);
-                                    }
-                                    break;
-                                }
-                            } /* The new segment goes after the 'next' one. If there is a "hole" in sequence numbers
-                 between 'prev' and the beginning of 'next', we want to move sackbeg. */
-                            if (prev != nullptr && prev->tcphdr->seqno + prev->len != next
-                                                                                      ->
-                                                                                      tcphdr
-                                                                                      ->
-                                                                                      seqno
-                            )
-                            {
-                                sackbeg = next->tcphdr->seqno;
-                            } /* We don't use 'prev' below, so let's set it to current 'next'.
-                 This way even if we break the loop below, 'prev' will be pointing
-                 at the segment right in front of the newly added one. */
-                            prev = next;
-                            /* If the "next" segment is the last segment on the
-                                            ooseq queue, we add the incoming segment to the end
-                                            of the list. */
-                            if (next->next == nullptr && TCP_SEQ_GT(
-                                seqno,
-                                next->tcphdr->seqno))
-                            {
-                                if (tcph_flags(next->tcphdr) & TCP_FIN)
-                                {
-                                    /* segment "next" already contains all data */
-                                    break;
-                                }
-                                next->next = tcp_seg_copy(&inseg);
-                                if (next->next != nullptr)
-                                {
-                                    if (TCP_SEQ_GT(next->tcphdr->seqno + next->len, seqno)
-                                    )
-                                    {
-                                        /* We need to trim the last segment. */
-                                        next->len = (uint16_t)(seqno - next->tcphdr->seqno
-                                        );
-                                        // pbuf_realloc(next->p);
-                                    } /* check if the remote side overruns our receive window */
-                                    if (TCP_SEQ_GT((uint32_t)tcplen + seqno,
-                                                   pcb->rcv_nxt + (uint32_t)pcb->rcv_wnd))
-                                    {
-                                        Logf(true,
-                                             "tcp_receive: other end overran receive window"
-                                                 "seqno %d len %d right edge %d\n", seqno,
-                                                 tcplen, pcb->rcv_nxt + pcb->rcv_wnd);
-                                        if (tcph_flags(next->next->tcphdr) & TCP_FIN)
-                                        {
-                                            /* Must remove the FIN from the header as we're trimming
-                                             * that byte of sequence-space from the packet */
-                                            set_tcp_hdr_flags(
-                                                next->next->tcphdr,
-                                                tcph_flags(
-                                                    next->next->tcphdr) & ~TCP_FIN);
-                                        } /* Adjust length of segment to fit in the window. */
-                                        next->next->len = (uint16_t)(pcb->rcv_nxt + pcb->
-                                            rcv_wnd - seqno);
-                                        // pbuf_realloc(next->next->p);
-                                        tcplen = tcp_tcplen(next->next);
-                                        lwip_assert(
-                                            "tcp_receive: segment not trimmed correctly to rcv_wnd\n",
-                                            (seqno + tcplen) == (pcb->rcv_nxt + pcb->
-                                                rcv_wnd));
-                                    }
-                                }
-                                break;
-                            }
-                        }
-                    }
-                    if (pcb->flags & TF_SACK)
-                    {
-                        if (prev == nullptr)
-                        {
-                            /* The new segment is at the beginning. sackbeg should already be set properly.
-                               We need to find the right edge. */
-                            next = pcb->ooseq;
-                        }
-                        else if (prev->next != nullptr)
-                        {
-                            /* The new segment was added after 'prev'. If there is a "hole" between 'prev' and 'prev->next',
-                               we need to move sackbeg. After that we should find the right edge. */
-                            next = prev->next;
-                            if (prev->tcphdr->seqno + prev->len != next->tcphdr->seqno)
-                            {
-                                sackbeg = next->tcphdr->seqno;
-                            }
-                        }
-                        else
-                        {
-                            next = nullptr;
-                        }
-                        if (next != nullptr)
-                        {
-                            uint32_t sackend = next->tcphdr->seqno;
-                            for (; (next != nullptr) && (sackend == next->tcphdr->seqno);
-                                   next = next->next)
-                            {
-                                sackend += next->len;
-                            }
-                            tcp_add_sack(pcb, sackbeg, sackend);
-                        }
-                    }
+                    tcp_add_sack(pcb, sack.left, sack.right);
                 }
+                if (tcp_ooseq_empty(pcb->ooseq))
                 {
-                    /* Check that the data on ooseq doesn't exceed one of the limits
-                       and throw away everything above that limit. */
-                    // const uint32_t ooseq_max_blen = TCP_OOSEQ_BYTES_LIMIT(pcb);
-                    uint32_t ooseq_blen = 0;
-                    // const uint16_t ooseq_max_qlen = TCP_OOSEQ_PBUFS_LIMIT(pcb);
-                    uint16_t ooseq_qlen = 0;
-                    struct TcpSeg* prev = nullptr;
-                    for (struct TcpSeg* next = pcb->ooseq; next != nullptr; prev = next,
-                         next = next->next)
-                    {
-                        struct PacketBuffer* p = next->p;
-                        int stop_here = 0;
-                        ooseq_blen += p->tot_len;
-                        // if (ooseq_blen > ooseq_max_blen)
-                        // {
-                        //     stop_here = 1;
-                        // }
-                        // ooseq_qlen += pbuf_clen(p);
-                        // if (ooseq_qlen > ooseq_max_qlen)
-                        // {
-                        //     stop_here = 1;
-                        // }
-                        if (stop_here)
-                        {
-                            if (pcb->flags & TF_SACK)
-                            {
-                                /* Let's remove all SACKs from next's seqno up. */
-                                tcp_remove_sacks_gt(pcb, next->tcphdr->seqno);
-                            } /* too much ooseq data, dump this and everything after it */
-                            tcp_segs_free(next);
-                            if (prev == nullptr)
-                            {
-                                /* first ooseq segment is too much, dump the whole queue */
-                                pcb->ooseq = nullptr;
-                            }
-                            else
-                            {
-                                /* just dump 'next' and everything after it */
-                                prev->next = nullptr;
-                            }
-                            break;
-                        }
-                    }
-                } /* We send the ACK packet after we've (potentially) dealt with SACKs,
-           so they can be included in the acknowledgment. */
-                tcp_send_empty_ack(pcb);
+                    tcp_free_ooseq(pcb);
+                }
+                /* Check that the data on ooseq doesn't exceed one of the limits
+                   and throw away everything above that limit. */
+                tcp_free_ooseq_excess(pcb);
+                /* We send the ACK packet after we've (potentially) dealt with SACKs,
+                   so they can be included in the acknowledgment (at the end of
+                   tcp_input(), or of the input batch). */
+                if (tcp_input_batching)
+                {
+                    tcp_ack_now(pcb);
+                }
+                else
+                {
+                    tcp_send_empty_ack(pcb);
+                }
             }
         }
         else
@@ -1818,10 +2010,39 @@ tcp_get_next_optbyte(void)
         uint8_t idx = (uint8_t)(optidx - tcphdr_opt1_len);
         return tcphdr_opt2[idx];
     }
-} /**
+}
+
+/* Parse a Fast Open option into tfo_opt, the kind byte is already read.
+   Only SYNs and SYN-ACKs carry one. Returns false on a bad length. */
+static bool
+tcp_parseopt_fastopen(void)
+{
+    const uint8_t len = tcp_get_next_optbyte();
+    if (len < 2 || (tcp_optidx - 2 + len) > tcphdr_optlen)
+    {
+        return false;
+    }
+    const uint8_t cookie_len = uint8_t(len - 2);
+    if (!(flags & TCP_SYN) || cookie_len > sizeof(tfo_opt.cookie) ||
+        (cookie_len != 0 && cookie_len < TCP_FASTOPEN_COOKIE_MIN))
+    {
+        tcp_optidx += cookie_len;
+        return true;
+    }
+    tfo_opt.present = true;
+    tfo_opt.len = cookie_len;
+    for (uint8_t i = 0; i < cookie_len; i++)
+    {
+        tfo_opt.cookie[i] = tcp_get_next_optbyte();
+    }
+    return true;
+}
+
+/**
  * Parses the options contained in the incoming segment.
  *
- * Called from tcp_listen_input() and tcp_process().
+ * Called from tcp_process(); SYNs to listeners are parsed by
+ * tcp_parseopt_syn().
  * Currently, only the MSS option is supported!
  *
  * @param pcb the TcpProtoCtrlBlk for which a segment arrived
@@ -1875,20 +2096,7 @@ tcp_parseopt(struct TcpPcb* pcb)
                             activate wnd scale opt, but only if this is not a retransmission */
                 if ((flags & TCP_SYN) && !(pcb->flags & TF_WND_SCALE))
                 {
-                    pcb->snd_scale = data;
-                    if (pcb->snd_scale > 14U)
-                    {
-                        pcb->snd_scale = 14U;
-                    }
-                    // fixme
-                    pcb->rcv_scale = 0xff;
-                    tcp_set_flags(pcb, TF_WND_SCALE);
-                    /* window scaling is enabled, we can use the full receive window */
-                    lwip_assert("window not at default value",
-                                pcb->rcv_wnd == TCPWND_MIN16(TCP_WND));
-                    lwip_assert("window not at default value",
-                                pcb->rcv_ann_wnd == TCPWND_MIN16(TCP_WND));
-                    pcb->rcv_wnd = pcb->rcv_ann_wnd = TCP_WND;
+                    tcp_enable_wnd_scale(pcb, data);
                 }
                 break;
             case LWIP_TCP_OPT_TS:
@@ -1932,6 +2140,15 @@ tcp_parseopt(struct TcpPcb* pcb)
                     tcp_set_flags(pcb, TF_SACK);
                 }
                 break;
+            case LWIP_TCP_OPT_TFO:
+                Logf(true, ("tcp_parseopt: TFO\n"));
+                if (!tcp_parseopt_fastopen())
+                {
+                    /* Bad length */
+                    Logf(true, ("tcp_parseopt: bad length\n"));
+                    return;
+                }
+                break;
             default:
                 Logf(true, ("tcp_parseopt: other\n"));
                 data = tcp_get_next_optbyte();
@@ -1949,6 +2166,152 @@ tcp_parseopt(struct TcpPcb* pcb)
     }
 }
 
+/**
+ * Parses the options of a SYN received by a listener into the connection
+ * request, like tcp_parseopt() does for a pcb.
+ *
+ * @param req the request for which the SYN arrived
+ */
+static void
+tcp_parseopt_syn(TcpSynReq& req)
+{
+    for (tcp_optidx = 0; tcp_optidx < tcphdr_optlen;)
+    {
+        uint8_t opt = tcp_get_next_optbyte();
+        switch (opt)
+        {
+        case LWIP_TCP_OPT_EOL:
+            return;
+        case LWIP_TCP_OPT_NOP:
+            break;
+        case LWIP_TCP_OPT_MSS:
+        {
+            if (tcp_get_next_optbyte() != LWIP_TCP_OPT_LEN_MSS || (tcp_optidx - 2 +
+                LWIP_TCP_OPT_LEN_MSS) > tcphdr_optlen)
+            {
+                Logf(true, ("tcp_parseopt_syn: bad length\n"));
+                return;
+            }
+            uint16_t mss = uint16_t(tcp_get_next_optbyte() << 8);
+            mss |= tcp_get_next_optbyte();
+            /* Limit the mss to the configured TCP_MSS and prevent division by zero */
+            req.mss = ((mss > TCP_MSS) || (mss == 0)) ? TCP_MSS : mss;
+            break;
+        }
+        case LWIP_TCP_OPT_WS:
+            if (tcp_get_next_optbyte() != LWIP_TCP_OPT_LEN_WS || (tcp_optidx - 2 +
+                LWIP_TCP_OPT_LEN_WS) > tcphdr_optlen)
+            {
+                Logf(true, ("tcp_parseopt_syn: bad length\n"));
+                return;
+            }
+            req.snd_scale = std::min(tcp_get_next_optbyte(), uint8_t(14U));
+            req.flags |= TCP_SYNQ_FLAG_WND_SCALE;
+            break;
+        case LWIP_TCP_OPT_TS:
+        {
+            if (tcp_get_next_optbyte() != LWIP_TCP_OPT_LEN_TS || (tcp_optidx - 2 +
+                LWIP_TCP_OPT_LEN_TS) > tcphdr_optlen)
+            {
+                Logf(true, ("tcp_parseopt_syn: bad length\n"));
+                return;
+            }
+            uint32_t tsval = tcp_get_next_optbyte();
+            tsval |= (tcp_get_next_optbyte() << 8);
+            tsval |= (tcp_get_next_optbyte() << 16);
+            tsval |= (tcp_get_next_optbyte() << 24);
+            req.ts_recent = lwip_ntohl(tsval);
+            req.flags |= TCP_SYNQ_FLAG_TIMESTAMP;
+            /* Advance to next option (6 bytes already read) */
+            tcp_optidx += LWIP_TCP_OPT_LEN_TS - 6;
+            break;
+        }
+        case LWIP_TCP_OPT_SACK_PERM:
+            if (tcp_get_next_optbyte() != LWIP_TCP_OPT_LEN_SACK_PERM || (tcp_optidx - 2 +
+                LWIP_TCP_OPT_LEN_SACK_PERM) > tcphdr_optlen)
+            {
+                Logf(true, ("tcp_parseopt_syn: bad length\n"));
+                return;
+            }
+            req.flags |= TCP_SYNQ_FLAG_SACK;
+            break;
+        case LWIP_TCP_OPT_TFO:
+            if (!tcp_parseopt_fastopen())
+            {
+                Logf(true, ("tcp_parseopt_syn: bad length\n"));
+                return;
+            }
+            break;
+        default:
+        {
+            const uint8_t len = tcp_get_next_optbyte();
+            if (len < 2)
+            {
+                /* If the length field is zero, the options are malformed
+                   and we don't process them further. */
+                Logf(true, ("tcp_parseopt_syn: bad length\n"));
+                return;
+            }
+            tcp_optidx += len - 2;
+        }
+        }
+    }
+}
+
+/**
+ * Parses the timestamp option of a segment that arrived for a TIME-WAIT
+ * record and updates ts_recent the way tcp_parseopt() does for a pcb, so
+ * the ACKs sent from the record echo the peer's latest timestamp. The last
+ * ACK sent from the record acknowledged rcv_nxt.
+ *
+ * @param tw the TIME-WAIT record for which the segment arrived
+ */
+static void
+tcp_parseopt_timewait(TcpTwRecord* tw)
+{
+    for (tcp_optidx = 0; tcp_optidx < tcphdr_optlen;)
+    {
+        uint8_t opt = tcp_get_next_optbyte();
+        switch (opt)
+        {
+        case LWIP_TCP_OPT_EOL:
+            return;
+        case LWIP_TCP_OPT_NOP:
+            break;
+        case LWIP_TCP_OPT_TS:
+        {
+            if (tcp_get_next_optbyte() != LWIP_TCP_OPT_LEN_TS || (tcp_optidx - 2 +
+                LWIP_TCP_OPT_LEN_TS) > tcphdr_optlen)
+            {
+                Logf(true, ("tcp_parseopt_timewait: bad length\n"));
+                return;
+            }
+            uint32_t tsval = tcp_get_next_optbyte();
+            tsval |= (tcp_get_next_optbyte() << 8);
+            tsval |= (tcp_get_next_optbyte() << 16);
+            tsval |= (tcp_get_next_optbyte() << 24);
+            if (TCP_SEQ_BETWEEN(tw->rcv_nxt, seqno, seqno + tcplen))
+            {
+                tw->ts_recent = lwip_ntohl(tsval);
+            }
+            return;
+        }
+        default:
+        {
+            const uint8_t len = tcp_get_next_optbyte();
+            if (len < 2)
+            {
+                /* If the length field is zero, the options are malformed
+                   and we don't process them further. */
+                Logf(true, ("tcp_parseopt_timewait: bad length\n"));
+                return;
+            }
+            tcp_optidx += len - 2;
+        }
+        }
+    }
+}
+
 void
 tcp_trigger_input_pcb_close(void)
 {
@@ -1,5 +1,5 @@
 #pragma once
-void
+struct TcpPcb*
 tcp_listen_input(struct TcpPcbListen* pcb);
 /// Initial CWND calculation as defined RFC 2581
 inline TcpWndSize
@@ -15,7 +15,7 @@ tcp_receive(struct TcpPcb* pcb);
 void
 tcp_parseopt(struct TcpPcb* pcb);
 void
-tcp_timewait_input(struct TcpPcb* pcb);
+tcp_timewait_input(struct TcpTwRecord* tw);
 int
 tcp_input_delayed_close(struct TcpPcb* pcb);
 void
@@ -0,0 +1,376 @@
+///
+/// file: tcp_ooseq.cpp
+///
+/// Ordered interval queue for out-of-sequence TCP segments, see tcp_ooseq.h.
+///
+
+#include <lwip_debug.h>
+#include <tcp_ooseq.h>
+#include <tcp_priv.h>
+
+
+///
+/// Free all segments of a range.
+///
+static void
+tcp_ooseq_free_range(TcpOoseq* q, TcpOoseqRangeMap::iterator it)
+{
+    q->bytes -= it->second.bytes;
+    q->pbufs -= it->second.pbufs;
+    tcp_segs_free(it->second.head);
+}
+
+///
+/// Trim off the first 'off' bytes of a queued segment: the payload, the last
+/// seg->len bytes of its buffer, loses its first 'off' bytes and the sequence
+/// number moves past them.
+///
+static void
+tcp_ooseq_trim_front(TcpSeg* seg, const uint32_t off)
+{
+    lwip_assert("tcp_ooseq_trim_front: insane offset", off <= seg->len);
+    std::vector<uint8_t>& data = seg->p->data;
+    lwip_assert("tcp_ooseq_trim_front: payload not in buffer", data.size() >= seg->len);
+    const auto payload = data.end() - seg->len;
+    data.erase(payload, payload + off);
+    seg->len = uint16_t(seg->len - off);
+    seg->tcphdr->seqno += off;
+}
+
+///
+/// Trim a queued segment so that it ends at 'right', dropping the end of its
+/// payload from the buffer.
+///
+static void
+tcp_ooseq_trim_back(TcpSeg* seg, const uint32_t right)
+{
+    const auto len = uint16_t(right - seg->tcphdr->seqno);
+    lwip_assert("tcp_ooseq_trim_back: insane length", len <= seg->len);
+    std::vector<uint8_t>& data = seg->p->data;
+    lwip_assert("tcp_ooseq_trim_back: payload not in buffer", data.size() >= seg->len);
+    data.resize(data.size() - (seg->len - len));
+    seg->len = len;
+}
+
+///
+/// Allocate an empty out-of-sequence queue.
+///
+TcpOoseq*
+tcp_ooseq_new()
+{
+    const auto q = new TcpOoseq;
+    q->bytes = 0;
+    q->pbufs = 0;
+    return q;
+}
+
+///
+/// Free an out-of-sequence queue together with all segments on it.
+///
+void
+tcp_ooseq_free(TcpOoseq* q)
+{
+    if (q == nullptr)
+    {
+        return;
+    }
+    for (auto it = q->ranges.begin(); it != q->ranges.end(); ++it)
+    {
+        tcp_segs_free(it->second.head);
+    }
+    delete q;
+}
+
+///
+/// Unlink and return the lowest queued segment. Used by tcp_receive() once
+/// rcv_nxt has reached the left edge of the queue.
+///
+TcpSeg*
+tcp_ooseq_pop_front(TcpOoseq* q)
+{
+    if (tcp_ooseq_empty(q))
+    {
+        return nullptr;
+    }
+    const auto it = q->ranges.begin();
+    TcpSeg* seg = it->second.head;
+    it->second.head = seg->next;
+    it->second.bytes -= seg->len;
+    it->second.pbufs--;
+    q->bytes -= seg->len;
+    q->pbufs--;
+    seg->next = nullptr;
+    if (it->second.head == nullptr)
+    {
+        q->ranges.erase(it);
+    }
+    else
+    {
+        /* the range now starts at its next segment: re-key it in place */
+        auto node = q->ranges.extract(it);
+        node.key() = node.mapped().head->tcphdr->seqno;
+        q->ranges.insert(q->ranges.begin(), std::move(node));
+    }
+    return seg;
+}
+
+///
+/// Queue a copy of an out-of-sequence segment.
+///
+/// Data already on the queue is kept: the new segment is trimmed on the left
+/// against the range it starts in and on the right against the next range,
+/// and queued ranges it covers completely are replaced by it. A FIN on the new
+/// segment bins everything above it. The segment is then linked into the range
+/// it touches, merging the neighbouring ranges where the hole between them is
+/// closed.
+///
+/// @param q the queue
+/// @param inseg the segment to queue (copied with tcp_seg_copy())
+/// @param wnd_right_edge rcv_nxt + rcv_wnd; data beyond it is trimmed off
+/// @param sack filled with the merged range now containing the segment
+/// @return STATUS_SUCCESS if the segment was queued, ERR_ALREADY if it carried
+///         nothing new, ERR_MEM if it could not be copied
+///
+LwipStatus
+tcp_ooseq_insert(TcpOoseq* q,
+                 TcpSeg* inseg,
+                 const uint32_t wnd_right_edge,
+                 TcpSackRange* sack)
+{
+    lwip_assert("tcp_ooseq_insert: invalid queue", q != nullptr);
+    lwip_assert("tcp_ooseq_insert: invalid inseg", inseg != nullptr);
+    uint32_t left = inseg->tcphdr->seqno;
+    uint32_t right = left + inseg->len;
+    bool fin = (tcph_flags(inseg->tcphdr) & TCP_FIN) != 0;
+    if (!q->ranges.empty())
+    {
+        /* the highest range already ends with a FIN: it holds all data there is */
+        const auto last = std::prev(q->ranges.end());
+        if ((tcph_flags(last->second.tail->tcphdr) & TCP_FIN) && TCP_SEQ_GEQ(
+            left,
+            last->second.right))
+        {
+            return ERR_ALREADY;
+        }
+    }
+    auto prev = q->ranges.end();
+    uint32_t front_off = 0;
+    auto it = q->ranges.upper_bound(left);
+    if (it != q->ranges.begin())
+    {
+        prev = std::prev(it);
+        if (TCP_SEQ_LEQ(right, prev->second.right) && !(fin && right == prev->second.
+            right))
+        {
+            /* completely covered by queued data */
+            return ERR_ALREADY;
+        }
+        if (tcp_seq_lt(left, prev->second.right))
+        {
+            front_off = prev->second.right - left;
+            left = prev->second.right;
+        }
+        if (left != prev->second.right)
+        {
+            /* there is a hole between prev and the new data */
+            prev = q->ranges.end();
+        }
+    }
+    TcpSeg* cseg = tcp_seg_copy(inseg);
+    if (cseg == nullptr)
+    {
+        return ERR_MEM;
+    }
+    cseg->next = nullptr;
+    if (front_off != 0)
+    {
+        tcp_ooseq_trim_front(cseg, front_off);
+    }
+    /* check if the remote side overruns our receive window */
+    if (TCP_SEQ_GT(right + (fin ? 1 : 0), wnd_right_edge))
+    {
+        Logf(true,
+             "tcp_ooseq_insert: other end overran receive window seqno %d len %d right edge %d\n",
+             left,
+             cseg->len,
+             wnd_right_edge);
+        if (fin)
+        {
+            /* Must remove the FIN from the header as we're trimming
+             * that byte of sequence-space from the packet */
+            set_tcp_hdr_flags(cseg->tcphdr, tcph_flags(cseg->tcphdr) & ~TCP_FIN);
+            fin = false;
+        }
+        if (TCP_SEQ_GT(right, wnd_right_edge))
+        {
+            right = wnd_right_edge;
+            tcp_ooseq_trim_back(cseg, right);
+        }
+        if (cseg->len == 0)
+        {
+            tcp_seg_free(cseg);
+            return ERR_ALREADY;
+        }
+    }
+    /* delete the ranges covered by the new segment; a FIN covers everything above */
+    it = q->ranges.lower_bound(left);
+    while (it != q->ranges.end() && (fin || TCP_SEQ_GEQ(right, it->second.right)))
+    {
+        if (tcph_flags(it->second.tail->tcphdr) & TCP_FIN)
+        {
+            /* the covered range ended with a FIN, keep it */
+            TCPH_SET_FLAG(cseg->tcphdr, TCP_FIN);
+            fin = true;
+        }
+        tcp_ooseq_free_range(q, it);
+        it = q->ranges.erase(it);
+    }
+    if (it != q->ranges.end() && TCP_SEQ_GT(right, it->first))
+    {
+        /* We need to trim the incoming segment. */
+        right = it->first;
+        tcp_ooseq_trim_back(cseg, right);
+    }
+    const bool merge_next = !fin && it != q->ranges.end() && it->first == right;
+    q->bytes += cseg->len;
+    q->pbufs++;
+    TcpOoseqRangeMap::iterator range;
+    if (prev != q->ranges.end())
+    {
+        /* the new segment closes the gap after prev */
+        range = prev;
+        range->second.tail->next = cseg;
+        range->second.tail = cseg;
+        range->second.right = right;
+        range->second.bytes += cseg->len;
+        range->second.pbufs++;
+    }
+    else
+    {
+        range = q->ranges.emplace_hint(it,
+                                       left,
+                                       TcpOoseqRange{right, cseg, cseg, cseg->len, 1});
+    }
+    if (merge_next)
+    {
+        range->second.tail->next = it->second.head;
+        range->second.tail = it->second.tail;
+        range->second.right = it->second.right;
+        range->second.bytes += it->second.bytes;
+        range->second.pbufs += it->second.pbufs;
+        q->ranges.erase(it);
+    }
+    if (sack != nullptr)
+    {
+        sack->left = range->first;
+        sack->right = range->second.right;
+    }
+    return STATUS_SUCCESS;
+}
+
+///
+/// Enforce a memory cap on the queue by throwing away the highest queued data
+/// (it is the furthest away from being delivered) until both limits hold.
+///
+/// @param max_bytes limit on queued payload bytes, 0 for no limit
+/// @param max_pbufs limit on queued buffers, 0 for no limit
+/// @param cut_seq set to the lowest discarded sequence number
+/// @return true if anything was discarded
+///
+bool
+tcp_ooseq_trim_to_limit(TcpOoseq* q,
+                        const size_t max_bytes,
+                        const size_t max_pbufs,
+                        uint32_t* cut_seq)
+{
+    bool trimmed = false;
+    while (!tcp_ooseq_empty(q) && ((max_bytes != 0 && q->bytes > max_bytes) || (
+        max_pbufs != 0 && q->pbufs > max_pbufs)))
+    {
+        const auto last = std::prev(q->ranges.end());
+        size_t bytes = q->bytes - last->second.bytes;
+        size_t pbufs = q->pbufs - last->second.pbufs;
+        TcpSeg* seg = last->second.head;
+        const auto fits = [&](const TcpSeg* s)
+        {
+            return (max_bytes == 0 || bytes + s->len <= max_bytes) && (max_pbufs == 0 ||
+                pbufs + 1 <= max_pbufs);
+        };
+        trimmed = true;
+        if (!fits(seg))
+        {
+            /* even the first segment of this range is over the limit: dump it all */
+            *cut_seq = last->first;
+            tcp_ooseq_free_range(q, last);
+            q->ranges.erase(last);
+            continue;
+        }
+        /* keep the head of this range up to the limit, dump the rest of it */
+        bytes += seg->len;
+        pbufs++;
+        while (seg->next != nullptr && fits(seg->next))
+        {
+            seg = seg->next;
+            bytes += seg->len;
+            pbufs++;
+        }
+        lwip_assert("tcp_ooseq_trim_to_limit: range within limit", seg->next != nullptr);
+        TcpSeg* next = seg->next;
+        *cut_seq = next->tcphdr->seqno;
+        seg->next = nullptr;
+        last->second.tail = seg;
+        last->second.right = seg->tcphdr->seqno + seg->len;
+        last->second.bytes -= q->bytes - bytes;
+        last->second.pbufs -= q->pbufs - pbufs;
+        q->bytes = bytes;
+        q->pbufs = pbufs;
+        tcp_segs_free(next);
+    }
+    return trimmed;
+}
+
+///
+/// Generate SACK blocks (RFC 2018) straight from the queued ranges: the range
+/// containing the most recently received sequence number comes first, the
+/// remaining ranges follow from the lowest upwards.
+///
+/// @return the number of blocks written
+///
+size_t
+tcp_ooseq_sack_blocks(const TcpOoseq* q,
+                      const uint32_t recent,
+                      TcpSackRange* blocks,
+                      const size_t max_blocks)
+{
+    if (tcp_ooseq_empty(q) || max_blocks == 0)
+    {
+        return 0;
+    }
+    size_t count = 0;
+    auto first = q->ranges.upper_bound(recent);
+    if (first != q->ranges.begin())
+    {
+        --first;
+        if (tcp_seq_lt(recent, first->second.right))
+        {
+            blocks[count].left = first->first;
+            blocks[count].right = first->second.right;
+            count++;
+        }
+    }
+    for (auto it = q->ranges.begin(); it != q->ranges.end() && count < max_blocks; ++it)
+    {
+        if (count > 0 && it->first == blocks[0].left)
+        {
+            continue;
+        }
+        blocks[count].left = it->first;
+        blocks[count].right = it->second.right;
+        count++;
+    }
+    return count;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,104 @@
+///
+/// file: tcp_ooseq.h
+///
+/// Out-of-sequence receive queue for TCP. Segments that arrive above rcv_nxt
+/// are kept in an ordered map of contiguous sequence ranges, keyed by the left
+/// edge of each range. Adjacent ranges are merged on insert, so each map entry
+/// is exactly one SACK block and insertion, lookup and SACK generation cost
+/// O(log n) in the number of holes instead of a walk over every queued segment.
+///
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <lwip_status.h>
+#include <map>
+
+struct TcpSeg;
+struct TcpSackRange;
+
+/// Strict weak ordering of sequence numbers for keys that all lie within one
+/// receive window (i.e. less than 2^31 apart).
+struct TcpSeqLess
+{
+    bool operator()(const uint32_t a, const uint32_t b) const
+    {
+        return int32_t(a - b) < 0;
+    }
+};
+
+/// A run of queued segments covering [left, right) without holes. The left
+/// edge is the map key. FIN is only ever carried by the tail segment of the
+/// highest range and is not counted in right.
+struct TcpOoseqRange
+{
+    uint32_t right;
+    TcpSeg* head;
+    TcpSeg* tail;
+    size_t bytes;
+    size_t pbufs;
+};
+
+using TcpOoseqRangeMap = std::map<uint32_t, TcpOoseqRange, TcpSeqLess>;
+
+/// The out-of-sequence queue of one TcpPcb.
+struct TcpOoseq
+{
+    TcpOoseqRangeMap ranges;
+    /// Payload bytes held by all queued segments.
+    size_t bytes;
+    /// Number of queued segments (one PacketBuffer each).
+    size_t pbufs;
+};
+
+TcpOoseq*
+tcp_ooseq_new();
+
+void
+tcp_ooseq_free(TcpOoseq* q);
+
+inline bool
+tcp_ooseq_empty(const TcpOoseq* q)
+{
+    return q == nullptr || q->ranges.empty();
+}
+
+/// Lowest sequence number held on the queue. The queue must not be empty.
+inline uint32_t
+tcp_ooseq_left(const TcpOoseq* q)
+{
+    return q->ranges.begin()->first;
+}
+
+/// Lowest queued segment, or nullptr if the queue is empty.
+inline TcpSeg*
+tcp_ooseq_first(const TcpOoseq* q)
+{
+    return tcp_ooseq_empty(q) ? nullptr : q->ranges.begin()->second.head;
+}
+
+TcpSeg*
+tcp_ooseq_pop_front(TcpOoseq* q);
+
+LwipStatus
+tcp_ooseq_insert(TcpOoseq* q,
+                 TcpSeg* inseg,
+                 uint32_t wnd_right_edge,
+                 TcpSackRange* sack);
+
+bool
+tcp_ooseq_trim_to_limit(TcpOoseq* q,
+                        size_t max_bytes,
+                        size_t max_pbufs,
+                        uint32_t* cut_seq);
+
+size_t
+tcp_ooseq_sack_blocks(const TcpOoseq* q,
+                      uint32_t recent,
+                      TcpSackRange* blocks,
+                      size_t max_blocks);
+
+//
+// END OF FILE
+//
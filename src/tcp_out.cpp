@@ -61,16 +61,22 @@
  */
 
 #include <cstring>
+#include <new>
 #include <def.h>
 #include <inet_chksum.h>
 #include <ip6.h>
 #include <ip6_addr.h>
 #include <ip_addr.h>
+#include <ip_ecmp.h>
 #include <lwip_debug.h>
 #include <network_interface.h>
 #include <opt.h>
 #include <sys.h>
+#include <tcp_ecn.h>
+#include <tcp_fastopen.h>
 #include <tcp_priv.h>
+#include <tcp_synq.h>
+#include <tcp_timewait.h>
 
 
 /* Allow to add custom TCP header options by defining this hook */
@@ -129,10 +135,30 @@ tcp_route(const struct TcpPcb *pcb, const IpAddrInfo *src, const IpAddrInfo *dst
     if ((pcb != nullptr) && (pcb->netif_idx != NETIF_NO_INDEX)) {
     // return get_netif_by_index(pcb->netif_idx);
   } else {
-    return ip_route(src, dst,);
+    /* multipath routes keep all segments of a connection on one path */
+    const uint32_t flow_hash =
+        pcb != nullptr ? ip_ecmp_hash(*src, *dst, IP_PROTO_TCP, pcb->local_port, pcb->remote_port) : 0;
+    return ip_route(src, dst,, flow_hash);
   }
 }
 
+/* tcp_route for the segments of pcb to remote_ip, through its route cache */
+static NetworkInterface*
+tcp_route_cached(struct TcpPcb *pcb)
+{
+  if (pcb->netif_idx != NETIF_NO_INDEX) {
+    return tcp_route(pcb, &pcb->local_ip, &pcb->remote_ip);
+  }
+  if (dst_cache_valid(pcb->dst_cache, pcb->remote_ip)) {
+    return pcb->dst_cache.netif;
+  }
+  NetworkInterface* netif = tcp_route(pcb, &pcb->local_ip, &pcb->remote_ip);
+  if (netif != nullptr) {
+    dst_cache_fill(pcb->dst_cache, pcb->remote_ip, netif);
+  }
+  return netif;
+}
+
 /**
  * Create a TCP segment with prefilled header.
  *
@@ -168,6 +194,7 @@ tcp_create_segment(const struct TcpPcb* pcb,
     seg->flags = optflags;
     seg->next = nullptr;
     seg->p = p;
+    seg->zc = nullptr;
     lwip_assert("p->tot_len >= optlen", p->tot_len >= optlen);
     seg->len = p->tot_len - optlen;
     // seg->oversize_left = 0;
@@ -391,6 +418,11 @@ tcp_write(struct TcpPcb* pcb, const void* arg, size_t len, uint8_t apiflags)
          arg,
          len,
          (uint16_t)apiflags);
+    if ((pcb->cold.tfo & TCP_TFO_CLIENT) && (pcb->state == CLOSED || pcb->state == SYN_SENT))
+    {
+        /* Fast Open: keep the data for the SYN until the handshake is done */
+        return tcp_fastopen_write(pcb, arg, len);
+    }
     LwipStatus err = tcp_write_checks(pcb, len);
     if (err != STATUS_SUCCESS)
     {
@@ -468,14 +500,15 @@ tcp_write(struct TcpPcb* pcb, const void* arg, size_t len, uint8_t apiflags)
      * ROM PacketBuffer reference to the buffer, thus saving a ROM PacketBuffer allocation.
      *
      * We don't extend segments containing SYN/FIN flags or options
-     * (len==0). The new PacketBuffer is kept in concat_p and pbuf_cat'ed at
+     * (len==0), nor zero-copy segments from tcp_write_zc (they reference
+     * exactly one application buffer). The new PacketBuffer is kept in concat_p and pbuf_cat'ed at
      * the end.
      *
      * This phase is skipped for LWIP_NETIF_TX_SINGLE_PBUF as we could only execute
      * it after rexmit puts a segment from unacked to unsent and at this point,
      * oversize info is lost.
      */
-        if ((pos < len) && (space > 0) && (last_unsent->len > 0))
+        if ((pos < len) && (space > 0) && (last_unsent->len > 0) && (last_unsent->zc == nullptr))
         {
             uint16_t seglen = std::min(space, len - pos);
             seg = last_unsent;
@@ -769,6 +802,161 @@ memerr: tcp_set_flags(pcb, TF_NAGLEMEMERR);
     return ERR_MEM;
 }
 
+/**
+ * @ingroup tcp_raw
+ * Enqueue a zero-copy buffer for sending (MSG_ZEROCOPY style).
+ *
+ * Works like @ref tcp_write without TCP_WRITE_FLAG_COPY, except that every
+ * segment created references 'buf' and holds a reference on it. The buffer's
+ * completion callback therefore runs exactly when all of its data has been
+ * ACKed and no segment that might still be retransmitted points into it,
+ * after which the application may reuse the memory. The caller keeps its own
+ * reference and drops it with @ref tcp_zc_buf_unref when done with 'buf'.
+ *
+ * The data is never merged into segments already queued by tcp_write (and
+ * later writes are not merged into these), so each segment references at
+ * most one buffer.
+ *
+ * Each segment's PacketBuffer references its part of 'buf' through
+ * ext_data/ext_len instead of holding a copy; the checksum of that part is
+ * computed once here, and the bytes are only read again when the driver
+ * puts the frame on the wire.
+ *
+ * @param pcb Protocol control block for the TCP connection to enqueue data for.
+ * @param buf the buffer to send, created with @ref tcp_zc_buf_new
+ * @param apiflags TCP_WRITE_FLAG_MORE to suppress PSH on the last segment
+ * @return ERR_OK if enqueued, another LwipStatus on error (nothing is queued
+ *         and no reference is taken in that case)
+ */
+LwipStatus
+tcp_write_zc(struct TcpPcb* pcb, struct TcpZcBuf* buf, uint8_t apiflags)
+{
+    struct TcpSeg *seg = nullptr, *prev_seg = nullptr, *queue = nullptr;
+    size_t pos = 0;
+    size_t optlen = 0;
+    uint8_t optflags = 0;
+    lwip_assert("tcp_write_zc: invalid buf", buf != nullptr);
+    lwip_assert("tcp_write_zc: ROM flag and zero-copy don't mix",
+                (apiflags & TCP_WRITE_FLAG_COPY) == 0);
+    const size_t len = buf->len;
+    /* don't allocate segments bigger than half the maximum window we ever received */
+    uint16_t mss_local = std::min(pcb->mss, TCPWND_MIN16(pcb->snd_wnd_max / 2));
+    mss_local = mss_local ? mss_local : pcb->mss;
+    Logf(true,
+         "tcp_write_zc(pcb=%p, buf=%p, len=%zu, apiflags=%d)\n",
+         (void *)pcb,
+         (void *)buf,
+         len,
+         (uint16_t)apiflags);
+    if ((pcb->cold.tfo & TCP_TFO_CLIENT) && (pcb->state == CLOSED || pcb->state == SYN_SENT))
+    {
+        /* the Fast Open buffer holds copies only */
+        Logf(true, ("tcp_write_zc: not before the Fast Open handshake is done\n"));
+        return ERR_CONN;
+    }
+    LwipStatus err = tcp_write_checks(pcb, len);
+    if (err != STATUS_SUCCESS || len == 0)
+    {
+        return err;
+    }
+    uint16_t queuelen = pcb->snd_queuelen;
+    if ((pcb->flags & TF_TIMESTAMP))
+    {
+        optflags = TF_SEG_OPTS_TS;
+        // optlen = LWIP_TCP_OPT_LENGTH_SEGMENT(TF_SEG_OPTS_TS, pcb);
+        mss_local = std::max(mss_local, uint16_t(LWIP_TCP_OPT_LEN_TS + 1));
+    }
+    while (pos < len)
+    {
+        const uint16_t seglen = uint16_t(std::min(len - pos, size_t(mss_local - optlen)));
+        /* the checksum of the referenced data is computed once here, so
+         * tcp_output_segment() never has to touch the payload again */
+        uint16_t chksum = ~inet_chksum(buf->data + pos, seglen);
+        uint8_t chksum_swapped = 0;
+        if (seglen & 1)
+        {
+            chksum_swapped = 1;
+            chksum = SWAP_BYTES_IN_WORD(chksum);
+        }
+        struct PacketBuffer* p = new (std::nothrow) PacketBuffer{};
+        if (p == nullptr)
+        {
+            Logf(true, ("tcp_write_zc: could not allocate memory for PacketBuffer\n"));
+            goto memerr;
+        }
+        /* the segment points into buf; its reference below keeps it alive */
+        p->ext_data = buf->data + pos;
+        p->ext_len = seglen;
+        queuelen++;
+        if (queuelen > TCP_SND_QUEUELEN)
+        {
+            Logf(true,
+                 "tcp_write_zc: queue too long %d (%d)\n", queuelen, (int)TCP_SND_QUEUELEN);
+            free_pkt_buf(p);
+            goto memerr;
+        }
+        if ((seg = tcp_create_segment(pcb, p, 0, pcb->snd_lbb + pos, optflags)) == nullptr)
+        {
+            goto memerr;
+        }
+        seg->len = seglen;
+        seg->chksum = chksum;
+        seg->chksum_swapped = chksum_swapped;
+        seg->flags |= TF_SEG_DATA_CHECKSUMMED;
+        seg->zc = buf;
+        tcp_zc_buf_ref(buf);
+        if (queue == nullptr)
+        {
+            queue = seg;
+        }
+        else
+        {
+            lwip_assert("prev_seg != NULL", prev_seg != nullptr);
+            prev_seg->next = seg;
+        }
+        prev_seg = seg;
+        Logf(true | LWIP_DBG_TRACE,
+             "tcp_write_zc: queueing %d:%d\n", lwip_ntohl(seg->tcphdr->seqno), lwip_ntohl(
+                 seg->tcphdr->seqno) + tcp_tcplen(seg));
+        pos += seglen;
+    }
+    /* Append queue to pcb->unsent. The last unsent segment may still have
+     * oversize space, but it must not be filled by a later tcp_write() since
+     * that data would then follow ours on the wire in the wrong order. */
+    if (pcb->unsent == nullptr)
+    {
+        pcb->unsent = queue;
+    }
+    else
+    {
+        struct TcpSeg* last_unsent;
+        for (last_unsent = pcb->unsent; last_unsent->next != nullptr; last_unsent =
+             last_unsent->next)
+        {
+            ;
+        }
+        last_unsent->next = queue;
+    }
+    pcb->unsent_oversize = 0;
+    pcb->snd_lbb += len;
+    pcb->snd_buf -= len;
+    pcb->snd_queuelen = queuelen;
+    Logf(true, "tcp_write_zc: %d (after enqueued)\n", pcb->snd_queuelen);
+    /* Set the PSH flag in the last segment that we enqueued. */
+    if ((apiflags & TCP_WRITE_FLAG_MORE) == 0)
+    {
+        TCPH_SET_FLAG(seg->tcphdr, TCP_PSH);
+    }
+    return STATUS_SUCCESS;
+memerr: tcp_set_flags(pcb, TF_NAGLEMEMERR);
+    /* the segments' references go away with them; buf cannot complete here
+       since the caller still holds its own reference */
+    tcp_segs_free(queue);
+    Logf(true | LWIP_DBG_STATE,
+         "tcp_write_zc: %d (with mem err)\n", pcb->snd_queuelen);
+    return ERR_MEM;
+}
+
 /**
  * Split segment on the head of the unsent queue.  If return is not
  * ERR_OK, existing head remains intact
@@ -831,16 +1019,24 @@ tcp_split_unsent_seg(struct TcpPcb *pcb, uint16_t split)
 
   /* Offset into the original PacketBuffer is past TCP/IP headers, options, and split amount */
   uint16_t offset = useg->p->tot_len - useg->len + split;
-  /* Copy remainder into new PacketBuffer, headers and options will not be filled out */
-  if (pbuf_copy_partial(useg->p, (uint8_t *)p->payload + optlen, remainder, offset ) != remainder) {
-    Logf(true,
-         "tcp_split_unsent_seg: could not copy PacketBuffer remainder %u\n", remainder);
-    goto memerr;
-  }
+  if (useg->zc != nullptr) {
+    /* zero-copy data: the remainder points further into the same buffer */
+    p.ext_data = useg->p->ext_data + split;
+    p.ext_len = remainder;
+    tcp_seg_add_chksum(~inet_chksum(p.ext_data, remainder), remainder,
+                       &chksum, &chksum_swapped);
+  } else {
+    /* Copy remainder into new PacketBuffer, headers and options will not be filled out */
+    if (pbuf_copy_partial(useg->p, (uint8_t *)p->payload + optlen, remainder, offset ) != remainder) {
+      Logf(true,
+           "tcp_split_unsent_seg: could not copy PacketBuffer remainder %u\n", remainder);
+      goto memerr;
+    }
 
-  /* calculate the checksum on remainder data */
-  tcp_seg_add_chksum(~inet_chksum((const uint8_t *)p->payload + optlen, remainder), remainder,
-                     &chksum, &chksum_swapped);
+    /* calculate the checksum on remainder data */
+    tcp_seg_add_chksum(~inet_chksum((const uint8_t *)p->payload + optlen, remainder), remainder,
+                       &chksum, &chksum_swapped);
+  }
 
 
   /* Options are created when calling tcp_output() */
@@ -869,6 +1065,11 @@ tcp_split_unsent_seg(struct TcpPcb *pcb, uint16_t split)
   seg->chksum = chksum;
   seg->chksum_swapped = chksum_swapped;
   seg->flags |= TF_SEG_DATA_CHECKSUMMED;
+  if (useg->zc != nullptr) {
+    /* the remainder still points into the same zero-copy buffer */
+    seg->zc = useg->zc;
+    tcp_zc_buf_ref(seg->zc);
+  }
 
   /* Remove this segment from the queue since trimming it may free pbufs */
   // pcb->snd_queuelen -= pbuf_clen(useg->p);
@@ -888,19 +1089,25 @@ tcp_split_unsent_seg(struct TcpPcb *pcb, uint16_t split)
   /* The checksum on the split segment is now incorrect. We need to re-run it over the split */
   useg->chksum = 0;
   useg->chksum_swapped = 0;
-  struct PacketBuffer* q = useg->p;
-  offset = q->tot_len - useg->len; /* Offset due to exposed headers */
-
-  /* Advance to the PacketBuffer where the offset ends */
-  while (q != nullptr && offset > q->len) {
-    offset -= q->len;
-    q = q->next;
-  }
-  lwip_assert("Found start of payload PacketBuffer", q != nullptr);
-  /* Checksum the first payload PacketBuffer accounting for offset, then other pbufs are all payload */
-  for (; q != nullptr; offset = 0, q = q->next) {
-    tcp_seg_add_chksum(~inet_chksum((const uint8_t *)q->payload + offset, q->len - offset), q->len - offset,
+  if (useg->zc != nullptr) {
+    useg->p->ext_len = split;
+    tcp_seg_add_chksum(~inet_chksum(useg->p->ext_data, split), split,
                        &useg->chksum, &useg->chksum_swapped);
+  } else {
+    struct PacketBuffer* q = useg->p;
+    offset = q->tot_len - useg->len; /* Offset due to exposed headers */
+
+    /* Advance to the PacketBuffer where the offset ends */
+    while (q != nullptr && offset > q->len) {
+      offset -= q->len;
+      q = q->next;
+    }
+    lwip_assert("Found start of payload PacketBuffer", q != nullptr);
+    /* Checksum the first payload PacketBuffer accounting for offset, then other pbufs are all payload */
+    for (; q != nullptr; offset = 0, q = q->next) {
+      tcp_seg_add_chksum(~inet_chksum((const uint8_t *)q->payload + offset, q->len - offset), q->len - offset,
+                         &useg->chksum, &useg->chksum_swapped);
+    }
   }
 
 
@@ -963,33 +1170,13 @@ tcp_send_fin(struct TcpPcb *pcb)
   return tcp_enqueue_flags(pcb, TCP_FIN);
 }
 
-/**
- * Enqueue SYN or FIN for transmission.
- *
- * Called by @ref tcp_connect, tcp_listen_input, and @ref tcp_close
- * (via @ref tcp_send_fin)
- *
- * @param pcb Protocol control block for the TCP connection.
- * @param flags TCP header flags to set in the outgoing segment.
- */
-LwipStatus
-tcp_enqueue_flags(struct TcpPcb *pcb, uint8_t flags)
+/* Options of a SYN or FIN segment queued on pcb. This is a special case
+   since SYNs are only queued by tcp_enqueue_flags and tcp_enqueue_syn_data. */
+static uint8_t
+tcp_enqueue_optflags(const struct TcpPcb *pcb, uint8_t flags)
 {
-  struct PacketBuffer p{};
-  struct TcpSeg *seg;
   uint8_t optflags = 0;
-  uint8_t optlen = 0;
 
-  Logf(true, "tcp_enqueue_flags: queuelen: %d\n", (uint16_t)pcb->snd_queuelen);
-
-  lwip_assert("tcp_enqueue_flags: need either TCP_SYN or TCP_FIN in flags (programmer violates API)",
-              (flags & (TCP_SYN | TCP_FIN)) != 0);
-  lwip_assert("tcp_enqueue_flags: invalid pcb", pcb != nullptr);
-
-  /* No need to check pcb->snd_queuelen if only SYN or FIN are allowed! */
-
-  /* Get options for this segment. This is a special case since this is the
-     only place where a SYN can be sent. */
   if (flags & TCP_SYN) {
     optflags = TF_SEG_OPTS_MSS;
 
@@ -1012,6 +1199,34 @@ tcp_enqueue_flags(struct TcpPcb *pcb, uint8_t flags)
        agreed about it with the remote host (and in active open SYN segments). */
     optflags |= TF_SEG_OPTS_TS;
   }
+  return optflags;
+}
+
+/**
+ * Enqueue SYN or FIN for transmission.
+ *
+ * Called by @ref tcp_connect, tcp_listen_input, and @ref tcp_close
+ * (via @ref tcp_send_fin)
+ *
+ * @param pcb Protocol control block for the TCP connection.
+ * @param flags TCP header flags to set in the outgoing segment.
+ */
+LwipStatus
+tcp_enqueue_flags(struct TcpPcb *pcb, uint8_t flags)
+{
+  struct PacketBuffer p{};
+  struct TcpSeg *seg;
+  uint8_t optlen = 0;
+
+  Logf(true, "tcp_enqueue_flags: queuelen: %d\n", (uint16_t)pcb->snd_queuelen);
+
+  lwip_assert("tcp_enqueue_flags: need either TCP_SYN or TCP_FIN in flags (programmer violates API)",
+              (flags & (TCP_SYN | TCP_FIN)) != 0);
+  lwip_assert("tcp_enqueue_flags: invalid pcb", pcb != nullptr);
+
+  /* No need to check pcb->snd_queuelen if only SYN or FIN are allowed! */
+
+  const uint8_t optflags = tcp_enqueue_optflags(pcb, flags);
 
   // optlen = LWIP_TCP_OPT_LENGTH_SEGMENT(optflags, pcb);
 
@@ -1074,6 +1289,70 @@ tcp_enqueue_flags(struct TcpPcb *pcb, uint8_t flags)
   return STATUS_SUCCESS;
 }
 
+/**
+ * Enqueue the SYN of an active open carrying a Fast Open option and data,
+ * see tcp_fastopen.h. The data is copied into the segment.
+ *
+ * Called by tcp_fastopen_enqueue_syn().
+ *
+ * @param pcb Protocol control block for the TCP connection.
+ * @param data data to send with the SYN
+ * @param len in: length of data, out: how much of it fits in the SYN
+ */
+LwipStatus
+tcp_enqueue_syn_data(struct TcpPcb *pcb, const uint8_t *data, uint16_t *len)
+{
+  struct PacketBuffer p{};
+  uint16_t chksum = 0;
+  uint8_t chksum_swapped = 0;
+
+  lwip_assert("tcp_enqueue_syn_data: invalid pcb", pcb != nullptr);
+  lwip_assert("tcp_enqueue_syn_data: queues not empty",
+              pcb->unsent == nullptr && pcb->unacked == nullptr);
+
+  const uint8_t optflags = tcp_enqueue_optflags(pcb, TCP_SYN) | TF_SEG_OPTS_TFO;
+  const uint8_t optlen = LWIP_TCP_OPT_LENGTH(optflags) +
+                         tcp_fastopen_optlen(pcb->cold.tfo_cookie_len);
+  lwip_assert("tcp_enqueue_syn_data: options too long", optlen <= MAX_TCP_OPT_BYTES);
+  /* one segment: the options take room from the MSS */
+  *len = std::min(*len, uint16_t(pcb->mss - optlen));
+
+  /* Allocate PacketBuffer with room for TCP header + options + data */
+  p = PacketBuffer();
+  // if ((p = pbuf_alloc(PBUF_TRANSPORT, optlen + *len, PBUF_RAM)) == nullptr) {
+  //   tcp_set_flags(pcb, TF_NAGLEMEMERR);
+  //   return ERR_MEM;
+  // }
+  if (*len > 0) {
+    TCP_DATA_COPY2((uint8_t *)p->payload + optlen, const_cast<uint8_t *>(data), *len,
+                   &chksum, &chksum_swapped);
+  }
+
+  struct TcpSeg *seg = tcp_create_segment(pcb, p, TCP_SYN, pcb->snd_lbb, optflags);
+  if (seg == nullptr) {
+    tcp_set_flags(pcb, TF_NAGLEMEMERR);
+    return ERR_MEM;
+  }
+  if (*len > 0) {
+    seg->chksum = chksum;
+    seg->chksum_swapped = chksum_swapped;
+    seg->flags |= TF_SEG_DATA_CHECKSUMMED;
+  }
+
+  Logf(true | LWIP_DBG_TRACE,
+       "tcp_enqueue_syn_data: queueing %d:%d\n",
+           lwip_ntohl(seg->tcphdr->seqno),
+           lwip_ntohl(seg->tcphdr->seqno) + tcp_tcplen(seg));
+
+  pcb->unsent = seg;
+  pcb->unsent_oversize = 0;
+  /* the SYN and its data bump the sequence number; the data stays accounted
+     to the Fast Open buffer, not to snd_buf */
+  pcb->snd_lbb += 1 + *len;
+  pcb->snd_queuelen++;
+  return STATUS_SUCCESS;
+}
+
 /* Build a timestamp option (12 bytes long) at the specified options pointer)
  *
  * @param pcb TcpProtoCtrlBlk
@@ -1154,7 +1433,7 @@ tcp_build_wnd_scale_option(uint32_t *opts)
   lwip_assert("tcp_build_wnd_scale_option: invalid opts", opts != nullptr);
 
   /* Pad with one NOP option to make everything nicely aligned */
-  opts[0] = pp_htonl(0x01030300 | 0xff);
+  opts[0] = pp_htonl(0x01030300 | TCP_RCV_SCALE);
 }
 
 /**
@@ -1206,7 +1485,7 @@ tcp_output(struct TcpPcb *pcb)
     //          lwip_ntohl(seg->tcphdr->seqno), pcb->lastack));
   }
 
-  NetworkInterface* netif = tcp_route(pcb, &pcb->local_ip, &pcb->remote_ip);
+  NetworkInterface* netif = tcp_route_cached(pcb);
   if (netif == nullptr) {
     return STATUS_E_ROUTING;
   }
@@ -1282,6 +1561,7 @@ tcp_output(struct TcpPcb *pcb)
     pcb->unsent = seg->next;
     if (pcb->state != SYN_SENT) {
       tcp_clear_flags(pcb, TF_ACK_DELAY | TF_ACK_NOW);
+      pcb->rcv_unacked_segs = 0;
     }
     uint32_t snd_nxt = lwip_ntohl(seg->tcphdr->seqno) + tcp_tcplen(seg);
     if (tcp_seq_lt(pcb->snd_nxt, snd_nxt)) {
@@ -1433,6 +1713,10 @@ tcp_output_segment(struct TcpSeg *seg, struct TcpPcb *pcb, NetworkInterface*neti
     *(opts++) = pp_htonl(0x01010402);
   }
 
+  if (seg->flags & TF_SEG_OPTS_TFO) {
+    opts = tcp_fastopen_build_option(opts, pcb->cold.tfo_cookie, pcb->cold.tfo_cookie_len);
+  }
+
 
   /* Set retransmission timer running if it is not currently enabled
      This must be set before checking the route. */
@@ -1461,6 +1745,9 @@ tcp_output_segment(struct TcpSeg *seg, struct TcpPcb *pcb, NetworkInterface*neti
 
   seg->p->payload = (uint8_t*)seg->tcphdr;
 
+  /* ECN flags depend on whether this is new data, so are set at each send */
+  const uint8_t tos = tcp_ecn_output(pcb, seg);
+
   seg->tcphdr->chksum = 0;
 
   // opts = LWIP_HOOK_TCP_OUT_ADD_TCPOPTS(seg->p, seg->tcphdr, pcb, opts);
@@ -1493,7 +1780,8 @@ tcp_output_segment(struct TcpSeg *seg, struct TcpPcb *pcb, NetworkInterface*neti
     acc = (uint16_t)~acc + seg->chksum;
     seg->tcphdr->chksum = (uint16_t)~fold_u32(acc);
 
-    if (chksum_slow != seg->tcphdr->chksum) {
+    /* the slow sum only covers p->data, not zero-copy ext_data */
+    if (seg->zc == nullptr && chksum_slow != seg->tcphdr->chksum) {
       // TCP_CHECKSUM_ON_COPY_SANITY_CHECK_FAIL(
       //   ("tcp_output_segment: calculated checksum is %x instead of %x\n",
       //    seg->tcphdr->chksum, chksum_slow));
@@ -1505,13 +1793,15 @@ tcp_output_segment(struct TcpSeg *seg, struct TcpPcb *pcb, NetworkInterface*neti
   // TCP_STATS_INC(tcp.xmit);
 
   netif_set_hints(netif, pcb->netif_hints);
+  dst_cache_current = dst_cache_for(pcb->dst_cache, pcb->remote_ip);
     const LwipStatus err = ip_output_if(seg->p,
                                         &pcb->local_ip,
                                         &pcb->remote_ip,
                                         pcb->ttl,
-                                        pcb->tos,
+                                        tos,
                                         IP_PROTO_TCP,
                                         netif);
+  dst_cache_current = nullptr;
   netif_reset_hints(netif);
 
 
@@ -1755,7 +2045,7 @@ tcp_output_alloc_header(struct TcpPcb *pcb, uint16_t optlen, uint16_t datalen,
       seqno_be,
       pcb->local_port,
       pcb->remote_port,
-      TCP_ACK,
+      TCP_ACK | tcp_ecn_ack_flags(pcb),
       TCPWND_MIN16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
   if (p != nullptr) {
     /* If we're sending a packet, update the announced right window edge */
@@ -1797,15 +2087,15 @@ tcp_output_fill_options(const struct TcpPcb *pcb, struct PacketBuffer *p, uint8_
   //   lwip_assert("options not filled", (uint8_t *)opts == ((uint8_t *)(tcphdr + 1)) + sacks_len * 4 + LWIP_TCP_OPT_LENGTH_SEGMENT(optflags, pcb));
 }
 
-/** Output a control segment PacketBuffer to IP.
+/** Output a control segment PacketBuffer to IP with the given TTL and TOS.
  *
- * Called from tcp_rst, tcp_send_empty_ack, tcp_keepalive and tcp_zero_window_probe,
- * this function combines selecting a netif for transmission, generating the tcp
- * header checksum and calling ip_output_if while handling netif hints and stats.
+ * Called from tcp_output_control_segment, and by tcp_timewait_send_ack with
+ * the values the connection had before it was compacted into its record.
  */
 static LwipStatus
-tcp_output_control_segment(const struct TcpPcb *pcb, struct PacketBuffer *p,
-                           const IpAddrInfo *src, const IpAddrInfo *dst)
+tcp_output_control_segment_ttl(const struct TcpPcb *pcb, struct PacketBuffer *p,
+                               const IpAddrInfo *src, const IpAddrInfo *dst,
+                               uint8_t ttl, uint8_t tos)
 {
   LwipStatus err;
   lwip_assert("tcp_output_control_segment: invalid pbuf", p != nullptr);
@@ -1814,8 +2104,6 @@ tcp_output_control_segment(const struct TcpPcb *pcb, struct PacketBuffer *p,
   if (netif == nullptr) {
     err = STATUS_E_ROUTING;
   } else {
-    uint8_t ttl, tos;
-
    if( is_netif_checksum_enabled(netif, NETIF_CHECKSUM_GEN_TCP)) {
       struct TcpHdr *tcphdr = (struct TcpHdr *)p->payload;
       tcphdr->chksum = ip_chksum_pseudo(p, IP_PROTO_TCP, p->tot_len,
@@ -1824,12 +2112,6 @@ tcp_output_control_segment(const struct TcpPcb *pcb, struct PacketBuffer *p,
 
     if (pcb != nullptr) {
       netif_set_hints(netif,  pcb->netif_hints);
-      ttl = pcb->ttl;
-      tos = pcb->tos;
-    } else {
-      /* Send output with hardcoded TTL/HL since we have no access to the pcb */
-      ttl = TCP_TTL;
-      tos = 0;
     }
     // TCP_STATS_INC(tcp.xmit);
     err = ip_output_if(p, src, dst, ttl, tos, IP_PROTO_TCP, netif);
@@ -1839,6 +2121,23 @@ tcp_output_control_segment(const struct TcpPcb *pcb, struct PacketBuffer *p,
   return err;
 }
 
+/** Output a control segment PacketBuffer to IP.
+ *
+ * Called from tcp_rst, tcp_send_empty_ack, tcp_keepalive and tcp_zero_window_probe,
+ * this function combines selecting a netif for transmission, generating the tcp
+ * header checksum and calling ip_output_if while handling netif hints and stats.
+ */
+static LwipStatus
+tcp_output_control_segment(const struct TcpPcb *pcb, struct PacketBuffer *p,
+                           const IpAddrInfo *src, const IpAddrInfo *dst)
+{
+  if (pcb != nullptr) {
+    return tcp_output_control_segment_ttl(pcb, p, src, dst, pcb->ttl, pcb->tos);
+  }
+  /* Send output with hardcoded TTL/HL since we have no access to the pcb */
+  return tcp_output_control_segment_ttl(nullptr, p, src, dst, TCP_TTL, 0);
+}
+
 /**
  * Send a TCP RESET packet (empty segment with RST flag set) either to
  * abort a connection or to show that there is no matching local connection
@@ -1871,7 +2170,7 @@ tcp_rst(const struct TcpPcb *pcb, uint32_t seqno, uint32_t ackno,
   // uint8_t optlen = LWIP_TCP_OPT_LENGTH_SEGMENT(0, pcb);
 
   size_t optlen = 0;
-  uint16_t wnd = pp_htons(((TCP_WND >> 0xff) & 0xFFFF));
+  uint16_t wnd = pp_htons(((TCP_WND >> TCP_RCV_SCALE) & 0xFFFF));
 
 
   struct PacketBuffer* p = tcp_output_alloc_header_common(
@@ -1946,11 +2245,133 @@ tcp_send_empty_ack(struct TcpPcb *pcb)
   } else {
     /* remove ACK flags from the PCB, as we sent an empty ACK now */
     tcp_clear_flags(pcb, TF_ACK_DELAY | TF_ACK_NOW);
+    pcb->rcv_unacked_segs = 0;
   }
 
   return err;
 }
 
+/**
+ * Send an ACK for a connection held as a TIME-WAIT record, see tcp_timewait.h.
+ * Like tcp_send_empty_ack, but everything comes from the record since the
+ * pcb is gone.
+ *
+ * @param tw the TIME-WAIT record to send the ACK for
+ */
+LwipStatus
+tcp_timewait_send_ack(const TcpTwRecord *tw)
+{
+  size_t optlen = 0;
+  IpAddrInfo local_ip{};
+  IpAddrInfo remote_ip{};
+
+  lwip_assert("tcp_timewait_send_ack: invalid tw", tw != nullptr);
+
+  if (tw->flags & TCP_TW_FLAG_TIMESTAMP) {
+    optlen = LWIP_TCP_OPT_LEN_TS_OUT;
+  }
+
+  struct PacketBuffer* p = tcp_output_alloc_header_common(
+      tw->rcv_nxt,
+      optlen,
+      0,
+      lwip_htonl(tw->snd_nxt),
+      tw->local_port,
+      tw->remote_port,
+      TCP_ACK,
+      tw->wnd);
+  if (p == nullptr) {
+    /* the peer retransmits its FIN, we'll get another chance */
+    Logf(true, ("tcp_timewait_send_ack: could not allocate PacketBuffer\n"));
+    return ERR_BUF;
+  }
+  if (tw->flags & TCP_TW_FLAG_TIMESTAMP) {
+    struct TcpHdr* tcphdr = (struct TcpHdr *)p->payload;
+    uint32_t* opts = (uint32_t *)(uint8_t *)(tcphdr + 1);
+    opts[0] = pp_htonl(0x0101080A);
+    opts[1] = lwip_htonl(sys_now());
+    opts[2] = lwip_htonl(tw->ts_recent);
+  }
+
+  tcp_timewait_get_addrs(tw, local_ip, remote_ip);
+  Logf(true,
+       "tcp_timewait_send_ack: sending ACK for %d\n", tw->rcv_nxt);
+  return tcp_output_control_segment_ttl(nullptr, p, &local_ip, &remote_ip, tw->ttl, tw->tos);
+}
+
+/**
+ * Send the SYN-ACK of a connection request that has no pcb yet, see
+ * tcp_synq.h. Used for queued requests (first transmission and
+ * retransmissions from tcp_synq_tmr) and for SYN cookies. The options
+ * mirror what tcp_enqueue_flags(TCP_SYN | TCP_ACK) would send on a pcb
+ * that parsed the same SYN.
+ *
+ * @param req the request to answer
+ * @param local_ip the local IP address to send the segment from
+ * @param remote_ip the remote IP address to send the segment to
+ */
+LwipStatus
+tcp_synq_send_synack(const TcpSynReq &req, const IpAddrInfo &local_ip,
+                     const IpAddrInfo &remote_ip)
+{
+  size_t optlen = LWIP_TCP_OPT_LEN_MSS;
+
+  if (req.flags & TCP_SYNQ_FLAG_TIMESTAMP) {
+    optlen += LWIP_TCP_OPT_LEN_TS_OUT;
+  }
+  if (req.flags & TCP_SYNQ_FLAG_WND_SCALE) {
+    optlen += LWIP_TCP_OPT_LEN_WS_OUT;
+  }
+  if (req.flags & TCP_SYNQ_FLAG_SACK) {
+    optlen += LWIP_TCP_OPT_LEN_SACK_PERM_OUT;
+  }
+  if (req.flags & TCP_SYNQ_FLAG_TFO_COOKIE) {
+    optlen += tcp_fastopen_optlen(TCP_FASTOPEN_COOKIE_LEN);
+  }
+
+  /* The Window field in a SYN segment is never scaled. */
+  struct PacketBuffer* p = tcp_output_alloc_header_common(
+      req.irs + 1,
+      optlen,
+      0,
+      lwip_htonl(req.iss),
+      req.local_port,
+      req.remote_port,
+      (req.flags & TCP_SYNQ_FLAG_ECN) ? TCP_SYN | TCP_ACK | TCP_ECE : TCP_SYN | TCP_ACK,
+      TCPWND_MIN16(TCP_WND));
+  if (p == nullptr) {
+    /* queued requests are retried by tcp_synq_tmr, cookies by the peer */
+    Logf(true, ("tcp_synq_send_synack: could not allocate PacketBuffer\n"));
+    return ERR_BUF;
+  }
+
+  struct TcpHdr* tcphdr = (struct TcpHdr *)p->payload;
+  uint32_t* opts = (uint32_t *)(uint8_t *)(tcphdr + 1);
+  *(opts++) = TCP_BUILD_MSS_OPTION(tcp_eff_send_mss(TCP_MSS, &local_ip, &remote_ip));
+  if (req.flags & TCP_SYNQ_FLAG_TIMESTAMP) {
+    opts[0] = pp_htonl(0x0101080A);
+    opts[1] = lwip_htonl(sys_now());
+    opts[2] = lwip_htonl(req.ts_recent);
+    opts += 3;
+  }
+  if (req.flags & TCP_SYNQ_FLAG_WND_SCALE) {
+    tcp_build_wnd_scale_option(opts);
+    opts += 1;
+  }
+  if (req.flags & TCP_SYNQ_FLAG_SACK) {
+    *(opts++) = pp_htonl(0x01010402);
+  }
+  if (req.flags & TCP_SYNQ_FLAG_TFO_COOKIE) {
+    uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN];
+    tcp_fastopen_make_cookie(local_ip, remote_ip, cookie);
+    opts = tcp_fastopen_build_option(opts, cookie, TCP_FASTOPEN_COOKIE_LEN);
+  }
+
+  Logf(true,
+       "tcp_synq_send_synack: seqno %d ackno %d\n", req.iss, req.irs + 1);
+  return tcp_output_control_segment(nullptr, p, &local_ip, &remote_ip);
+}
+
 /**
  * Send keepalive packets to keep a connection active although
  * no data is sent over it.
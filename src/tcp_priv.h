@@ -50,6 +50,8 @@
 
 #include "packet_buffer.h"
 
+#include "port_alloc.h"
+
 #include "tcp.h"
 
 #include <algorithm>
@@ -77,6 +79,11 @@ void             tcp_txnow   ();
 
 /* Only used by IP to pass a TCP segment to TCP: */
 void             tcp_input   (struct PacketBuffer *p, NetworkInterface*inp);
+/* Called by a netif receive loop around a burst of packets, so that
+   connections getting several segments send one ACK for all of them: */
+void             tcp_input_batch_begin();
+void             tcp_input_batch_end();
+void             tcp_input_batch_forget(struct TcpPcb *pcb);
 /* Used within the TCP code only: */
 struct TcpPcb * tcp_alloc   (uint8_t prio);
 void             tcp_free    (struct TcpPcb *pcb);
@@ -178,15 +185,17 @@ enum TcpProcFlags
 
 #define TCP_EVENT_SENT(pcb,space,ret)                          \
   do {                                                         \
-    if((pcb)->sent != NULL)                                    \
-      (ret) = (pcb)->sent((pcb)->callback_arg,(pcb),(space));  \
+    if((pcb)->cold.sent != NULL)                                    \
+      (ret) = (pcb)->cold.sent((pcb)->callback_arg,(pcb),(space));  \
     else (ret) = ERR_OK;                                       \
   } while (0)
 
 #define TCP_EVENT_RECV(pcb,p,err,ret)                          \
   do {                                                         \
-    if((pcb)->recv != NULL) {                                  \
-      (ret) = (pcb)->recv((pcb)->callback_arg,(pcb),(p),(err));\
+    if((pcb)->cold.recv_zc != NULL) {                               \
+      (ret) = tcp_rx_slice_deliver((pcb),(p),(err));           \
+    } else if((pcb)->cold.recv != NULL) {                           \
+      (ret) = (pcb)->cold.recv((pcb)->callback_arg,(pcb),(p),(err));\
     } else {                                                   \
       (ret) = tcp_recv_null(NULL, (pcb), (p), (err));          \
     }                                                          \
@@ -194,8 +203,10 @@ enum TcpProcFlags
 
 #define TCP_EVENT_CLOSED(pcb,ret)                                \
   do {                                                           \
-    if(((pcb)->recv != NULL)) {                                  \
-      (ret) = (pcb)->recv((pcb)->callback_arg,(pcb),NULL,ERR_OK);\
+    if(((pcb)->cold.recv_zc != NULL)) {                               \
+      (ret) = (pcb)->cold.recv_zc((pcb)->callback_arg,(pcb),NULL,ERR_OK);\
+    } else if(((pcb)->cold.recv != NULL)) {                           \
+      (ret) = (pcb)->cold.recv((pcb)->callback_arg,(pcb),NULL,ERR_OK);\
     } else {                                                     \
       (ret) = ERR_OK;                                            \
     }                                                            \
@@ -203,15 +214,15 @@ enum TcpProcFlags
 
 #define TCP_EVENT_CONNECTED(pcb,err,ret)                         \
   do {                                                           \
-    if((pcb)->connected != NULL)                                 \
-      (ret) = (pcb)->connected((pcb)->callback_arg,(pcb),(err)); \
+    if((pcb)->cold.connected != NULL)                                 \
+      (ret) = (pcb)->cold.connected((pcb)->callback_arg,(pcb),(err)); \
     else (ret) = ERR_OK;                                         \
   } while (0)
 
 #define TCP_EVENT_POLL(pcb,ret)                                \
   do {                                                         \
-    if((pcb)->poll != NULL)                                    \
-      (ret) = (pcb)->poll((pcb)->callback_arg,(pcb));          \
+    if((pcb)->cold.poll != NULL)                                    \
+      (ret) = (pcb)->cold.poll((pcb)->callback_arg,(pcb));          \
     else (ret) = ERR_OK;                                       \
   } while (0)
 
@@ -237,6 +248,8 @@ enum TcpSegOpts
     /* Include WND SCALE option (only used in SYN segments) */
     TF_SEG_OPTS_SACK_PERM =0x10U,
     /* Include SACK Permitted option (only used in SYN segments) */
+    TF_SEG_OPTS_TFO =0x20U,
+    /* Include Fast Open option (only used in SYN segments) */
 };
 
 /// This structure represents a TCP segment on the unsent, unacked and ooseq queues
@@ -249,6 +262,7 @@ struct TcpSeg
     uint8_t chksum_swapped;
     uint8_t flags;
     struct TcpHdr* tcphdr; /* the TCP header */
+    struct TcpZcBuf* zc; /* zero-copy buffer the payload points into, or NULL */
 };
 
 ///
@@ -302,6 +316,7 @@ LWIP_TCP_OPT_MSS        =2,
 LWIP_TCP_OPT_WS         =3,
 LWIP_TCP_OPT_SACK_PERM  =4,
 LWIP_TCP_OPT_TS         =8,
+LWIP_TCP_OPT_TFO        =34,
 
 };
 
@@ -318,6 +333,22 @@ constexpr auto LWIP_TCP_OPT_LEN_SACK_PERM_OUT = 4;
 /* aligned for output (includes NOP padding) */
 // #define LWIP_TCP_OPT_LEN_SACK_PERM_OUT 0
 
+/* Smallest window scale shift that can announce a window of 'wnd' bytes */
+constexpr uint8_t
+tcp_wnd_scale_for(const uint32_t wnd)
+{
+    uint8_t shift = 0;
+    while ((uint32_t(0xFFFF) << shift) < wnd)
+    {
+        shift++;
+    }
+    return shift;
+}
+
+/* The window scale we announce: enough for TCP_WND_AUTOTUNE_MAX */
+constexpr auto TCP_RCV_SCALE = tcp_wnd_scale_for(TCP_WND_AUTOTUNE_MAX);
+static_assert(TCP_RCV_SCALE <= 14, "TCP_WND_AUTOTUNE_MAX too large for window scaling");
+
 ///
 ///
 ///
@@ -425,6 +456,8 @@ extern struct TcpPcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
               state in which they accept or send
               data. */
 extern struct TcpPcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
+extern PortAllocator tcp_ports;         /* Local ports used by any TCP PCB or
+              TIME-WAIT record. */
 
 constexpr auto NUM_TCP_PCB_LISTS_NO_TIME_WAIT = 3;
 constexpr auto NUM_TCP_PCB_LISTS       =        4;
@@ -508,22 +541,44 @@ void tcp_segs_free(struct TcpSeg *seg);
 void tcp_seg_free(struct TcpSeg *seg);
 struct TcpSeg *tcp_seg_copy(struct TcpSeg *seg);
 
-#define tcp_ack(pcb)                               \
-  do {                                             \
-    if((pcb)->flags & TF_ACK_DELAY) {              \
-      tcp_clear_flags(pcb, TF_ACK_DELAY);          \
-      tcp_ack_now(pcb);                            \
-    }                                              \
-    else {                                         \
-      tcp_set_flags(pcb, TF_ACK_DELAY);            \
-    }                                              \
-  } while (0)
-
 #define tcp_ack_now(pcb)                           \
   tcp_set_flags(pcb, TF_ACK_NOW)
 
+static_assert(TCP_STRETCH_ACK_SEGS >= 2 && TCP_STRETCH_ACK_SEGS <= 0xff, "invalid TCP_STRETCH_ACK_SEGS");
+
+/* Number of in-sequence segments one ACK covers: every second one, or up to
+   TCP_STRETCH_ACK_SEGS once the receiver has an RTT sample (the peer is past
+   its initial window). Stretch ACKs still leave at least four ACKs per
+   announced window, so the peer's congestion window keeps growing. */
+inline uint32_t
+tcp_ack_segs(const TcpPcb* pcb)
+{
+    if (TCP_STRETCH_ACK_SEGS == 2 || pcb->cold.rcv_rtt == 0)
+    {
+        return 2;
+    }
+    return std::max(2U, std::min(uint32_t(TCP_STRETCH_ACK_SEGS), pcb->rcv_ann_wnd / (4U * pcb->mss)));
+}
+
+/* Acknowledge an in-sequence segment: delay the ACK until tcp_ack_segs()
+   segments are waiting for it (or tcp_fasttmr() fires) */
+inline void
+tcp_ack(TcpPcb* pcb)
+{
+    if (++pcb->rcv_unacked_segs >= tcp_ack_segs(pcb))
+    {
+        tcp_clear_flags(pcb, TF_ACK_DELAY);
+        tcp_ack_now(pcb);
+    }
+    else
+    {
+        tcp_set_flags(pcb, TF_ACK_DELAY);
+    }
+}
+
 LwipStatus tcp_send_fin(struct TcpPcb *pcb);
 LwipStatus tcp_enqueue_flags(struct TcpPcb *pcb, uint8_t flags);
+LwipStatus tcp_enqueue_syn_data(struct TcpPcb *pcb, const uint8_t *data, uint16_t *len);
 
 void tcp_rexmit_seg(struct TcpPcb *pcb, struct TcpSeg *seg);
 
@@ -532,6 +587,8 @@ void tcp_rst(const struct TcpPcb* pcb, uint32_t seqno, uint32_t ackno,
        uint16_t local_port, uint16_t remote_port);
 
 uint32_t tcp_next_iss(struct TcpPcb *pcb);
+uint32_t tcp_next_iss(const IpAddrInfo& local_ip, uint16_t local_port,
+       const IpAddrInfo& remote_ip, uint16_t remote_port);
 
 LwipStatus tcp_keepalive(struct TcpPcb *pcb);
 LwipStatus tcp_split_unsent_seg(struct TcpPcb *pcb, uint16_t split);
@@ -544,6 +601,7 @@ uint16_t tcp_eff_send_mss_netif(uint16_t sendmss, NetworkInterface*outif,
     tcp_eff_send_mss_netif(sendmss, ip_route(src, dest), dest)
 
 LwipStatus tcp_recv_null(void *arg, struct TcpPcb *pcb, struct PacketBuffer *p, LwipStatus err);
+LwipStatus tcp_rx_slice_deliver(struct TcpPcb *pcb, struct PacketBuffer *p, LwipStatus err);
 
 #  define tcp_debug_print(tcphdr)
 #  define tcp_debug_print_flags(flags)
@@ -557,6 +615,7 @@ LwipStatus tcp_recv_null(void *arg, struct TcpPcb *pcb, struct PacketBuffer *p,
 void tcp_netif_ip_addr_changed(const IpAddrInfo* old_addr, const IpAddrInfo* new_addr);
 
 void tcp_free_ooseq(struct TcpPcb *pcb);
+void tcp_free_ooseq_excess(struct TcpPcb *pcb);
 
 
 LwipStatus tcp_ext_arg_invoke_callbacks_passive_open(struct TcpPcbListen *lpcb, struct TcpPcb *cpcb);
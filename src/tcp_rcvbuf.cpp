@@ -0,0 +1,183 @@
+///
+/// file: tcp_rcvbuf.cpp
+///
+/// Receive buffer autotuning, see tcp_rcvbuf.h.
+///
+
+#include <algorithm>
+#include <lwip_debug.h>
+#include <opt.h>
+#include <sys.h>
+#include <tcp_rcvbuf.h>
+
+size_t tcp_rcvbuf_total;
+
+/* The window a connection starts with, and never shrinks below */
+static TcpWndSize
+tcp_rcvbuf_base(const struct TcpPcb* pcb)
+{
+    return TcpWndSize((pcb->flags & TF_WND_SCALE) ? TCP_WND : TCPWND16(TCP_WND));
+}
+
+/* The largest window the connection can announce */
+static TcpWndSize
+tcp_rcvbuf_limit(const struct TcpPcb* pcb)
+{
+    return TcpWndSize((pcb->flags & TF_WND_SCALE) ? TCP_WND_AUTOTUNE_MAX : MAX_TCP_WND16);
+}
+
+static void
+tcp_rcvbuf_grow(struct TcpPcb* pcb, TcpWndSize target)
+{
+    target = std::min(target, tcp_rcvbuf_limit(pcb));
+    if (target <= pcb->rcv_wnd_max || tcp_rcvbuf_total >= TCP_RCVBUF_BUDGET)
+    {
+        return;
+    }
+    const auto delta = TcpWndSize(std::min(size_t(target - pcb->rcv_wnd_max),
+                                           TCP_RCVBUF_BUDGET - tcp_rcvbuf_total));
+    pcb->rcv_wnd_max += delta;
+    pcb->rcv_wnd += delta;
+    tcp_rcvbuf_total += delta;
+    Logf(true,
+         "tcp_rcvbuf_grow: wnd %d, space %d, rtt %d ms\n",
+         pcb->rcv_wnd_max,
+         pcb->cold.rcv_space,
+         pcb->cold.rcv_rtt);
+}
+
+static void
+tcp_rcvbuf_shrink(struct TcpPcb* pcb, TcpWndSize target)
+{
+    target = std::max(target, tcp_rcvbuf_base(pcb));
+    if (target >= pcb->rcv_wnd_max)
+    {
+        return;
+    }
+    const TcpWndSize delta = pcb->rcv_wnd_max - target;
+    pcb->rcv_wnd_max = target;
+    tcp_rcvbuf_total -= delta;
+    /* only take back what has not been announced yet; tcp_recved() keeps
+       rcv_wnd below the new size as the application drains the rest */
+    const TcpWndSize unannounced = pcb->rcv_wnd > pcb->rcv_ann_wnd
+                                       ? pcb->rcv_wnd - pcb->rcv_ann_wnd
+                                       : 0;
+    pcb->rcv_wnd -= std::min(delta, unannounced);
+    Logf(true, "tcp_rcvbuf_shrink: wnd %d\n", pcb->rcv_wnd_max);
+}
+
+///
+/// Reset autotuning for a pcb whose receive window has just been set to its
+/// initial value (new pcb, tcp_connect(), window scaling agreed).
+///
+void
+tcp_rcvbuf_init(struct TcpPcb* pcb)
+{
+    lwip_assert("tcp_rcvbuf_init: window already grown",
+                pcb->rcv_wnd_max <= tcp_rcvbuf_base(pcb));
+    pcb->rcv_wnd_max = pcb->rcv_wnd;
+    pcb->cold.rcv_space = 0;
+    pcb->cold.rcv_drained = 0;
+    pcb->cold.rcv_space_time = sys_now();
+    pcb->rcv_rtt_time = 0;
+    pcb->cold.rcv_rtt = 0;
+}
+
+///
+/// Give the growth of a pcb's buffer back to the budget. Called from
+/// tcp_free().
+///
+void
+tcp_rcvbuf_release(struct TcpPcb* pcb)
+{
+    const TcpWndSize base = tcp_rcvbuf_base(pcb);
+    if (pcb->rcv_wnd_max > base)
+    {
+        tcp_rcvbuf_total -= pcb->rcv_wnd_max - base;
+        pcb->rcv_wnd_max = base;
+    }
+}
+
+///
+/// Receiver-side RTT sampling, called by tcp_receive() when in-sequence data
+/// advanced rcv_nxt: a sample is the time the peer takes to send up to the
+/// right edge that was announced when the sample started.
+///
+void
+tcp_rcvbuf_data(struct TcpPcb* pcb)
+{
+    const uint32_t now = sys_now();
+    if (pcb->rcv_rtt_time != 0 && TCP_SEQ_GEQ(pcb->rcv_nxt, pcb->rcv_rtt_seq))
+    {
+        const uint32_t sample = std::max(now - pcb->rcv_rtt_time, uint32_t(1));
+        /* the estimate is an upper bound (the peer may not have sent at once):
+           follow decreases quickly and increases slowly */
+        if (pcb->cold.rcv_rtt == 0 || sample < pcb->cold.rcv_rtt)
+        {
+            pcb->cold.rcv_rtt = sample;
+        }
+        else
+        {
+            pcb->cold.rcv_rtt = (7 * pcb->cold.rcv_rtt + sample) / 8;
+        }
+        pcb->rcv_rtt_time = 0;
+    }
+    if (pcb->rcv_rtt_time == 0)
+    {
+        pcb->rcv_rtt_seq = pcb->rcv_nxt + pcb->rcv_ann_wnd;
+        pcb->rcv_rtt_time = now | 1;
+    }
+}
+
+///
+/// Account for data taken by the application, called by tcp_recved(). Once
+/// per RTT, grow the buffer to twice what was drained in the last RTT if the
+/// drain rate went up.
+///
+void
+tcp_rcvbuf_drained(struct TcpPcb* pcb, const uint32_t len)
+{
+    pcb->cold.rcv_drained += len;
+    const uint32_t now = sys_now();
+    if (pcb->cold.rcv_rtt == 0 || now - pcb->cold.rcv_space_time < pcb->cold.rcv_rtt)
+    {
+        return;
+    }
+    if (pcb->cold.rcv_drained > pcb->cold.rcv_space)
+    {
+        tcp_rcvbuf_grow(pcb, TcpWndSize(std::min(2 * size_t(pcb->cold.rcv_drained),
+                                                 size_t(TCP_WND_AUTOTUNE_MAX))));
+    }
+    pcb->cold.rcv_space = pcb->cold.rcv_drained;
+    pcb->cold.rcv_drained = 0;
+    pcb->cold.rcv_space_time = now;
+}
+
+///
+/// Shrink the buffer of a connection that no longer needs it. Called from
+/// tcp_slowtmr() for every active pcb.
+///
+void
+tcp_rcvbuf_tmr(struct TcpPcb* pcb)
+{
+    if (pcb->rcv_wnd_max <= tcp_rcvbuf_base(pcb))
+    {
+        return;
+    }
+    if (sys_now() - pcb->cold.rcv_space_time >= TCP_RCVBUF_IDLE)
+    {
+        /* the application stopped reading (or the peer stopped sending) */
+        tcp_rcvbuf_shrink(pcb, pcb->rcv_wnd_max / 2);
+        pcb->cold.rcv_space = 0;
+    }
+    else if (tcp_rcvbuf_total > TCP_RCVBUF_BUDGET / 4 * 3 &&
+        2 * size_t(pcb->cold.rcv_space) < pcb->rcv_wnd_max)
+    {
+        /* memory is getting short: give back what the last RTT did not need */
+        tcp_rcvbuf_shrink(pcb, std::max(TcpWndSize(2 * pcb->cold.rcv_space), pcb->rcv_wnd_max / 2));
+    }
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,49 @@
+///
+/// file: tcp_rcvbuf.h
+///
+/// Receive buffer autotuning for TCP. Every connection starts with the static
+/// TCP_WND. Its receive window (pcb->rcv_wnd_max, the size of the buffer the
+/// window is announced from) then follows what the application actually
+/// drains per receiver-side RTT, similar to dynamic right-sizing (Linux DRS):
+///
+/// - tcp_receive() samples the RTT as the time it takes the peer to fill the
+///   window announced when the sample started;
+/// - tcp_recved() counts the bytes the application took; once per RTT the
+///   buffer is grown to twice that amount if it went up, so the window stays
+///   ahead of the sender's congestion window;
+/// - tcp_slowtmr() shrinks buffers back towards TCP_WND when a connection
+///   stops draining, or when the grown windows of all connections get close
+///   to TCP_RCVBUF_BUDGET and the buffer is larger than the connection needs.
+///
+/// Growth beyond 64K needs the window scale option; TCP_RCV_SCALE is chosen
+/// so that TCP_WND_AUTOTUNE_MAX can be announced. A shrink never retracts a
+/// window that was already announced: only the unannounced part is taken
+/// away at once, the rest as the application drains the buffer.
+///
+
+#pragma once
+
+#include <tcp_priv.h>
+
+void
+tcp_rcvbuf_init(struct TcpPcb* pcb);
+
+void
+tcp_rcvbuf_release(struct TcpPcb* pcb);
+
+void
+tcp_rcvbuf_data(struct TcpPcb* pcb);
+
+void
+tcp_rcvbuf_drained(struct TcpPcb* pcb, uint32_t len);
+
+void
+tcp_rcvbuf_tmr(struct TcpPcb* pcb);
+
+/// Bytes by which the receive buffers of all connections exceed their initial
+/// window, bounded by TCP_RCVBUF_BUDGET.
+extern size_t tcp_rcvbuf_total;
+
+//
+// END OF FILE
+//
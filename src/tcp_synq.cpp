@@ -0,0 +1,463 @@
+///
+/// file: tcp_synq.cpp
+///
+/// SYN-RECEIVED request table and SYN cookies, see tcp_synq.h.
+///
+
+#include <arch.h>
+#include <cstring>
+#include <def.h>
+#include <lwip_debug.h>
+#include <opt.h>
+#include <sys.h>
+#include <tcp_synq.h>
+
+size_t tcp_synq_count;
+
+/* 4-tuple hash table; TCP_SYNQ_SIZE is a power of two */
+static TcpSynReq* tcp_synq_hash[TCP_SYNQ_SIZE];
+
+/* all requests, oldest first */
+static TcpSynReq* tcp_synq_oldest;
+static TcpSynReq* tcp_synq_newest;
+
+/* key of the hash used for the table index and for cookies */
+static uint64_t tcp_synq_secret[2];
+
+/* MSS values a cookie can carry, ascending */
+static const uint16_t TCP_SYNCOOKIE_MSS[8] = {536, 1024, 1220, 1300, 1400, 1440, 1460, 8960};
+
+
+static void
+tcp_synq_addr_store(Ip6Addr& dst, const IpAddrInfo& src)
+{
+    if (is_ip_addr_v6(src))
+    {
+        dst = src.u_addr.ip6.addr;
+    }
+    else
+    {
+        memset(&dst, 0, sizeof(dst));
+        dst.word[0] = src.u_addr.ip4.address.addr;
+    }
+}
+
+static bool
+tcp_synq_addr_equal(const Ip6Addr& a, const IpAddrInfo& b)
+{
+    if (is_ip_addr_v6(b))
+    {
+        return memcmp(&a, &b.u_addr.ip6.addr, sizeof(a)) == 0;
+    }
+    return a.word[0] == b.u_addr.ip4.address.addr;
+}
+
+static uint64_t
+tcp_synq_rotl(const uint64_t x, const int b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+///
+/// SipHash-2-4 of 'n' 32-bit words under tcp_synq_secret. Keyed, so neither
+/// table buckets nor cookies can be predicted from outside.
+///
+uint64_t
+tcp_synq_siphash(const uint32_t* words, const size_t n)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ tcp_synq_secret[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ tcp_synq_secret[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ tcp_synq_secret[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ tcp_synq_secret[1];
+    const auto sipround = [&]()
+    {
+        v0 += v1;
+        v1 = tcp_synq_rotl(v1, 13);
+        v1 ^= v0;
+        v0 = tcp_synq_rotl(v0, 32);
+        v2 += v3;
+        v3 = tcp_synq_rotl(v3, 16);
+        v3 ^= v2;
+        v0 += v3;
+        v3 = tcp_synq_rotl(v3, 21);
+        v3 ^= v0;
+        v2 += v1;
+        v1 = tcp_synq_rotl(v1, 17);
+        v1 ^= v2;
+        v2 = tcp_synq_rotl(v2, 32);
+    };
+    size_t i = 0;
+    for (; i + 1 < n; i += 2)
+    {
+        const uint64_t m = words[i] | (uint64_t(words[i + 1]) << 32);
+        v3 ^= m;
+        sipround();
+        sipround();
+        v0 ^= m;
+    }
+    uint64_t last = uint64_t(n * 4) << 56;
+    if (i < n)
+    {
+        last |= words[i];
+    }
+    v3 ^= last;
+    sipround();
+    sipround();
+    v0 ^= last;
+    v2 ^= 0xff;
+    sipround();
+    sipround();
+    sipround();
+    sipround();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+///
+/// Lay out a 4-tuple as hash input, TCP_SYNQ_TUPLE_WORDS words.
+///
+void
+tcp_synq_tuple_words(uint32_t* words,
+                     const IpAddrInfo& local_ip,
+                     const uint16_t local_port,
+                     const IpAddrInfo& remote_ip,
+                     const uint16_t remote_port)
+{
+    Ip6Addr local{};
+    Ip6Addr remote{};
+    tcp_synq_addr_store(local, local_ip);
+    tcp_synq_addr_store(remote, remote_ip);
+    memcpy(words, local.word, 16);
+    memcpy(words + 4, remote.word, 16);
+    words[8] = (uint32_t(remote_port) << 16) | local_port;
+}
+
+static uint32_t
+tcp_synq_hash_index(const IpAddrInfo& local_ip,
+                    const uint16_t local_port,
+                    const IpAddrInfo& remote_ip,
+                    const uint16_t remote_port)
+{
+    uint32_t words[TCP_SYNQ_TUPLE_WORDS];
+    tcp_synq_tuple_words(words, local_ip, local_port, remote_ip, remote_port);
+    return uint32_t(tcp_synq_siphash(words, TCP_SYNQ_TUPLE_WORDS)) & (TCP_SYNQ_SIZE - 1);
+}
+
+///
+/// Pick a new hash key. Called from tcp_init(); cookies handed out before
+/// become invalid.
+///
+void
+tcp_synq_init()
+{
+    tcp_synq_secret[0] = (uint64_t(lwip_rand()) << 32) | lwip_rand();
+    tcp_synq_secret[1] = (uint64_t(lwip_rand()) << 32) | lwip_rand();
+}
+
+///
+/// Find the pending connection request of a 4-tuple, or nullptr.
+///
+TcpSynReq*
+tcp_synq_lookup(const IpAddrInfo& local_ip,
+                const uint16_t local_port,
+                const IpAddrInfo& remote_ip,
+                const uint16_t remote_port)
+{
+    if (tcp_synq_count == 0)
+    {
+        return nullptr;
+    }
+    TcpSynReq* req = tcp_synq_hash[tcp_synq_hash_index(local_ip,
+                                                       local_port,
+                                                       remote_ip,
+                                                       remote_port)];
+    for (; req != nullptr; req = req->hash_next)
+    {
+        if (req->local_port == local_port && req->remote_port == remote_port && req->
+            addr_type == uint8_t(get_ip_addr_type(remote_ip)) && tcp_synq_addr_equal(
+                req->remote_addr,
+                remote_ip) && tcp_synq_addr_equal(req->local_addr, local_ip))
+        {
+            return req;
+        }
+    }
+    return nullptr;
+}
+
+///
+/// Check whether a listener may queue another request. If not, new SYNs
+/// are answered with a cookie (or dropped without TCP_SYN_COOKIES).
+///
+bool
+tcp_synq_full(const TcpPcbListen* lpcb)
+{
+    return tcp_synq_count >= TCP_SYNQ_SIZE || lpcb->syn_pending >= TCP_SYNQ_LISTEN_MAX;
+}
+
+///
+/// Queue a connection request for a listener.
+///
+/// @param req the request as parsed from the SYN (ports, irs, iss, options)
+/// @return the queued copy, nullptr if it could not be allocated
+///
+TcpSynReq*
+tcp_synq_add(TcpPcbListen* lpcb,
+             const TcpSynReq& req,
+             const IpAddrInfo& local_ip,
+             const IpAddrInfo& remote_ip)
+{
+    const auto nreq = new TcpSynReq(req);
+    if (nreq == nullptr)
+    {
+        return nullptr;
+    }
+    nreq->listener = lpcb;
+    tcp_synq_addr_store(nreq->local_addr, local_ip);
+    tcp_synq_addr_store(nreq->remote_addr, remote_ip);
+    nreq->addr_type = uint8_t(get_ip_addr_type(local_ip));
+    nreq->rtx_tick = tcp_ticks;
+    nreq->nrtx = 0;
+    const auto idx = tcp_synq_hash_index(local_ip,
+                                         req.local_port,
+                                         remote_ip,
+                                         req.remote_port);
+    nreq->hash_next = tcp_synq_hash[idx];
+    tcp_synq_hash[idx] = nreq;
+    nreq->age_next = nullptr;
+    nreq->age_prev = tcp_synq_newest;
+    if (tcp_synq_newest != nullptr)
+    {
+        tcp_synq_newest->age_next = nreq;
+    }
+    else
+    {
+        tcp_synq_oldest = nreq;
+    }
+    tcp_synq_newest = nreq;
+    tcp_synq_count++;
+    lpcb->syn_pending++;
+    /* SYN-ACK retransmissions need the slow timer even without active pcbs */
+    tcp_timer_needed();
+    return nreq;
+}
+
+///
+/// Unlink a request from the table and free it.
+///
+void
+tcp_synq_remove(TcpSynReq* req)
+{
+    IpAddrInfo local_ip{};
+    IpAddrInfo remote_ip{};
+    tcp_synq_get_addrs(req, local_ip, remote_ip);
+    TcpSynReq** link = &tcp_synq_hash[tcp_synq_hash_index(local_ip,
+                                                          req->local_port,
+                                                          remote_ip,
+                                                          req->remote_port)];
+    while (*link != req)
+    {
+        lwip_assert("tcp_synq_remove: request not hashed", *link != nullptr);
+        link = &(*link)->hash_next;
+    }
+    *link = req->hash_next;
+    if (req->age_prev != nullptr)
+    {
+        req->age_prev->age_next = req->age_next;
+    }
+    else
+    {
+        tcp_synq_oldest = req->age_next;
+    }
+    if (req->age_next != nullptr)
+    {
+        req->age_next->age_prev = req->age_prev;
+    }
+    else
+    {
+        tcp_synq_newest = req->age_prev;
+    }
+    tcp_synq_count--;
+    req->listener->syn_pending--;
+    delete req;
+}
+
+///
+/// Drop all requests of a listener that is being closed.
+///
+void
+tcp_synq_purge(const TcpPcbListen* lpcb)
+{
+    TcpSynReq* req = tcp_synq_oldest;
+    while (req != nullptr && lpcb->syn_pending > 0)
+    {
+        TcpSynReq* next = req->age_next;
+        if (req->listener == lpcb)
+        {
+            tcp_synq_remove(req);
+        }
+        req = next;
+    }
+}
+
+///
+/// Retransmit SYN-ACKs whose timeout expired (with exponential backoff) and
+/// drop requests that were retransmitted TCP_SYNMAXRTX times. Called from
+/// tcp_slowtmr().
+///
+void
+tcp_synq_tmr()
+{
+    TcpSynReq* req = tcp_synq_oldest;
+    while (req != nullptr)
+    {
+        TcpSynReq* next = req->age_next;
+        if (tcp_ticks - req->rtx_tick >= uint32_t(TCP_SYNQ_RTO) << req->nrtx)
+        {
+            if (req->nrtx >= TCP_SYNMAXRTX)
+            {
+                Logf(true,
+                     "tcp_synq_tmr: dropping request %d -> %d\n",
+                     req->remote_port,
+                     req->local_port);
+                tcp_synq_remove(req);
+            }
+            else
+            {
+                IpAddrInfo local_ip{};
+                IpAddrInfo remote_ip{};
+                tcp_synq_get_addrs(req, local_ip, remote_ip);
+                req->nrtx++;
+                req->rtx_tick = tcp_ticks;
+                tcp_synq_send_synack(*req, local_ip, remote_ip);
+            }
+        }
+        req = next;
+    }
+}
+
+/* The 9 option bits at the bottom of a cookie */
+static uint32_t
+tcp_syncookie_data(const TcpSynReq& req)
+{
+    uint32_t mss_idx = 0;
+    while (mss_idx + 1 < LWIP_ARRAYSIZE(TCP_SYNCOOKIE_MSS) && TCP_SYNCOOKIE_MSS[mss_idx + 1]
+        <= req.mss)
+    {
+        mss_idx++;
+    }
+    const uint32_t ws = (req.flags & TCP_SYNQ_FLAG_WND_SCALE)
+                            ? std::min(uint32_t(req.snd_scale), uint32_t(14))
+                            : TCP_SYNCOOKIE_NO_WS;
+    return (mss_idx << 6) | (ws << 2) | ((req.flags & TCP_SYNQ_FLAG_SACK) ? 2 : 0) | ((
+        req.flags & TCP_SYNQ_FLAG_TIMESTAMP) ? 1 : 0);
+}
+
+/* The authenticating part of a cookie (21 bits) */
+static uint32_t
+tcp_syncookie_mac(const TcpSynReq& req,
+                  const IpAddrInfo& local_ip,
+                  const IpAddrInfo& remote_ip,
+                  const uint32_t counter,
+                  const uint32_t data)
+{
+    uint32_t words[TCP_SYNQ_TUPLE_WORDS + 3];
+    tcp_synq_tuple_words(words, local_ip, req.local_port, remote_ip, req.remote_port);
+    words[TCP_SYNQ_TUPLE_WORDS] = req.irs;
+    words[TCP_SYNQ_TUPLE_WORDS + 1] = counter;
+    words[TCP_SYNQ_TUPLE_WORDS + 2] = data;
+    return uint32_t(tcp_synq_siphash(words, LWIP_ARRAYSIZE(words))) & 0x1fffff;
+}
+
+static uint32_t
+tcp_syncookie_counter()
+{
+    return (sys_now() / TCP_SYNCOOKIE_PERIOD) & 0x3;
+}
+
+///
+/// Compute the cookie to use as ISS for a SYN that is not queued.
+///
+/// @param req the request as parsed from the SYN (ports, irs, options)
+///
+uint32_t
+tcp_syncookie_make(const TcpSynReq& req,
+                   const IpAddrInfo& local_ip,
+                   const IpAddrInfo& remote_ip)
+{
+    const uint32_t counter = tcp_syncookie_counter();
+    const uint32_t data = tcp_syncookie_data(req);
+    return (counter << 30) | (tcp_syncookie_mac(req, local_ip, remote_ip, counter, data) <<
+        9) | data;
+}
+
+///
+/// Validate the cookie acknowledged by a bare ACK to a listener and decode
+/// the SYN options it carries.
+///
+/// @param req ports and irs (the ACK's seqno - 1) set by the caller; iss,
+///            mss, snd_scale and flags are filled in on success
+/// @param cookie the ACK's ackno - 1
+/// @return true if the cookie is one of ours and not older than two periods
+///
+bool
+tcp_syncookie_check(TcpSynReq& req,
+                    const uint32_t cookie,
+                    const IpAddrInfo& local_ip,
+                    const IpAddrInfo& remote_ip)
+{
+    const uint32_t counter = cookie >> 30;
+    if (((tcp_syncookie_counter() - counter) & 0x3) > 1)
+    {
+        return false;
+    }
+    const uint32_t data = cookie & 0x1ff;
+    if (((cookie >> 9) & 0x1fffff) != tcp_syncookie_mac(req,
+                                                       local_ip,
+                                                       remote_ip,
+                                                       counter,
+                                                       data))
+    {
+        return false;
+    }
+    const uint32_t ws = (data >> 2) & 0x0f;
+    req.iss = cookie;
+    req.mss = TCP_SYNCOOKIE_MSS[data >> 6];
+    req.flags = 0;
+    if (ws != TCP_SYNCOOKIE_NO_WS)
+    {
+        req.snd_scale = uint8_t(ws);
+        req.flags |= TCP_SYNQ_FLAG_WND_SCALE;
+    }
+    if (data & 2)
+    {
+        req.flags |= TCP_SYNQ_FLAG_SACK;
+    }
+    if (data & 1)
+    {
+        req.flags |= TCP_SYNQ_FLAG_TIMESTAMP;
+    }
+    return true;
+}
+
+///
+/// Rebuild the full addresses of a request, for output.
+///
+void
+tcp_synq_get_addrs(const TcpSynReq* req, IpAddrInfo& local_ip, IpAddrInfo& remote_ip)
+{
+    local_ip.type = IpAddrType(req->addr_type);
+    remote_ip.type = IpAddrType(req->addr_type);
+    if (req->addr_type == IPADDR_TYPE_V6)
+    {
+        local_ip.u_addr.ip6.addr = req->local_addr;
+        remote_ip.u_addr.ip6.addr = req->remote_addr;
+    }
+    else
+    {
+        local_ip.u_addr.ip4.address.addr = req->local_addr.word[0];
+        remote_ip.u_addr.ip4.address.addr = req->remote_addr.word[0];
+    }
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,149 @@
+///
+/// file: tcp_synq.h
+///
+/// SYN-RECEIVED handling for listening TCP pcbs. A SYN no longer allocates a
+/// full TcpPcb: the handshake is tracked in a TcpSynReq that holds the 4-tuple,
+/// both initial sequence numbers and the options negotiated in the SYN. The
+/// TcpPcb is only created by tcp_listen_input() when the final ACK arrives.
+///
+/// When the request table (or a listener's share of it) is full, the SYN-ACK
+/// is sent statelessly instead: its ISS is a SYN cookie that encodes the MSS,
+/// window scale, SACK-permitted and timestamp options of the SYN and is
+/// authenticated by a keyed hash, so the connection can be rebuilt from the
+/// final ACK alone.
+///
+/// Cookie layout (the ISS of the SYN-ACK):
+///   bits 31..30  time counter, TCP_SYNCOOKIE_PERIOD ms per step
+///   bits 29..9   keyed hash of the 4-tuple, peer ISN, counter and bits 8..0
+///   bits  8..6   index into the MSS table
+///   bits  5..2   peer window scale, TCP_SYNCOOKIE_NO_WS if none
+///   bit   1      SACK permitted
+///   bit   0      timestamps
+///
+/// A cookie is only accepted in the period it was made in and the next, so
+/// two counter bits are enough and the rest go to the hash. An off-path
+/// attacker forging the final ACK has to guess 21 bits for one 4-tuple and
+/// peer ISN, and gets two periods to do it in before the counter moves on.
+///
+
+#pragma once
+
+#include <cstdint>
+#include <ip_addr.h>
+#include <tcp_priv.h>
+
+/// A connection request in SYN-RECEIVED. Addresses are kept as raw words
+/// (IPv4 in word[0]) like TIME-WAIT records.
+struct TcpSynReq
+{
+    TcpSynReq* hash_next;
+    /// Age list, oldest first; walked by tcp_synq_tmr().
+    TcpSynReq* age_prev;
+    TcpSynReq* age_next;
+    TcpPcbListen* listener;
+    Ip6Addr local_addr;
+    Ip6Addr remote_addr;
+    /// Initial sequence number of the peer (the SYN's seqno).
+    uint32_t irs;
+    /// Our initial sequence number (the SYN-ACK's seqno).
+    uint32_t iss;
+    uint32_t ts_recent;
+    /// tcp_ticks when the SYN-ACK was last sent.
+    uint32_t rtx_tick;
+    uint16_t local_port;
+    uint16_t remote_port;
+    /// MSS announced by the peer, 536 (RFC 1122) if it sent none.
+    uint16_t mss;
+    /// Window of the SYN (never scaled).
+    uint16_t snd_wnd;
+    uint8_t snd_scale;
+    uint8_t addr_type;
+    /// Number of SYN-ACK retransmissions.
+    uint8_t nrtx;
+    /// TCP_SYNQ_FLAG_* below.
+    uint8_t flags;
+};
+
+constexpr auto TCP_SYNQ_FLAG_WND_SCALE = 0x01U;
+constexpr auto TCP_SYNQ_FLAG_SACK = 0x02U;
+constexpr auto TCP_SYNQ_FLAG_TIMESTAMP = 0x04U;
+/// ECN agreed: the SYN-ACK carries ECE (not kept in SYN cookies)
+constexpr auto TCP_SYNQ_FLAG_ECN = 0x08U;
+/// The SYN asked for a Fast Open cookie, or sent an invalid one: the SYN-ACK
+/// carries a fresh cookie.
+constexpr auto TCP_SYNQ_FLAG_TFO_COOKIE = 0x10U;
+
+/// Initial SYN-ACK retransmission timeout in ticks of TCP_SLOW_INTERVAL,
+/// doubled with every retransmission (3 s, as the initial rto of a pcb).
+constexpr auto TCP_SYNQ_RTO = 3000 / TCP_SLOW_INTERVAL;
+
+/// Length of one step of the cookie time counter; a cookie is accepted
+/// for one to two periods.
+constexpr auto TCP_SYNCOOKIE_PERIOD = 64000U;
+constexpr auto TCP_SYNCOOKIE_NO_WS = 0x0fU;
+
+/// Words tcp_synq_tuple_words() lays a 4-tuple out in.
+constexpr auto TCP_SYNQ_TUPLE_WORDS = 9;
+
+void
+tcp_synq_init();
+
+TcpSynReq*
+tcp_synq_lookup(const IpAddrInfo& local_ip,
+                uint16_t local_port,
+                const IpAddrInfo& remote_ip,
+                uint16_t remote_port);
+
+bool
+tcp_synq_full(const TcpPcbListen* lpcb);
+
+TcpSynReq*
+tcp_synq_add(TcpPcbListen* lpcb,
+             const TcpSynReq& req,
+             const IpAddrInfo& local_ip,
+             const IpAddrInfo& remote_ip);
+
+void
+tcp_synq_remove(TcpSynReq* req);
+
+void
+tcp_synq_purge(const TcpPcbListen* lpcb);
+
+void
+tcp_synq_tmr();
+
+uint32_t
+tcp_syncookie_make(const TcpSynReq& req,
+                   const IpAddrInfo& local_ip,
+                   const IpAddrInfo& remote_ip);
+
+bool
+tcp_syncookie_check(TcpSynReq& req,
+                    uint32_t cookie,
+                    const IpAddrInfo& local_ip,
+                    const IpAddrInfo& remote_ip);
+
+LwipStatus
+tcp_synq_send_synack(const TcpSynReq& req,
+                     const IpAddrInfo& local_ip,
+                     const IpAddrInfo& remote_ip);
+
+void
+tcp_synq_get_addrs(const TcpSynReq* req, IpAddrInfo& local_ip, IpAddrInfo& remote_ip);
+
+uint64_t
+tcp_synq_siphash(const uint32_t* words, size_t n);
+
+void
+tcp_synq_tuple_words(uint32_t* words,
+                     const IpAddrInfo& local_ip,
+                     uint16_t local_port,
+                     const IpAddrInfo& remote_ip,
+                     uint16_t remote_port);
+
+/// Number of connection requests currently held in the table.
+extern size_t tcp_synq_count;
+
+//
+// END OF FILE
+//
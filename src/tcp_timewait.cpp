@@ -0,0 +1,314 @@
+///
+/// file: tcp_timewait.cpp
+///
+/// Compact TIME-WAIT records, see tcp_timewait.h.
+///
+
+#include <cstring>
+#include <lwip_debug.h>
+#include <opt.h>
+#include <tcp_timewait.h>
+
+size_t tcp_tw_count;
+
+/* 4-tuple hash table; TCP_TW_HASH_SIZE is a power of two */
+static TcpTwRecord* tcp_tw_hash[TCP_TW_HASH_SIZE];
+
+/* local port hash table, for tcp_timewait_port_used() */
+static TcpTwRecord* tcp_tw_port_hash[TCP_TW_HASH_SIZE];
+
+/* expiry wheel, slot tcp_tw_wheel_pos is the one expired last */
+static TcpTwRecord* tcp_tw_wheel[TCP_TW_WHEEL_SLOTS];
+static uint16_t tcp_tw_wheel_pos;
+
+static void
+tcp_tw_addr_store(Ip6Addr& dst, const IpAddrInfo& src)
+{
+    if (is_ip_addr_v6(src))
+    {
+        dst = src.u_addr.ip6.addr;
+    }
+    else
+    {
+        memset(&dst, 0, sizeof(dst));
+        dst.word[0] = src.u_addr.ip4.address.addr;
+    }
+}
+
+static bool
+tcp_tw_addr_equal(const Ip6Addr& a, const IpAddrInfo& b)
+{
+    if (is_ip_addr_v6(b))
+    {
+        return memcmp(&a, &b.u_addr.ip6.addr, sizeof(a)) == 0;
+    }
+    return a.word[0] == b.u_addr.ip4.address.addr;
+}
+
+static uint32_t
+tcp_tw_hash_index(const IpAddrInfo& local_ip,
+                  const uint16_t local_port,
+                  const IpAddrInfo& remote_ip,
+                  const uint16_t remote_port)
+{
+    /* the remote address and port carry most of the entropy; the local side
+       is folded in so that multihomed hosts spread as well */
+    uint32_t h = (uint32_t(remote_port) << 16) ^ local_port;
+    if (is_ip_addr_v6(remote_ip))
+    {
+        for (const auto w : remote_ip.u_addr.ip6.addr.word)
+        {
+            h = (h ^ w) * 0x9E3779B1U;
+        }
+        h ^= local_ip.u_addr.ip6.addr.word[3];
+    }
+    else
+    {
+        h = (h ^ remote_ip.u_addr.ip4.address.addr) * 0x9E3779B1U;
+        h ^= local_ip.u_addr.ip4.address.addr;
+    }
+    h ^= h >> 16;
+    return h & (TCP_TW_HASH_SIZE - 1);
+}
+
+static void
+tcp_tw_wheel_insert(TcpTwRecord* tw)
+{
+    tw->slot = uint16_t((tcp_tw_wheel_pos + TCP_TW_TICKS) % TCP_TW_WHEEL_SLOTS);
+    tw->wheel_prev = nullptr;
+    tw->wheel_next = tcp_tw_wheel[tw->slot];
+    if (tw->wheel_next != nullptr)
+    {
+        tw->wheel_next->wheel_prev = tw;
+    }
+    tcp_tw_wheel[tw->slot] = tw;
+}
+
+static void
+tcp_tw_wheel_remove(TcpTwRecord* tw)
+{
+    if (tw->wheel_prev != nullptr)
+    {
+        tw->wheel_prev->wheel_next = tw->wheel_next;
+    }
+    else
+    {
+        tcp_tw_wheel[tw->slot] = tw->wheel_next;
+    }
+    if (tw->wheel_next != nullptr)
+    {
+        tw->wheel_next->wheel_prev = tw->wheel_prev;
+    }
+}
+
+/* Unlink a record from the hash table and the wheel and free it */
+static void
+tcp_tw_free(TcpTwRecord* tw)
+{
+    IpAddrInfo local_ip{};
+    IpAddrInfo remote_ip{};
+    tcp_timewait_get_addrs(tw, local_ip, remote_ip);
+    TcpTwRecord** link = &tcp_tw_hash[tcp_tw_hash_index(local_ip,
+                                                        tw->local_port,
+                                                        remote_ip,
+                                                        tw->remote_port)];
+    while (*link != tw)
+    {
+        lwip_assert("tcp_tw_free: record not hashed", *link != nullptr);
+        link = &(*link)->hash_next;
+    }
+    *link = tw->hash_next;
+    link = &tcp_tw_port_hash[tw->local_port & (TCP_TW_HASH_SIZE - 1)];
+    while (*link != tw)
+    {
+        lwip_assert("tcp_tw_free: record not hashed by port", *link != nullptr);
+        link = &(*link)->port_next;
+    }
+    *link = tw->port_next;
+    tcp_tw_wheel_remove(tw);
+    tcp_tw_count--;
+    port_alloc_unref(tcp_ports, tw->local_port);
+    delete tw;
+}
+
+///
+/// Replace a TIME-WAIT pcb by a compact record. The pcb is taken off
+/// tcp_tw_pcbs and freed. Only called once tcp_input() is done with the pcb,
+/// after the final ACK has gone out.
+///
+/// @return true if the pcb was replaced; false if no record could be
+///         allocated, in which case the pcb stays on tcp_tw_pcbs and is
+///         reaped by tcp_slowtmr() as before
+///
+bool
+tcp_timewait_compact(struct TcpPcb* pcb)
+{
+    lwip_assert("tcp_timewait_compact: pcb not in TIME-WAIT", pcb->state == TIME_WAIT);
+    const auto tw = new TcpTwRecord;
+    if (tw == nullptr)
+    {
+        return false;
+    }
+    tcp_tw_addr_store(tw->local_addr, pcb->local_ip);
+    tcp_tw_addr_store(tw->remote_addr, pcb->remote_ip);
+    tw->addr_type = uint8_t(get_ip_addr_type(pcb->local_ip));
+    tw->local_port = pcb->local_port;
+    tw->remote_port = pcb->remote_port;
+    tw->snd_nxt = pcb->snd_nxt;
+    tw->rcv_nxt = pcb->rcv_nxt;
+    tw->wnd = TCPWND_MIN16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd));
+    tw->rcv_wnd = pcb->rcv_wnd;
+    tw->ts_recent = pcb->ts_recent;
+    tw->flags = (pcb->flags & TF_TIMESTAMP) ? TCP_TW_FLAG_TIMESTAMP : 0;
+    tw->ttl = pcb->ttl;
+    tw->tos = pcb->tos;
+    const auto idx = tcp_tw_hash_index(pcb->local_ip,
+                                       pcb->local_port,
+                                       pcb->remote_ip,
+                                       pcb->remote_port);
+    tw->hash_next = tcp_tw_hash[idx];
+    tcp_tw_hash[idx] = tw;
+    const auto port_idx = tw->local_port & (TCP_TW_HASH_SIZE - 1);
+    tw->port_next = tcp_tw_port_hash[port_idx];
+    tcp_tw_port_hash[port_idx] = tw;
+    tcp_tw_wheel_insert(tw);
+    tcp_tw_count++;
+    /* the record keeps the local port in use after the pcb lets go of it */
+    port_alloc_ref(tcp_ports, tw->local_port);
+    tcp_pcb_remove(&tcp_tw_pcbs, pcb);
+    tcp_free(pcb);
+    return true;
+}
+
+///
+/// Find the TIME-WAIT record of a 4-tuple, or nullptr.
+///
+TcpTwRecord*
+tcp_timewait_lookup(const IpAddrInfo& local_ip,
+                    const uint16_t local_port,
+                    const IpAddrInfo& remote_ip,
+                    const uint16_t remote_port)
+{
+    TcpTwRecord* tw = tcp_tw_hash[tcp_tw_hash_index(local_ip,
+                                                    local_port,
+                                                    remote_ip,
+                                                    remote_port)];
+    for (; tw != nullptr; tw = tw->hash_next)
+    {
+        if (tw->local_port == local_port && tw->remote_port == remote_port && tw->
+            addr_type == uint8_t(get_ip_addr_type(remote_ip)) && tcp_tw_addr_equal(
+                tw->remote_addr,
+                remote_ip) && tcp_tw_addr_equal(tw->local_addr, local_ip))
+        {
+            return tw;
+        }
+    }
+    return nullptr;
+}
+
+///
+/// Check whether any TIME-WAIT record uses a local port, for the
+/// address-in-use check of tcp_bind().
+///
+/// @param local_ip only count records on this local address (any address
+///                 matches all); nullptr to check the port alone
+///
+bool
+tcp_timewait_port_used(const uint16_t port, const IpAddrInfo* local_ip)
+{
+    for (auto tw = tcp_tw_port_hash[port & (TCP_TW_HASH_SIZE - 1)]; tw != nullptr; tw = tw->
+         port_next)
+    {
+        if (tw->local_port != port)
+        {
+            continue;
+        }
+        if (local_ip == nullptr || is_ip_addr_any(*local_ip))
+        {
+            return true;
+        }
+        if (tw->addr_type == uint8_t(get_ip_addr_type(*local_ip)) && tcp_tw_addr_equal(
+            tw->local_addr,
+            *local_ip))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+///
+/// Restart the 2*MSL timeout of a record (FIN retransmitted by the peer).
+///
+void
+tcp_timewait_restart(TcpTwRecord* tw)
+{
+    tcp_tw_wheel_remove(tw);
+    tcp_tw_wheel_insert(tw);
+}
+
+///
+/// Expire the records whose time is up. Called from tcp_slowtmr() once per
+/// slow timer tick.
+///
+void
+tcp_timewait_tmr()
+{
+    tcp_tw_wheel_pos = uint16_t((tcp_tw_wheel_pos + 1) % TCP_TW_WHEEL_SLOTS);
+    while (tcp_tw_wheel[tcp_tw_wheel_pos] != nullptr)
+    {
+        tcp_tw_free(tcp_tw_wheel[tcp_tw_wheel_pos]);
+    }
+}
+
+///
+/// Drop the record closest to expiry to make room. Used by
+/// tcp_kill_timewait() when allocating a pcb fails.
+///
+/// @return true if a record was dropped
+///
+bool
+tcp_timewait_kill_oldest()
+{
+    if (tcp_tw_count == 0)
+    {
+        return false;
+    }
+    for (size_t i = 1; i <= TCP_TW_WHEEL_SLOTS; i++)
+    {
+        const auto slot = (tcp_tw_wheel_pos + i) % TCP_TW_WHEEL_SLOTS;
+        if (tcp_tw_wheel[slot] != nullptr)
+        {
+            Logf(true,
+                 "tcp_timewait_kill_oldest: killing TIME-WAIT record, port %d\n",
+                 tcp_tw_wheel[slot]->local_port);
+            tcp_tw_free(tcp_tw_wheel[slot]);
+            return true;
+        }
+    }
+    return false;
+}
+
+///
+/// Rebuild the full addresses of a record, for output.
+///
+void
+tcp_timewait_get_addrs(const TcpTwRecord* tw, IpAddrInfo& local_ip, IpAddrInfo& remote_ip)
+{
+    local_ip.type = IpAddrType(tw->addr_type);
+    remote_ip.type = IpAddrType(tw->addr_type);
+    if (tw->addr_type == IPADDR_TYPE_V6)
+    {
+        local_ip.u_addr.ip6.addr = tw->local_addr;
+        remote_ip.u_addr.ip6.addr = tw->remote_addr;
+    }
+    else
+    {
+        local_ip.u_addr.ip4.address.addr = tw->local_addr.word[0];
+        remote_ip.u_addr.ip4.address.addr = tw->remote_addr.word[0];
+    }
+}
+
+//
+// END OF FILE
+//
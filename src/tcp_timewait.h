@@ -0,0 +1,91 @@
+///
+/// file: tcp_timewait.h
+///
+/// Compact TIME-WAIT state for TCP. Once a connection reaches TIME-WAIT and
+/// tcp_input() is done with it, its TcpPcb is replaced by a TcpTwRecord that
+/// keeps only what is needed to answer the peer for the rest of 2*MSL: the
+/// 4-tuple, snd_nxt/rcv_nxt, the announced window and the timestamp state.
+/// Records are found through a hash table on the 4-tuple, and for tcp_bind()
+/// through one on the local port, and expire from a timer wheel with one slot
+/// per slow timer tick, so neither lookup nor expiry walks the whole TIME-WAIT
+/// population.
+///
+
+#pragma once
+
+#include <cstdint>
+#include <ip_addr.h>
+#include <tcp_priv.h>
+
+/// A connection in TIME-WAIT. Addresses are kept as raw words (IPv4 in
+/// word[0]) instead of full IpAddrInfo to keep the record small.
+struct TcpTwRecord
+{
+    TcpTwRecord* hash_next;
+    TcpTwRecord* port_next;
+    TcpTwRecord* wheel_prev;
+    TcpTwRecord* wheel_next;
+    Ip6Addr local_addr;
+    Ip6Addr remote_addr;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    /// Peer's timestamp to echo, kept current by tcp_timewait_input().
+    uint32_t ts_recent;
+    /// Receive window, unscaled, for the in-window check of a SYN.
+    TcpWndSize rcv_wnd;
+    uint16_t local_port;
+    uint16_t remote_port;
+    /// Window to announce, already scaled for the header.
+    uint16_t wnd;
+    /// Wheel slot the record expires in.
+    uint16_t slot;
+    uint8_t addr_type;
+    /// IP TTL and TOS of the connection, for the ACKs sent from the record.
+    uint8_t ttl;
+    uint8_t tos;
+    /// TCP_TW_FLAG_* below.
+    uint8_t flags;
+};
+
+constexpr auto TCP_TW_FLAG_TIMESTAMP = 0x01U;
+
+/// Ticks of TCP_SLOW_INTERVAL a record lives, as the TIME-WAIT reaping in
+/// tcp_slowtmr() used for full pcbs.
+constexpr auto TCP_TW_TICKS = 2 * TCP_MSL / TCP_SLOW_INTERVAL + 1;
+/// One slot more than TCP_TW_TICKS, so a record is never queued into the
+/// slot being expired.
+constexpr auto TCP_TW_WHEEL_SLOTS = TCP_TW_TICKS + 1;
+
+bool
+tcp_timewait_compact(struct TcpPcb* pcb);
+
+TcpTwRecord*
+tcp_timewait_lookup(const IpAddrInfo& local_ip,
+                    uint16_t local_port,
+                    const IpAddrInfo& remote_ip,
+                    uint16_t remote_port);
+
+bool
+tcp_timewait_port_used(uint16_t port, const IpAddrInfo* local_ip);
+
+void
+tcp_timewait_restart(TcpTwRecord* tw);
+
+void
+tcp_timewait_tmr();
+
+bool
+tcp_timewait_kill_oldest();
+
+LwipStatus
+tcp_timewait_send_ack(const TcpTwRecord* tw);
+
+void
+tcp_timewait_get_addrs(const TcpTwRecord* tw, IpAddrInfo& local_ip, IpAddrInfo& remote_ip);
+
+/// Number of connections currently held as TIME-WAIT records.
+extern size_t tcp_tw_count;
+
+//
+// END OF FILE
+//
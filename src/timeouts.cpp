@@ -6,6 +6,7 @@
 #include <dns.h>
 #include <etharp.h>
 #include <igmp.h>
+#include <ip4_conntrack.h>
 #include <ip4_frag.h>
 #include <ip6_frag.h>
 #include <mld6.h>
@@ -13,6 +14,8 @@
 #include <packet_buffer.h>
 #include <sys.h>
 #include <tcp_priv.h>
+#include <tcp_synq.h>
+#include <tcp_timewait.h>
 #include <tcpip_priv.h>
 #include <timeouts.h>
 #include <lwip_debug.h>
@@ -32,7 +35,6 @@
 //     /* The TCP timer is a special case: it does not have to run always and
 //        is triggered to start from TCP using tcp_timer_needed() */
 //     {TCP_TMR_INTERVAL, tcp_tmr, "tcp_tmr"},
-//     {IP_TMR_INTERVAL, ip_reass_tmr, "ip_reass_tmr"},
 //     {kArpTmrInterval, etharp_tmr, "etharp_tmr"},
 //     {DHCP_COARSE_TIMER_MSECS, dhcp_coarse_tmr, "dhcp_coarse_tmr"},
 //     {DHCP_FINE_TIMER_MSECS, dhcp_fine_tmr, "dhcp_fine_tmr"},
@@ -49,6 +51,13 @@
 
 // const int NUM_CYCLIC_TIMERS = LWIP_ARRAYSIZE(lwip_cyclic_timers);
 
+/** Cyclic timers started by sys_timeouts_init() while the table above is
+ * commented out */
+static const struct CyclicTimer lwip_running_timers[] = {
+    {IP_TMR_INTERVAL, HANDLER(ip_reass_tmr)},
+    {IP4_CT_TMR_INTERVAL, HANDLER(ip4_conntrack_tmr)},
+};
+
 /** The one and only timeout list */
 static struct SysTimeoutContext *next_timeout;
 
@@ -57,6 +66,9 @@ static uint32_t current_timeout_due_time;
 /** global variable that shows if the tcp timer is currently scheduled or not */
 static int tcpip_tcp_timer_active;
 
+static void
+sys_timeout_abs(uint32_t abs_time, SysTimeoutHandler handler, void* arg, const char *handler_name);
+
 
 /**
  * Create a one-shot timer (aka timeout). Timeouts are processed in the
@@ -64,18 +76,20 @@ static int tcpip_tcp_timer_active;
  * - while waiting for a message using sys_timeouts_mbox_fetch()
  * - by calling sys_check_timeouts() (NO_SYS==1 only)
  *
+ * Called through the sys_timeout() macro, which passes the handler's name.
+ *
  * @param msecs time in milliseconds after that the timer should expire
  * @param handler callback function to call when msecs have elapsed
  * @param arg argument to pass to the callback function
+ * @param handler_name name of handler, for the debug log
  */
-void sys_timeout(uint32_t msecs, SysTimeoutHandler handler, void* arg)
+void sys_timeout_debug(uint32_t msecs, SysTimeoutHandler handler, void* arg, const char* handler_name)
 {
     lwip_assert("Timeout time too long, max is LWIP_UINT32_MAX/4 msecs",
                 msecs <= (kLwipUint32Max / 4));
     uint32_t next_timeout_time = uint32_t(sys_now() + msecs);
     /* overflow handled by TIME_LESS_THAN macro */
-    // fixme: handler_name missing
-    // sys_timeout_abs(next_timeout_time, handler, arg, handler_name);
+    sys_timeout_abs(next_timeout_time, handler, arg, handler_name);
 }
 
 /**
@@ -91,7 +105,7 @@ tcpip_tcp_timer(void* arg)
   /* call TCP timer handler */
   tcp_tmr();
   /* timer still needed? */
-  if (tcp_active_pcbs || tcp_tw_pcbs) {
+  if (tcp_active_pcbs || tcp_tw_pcbs || tcp_tw_count || tcp_synq_count) {
     /* restart timer */
     sys_timeout(TCP_TMR_INTERVAL, tcpip_tcp_timer, nullptr);
   } else {
@@ -103,7 +117,8 @@ tcpip_tcp_timer(void* arg)
 /**
  * Called from TCP_REG when registering a new PCB:
  * the reason is to have the TCP timer only running when
- * there are active (or time-wait) PCBs.
+ * there are active (or time-wait) PCBs, TIME-WAIT records or pending
+ * connection requests.
  */
 void
 tcp_timer_needed(void)
@@ -111,7 +126,7 @@ tcp_timer_needed(void)
 
 
   /* timer is off but needed again? */
-  if (!tcpip_tcp_timer_active && (tcp_active_pcbs || tcp_tw_pcbs)) {
+  if (!tcpip_tcp_timer_active && (tcp_active_pcbs || tcp_tw_pcbs || tcp_tw_count || tcp_synq_count)) {
     /* enable and start timer */
     tcpip_tcp_timer_active = 1;
     sys_timeout(TCP_TMR_INTERVAL, tcpip_tcp_timer, nullptr);
@@ -206,6 +221,13 @@ sys_timeouts_init()
     //                     lwip_cyclic_timer,
     //                     (void*)&lwip_cyclic_timers[i]);
     //     }
+    for (const auto& timer : lwip_running_timers)
+    {
+        sys_timeout_abs(uint32_t(sys_now() + timer.interval_ms),
+                        lwip_cyclic_timer,
+                        (void*)&timer,
+                        timer.handler_name);
+    }
 }
 
 
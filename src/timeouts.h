@@ -42,8 +42,6 @@ extern const int NUM_CYCLIC_TIMERS;
  */
 using SysTimeoutHandler = void (*)(void*);
 
-void sys_timeout(uint32_t msecs, SysTimeoutHandler handler, void* arg);
-
 struct SysTimeoutContext
 {
     struct SysTimeoutContext* next;
@@ -58,6 +56,9 @@ void sys_timeouts_init(void);
 
 void sys_timeout_debug(uint32_t msecs, SysTimeoutHandler handler, void* arg, const char* handler_name);
 
+/** Create a one-shot timer (see sys_timeout_debug()), named after its handler */
+#define sys_timeout(msecs, handler, arg) sys_timeout_debug(msecs, handler, arg, #handler)
+
 
 
 void sys_untimeout(SysTimeoutHandler handler, void* arg);
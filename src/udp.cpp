@@ -2,6 +2,7 @@
 /// file: udp.cpp
 ///
 
+#include <algorithm>
 #include <cstring>
 #include <def.h>
 #include <icmp.h>
@@ -10,10 +11,14 @@
 #include <ip6.h>
 #include <ip6_addr.h>
 #include <ip_addr.h>
+#include <ip_ecmp.h>
 #include <lwip_debug.h>
 #include <network_interface.h>
 #include <opt.h>
+#include <port_alloc.h>
 #include <udp.h>
+#include <udp_demux.h>
+#include <udp_ring.h>
 #include "ip.h"
 
 /* From http://www.iana.org/assignments/port-numbers:
@@ -22,13 +27,9 @@ constexpr auto UDP_LOCAL_PORT_RANGE_START = 0xc000;
 
 constexpr auto UDP_LOCAL_PORT_RANGE_END = 0xffff;
 
-inline uint16_t
-UDP_ENSURE_LOCAL_PORT_RANGE(uint16_t port)
-{
-    return uint16_t(
-        ((port) & uint16_t(~UDP_LOCAL_PORT_RANGE_START)) + UDP_LOCAL_PORT_RANGE_START);
-} /* last local UDP port */
-static uint16_t udp_port = UDP_LOCAL_PORT_RANGE_START; /* The list of UDP PCBs */
+/* local UDP ports in use, and the ephemeral range udp_new_port() picks from */
+static PortAllocator udp_ports{UDP_LOCAL_PORT_RANGE_START, UDP_LOCAL_PORT_RANGE_END, {}, {}};
+/* The list of UDP PCBs */
 /* exported in udp.h (was static) */
 struct UdpPcb* udp_pcbs; /**
  * Initialize this module.
@@ -36,33 +37,17 @@ struct UdpPcb* udp_pcbs; /**
 void
 udp_init(void)
 {
-    udp_port = UDP_ENSURE_LOCAL_PORT_RANGE(lwip_rand());
+    port_alloc_init(udp_ports, UDP_LOCAL_PORT_RANGE_START, UDP_LOCAL_PORT_RANGE_END);
 } //
-// Allocate a new local UDP port.
+// Allocate a new local UDP port, picked at random among the free ports of
+// the ephemeral range (RFC 6056, algorithm 1).
 //
-// @return a new (free) local UDP port number
+// @return a new (free) local UDP port number, 0 if the range is exhausted
 //
-// todo: rewrite
 static uint16_t
 udp_new_port(void)
 {
-    uint16_t n = 0;
-again: if (udp_port++ == UDP_LOCAL_PORT_RANGE_END)
-    {
-        udp_port = UDP_LOCAL_PORT_RANGE_START;
-    } // Check all PCBs.
-    for (struct UdpPcb* pcb = udp_pcbs; pcb != nullptr; pcb = pcb->next)
-    {
-        if (pcb->local_port == udp_port)
-        {
-            if (++n > (UDP_LOCAL_PORT_RANGE_END - UDP_LOCAL_PORT_RANGE_START))
-            {
-                return 0;
-            }
-            goto again;
-        }
-    }
-    return udp_port;
+    return port_alloc_pick(udp_ports);
 } /** Common code to see if the current input packet matches the pcb
  * (current input packet is accessed via ip(4/6)_current_* macros)
  *
@@ -117,7 +102,372 @@ udp_input_local_match(struct UdpPcb* pcb, NetworkInterface& inp, bool broadcast)
             }
     }
     return 0;
-} /**
+}
+
+/* Datagrams held back for recv_batch callbacks during an input batch, see
+   udp_input_batch_begin(): one slot per pcb */
+struct UdpInputBatchSlot
+{
+    struct UdpPcb* pcb;
+    size_t count;
+    UdpRecvMsg msgs[UDP_INPUT_BATCH_MSGS];
+};
+
+static bool udp_input_batching;
+static UdpInputBatchSlot udp_input_batch_slots[UDP_INPUT_BATCH_PCBS];
+static size_t udp_input_batch_count;
+
+static void
+udp_input_batch_deliver(UdpInputBatchSlot& slot)
+{
+    /* empty the slot first: the callback owns the datagrams, and may remove
+       the pcb or receive again */
+    const size_t count = slot.count;
+    slot.count = 0;
+    if (count != 0)
+    {
+        slot.pcb->recv_batch(slot.pcb->recv_arg, slot.pcb, slot.msgs, count);
+    }
+}
+
+static void
+udp_input_batch_flush()
+{
+    for (size_t i = 0; i < udp_input_batch_count; i++)
+    {
+        if (udp_input_batch_slots[i].pcb != nullptr)
+        {
+            udp_input_batch_deliver(udp_input_batch_slots[i]);
+        }
+    }
+    udp_input_batch_count = 0;
+}
+
+/**
+ * Open an input batch: until udp_input_batch_end(), udp_input() holds back
+ * the datagrams for pcbs with a recv_batch callback, so each of them gets all
+ * its datagrams of a receive burst in one call.
+ */
+void
+udp_input_batch_begin()
+{
+    lwip_assert("udp_input_batch_begin: batch already open", !udp_input_batching);
+    udp_input_batching = true;
+}
+
+/**
+ * Close the input batch and deliver the datagrams held back during it.
+ */
+void
+udp_input_batch_end()
+{
+    udp_input_batching = false;
+    udp_input_batch_flush();
+}
+
+/* Cut p down to the payload of the UDP datagram it holds: drop the IP
+   header, any IPv6 extension headers and the UDP header, and whatever follows
+   the length the UDP header gives (link-layer padding). False if the headers
+   do not add up. */
+static bool
+udp_input_strip(struct PacketBuffer* p)
+{
+    auto& data = p->data;
+    if (data.empty())
+    {
+        return false;
+    }
+    size_t off;
+    if (data[0] >> 4 == 4)
+    {
+        off = size_t(data[0] & 0x0f) * 4;
+        if (off < IP4_HDR_LEN)
+        {
+            return false;
+        }
+    }
+    else if (data[0] >> 4 == 6 && data.size() >= IP6_HDR_LEN)
+    {
+        uint8_t nexth = data[6];
+        off = IP6_HDR_LEN;
+        while ((nexth == IP6_NEXTH_HOPBYHOP || nexth == IP6_NEXTH_ROUTING || nexth ==
+            IP6_NEXTH_DESTOPTS || nexth == IP6_NEXTH_FRAGMENT) && off + 8 <= data.size())
+        {
+            const size_t ext_len = nexth == IP6_NEXTH_FRAGMENT ? 8 : (size_t(data[off + 1]) + 1) * 8;
+            nexth = data[off];
+            off += ext_len;
+        }
+    }
+    else
+    {
+        return false;
+    }
+    if (off + UDP_HDR_LEN > data.size())
+    {
+        return false;
+    }
+    const size_t udp_len = size_t(data[off + 4]) << 8 | data[off + 5];
+    if (udp_len < UDP_HDR_LEN || off + udp_len > data.size())
+    {
+        return false;
+    }
+    data.resize(off + udp_len);
+    data.erase(data.begin(), data.begin() + off + UDP_HDR_LEN);
+    return true;
+}
+
+/* Receive aggregation: append datagram p to msg if it continues the train of
+   equal-sized datagrams of the same flow in msg. A shorter datagram ends the
+   train. Both hold UDP payload only (see udp_input_strip()), so the train is
+   the payloads back to back and segsz the payload length of each. */
+static bool
+udp_input_gro_merge(UdpRecvMsg& msg,
+                    struct PacketBuffer* p,
+                    const IpAddrInfo& addr,
+                    const uint16_t port,
+                    NetworkInterface* netif)
+{
+    const size_t held = msg.p->data.size();
+    const size_t seg = msg.segsz != 0 ? msg.segsz : held;
+    const size_t len = p->data.size();
+    if (msg.port != port || msg.netif != netif || !compare_ip_addr(msg.addr, addr) || len == 0 ||
+        len > seg || held % seg != 0 || held / seg >= UDP_GSO_MAX_SEGS ||
+        held + len > UDP_GRO_MAX_SIZE)
+    {
+        return false;
+    }
+    msg.p->data.insert(msg.p->data.end(), p->data.begin(), p->data.end());
+    msg.segsz = uint16_t(seg);
+    free_pkt_buf(p);
+    return true;
+}
+
+/* Drop the datagrams held back for a pcb that is being removed */
+static void
+udp_input_batch_forget(struct UdpPcb* pcb)
+{
+    for (size_t i = 0; i < udp_input_batch_count; i++)
+    {
+        UdpInputBatchSlot& slot = udp_input_batch_slots[i];
+        if (slot.pcb == pcb)
+        {
+            for (size_t j = 0; j < slot.count; j++)
+            {
+                free_pkt_buf(slot.msgs[j].p);
+            }
+            slot.count = 0;
+            slot.pcb = nullptr;
+            return;
+        }
+    }
+}
+
+/* Whether pcb takes datagrams: it has a receive ring or a recv callback */
+static bool
+udp_input_wanted(const struct UdpPcb* pcb)
+{
+    return pcb->ring != nullptr || pcb->recv != nullptr || pcb->recv_batch != nullptr;
+}
+
+/* Hand a datagram to the receive ring or the recv or recv_batch callback of
+   pcb, which is then responsible for freeing p */
+static void
+udp_input_deliver(struct UdpPcb* pcb,
+                  struct PacketBuffer* p,
+                  const IpAddrInfo& addr,
+                  const uint16_t port,
+                  NetworkInterface* netif)
+{
+    if (pcb->ring != nullptr)
+    {
+        /* the application threads take it from here */
+        if (!udp_ring_push(pcb->ring, UdpRecvMsg{p, addr, port, netif, 0}))
+        {
+            free_pkt_buf(p);
+        }
+        return;
+    }
+    if (pcb->recv_batch == nullptr)
+    {
+        pcb->recv(pcb->recv_arg, pcb, p, &addr, port, netif);
+        return;
+    }
+    if (!udp_input_batching)
+    {
+        UdpRecvMsg msg{p, addr, port, netif, 0};
+        pcb->recv_batch(pcb->recv_arg, pcb, &msg, 1);
+        return;
+    }
+    UdpInputBatchSlot* slot = nullptr;
+    for (size_t i = 0; i < udp_input_batch_count; i++)
+    {
+        if (udp_input_batch_slots[i].pcb == pcb)
+        {
+            slot = &udp_input_batch_slots[i];
+            break;
+        }
+    }
+    if (slot == nullptr)
+    {
+        if (udp_input_batch_count == UDP_INPUT_BATCH_PCBS)
+        {
+            /* too many pcbs in this burst: deliver what we have */
+            udp_input_batch_flush();
+        }
+        slot = &udp_input_batch_slots[udp_input_batch_count++];
+        slot->pcb = pcb;
+        slot->count = 0;
+    }
+    if (udp_is_flag_set(pcb, UDP_FLAGS_GRO) && slot->count != 0 &&
+        udp_input_gro_merge(slot->msgs[slot->count - 1], p, addr, port, netif))
+    {
+        return;
+    }
+    slot->msgs[slot->count++] = UdpRecvMsg{p, addr, port, netif, 0};
+    if (slot->count == UDP_INPUT_BATCH_MSGS)
+    {
+        udp_input_batch_deliver(*slot);
+    }
+}
+
+/* Walk a chain of the bound tier for pcbs bound to port dest and to a
+   specific address (wildcard == false) or to the any address. Returns a pcb
+   connected to port src of any address, or records the first unconnected
+   match in uncon_pcb. */
+static struct UdpPcb*
+udp_input_lookup_bound(struct UdpPcb* chain,
+                       NetworkInterface& inp,
+                       const bool wildcard,
+                       const uint16_t dest,
+                       const uint16_t src,
+                       struct UdpPcb*& uncon_pcb)
+{
+    for (struct UdpPcb* pcb = chain; pcb != nullptr; pcb = pcb->hash_next)
+    {
+        if (pcb->local_port != dest || is_ip_addr_any(pcb->local_ip) != wildcard ||
+            udp_input_local_match(pcb, inp, false) == 0)
+        {
+            continue;
+        }
+        if ((pcb->flags & UDP_FLAGS_CONNECTED) == 0)
+        {
+            if (uncon_pcb == nullptr)
+            {
+                uncon_pcb = pcb;
+            }
+        }
+        else if (pcb->remote_port == src)
+        {
+            return pcb;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Find the pcb for a datagram that is not an IPv4 broadcast through the
+ * tables of udp_demux.h.
+ * 'Perfect match' pcbs (connected to the remote port & ip address) are
+ * preferred. If no perfect match is found, the first unconnected pcb bound to
+ * the destination address gets the datagram, else the first one bound to any
+ * address.
+ */
+static struct UdpPcb*
+udp_input_lookup(NetworkInterface& inp,
+                 const IpAddrInfo& dst_ip,
+                 const uint16_t dest,
+                 const IpAddrInfo& src_ip,
+                 const uint16_t src)
+{
+    for (struct UdpPcb* pcb = udp_demux_connected(dest, src_ip, src); pcb != nullptr;
+         pcb = pcb->hash_next)
+    {
+        if (pcb->local_port == dest && pcb->remote_port == src &&
+            compare_ip_addr(pcb->remote_ip, src_ip) && udp_input_local_match(pcb, inp, false) != 0)
+        {
+            return pcb;
+        }
+    }
+    struct UdpPcb* uncon_pcb = nullptr;
+    struct UdpPcb* pcb = udp_input_lookup_bound(udp_demux_bound(dest, dst_ip),
+                                                inp,
+                                                false,
+                                                dest,
+                                                src,
+                                                uncon_pcb);
+    if (pcb == nullptr)
+    {
+        pcb = udp_input_lookup_bound(udp_demux_bound(dest, IpAddrInfo{}),
+                                     inp,
+                                     true,
+                                     dest,
+                                     src,
+                                     uncon_pcb);
+    }
+    return pcb != nullptr ? pcb : uncon_pcb;
+}
+
+/**
+ * Find the pcb for an IPv4 broadcast among the pcbs bound to port dest: a
+ * broadcast may match pcbs bound to any address of the subnet, so all of
+ * them are checked.
+ */
+static struct UdpPcb*
+udp_input_lookup_bcast(NetworkInterface& inp,
+                       const IpAddrInfo& dst_ip,
+                       const uint16_t dest,
+                       const IpAddrInfo& src_ip,
+                       const uint16_t src)
+{
+    struct UdpPcb* uncon_pcb = nullptr;
+    for (struct UdpPcb* pcb = udp_demux_port(dest); pcb != nullptr; pcb = pcb->port_next)
+    {
+        /* compare PCB local addr+port to UDP destination addr+port */
+        if ((pcb->local_port != dest) || (udp_input_local_match(pcb, inp, true) == 0))
+        {
+            continue;
+        }
+        if ((pcb->flags & UDP_FLAGS_CONNECTED) == 0)
+        {
+            if (uncon_pcb == nullptr)
+            {
+                /* the first unconnected matching PCB */
+                uncon_pcb = pcb;
+            }
+            else if (dst_ip.u_addr.ip4.address.addr == IP4_ADDR_BCAST_U32)
+            {
+                /* global broadcast address (only valid for IPv4; match was checked before) */
+                if (!is_ip_addr_v4(uncon_pcb->local_ip) || !is_ip4_addr_equal(
+                    uncon_pcb->local_ip.u_addr.ip4.address,
+                    get_netif_ip4_addr(inp)))
+                {
+                    /* uncon_pcb does not match the input netif, check this pcb */
+                    if (is_ip_addr_v4(pcb->local_ip) && is_ip4_addr_equal(
+                        pcb->local_ip.u_addr.ip4.address,
+                        get_netif_ip4_addr(inp)))
+                    {
+                        /* better match */
+                        uncon_pcb = pcb;
+                    }
+                }
+            }
+            else if (!is_ip_addr_any(pcb->local_ip))
+            {
+                /* prefer specific IPs over catch-all */
+                uncon_pcb = pcb;
+            }
+        } /* compare PCB remote addr+port to UDP source addr+port */
+        if ((pcb->remote_port == src) && (is_ip_addr_any(pcb->remote_ip) ||
+            compare_ip_addr(pcb->remote_ip, src_ip)))
+        {
+            /* the first fully matching PCB */
+            return pcb;
+        }
+    }
+    return uncon_pcb;
+}
+
+/**
  * Process an incoming UDP datagram.
  *
  * Given an incoming UDP datagram (as a chain of pbufs) this function
@@ -158,75 +508,16 @@ udp_input(struct PacketBuffer* p, NetworkInterface* inp)
     uint16_t dest = lwip_ntohs(udphdr->dest);
     udp_debug_print(udphdr); /* print the UDP source and destination */
     Logf(true, ("udp ("));
-    struct UdpPcb* pcb = nullptr;
-    struct UdpPcb* prev = nullptr;
-    struct UdpPcb* uncon_pcb = nullptr;
-    /* Iterate through the UDP pcb list for a matching pcb.
-      * 'Perfect match' pcbs (connected to the remote port & ip address) are
-      * preferred. If no perfect match is found, the first unconnected pcb that
-      * matches the local port and ip address gets the datagram. */
-    for (pcb = udp_pcbs; pcb != nullptr; pcb = pcb->next)
+    struct UdpPcb* pcb;
+    if (broadcast)
     {
-        /* print the PCB local and remote address */
-        /* compare PCB local addr+port to UDP destination addr+port */
-        if ((pcb->local_port == dest) && (udp_input_local_match(pcb, inp, broadcast) != 0)
-        )
-        {
-            if ((pcb->flags & UDP_FLAGS_CONNECTED) == 0)
-            {
-                if (uncon_pcb == nullptr)
-                {
-                    /* the first unconnected matching PCB */
-                    uncon_pcb = pcb;
-                }
-                else if (broadcast && curr_dst_addr->u_addr.ip4.word == IP4_ADDR_BCAST_U32)
-                {
-                    /* global broadcast address (only valid for IPv4; match was checked before) */
-                    if (!is_ip_addr_v4(uncon_pcb->local_ip) || !is_ip4_addr_equal(
-                        uncon_pcb->local_ip.u_addr.ip4.address,
-                        get_netif_ip4_addr(inp)))
-                    {
-                        /* uncon_pcb does not match the input netif, check this pcb */
-                        if (is_ip_addr_v4(pcb->local_ip) && is_ip4_addr_equal(
-                            pcb->local_ip.u_addr.ip4.address,
-                            get_netif_ip4_addr(inp)))
-                        {
-                            /* better match */
-                            uncon_pcb = pcb;
-                        }
-                    }
-                }
-                else if (!is_ip_addr_any(pcb->local_ip))
-                {
-                    /* prefer specific IPs over catch-all */
-                    uncon_pcb = pcb;
-                }
-            } /* compare PCB remote addr+port to UDP source addr+port */
-            if ((pcb->remote_port == src) && (ip_addr_isany_val(pcb->remote_ip) ||
-                compare_ip_addr(&pcb->remote_ip, curr_src_addr)))
-            {
-                /* the first fully matching PCB */
-                if (prev != nullptr)
-                {
-                    /* move the pcb to the front of udp_pcbs so that is
-                       found faster next time */
-                    prev->next = pcb->next;
-                    pcb->next = udp_pcbs;
-                    udp_pcbs = pcb;
-                }
-                else
-                {
-                    // UDP_STATS_INC(udp.cachehit);
-                }
-                break;
-            }
-        }
-        prev = pcb;
-    } /* no fully matching pcb found? then look for an unconnected pcb */
-    if (pcb == nullptr)
+        pcb = udp_input_lookup_bcast(*inp, *curr_dst_addr, dest, *curr_src_addr, src);
+    }
+    else
     {
-        pcb = uncon_pcb;
-    } /* Check checksum if this is a match or if it was directed at us. */
+        pcb = udp_input_lookup(*inp, *curr_dst_addr, dest, *curr_src_addr, src);
+    }
+    /* Check checksum if this is a match or if it was directed at us. */
     if (pcb != nullptr)
     {
         for_us = 1;
@@ -291,19 +582,19 @@ udp_input(struct PacketBuffer* p, NetworkInterface* inp)
                 }
             }
         }
-        // if (pbuf_remove_header(p, UDP_HDR_LEN))
-        // {
-        //     /* Can we cope with this failing? Just assert for now */
-        //     lwip_assert("pbuf_remove_header failed\n", false); // UDP_STATS_INC(udp.drop);
-        //     free_pkt_buf(p);
-        //     goto end;
-        // }
         if (pcb != nullptr)
         {
+            /* recv callbacks, rings and receive aggregation get the payload */
+            if (!udp_input_strip(p))
+            {
+                Logf(true, ("udp_input: malformed headers, datagram discarded\n"));
+                free_pkt_buf(p);
+                return;
+            }
             if (ip_get_option((IpPcb*)pcb, SOF_REUSEADDR) && (broadcast ||
                 is_ip_addr_mcast(curr_dst_addr)))
             {
-                for (UdpPcb* mpcb = udp_pcbs; mpcb != nullptr; mpcb = mpcb->next)
+                for (UdpPcb* mpcb = udp_demux_port(dest); mpcb != nullptr; mpcb = mpcb->port_next)
                 {
                     if (mpcb != pcb)
                     {
@@ -314,28 +605,23 @@ udp_input(struct PacketBuffer* p, NetworkInterface* inp)
                             broadcast) != 0))
                         {
                             /* pass a copy of the packet to all local matches */
-                            if (mpcb->recv != nullptr)
+                            if (udp_input_wanted(mpcb))
                             {
                                 struct PacketBuffer* q;
                                 q = pbuf_clone(p);
                                 if (q != nullptr)
                                 {
-                                    mpcb->recv(mpcb->recv_arg,
-                                               mpcb,
-                                               q,
-                                               curr_src_addr,
-                                               src,
-                                               curr_netif);
+                                    udp_input_deliver(mpcb, q, *curr_src_addr, src, curr_netif);
                                 }
                             }
                         }
                     }
                 }
             } /* callback */
-            if (pcb->recv != nullptr)
+            if (udp_input_wanted(pcb))
             {
                 /* now the recv function is responsible for freeing p */
-                pcb->recv(pcb->recv_arg, pcb, p, curr_src_addr, src, curr_netif);
+                udp_input_deliver(pcb, p, *curr_src_addr, src, curr_netif);
             }
             else
             {
@@ -415,46 +701,14 @@ udp_send_chksum(UdpPcb* pcb, struct PacketBuffer* p, uint8_t have_chksum, uint16
                              pcb->remote_port,
                              have_chksum,
                              chksum);
-} /**
- * @ingroup udp_raw
- * Send data to a specified address using UDP.
- *
- * @param pcb UDP PCB used to send the data.
- * @param p chain of PacketBuffer's to be sent.
- * @param dst_ip Destination IP address.
- * @param dst_port Destination UDP port.
- *
- * dst_ip & dst_port are expected to be in the same byte order as in the pcb.
- *
- * If the PCB already has a remote address association, it will
- * be restored after the data is sent.
- *
- * @return lwIP error code (@see udp_send for possible error codes)
- *
- * @see udp_disconnect() udp_send()
- */
-LwipStatus
-udp_sendto(struct UdpPcb* pcb,
-           struct PacketBuffer* p,
-           const IpAddrInfo* dst_ip,
-           uint16_t dst_port)
-{
-    return udp_sendto_chksum(pcb, p, dst_ip, dst_port, 0, 0);
-} /** @ingroup udp_raw
- * Same as udp_sendto(), but with checksum */
-LwipStatus
-udp_sendto_chksum(UdpPcb* pcb,
-                  PacketBuffer& p,
-                  const IpAddrInfo& dst_ip,
-                  uint16_t dst_port,
-                  uint8_t have_chksum,
-                  uint16_t chksum)
+}
+
+/* Find the netif a datagram from pcb to dst_ip goes out on, nullptr if there
+   is no route */
+static NetworkInterface*
+udp_route(UdpPcb* pcb, const IpAddrInfo& dst_ip)
 {
-    NetworkInterface* netif;
-    if (!match_ip_addr_pcb_version((IpPcb*)pcb, dst_ip))
-    {
-        return ERR_VAL;
-    }
+    NetworkInterface* netif = nullptr;
     Logf(true, ("udp_send\n"));
     if (pcb->netif_idx != NETIF_NO_INDEX)
     {
@@ -491,12 +745,116 @@ udp_sendto_chksum(UdpPcb* pcb,
                 }
             }
         }
-        if (netif == nullptr)
+        if (netif == nullptr && dst_cache_valid(pcb->dst_cache, dst_ip))
+        {
+            netif = pcb->dst_cache.netif;
+        }
+        else if (netif == nullptr)
         {
             /* find the outgoing network interface for this packet */
-            netif = ip_route(&pcb->local_ip, dst_ip,);
+            const uint32_t flow_hash =
+                ip_ecmp_hash(pcb->local_ip, dst_ip, IP_PROTO_UDP, pcb->local_port, pcb->remote_port);
+            netif = ip_route(&pcb->local_ip, dst_ip,, flow_hash);
+            if (netif != nullptr && !is_ip_addr_mcast(dst_ip))
+            {
+                dst_cache_fill(pcb->dst_cache, dst_ip, netif);
+            }
+        }
+    }
+    return netif;
+}
+
+/* Pick the source address of a datagram from pcb to dst_ip sent on netif:
+   the local address of the pcb if it is bound to one (and the address is
+   still valid), else an address of netif */
+static LwipStatus
+udp_select_src(UdpPcb* pcb, const IpAddrInfo& dst_ip, NetworkInterface* netif, IpAddrInfo& src_ip)
+{
+    /* PCB local address is IP_ANY_ADDR or multicast? */
+    if (is_ip_addr_v6(dst_ip))
+    {
+        if (ip6_addr_is_any((&pcb->local_ip.u_addr.ip6)) || is_ip6_addr_mcast(
+            (&pcb->local_ip.u_addr.ip6)))
+        {
+            const auto src_addr = select_ip6_src_addr(netif, &dst_ip.u_addr.ip6,);
+            src_ip.u_addr.ip6 = dst_ip.u_addr.ip6;
+            src_ip.type = IPADDR_TYPE_V6;
+        }
+        else
+        {
+            /* use UDP PCB local IPv6 address as source address, if still valid. */
+            if (get_netif_ip6_addr_idx(netif, (&pcb->local_ip.u_addr.ip6)) < 0)
+            {
+                /* Address isn't valid anymore. */
+                return STATUS_E_ROUTING;
+            }
+            src_ip = pcb->local_ip;
         }
-    } /* no outgoing network interface could be found? */
+    }
+    else if (ip4_addr_isany((pcb->local_ip.u_addr.ip4.address)) ||
+        is_ip4_addr_multicast((pcb->local_ip.u_addr.ip4.address)))
+    {
+        /* if the local_ip is any or multicast
+         * use the outgoing network interface IP address as source address */
+        src_ip.u_addr.ip4 = get_netif_ip4_addr(netif,,)->u_addr.ip4;
+        src_ip.type = IPADDR_TYPE_V4;
+    }
+    else
+    {
+        /* check if UDP PCB local IP address is correct
+         * this could be an old address if netif->ip_addr has changed */
+        if (!is_ip4_addr_equal(((pcb->local_ip.u_addr.ip4.address)),
+                          get_netif_ip4_addr(netif,,)))
+        {
+            /* local_ip doesn't match, drop the packet */
+            return STATUS_E_ROUTING;
+        } /* use UDP PCB local IP address as source address */
+        src_ip = pcb->local_ip;
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @ingroup udp_raw
+ * Send data to a specified address using UDP.
+ *
+ * @param pcb UDP PCB used to send the data.
+ * @param p chain of PacketBuffer's to be sent.
+ * @param dst_ip Destination IP address.
+ * @param dst_port Destination UDP port.
+ *
+ * dst_ip & dst_port are expected to be in the same byte order as in the pcb.
+ *
+ * If the PCB already has a remote address association, it will
+ * be restored after the data is sent.
+ *
+ * @return lwIP error code (@see udp_send for possible error codes)
+ *
+ * @see udp_disconnect() udp_send()
+ */
+LwipStatus
+udp_sendto(struct UdpPcb* pcb,
+           struct PacketBuffer* p,
+           const IpAddrInfo* dst_ip,
+           uint16_t dst_port)
+{
+    return udp_sendto_chksum(pcb, p, dst_ip, dst_port, 0, 0);
+} /** @ingroup udp_raw
+ * Same as udp_sendto(), but with checksum */
+LwipStatus
+udp_sendto_chksum(UdpPcb* pcb,
+                  PacketBuffer& p,
+                  const IpAddrInfo& dst_ip,
+                  uint16_t dst_port,
+                  uint8_t have_chksum,
+                  uint16_t chksum)
+{
+    if (!match_ip_addr_pcb_version((IpPcb*)pcb, dst_ip))
+    {
+        return ERR_VAL;
+    }
+    NetworkInterface* netif = udp_route(pcb, dst_ip);
+    /* no outgoing network interface could be found? */
     if (netif == nullptr)
     {
         Logf(true | LWIP_DBG_LEVEL_SERIOUS, ("udp_send: No route to "));
@@ -544,50 +902,15 @@ udp_sendto_if_chksum(UdpPcb* pcb,
                      uint8_t have_chksum,
                      uint16_t chksum)
 {
-    IpAddrInfo src_ip{};
     if (!match_ip_addr_pcb_version((IpPcb*)pcb, dst_ip))
     {
         return ERR_VAL;
-    } /* PCB local address is IP_ANY_ADDR or multicast? */
-    if (is_ip_addr_v6(dst_ip))
-    {
-        if (ip6_addr_is_any((&pcb->local_ip.u_addr.ip6)) || is_ip6_addr_mcast(
-            (&pcb->local_ip.u_addr.ip6)))
-        {
-            const auto src_addr = select_ip6_src_addr(netif, &dst_ip->u_addr.ip6,);
-            src_ip.u_addr.ip6 = dst_ip->u_addr.ip6;
-            src_ip.type = IPADDR_TYPE_V6;
-        }
-        else
-        {
-            /* use UDP PCB local IPv6 address as source address, if still valid. */
-            if (get_netif_ip6_addr_idx(netif, (&pcb->local_ip.u_addr.ip6)) < 0)
-            {
-                /* Address isn't valid anymore. */
-                return STATUS_E_ROUTING;
-            }
-            src_ip = pcb->local_ip;
-        }
     }
-    else if (ip4_addr_isany((pcb->local_ip.u_addr.ip4.address)) ||
-        is_ip4_addr_multicast((pcb->local_ip.u_addr.ip4.address)))
+    IpAddrInfo src_ip{};
+    const LwipStatus err = udp_select_src(pcb, *dst_ip, netif, src_ip);
+    if (err != STATUS_SUCCESS)
     {
-        /* if the local_ip is any or multicast
-         * use the outgoing network interface IP address as source address */
-        src_ip.u_addr.ip4 = get_netif_ip4_addr(netif,,)->u_addr.ip4;
-        src_ip.type = IPADDR_TYPE_V4;
-    }
-    else
-    {
-        /* check if UDP PCB local IP address is correct
-         * this could be an old address if netif->ip_addr has changed */
-        if (!is_ip4_addr_equal(((pcb->local_ip.u_addr.ip4.address)),
-                          get_netif_ip4_addr(netif,,)))
-        {
-            /* local_ip doesn't match, drop the packet */
-            return STATUS_E_ROUTING;
-        } /* use UDP PCB local IP address as source address */
-        src_ip = pcb->local_ip;
+        return err;
     }
     return udp_sendto_if_src_chksum(pcb,
                                     p,
@@ -608,6 +931,49 @@ udp_sendto_if_src(struct UdpPcb* pcb,
                   IpAddrInfo* src_ip)
 {
     return udp_sendto_if_src_chksum(pcb, p, dst_ip, dst_port, netif, 0, 0, src_ip);
+}
+
+/* Segmentation offload: cut a datagram larger than pcb.gso_size into
+   datagrams of gso_size bytes (the last one may be shorter), checksumming the
+   payload of each one while it is copied, and send them on netif. */
+static LwipStatus
+udp_sendto_gso(UdpPcb& pcb,
+               PacketBuffer& p,
+               const IpAddrInfo& dst_ip,
+               const uint16_t dst_port,
+               NetworkInterface& netif,
+               IpAddrInfo& src_ip)
+{
+    const size_t len = p.data.size();
+    const size_t hdr_len = UDP_HDR_LEN + (is_ip_addr_v6(dst_ip) ? IP6_HDR_LEN : IP4_HDR_LEN);
+    if ((pcb.flags & UDP_FLAGS_UDPLITE) || (netif.mtu != 0 && pcb.gso_size + hdr_len > netif.mtu) ||
+        (len + pcb.gso_size - 1) / pcb.gso_size > UDP_GSO_MAX_SEGS)
+    {
+        Logf(true, "udp_sendto_gso: cannot cut %zu bytes into %d byte datagrams\n", len, pcb.gso_size);
+        return ERR_VAL;
+    }
+    for (size_t off = 0; off < len; off += pcb.gso_size)
+    {
+        const auto seg_len = uint16_t(std::min(size_t(pcb.gso_size), len - off));
+        PacketBuffer seg{};
+        seg.data.resize(seg_len);
+        const uint16_t chksum = lwip_standard_checksum_copy(seg.data.data(),
+                                                            p.data.data() + off,
+                                                            seg_len);
+        const LwipStatus err = udp_sendto_if_src_chksum(pcb,
+                                                        seg,
+                                                        dst_ip,
+                                                        dst_port,
+                                                        netif,
+                                                        1,
+                                                        chksum,
+                                                        src_ip);
+        if (err != STATUS_SUCCESS)
+        {
+            return err;
+        }
+    }
+    return STATUS_SUCCESS;
 } /** Same as udp_sendto_if_src(), but with checksum */
 LwipStatus
 udp_sendto_if_src_chksum(UdpPcb& pcb,
@@ -645,6 +1011,10 @@ udp_sendto_if_src_chksum(UdpPcb& pcb,
                  ("udp_send: forced port bind failed\n"));
             return err;
         }
+    }
+    if (pcb.gso_size != 0 && p.data.size() > pcb.gso_size)
+    {
+        return udp_sendto_gso(pcb, p, dst_ip, dst_port, netif, src_ip);
     } /* packet too large to add a UDP header without causing an overflow? */
     if ((uint16_t)(p->tot_len + UDP_HDR_LEN) < p->tot_len)
     {
@@ -783,7 +1153,9 @@ udp_sendto_if_src_chksum(UdpPcb& pcb,
     Logf(true, "udp_send: ip_output_if (,,,,0x%02x,)\n", (uint16_t)ip_proto);
     /* output to IP */
     netif_set_hints(netif, (pcb->netif_hints));
+    dst_cache_current = dst_cache_for(pcb->dst_cache, *dst_ip);
     err = ip_output_if_src(q, src_ip, dst_ip, ttl, pcb->tos, ip_proto, netif);
+    dst_cache_current = nullptr;
     netif_reset_hints(netif); /* @todo: must this be increased even if error occurred? */
     /* did we chain a separate header PacketBuffer earlier? */
     if (q != p)
@@ -794,6 +1166,72 @@ udp_sendto_if_src_chksum(UdpPcb& pcb,
     }
     // UDP_STATS_INC(udp.xmit);
     return err;
+}
+
+/**
+ * @ingroup udp_raw
+ * Send a burst of datagrams, like sendmmsg(). Consecutive datagrams to the
+ * same address form a group that is routed, and gets its source address
+ * picked, once; each datagram then only gets its UDP header before going to
+ * the netif of its group.
+ *
+ * @param pcb UDP PCB used to send the data.
+ * @param msgs the datagrams; the PacketBuffers are not deallocated. The
+ *        result of each one is stored in its err member.
+ * @param count number of datagrams in msgs.
+ *
+ * @return number of datagrams sent successfully
+ *
+ * @see udp_sendto()
+ */
+size_t
+udp_sendto_batch(struct UdpPcb* pcb, struct UdpSendMsg* msgs, const size_t count)
+{
+    const IpAddrInfo* group = nullptr;
+    NetworkInterface* netif = nullptr;
+    IpAddrInfo src_ip{};
+    LwipStatus group_err = STATUS_SUCCESS;
+    size_t sent = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        UdpSendMsg& msg = msgs[i];
+        if (group == nullptr || !compare_ip_addr(*group, *msg.dst_ip))
+        {
+            group = msg.dst_ip;
+            group_err = STATUS_SUCCESS;
+            if (!match_ip_addr_pcb_version((IpPcb*)pcb, *msg.dst_ip))
+            {
+                group_err = ERR_VAL;
+            }
+            else if ((netif = udp_route(pcb, *msg.dst_ip)) == nullptr)
+            {
+                Logf(true | LWIP_DBG_LEVEL_SERIOUS, ("udp_sendto_batch: No route\n"));
+                group_err = STATUS_E_ROUTING;
+            }
+            else
+            {
+                group_err = udp_select_src(pcb, *msg.dst_ip, netif, src_ip);
+            }
+        }
+        msg.err = group_err;
+        if (msg.err == STATUS_SUCCESS)
+        {
+            msg.err = udp_sendto_if_src_chksum(*pcb,
+                                               *msg.p,
+                                               *msg.dst_ip,
+                                               msg.dst_port,
+                                               *netif,
+                                               0,
+                                               0,
+                                               src_ip);
+        }
+        if (msg.err == STATUS_SUCCESS)
+        {
+            sent++;
+        }
+    }
+    Logf(true, "udp_sendto_batch: sent %zu of %zu datagrams\n", sent, count);
+    return sent;
 } /**
  * @ingroup udp_raw
  * Bind an UDP PCB.
@@ -824,16 +1262,9 @@ udp_bind(struct UdpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
     Logf(true | LWIP_DBG_TRACE, ("udp_bind(ipaddr = "));
     // ip_addr_debug_print(true | LWIP_DBG_TRACE, ipaddr);
     Logf(true | LWIP_DBG_TRACE, ", port = %d)\n", port);
-    uint8_t rebind = 0; /* Check for double bind and rebind of the same pcb */
-    for (ipcb = udp_pcbs; ipcb != nullptr; ipcb = ipcb->next)
-    {
-        /* is this UDP PCB already on active list? */
-        if (pcb == ipcb)
-        {
-            rebind = 1;
-            break;
-        }
-    } /* If the given IP address should have a zone but doesn't, assign one now.
+    /* Check for double bind and rebind of the same pcb */
+    const bool rebind = udp_is_flag_set(pcb, UDP_FLAGS_HASHED);
+    /* If the given IP address should have a zone but doesn't, assign one now.
    * This is legacy support: scope-aware callers should always provide properly
    * zoned source addresses. Do the zone selection before the address-in-use
    * check below; as such we have to make a temporary copy of the address. */
@@ -855,7 +1286,7 @@ udp_bind(struct UdpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
     }
     else
     {
-        for (ipcb = udp_pcbs; ipcb != nullptr; ipcb = ipcb->next)
+        for (ipcb = udp_demux_port(port); ipcb != nullptr; ipcb = ipcb->port_next)
         {
             if (pcb != ipcb)
             {
@@ -882,10 +1313,17 @@ udp_bind(struct UdpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
             }
         }
     }
+    if (rebind)
+    {
+        udp_demux_remove(pcb);
+        port_alloc_unref(udp_ports, pcb->local_port);
+    }
     set_ip_addr(&pcb->local_ip, ipaddr);
     pcb->local_port = port;
+    port_alloc_ref(udp_ports, port);
+    udp_demux_insert(pcb);
     // mib2_udp_bind(pcb); /* pcb not active yet? */
-    if (rebind == 0)
+    if (!rebind)
     {
         /* place the PCB on the active list if not already there */
         pcb->next = udp_pcbs;
@@ -946,6 +1384,12 @@ udp_connect(struct UdpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
             return err;
         }
     }
+    /* rehashed below, in the connected tier */
+    const bool listed = udp_is_flag_set(pcb, UDP_FLAGS_HASHED);
+    if (listed)
+    {
+        udp_demux_remove(pcb);
+    }
     set_ip_addr(&pcb->remote_ip, ipaddr);
     /* If the given IP address should have a zone but doesn't, assign one now,
       * using the bound address to make a more informed decision when possible. */
@@ -960,17 +1404,13 @@ udp_connect(struct UdpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
     Logf(true | LWIP_DBG_TRACE | LWIP_DBG_STATE, ("udp_connect: connected to "));
     // ip_addr_debug_print_val(true | LWIP_DBG_TRACE | LWIP_DBG_STATE, pcb->remote_ip);
     // Logf(true | LWIP_DBG_TRACE | LWIP_DBG_STATE, (", port %d)\n", pcb->remote_port));
+    udp_demux_insert(pcb);
     /* Insert UDP PCB into the list of active UDP PCBs. */
-    for (struct UdpPcb* ipcb = udp_pcbs; ipcb != nullptr; ipcb = ipcb->next)
+    if (!listed)
     {
-        if (pcb == ipcb)
-        {
-            /* already on the list, just return */
-            return STATUS_SUCCESS;
-        }
-    } /* PCB not yet on the list, add PCB now */
-    pcb->next = udp_pcbs;
-    udp_pcbs = pcb;
+        pcb->next = udp_pcbs;
+        udp_pcbs = pcb;
+    }
     return STATUS_SUCCESS;
 } /**
  * @ingroup udp_raw
@@ -982,6 +1422,11 @@ udp_connect(struct UdpPcb* pcb, const IpAddrInfo* ipaddr, uint16_t port)
 void
 udp_disconnect(struct UdpPcb* pcb)
 {
+    const bool listed = udp_is_flag_set(pcb, UDP_FLAGS_HASHED);
+    if (listed)
+    {
+        udp_demux_remove(pcb);
+    }
     /* reset remote address association */
     if (is_ip_addr_any_type(pcb->local_ip))
     {
@@ -995,6 +1440,10 @@ udp_disconnect(struct UdpPcb* pcb)
     pcb->remote_port = 0;
     pcb->netif_idx = NETIF_NO_INDEX; /* mark PCB as unconnected */
     udp_clear_flags(pcb, UDP_FLAGS_CONNECTED);
+    if (listed)
+    {
+        udp_demux_insert(pcb);
+    }
 } /**
  * @ingroup udp_raw
  * Set a receive callback for a UDP PCB.
@@ -1010,6 +1459,23 @@ udp_recv(struct UdpPcb* pcb, UdpRecvFn recv, void* recv_arg)
     /* remember recv() callback and user data */
     pcb->recv = recv;
     pcb->recv_arg = recv_arg;
+} /**
+ * @ingroup udp_raw
+ * Set a batched receive callback for a UDP PCB, like recvmmsg(). Inside an
+ * input batch (see udp_input_batch_begin()) the callback gets all datagrams
+ * of the batch for the pcb at once, up to UDP_INPUT_BATCH_MSGS per call;
+ * outside of one, it is called for each datagram. It takes precedence over
+ * the callback set with udp_recv().
+ *
+ * @param pcb the pcb for which to set the callback
+ * @param recv_batch function pointer of the callback function
+ * @param recv_arg additional argument to pass to the callback function
+ */
+void
+udp_recv_batch(struct UdpPcb* pcb, UdpRecvBatchFn recv_batch, void* recv_arg)
+{
+    pcb->recv_batch = recv_batch;
+    pcb->recv_arg = recv_arg;
 } /**
  * @ingroup udp_raw
  * Removes and deallocates the pcb.
@@ -1022,7 +1488,16 @@ udp_recv(struct UdpPcb* pcb, UdpRecvFn recv, void* recv_arg)
 void
 udp_remove(struct UdpPcb* pcb)
 {
-    // mib2_udp_unbind(pcb); /* pcb to be removed is first in list? */
+    // mib2_udp_unbind(pcb);
+    udp_input_batch_forget(pcb);
+    udp_ring_detach(pcb);
+    if (udp_is_flag_set(pcb, UDP_FLAGS_HASHED))
+    {
+        udp_demux_remove(pcb);
+    }
+    port_alloc_unref(udp_ports, pcb->local_port);
+    pcb->local_port = 0;
+    /* pcb to be removed is first in list? */
     if (udp_pcbs == pcb)
     {
         /* make list start at 2nd pcb */
@@ -1109,7 +1584,9 @@ udp_netif_ip_addr_changed(const IpAddrInfo* old_addr, const IpAddrInfo* new_addr
             {
                 /* The PCB is bound to the old ipaddr and
                  * is set to bound to the new one instead */
+                udp_demux_remove(upcb);
                 copy_ip_addr(&upcb->local_ip, new_addr);
+                udp_demux_insert(upcb);
             }
         }
     }
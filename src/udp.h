@@ -37,6 +37,7 @@
  */
 #pragma once
 #include <arch.h>
+#include <dst_cache.h>
 #include <packet_buffer.h>
 #include <network_interface.h>
 #include <ip_addr.h>
@@ -58,10 +59,15 @@ enum UdpFlags
     UDP_FLAGS_NOCHKSUM = 0x01U,
     UDP_FLAGS_UDPLITE = 0x02U,
     UDP_FLAGS_CONNECTED = 0x04U,
-    UDP_FLAGS_MULTICAST_LOOP= 0x08U
+    UDP_FLAGS_MULTICAST_LOOP= 0x08U,
+    /* in the demultiplexing tables, see udp_demux.h */
+    UDP_FLAGS_HASHED = 0x10U,
+    /* coalesce datagrams of a flow for the recv_batch callback, see UdpRecvMsg */
+    UDP_FLAGS_GRO = 0x20U
 };
 
 struct UdpPcb;
+struct UdpRing;
 
 /** Function prototype for udp pcb receive callback functions
  * addr and port are in same byte order as in the pcb
@@ -84,6 +90,41 @@ using UdpRecvFn = void (*)(void*,
                            uint16_t,
                            NetworkInterface*);
 
+/** A datagram handed to a UdpRecvBatchFn. The callback is responsible for
+ * freeing p. */
+struct UdpRecvMsg
+{
+    PacketBuffer* p;
+    /** the remote IP address and port the datagram was received from */
+    IpAddrInfo addr;
+    uint16_t port;
+    NetworkInterface* netif;
+    /** with UDP_FLAGS_GRO: 0 if p holds one datagram; else p holds several
+     * consecutive datagrams of the flow, each of segsz bytes but the last,
+     * which may be shorter */
+    uint16_t segsz;
+};
+
+/** Function prototype for batched udp pcb receive callback functions, see
+ * udp_recv_batch().
+ *
+ * @param arg user supplied argument (udp_pcb.recv_arg)
+ * @param pcb the udp_pcb which received data
+ * @param msgs the datagrams received, in order of arrival
+ * @param count number of datagrams in msgs
+ */
+using UdpRecvBatchFn = void (*)(void*, UdpPcb*, UdpRecvMsg*, size_t);
+
+/** A datagram to send with udp_sendto_batch(). */
+struct UdpSendMsg
+{
+    PacketBuffer* p;
+    const IpAddrInfo* dst_ip;
+    uint16_t dst_port;
+    /** result of sending this datagram, set by udp_sendto_batch() */
+    LwipStatus err;
+};
+
 /** the UDP protocol control block */
 struct UdpPcb
 {
@@ -96,6 +137,9 @@ struct UdpPcb
     uint8_t ttl;
     NetIfcHint* netif_hints; /* Protocol specific PCB members */
     struct UdpPcb* next;
+    /** next pcb in the same udp_demux.h table chain, and on the same port */
+    struct UdpPcb* hash_next;
+    struct UdpPcb* port_next;
     uint8_t flags; /** ports are in host byte order */
     uint16_t local_port, remote_port;
     /** outgoing network interface for multicast packets, by IPv4 address (if not 'any') */
@@ -103,9 +147,16 @@ struct UdpPcb
     /** outgoing network interface for multicast packets, by interface index (if nonzero) */
     uint8_t mcast_ifindex; /** TTL for outgoing multicast packets */
     uint8_t mcast_ttl; /** used for UDP_LITE only */
-    uint16_t chksum_len_rx, chksum_len_tx; /** receive callback function */
-    UdpRecvFn recv; /** user-supplied argument for the recv callback */
+    uint16_t chksum_len_rx, chksum_len_tx;
+    /** segment size for UDP segmentation offload, 0 if off, see udp_set_gso_size() */
+    uint16_t gso_size; /** receive callback function */
+    UdpRecvFn recv; /** batched receive callback function */
+    UdpRecvBatchFn recv_batch; /** user-supplied argument for the recv callbacks */
     void* recv_arg;
+    /** receive ring replacing the recv callbacks, see udp_ring.h */
+    struct UdpRing* ring;
+    /** route of the last destination sent to, see dst_cache.h */
+    DstCache dst_cache;
 };
 
 
@@ -126,6 +177,9 @@ void             udp_disconnect (struct UdpPcb *pcb);
 void             udp_recv       (struct UdpPcb *pcb,
                                  UdpRecvFn recv,
                                  void* recv_arg);
+void             udp_recv_batch (struct UdpPcb *pcb,
+                                 UdpRecvBatchFn recv_batch,
+                                 void* recv_arg);
 LwipStatus            udp_sendto_if  (struct UdpPcb *pcb, struct PacketBuffer *p,
                                  const IpAddrInfo *dst_ip, uint16_t dst_port,
                                  NetworkInterface*netif);
@@ -138,6 +192,8 @@ LwipStatus            udp_sendto_if_src(struct UdpPcb *pcb,
 LwipStatus            udp_sendto     (struct UdpPcb *pcb, struct PacketBuffer *p,
                                  const IpAddrInfo *dst_ip, uint16_t dst_port);
 LwipStatus            udp_send       (struct UdpPcb *pcb, struct PacketBuffer *p);
+size_t           udp_sendto_batch(struct UdpPcb *pcb, struct UdpSendMsg *msgs,
+                                  size_t count);
 
 LwipStatus            udp_sendto_if_chksum(UdpPcb *pcb, struct PacketBuffer *p,
                                  const IpAddrInfo *dst_ip, uint16_t dst_port,
@@ -175,8 +231,18 @@ inline bool udp_is_flag_set(UdpPcb* pcb, const uint8_t flag)
     return (((pcb)->flags & (flag)) != 0);
 }
 
+/** Segmentation offload, like UDP_SEGMENT: datagrams larger than size that
+ * are sent on pcb are cut into datagrams of size bytes (the last one may be
+ * shorter), at most UDP_GSO_MAX_SEGS of them. 0 turns it off. */
+inline void udp_set_gso_size(UdpPcb* pcb, const uint16_t size)
+{
+    pcb->gso_size = size;
+}
+
 /* The following functions are the lower layer interface to UDP. */
 void             udp_input      (struct PacketBuffer *p, NetworkInterface*inp);
+void             udp_input_batch_begin();
+void             udp_input_batch_end();
 
 void             udp_init       ();
 
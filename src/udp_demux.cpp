@@ -0,0 +1,154 @@
+///
+/// file: udp_demux.cpp
+///
+/// UDP demultiplexing tables, see udp_demux.h.
+///
+
+#include <lwip_debug.h>
+#include <opt.h>
+#include <udp_demux.h>
+
+/* the tables; all sizes are powers of two */
+static struct UdpPcb* udp_conn_hash[UDP_HASH_SIZE];
+static struct UdpPcb* udp_bound_hash[UDP_HASH_SIZE];
+static struct UdpPcb* udp_port_hash[UDP_HASH_SIZE];
+
+static uint32_t
+udp_demux_hash_addr(uint32_t h, const IpAddrInfo& addr)
+{
+    if (is_ip_addr_v6(addr))
+    {
+        for (const auto w : addr.u_addr.ip6.addr.word)
+        {
+            h = (h ^ w) * 0x9E3779B1U;
+        }
+    }
+    else
+    {
+        /* the any addresses of both versions hash alike, as they are
+           matched alike by udp_input() */
+        h = (h ^ addr.u_addr.ip4.address.addr) * 0x9E3779B1U;
+    }
+    h ^= h >> 16;
+    return h & (UDP_HASH_SIZE - 1);
+}
+
+static uint32_t
+udp_demux_conn_index(const uint16_t local_port, const IpAddrInfo& remote_ip, const uint16_t remote_port)
+{
+    return udp_demux_hash_addr((uint32_t(remote_port) << 16) ^ local_port, remote_ip);
+}
+
+static uint32_t
+udp_demux_bound_index(const uint16_t local_port, const IpAddrInfo& local_ip)
+{
+    if (is_ip_addr_any(local_ip))
+    {
+        return udp_demux_hash_addr(local_port, IpAddrInfo{});
+    }
+    return udp_demux_hash_addr(local_port, local_ip);
+}
+
+static uint32_t
+udp_demux_port_index(const uint16_t local_port)
+{
+    return ((local_port * 0x9E3779B1U) >> 16) & (UDP_HASH_SIZE - 1);
+}
+
+/* Whether pcb goes into the connected tier */
+static bool
+udp_demux_is_connected(const struct UdpPcb* pcb)
+{
+    return (pcb->flags & UDP_FLAGS_CONNECTED) && !is_ip_addr_any(pcb->remote_ip);
+}
+
+/* The chain of pcb's tier that pcb is (to be) in */
+static struct UdpPcb**
+udp_demux_chain(const struct UdpPcb* pcb)
+{
+    if (udp_demux_is_connected(pcb))
+    {
+        return &udp_conn_hash[udp_demux_conn_index(pcb->local_port,
+                                                   pcb->remote_ip,
+                                                   pcb->remote_port)];
+    }
+    return &udp_bound_hash[udp_demux_bound_index(pcb->local_port, pcb->local_ip)];
+}
+
+static void
+udp_demux_unlink(struct UdpPcb** link, const struct UdpPcb* pcb, const bool port_chain)
+{
+    while (*link != pcb)
+    {
+        lwip_assert("udp_demux_unlink: pcb not hashed", *link != nullptr);
+        link = port_chain ? &(*link)->port_next : &(*link)->hash_next;
+    }
+    *link = port_chain ? pcb->port_next : pcb->hash_next;
+}
+
+///
+/// Put a bound pcb into the tables, according to its current addresses and
+/// ports.
+///
+void
+udp_demux_insert(struct UdpPcb* pcb)
+{
+    lwip_assert("udp_demux_insert: pcb already hashed", !udp_is_flag_set(pcb, UDP_FLAGS_HASHED));
+    struct UdpPcb** chain = udp_demux_chain(pcb);
+    pcb->hash_next = *chain;
+    *chain = pcb;
+    struct UdpPcb** port_chain = &udp_port_hash[udp_demux_port_index(pcb->local_port)];
+    pcb->port_next = *port_chain;
+    *port_chain = pcb;
+    udp_set_flags(pcb, UDP_FLAGS_HASHED);
+}
+
+///
+/// Take a pcb out of the tables. Must be called before its addresses or
+/// ports change.
+///
+void
+udp_demux_remove(struct UdpPcb* pcb)
+{
+    lwip_assert("udp_demux_remove: pcb not hashed", udp_is_flag_set(pcb, UDP_FLAGS_HASHED));
+    udp_demux_unlink(udp_demux_chain(pcb), pcb, false);
+    udp_demux_unlink(&udp_port_hash[udp_demux_port_index(pcb->local_port)], pcb, true);
+    pcb->hash_next = nullptr;
+    pcb->port_next = nullptr;
+    udp_clear_flags(pcb, UDP_FLAGS_HASHED);
+}
+
+///
+/// The chain (through hash_next) holding the connected pcbs with the given
+/// 4-tuple. Other pcbs hash to the same chain, callers compare the keys.
+///
+struct UdpPcb*
+udp_demux_connected(const uint16_t local_port, const IpAddrInfo& remote_ip, const uint16_t remote_port)
+{
+    return udp_conn_hash[udp_demux_conn_index(local_port, remote_ip, remote_port)];
+}
+
+///
+/// The chain (through hash_next) holding the pcbs outside the connected tier
+/// bound to local_ip, or to the any address if local_ip is any, and to
+/// local_port. Other pcbs hash to the same chain, callers compare the keys.
+///
+struct UdpPcb*
+udp_demux_bound(const uint16_t local_port, const IpAddrInfo& local_ip)
+{
+    return udp_bound_hash[udp_demux_bound_index(local_port, local_ip)];
+}
+
+///
+/// The chain (through port_next) holding all pcbs bound to local_port.
+/// Other ports hash to the same chain, callers compare local_port.
+///
+struct UdpPcb*
+udp_demux_port(const uint16_t local_port)
+{
+    return udp_port_hash[udp_demux_port_index(local_port)];
+}
+
+//
+// END OF FILE
+//
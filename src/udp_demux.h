@@ -0,0 +1,45 @@
+///
+/// file: udp_demux.h
+///
+/// Hash tables udp_input() demultiplexes datagrams with, instead of walking
+/// udp_pcbs. Every bound pcb is in exactly one of two tiers:
+///
+/// - connected pcbs (remote address and port set) are hashed on the remote
+///   address and port and the local port, so a reply finds its pcb at once;
+/// - all other pcbs (including those connected to a port of any address) are
+///   hashed on their local address and port. Those bound to the any address
+///   share one key per port, the wildcard fallback that is looked up after
+///   the destination address.
+///
+/// Independently of its tier, every pcb is also on the list of its local port
+/// (chained through port_next): IPv4 broadcasts, copies of multicasts for
+/// SOF_REUSEADDR pcbs and the address-in-use check of udp_bind() only walk the
+/// pcbs of one port.
+///
+/// The tables hold pcbs while UDP_FLAGS_HASHED is set. udp.cpp takes a pcb
+/// out before changing its addresses or ports and puts it back afterwards.
+///
+
+#pragma once
+
+#include <ip_addr.h>
+#include <udp.h>
+
+void
+udp_demux_insert(struct UdpPcb* pcb);
+
+void
+udp_demux_remove(struct UdpPcb* pcb);
+
+struct UdpPcb*
+udp_demux_connected(uint16_t local_port, const IpAddrInfo& remote_ip, uint16_t remote_port);
+
+struct UdpPcb*
+udp_demux_bound(uint16_t local_port, const IpAddrInfo& local_ip);
+
+struct UdpPcb*
+udp_demux_port(uint16_t local_port);
+
+//
+// END OF FILE
+//
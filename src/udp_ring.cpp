@@ -0,0 +1,220 @@
+///
+/// file: udp_ring.cpp
+///
+/// UDP receive rings, see udp_ring.h.
+///
+
+#include <lwip_debug.h>
+#include <new>
+#include <opt.h>
+#include <udp_ring.h>
+
+std::atomic<size_t> udp_ring_drops;
+
+/* Take the oldest datagram out of ring, safe against other consumers */
+static bool
+udp_ring_pop(struct UdpRing* ring, UdpRecvMsg& msg)
+{
+    size_t pos = ring->head.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        UdpRingSlot& slot = ring->slots[pos & ring->mask];
+        const size_t seq = slot.seq.load(std::memory_order_acquire);
+        const auto diff = intptr_t(seq - (pos + 1));
+        if (diff < 0)
+        {
+            /* empty */
+            return false;
+        }
+        if (diff > 0)
+        {
+            /* another consumer took it */
+            pos = ring->head.load(std::memory_order_relaxed);
+        }
+        else if (ring->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+            msg = slot.msg;
+            /* free the slot for the next round of the producer */
+            slot.seq.store(pos + ring->mask + 1, std::memory_order_release);
+            return true;
+        }
+    }
+}
+
+/**
+ * @ingroup udp_raw
+ * Give a pcb a receive ring: udp_input() then queues its datagrams instead
+ * of calling its recv callbacks.
+ *
+ * @param pcb the pcb
+ * @param size number of datagrams the ring holds, a power of two
+ * @return ERR_VAL if size is not a power of two or the pcb has a ring
+ *         already, ERR_MEM if the ring could not be allocated
+ */
+LwipStatus
+udp_ring_attach(struct UdpPcb* pcb, const size_t size)
+{
+    if (size == 0 || (size & (size - 1)) != 0 || pcb->ring != nullptr)
+    {
+        return ERR_VAL;
+    }
+    const auto ring = new (std::nothrow) UdpRing;
+    if (ring == nullptr)
+    {
+        return ERR_MEM;
+    }
+    ring->slots = new (std::nothrow) UdpRingSlot[size];
+    if (ring->slots == nullptr || sys_sem_new(&ring->avail, 0) != STATUS_SUCCESS)
+    {
+        delete[] ring->slots;
+        delete ring;
+        return ERR_MEM;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        ring->slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    ring->mask = size - 1;
+    ring->tail = 0;
+    ring->head.store(0);
+    ring->waiters.store(0);
+    ring->drops.store(0);
+    pcb->ring = ring;
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @ingroup udp_raw
+ * Free the ring of a pcb and the datagrams still in it; datagrams go to the
+ * recv callbacks again. Called by udp_remove(). No consumer may use the ring
+ * any more.
+ */
+void
+udp_ring_detach(struct UdpPcb* pcb)
+{
+    UdpRing* ring = pcb->ring;
+    if (ring == nullptr)
+    {
+        return;
+    }
+    lwip_assert("udp_ring_detach: consumer still waiting", ring->waiters.load() == 0);
+    pcb->ring = nullptr;
+    UdpRecvMsg msg{};
+    while (udp_ring_pop(ring, msg))
+    {
+        free_pkt_buf(msg.p);
+    }
+    sys_sem_free(&ring->avail);
+    delete[] ring->slots;
+    delete ring;
+}
+
+///
+/// Queue a datagram, called by udp_input() on the stack thread. On success
+/// the ring owns msg.p.
+///
+/// @return false if the ring is full; the caller still owns msg.p
+///
+bool
+udp_ring_push(struct UdpRing* ring, const UdpRecvMsg& msg)
+{
+    UdpRingSlot& slot = ring->slots[ring->tail & ring->mask];
+    if (slot.seq.load(std::memory_order_acquire) != ring->tail)
+    {
+        /* a consumer has not taken the datagram of the last round yet */
+        ring->drops.fetch_add(1, std::memory_order_relaxed);
+        udp_ring_drops.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    slot.msg = msg;
+    slot.seq.store(ring->tail + 1, std::memory_order_release);
+    ring->tail++;
+    if (ring->waiters.load() != 0)
+    {
+        sys_sem_signal(&ring->avail);
+    }
+    return true;
+}
+
+/**
+ * @ingroup udp_raw
+ * Whether the ring of a pcb is filled beyond UDP_RING_HIGH_WATER percent.
+ * Only meaningful on the stack thread.
+ */
+bool
+udp_ring_pressure(const struct UdpPcb* pcb)
+{
+    const UdpRing* ring = pcb->ring;
+    if (ring == nullptr)
+    {
+        return false;
+    }
+    const size_t used = ring->tail - ring->head.load(std::memory_order_relaxed);
+    return used * 100 >= (ring->mask + 1) * UDP_RING_HIGH_WATER;
+}
+
+/**
+ * @ingroup udp_raw
+ * Take the oldest datagram out of the ring of a pcb without blocking. May be
+ * called from any thread.
+ *
+ * @param pcb the pcb, which must have a ring
+ * @param msg receives the datagram; the caller frees msg.p
+ * @return false if the ring is empty
+ */
+bool
+udp_ring_poll(struct UdpPcb* pcb, UdpRecvMsg& msg)
+{
+    lwip_assert("udp_ring_poll: pcb has no ring", pcb->ring != nullptr);
+    return udp_ring_pop(pcb->ring, msg);
+}
+
+/**
+ * @ingroup udp_raw
+ * Take the oldest datagram out of the ring of a pcb, waiting for one if the
+ * ring is empty. May be called from any thread.
+ *
+ * @param pcb the pcb, which must have a ring
+ * @param msg receives the datagram; the caller frees msg.p
+ * @param timeout milliseconds to wait at most, 0 to wait forever
+ * @return ERR_TIMEOUT if no datagram arrived in time
+ */
+LwipStatus
+udp_ring_recv(struct UdpPcb* pcb, UdpRecvMsg& msg, const uint32_t timeout)
+{
+    lwip_assert("udp_ring_recv: pcb has no ring", pcb->ring != nullptr);
+    UdpRing* ring = pcb->ring;
+    const uint32_t start = sys_now();
+    for (;;)
+    {
+        if (udp_ring_pop(ring, msg))
+        {
+            return STATUS_SUCCESS;
+        }
+        /* announce the wait before checking again, so that a datagram pushed
+           in between either is seen here or signals the semaphore */
+        ring->waiters.fetch_add(1);
+        if (udp_ring_pop(ring, msg))
+        {
+            ring->waiters.fetch_sub(1);
+            return STATUS_SUCCESS;
+        }
+        uint32_t wait = 0;
+        if (timeout != 0)
+        {
+            const uint32_t elapsed = sys_now() - start;
+            if (elapsed >= timeout)
+            {
+                ring->waiters.fetch_sub(1);
+                return ERR_TIMEOUT;
+            }
+            wait = timeout - elapsed;
+        }
+        sys_arch_sem_wait(&ring->avail, wait);
+        ring->waiters.fetch_sub(1);
+    }
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,78 @@
+///
+/// file: udp_ring.h
+///
+/// Receive rings for UDP pcbs, to move application work off the stack thread.
+///
+/// udp_ring_attach() gives a pcb a bounded ring. From then on udp_input()
+/// does not call the recv callbacks of the pcb: it queues each datagram in the
+/// ring and returns. Application threads take the datagrams out with
+/// udp_ring_recv(), which blocks, or udp_ring_poll(), which does not. The ring
+/// is lock-free: each slot carries a sequence number telling whether it holds
+/// a datagram, so the stack thread (the only producer) and any number of
+/// consumer threads never take a lock. The semaphore is only signalled when a
+/// consumer sleeps.
+///
+/// A full ring drops the arriving datagram and counts it in drops. The stack
+/// side can check udp_ring_pressure() to hold back input (e.g. stop polling
+/// the receive queue of a netif) before that happens.
+///
+/// Datagrams are handed over with their PacketBuffer, which the consumer
+/// frees; nothing is copied.
+///
+
+#pragma once
+
+#include <atomic>
+#include <opt.h>
+#include <sys.h>
+#include <udp.h>
+
+struct UdpRingSlot
+{
+    /* slot index if free for the round of the producer, index + 1 if it holds
+       a datagram for the round of the consumers */
+    std::atomic<size_t> seq;
+    UdpRecvMsg msg;
+};
+
+/// The ring of a pcb.
+struct UdpRing
+{
+    UdpRingSlot* slots;
+    /// number of slots - 1, the number of slots is a power of two
+    size_t mask;
+    /// next slot to fill, only used by the stack thread
+    alignas(CACHE_LINE_SIZE) size_t tail;
+    /// next slot to take
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    /// consumers sleeping on avail
+    std::atomic<uint32_t> waiters;
+    Semaphore avail;
+    /// datagrams dropped because the ring was full
+    std::atomic<size_t> drops;
+};
+
+LwipStatus
+udp_ring_attach(struct UdpPcb* pcb, size_t size);
+
+void
+udp_ring_detach(struct UdpPcb* pcb);
+
+bool
+udp_ring_push(struct UdpRing* ring, const UdpRecvMsg& msg);
+
+bool
+udp_ring_pressure(const struct UdpPcb* pcb);
+
+bool
+udp_ring_poll(struct UdpPcb* pcb, UdpRecvMsg& msg);
+
+LwipStatus
+udp_ring_recv(struct UdpPcb* pcb, UdpRecvMsg& msg, uint32_t timeout);
+
+/// Datagrams dropped by full rings, all pcbs together.
+extern std::atomic<size_t> udp_ring_drops;
+
+//
+// END OF FILE
+//
@@ -0,0 +1,152 @@
+///
+/// file: ip4_bench.cpp
+///
+/// Lookup rate of the IPv4 forwarding table with a million routes, and
+/// throughput of IPv4 reassembly. Prints one line per measurement.
+///
+
+#include "test_stubs.h"
+#include <chrono>
+#include <ip4.h>
+#include <ip4_fib.h>
+#include <ip4_frag.h>
+#include <random>
+
+using BenchClock = std::chrono::steady_clock;
+
+static double
+bench_seconds_since(const BenchClock::time_point start)
+{
+    return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+static void
+bench_fib_lookup()
+{
+    constexpr size_t routes = 1000000;
+    constexpr size_t host_routes = 16384;
+    constexpr size_t lookups = 20000000;
+    std::mt19937 rng(1);
+
+    auto start = BenchClock::now();
+    for (size_t i = 0; i < routes; i++)
+    {
+        const uint32_t prefix = rng() & 0xffffff00;
+        const Ip4FibNextHop next_hop{Ip4Addr{lwip_htonl(make_u32(192, 0, 2, uint8_t(i & 0x3f)))},
+                                     uint32_t(i & 0x3f)};
+        /* a few host routes, so that part of the lookups go through tbl8 */
+        if (i < host_routes)
+        {
+            ip4_fib_add(Ip4Addr{lwip_htonl(prefix | (rng() & 0xff))}, 32, next_hop);
+        }
+        else
+        {
+            ip4_fib_add(Ip4Addr{lwip_htonl(prefix)}, 24, next_hop);
+        }
+    }
+    if (ip4_fib_commit() != STATUS_SUCCESS)
+    {
+        test_failures++;
+        std::printf("ip4_fib: commit of %zu routes failed\n", routes);
+        return;
+    }
+    std::printf("ip4_fib: %zu routes added and committed in %.3f s\n", routes, bench_seconds_since(start));
+
+    std::vector<Ip4Addr> dsts(1 << 16);
+    for (auto& dst : dsts)
+    {
+        dst.addr = rng();
+    }
+    size_t hits = 0;
+    start = BenchClock::now();
+    for (size_t i = 0; i < lookups; i++)
+    {
+        Ip4FibNextHop next_hop{};
+        hits += ip4_fib_lookup(dsts[i & (dsts.size() - 1)], next_hop, uint32_t(i)) ? 1 : 0;
+    }
+    const double seconds = bench_seconds_since(start);
+    std::printf("ip4_fib: %zu lookups in %.3f s, %.1f M lookups/s, %.1f ns/lookup, %zu hits\n",
+                lookups,
+                seconds,
+                double(lookups) / seconds / 1e6,
+                seconds * 1e9 / double(lookups),
+                hits);
+
+    ip4_fib_clear();
+    ip4_fib_commit();
+    ip4_fib_reclaim();
+}
+
+static void
+bench_reass()
+{
+    constexpr size_t datagrams = 200000;
+    constexpr size_t frag_len = 1480;
+    constexpr size_t frags = 3;
+    /* datagrams interleaved, so that several are in progress at once */
+    constexpr size_t in_flight = 64;
+
+    std::vector<PacketBuffer> templates;
+    for (size_t f = 0; f < frags; f++)
+    {
+        PacketBuffer p{};
+        p.data.assign(IP4_HDR_LEN + frag_len, 0xa5);
+        std::vector<uint8_t>& d = p.data;
+        const size_t tot_len = IP4_HDR_LEN + frag_len;
+        const uint16_t frag = uint16_t((f + 1 < frags ? 0x2000 : 0) | f * frag_len / 8);
+        d[0] = 0x45;
+        d[2] = uint8_t(tot_len >> 8);
+        d[3] = uint8_t(tot_len);
+        d[6] = uint8_t(frag >> 8);
+        d[7] = uint8_t(frag);
+        d[8] = 64;
+        d[9] = 17;
+        d[12] = 192;
+        d[15] = 1;
+        d[16] = 198;
+        d[19] = 1;
+        templates.push_back(p);
+    }
+
+    ip_reass_init();
+    const size_t reassembled = ip4_reass_stats.reassembled;
+    const auto start = BenchClock::now();
+    for (size_t base = 0; base < datagrams; base += in_flight)
+    {
+        for (size_t f = frags; f-- > 0;)
+        {
+            for (size_t id = base; id < base + in_flight && id < datagrams; id++)
+            {
+                PacketBuffer p = templates[f];
+                p.data[4] = uint8_t(id >> 8);
+                p.data[5] = uint8_t(id);
+                ip4_reass(p);
+            }
+        }
+    }
+    const double seconds = bench_seconds_since(start);
+    const size_t done = ip4_reass_stats.reassembled - reassembled;
+    if (done != datagrams)
+    {
+        test_failures++;
+    }
+    std::printf("ip4_reass: %zu datagrams of %zu fragments in %.3f s, %.0f fragments/s, %.2f Gbit/s\n",
+                done,
+                frags,
+                seconds,
+                double(datagrams * frags) / seconds,
+                double(datagrams * frags * frag_len) * 8 / seconds / 1e9);
+    ip_reass_init();
+}
+
+int
+main()
+{
+    bench_fib_lookup();
+    bench_reass();
+    return test_failures == 0 ? 0 : 1;
+}
+
+//
+// END OF FILE
+//
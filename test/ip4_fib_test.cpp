@@ -0,0 +1,166 @@
+///
+/// file: ip4_fib_test.cpp
+///
+/// Longest prefix match, staging, deletion, tables and multipath routes of
+/// the IPv4 forwarding table (ip4_fib.h).
+///
+
+#include "test_stubs.h"
+#include <ip4_fib.h>
+#include <set>
+
+static Ip4Addr
+test_addr(const uint8_t a, const uint8_t b, const uint8_t c, const uint8_t d)
+{
+    return Ip4Addr{lwip_htonl(make_u32(a, b, c, d))};
+}
+
+static Ip4FibNextHop
+test_hop(const uint8_t n)
+{
+    return Ip4FibNextHop{test_addr(192, 0, 2, n), n};
+}
+
+/* if_num of the next hop dst is routed to, 0 if there is none */
+static uint32_t
+test_route(const Ip4Addr& dst, const uint32_t flow_hash = 0, const uint8_t table = IP4_FIB_TABLE_MAIN)
+{
+    Ip4FibNextHop next_hop{};
+    if (!ip4_fib_lookup(dst, next_hop, flow_hash, table))
+    {
+        return 0;
+    }
+    return next_hop.if_num;
+}
+
+static void
+test_longest_prefix_match()
+{
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 3)) == 0);
+    TEST_CHECK(ip4_fib_add(test_addr(10, 0, 0, 0), 8, test_hop(1)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_add(test_addr(10, 1, 0, 0), 16, test_hop(2)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_add(test_addr(10, 1, 2, 0), 24, test_hop(3)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_add(test_addr(10, 1, 2, 128), 25, test_hop(4)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_add(test_addr(10, 1, 2, 200), 32, test_hop(5)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_add(test_addr(10, 0, 0, 0), 33, test_hop(1)) == ERR_VAL);
+
+    /* staged routes are not used until committed */
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 3)) == 0);
+    const size_t invalidations = test_dst_cache_invalidations;
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    TEST_CHECK(test_dst_cache_invalidations == invalidations + 1);
+
+    TEST_CHECK(test_route(test_addr(10, 200, 0, 1)) == 1);
+    TEST_CHECK(test_route(test_addr(10, 1, 9, 9)) == 2);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 5)) == 3);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 127)) == 3);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 128)) == 4);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 199)) == 4);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 200)) == 5);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 201)) == 4);
+    TEST_CHECK(test_route(test_addr(11, 0, 0, 1)) == 0);
+
+    TEST_CHECK(ip4_fib_add(test_addr(0, 0, 0, 0), 0, test_hop(6)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    TEST_CHECK(test_route(test_addr(11, 0, 0, 1)) == 6);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 200)) == 5);
+}
+
+static void
+test_delete()
+{
+    TEST_CHECK(ip4_fib_delete(test_addr(10, 1, 2, 128), 25) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_delete(test_addr(10, 1, 2, 128), 25) == STATUS_NOT_FOUND);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 130)) == 4);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 130)) == 3);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 200)) == 5);
+
+    TEST_CHECK(ip4_fib_delete(test_addr(10, 1, 2, 200), 32) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_delete(test_addr(0, 0, 0, 0), 0) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 200)) == 3);
+    TEST_CHECK(test_route(test_addr(11, 0, 0, 1)) == 0);
+    ip4_fib_reclaim();
+}
+
+static void
+test_tables()
+{
+    const uint8_t table = 3;
+    TEST_CHECK(ip4_fib_add(test_addr(172, 16, 0, 0), 12, test_hop(7), table) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_add(test_addr(172, 16, 0, 0), 12, test_hop(7), IP4_FIB_MAX_TABLES) == ERR_VAL);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    TEST_CHECK(test_route(test_addr(172, 20, 1, 1), 0, table) == 7);
+    TEST_CHECK(test_route(test_addr(172, 20, 1, 1)) == 0);
+    TEST_CHECK(test_route(test_addr(10, 1, 2, 5), 0, table) == 0);
+
+    TEST_CHECK(ip4_fib_clear(table) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_current[table].load() == nullptr);
+    TEST_CHECK(test_route(test_addr(172, 20, 1, 1), 0, table) == 0);
+    ip4_fib_reclaim();
+}
+
+static void
+test_multipath()
+{
+    const Ip4Addr prefix = test_addr(198, 51, 100, 0);
+    const Ip4Addr dst = test_addr(198, 51, 100, 7);
+    TEST_CHECK(ip4_fib_add_next_hop(prefix, 24, test_hop(8)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_add_next_hop(prefix, 24, test_hop(9)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+
+    std::set<uint32_t> used;
+    for (uint32_t flow_hash = 0; flow_hash < 1024; flow_hash++)
+    {
+        const uint32_t if_num = test_route(dst, flow_hash * 0x9e3779b1U);
+        TEST_CHECK(if_num == 8 || if_num == 9);
+        /* a flow sticks to its next hop */
+        TEST_CHECK(test_route(dst, flow_hash * 0x9e3779b1U) == if_num);
+        used.insert(if_num);
+    }
+    TEST_CHECK(used.size() == 2);
+
+    /* ip4_fib_route() counts the packets of each next hop, across commits */
+    Ip4FibNextHop next_hop{};
+    uint64_t routed = 0;
+    for (uint32_t flow_hash = 0; flow_hash < 100; flow_hash++)
+    {
+        TEST_CHECK(ip4_fib_route(dst, flow_hash * 0x9e3779b1U, next_hop));
+        routed++;
+    }
+    TEST_CHECK(ip4_fib_next_hop_packets(test_hop(8)) + ip4_fib_next_hop_packets(test_hop(9)) == routed);
+    TEST_CHECK(ip4_fib_add(test_addr(203, 0, 113, 0), 24, test_hop(1)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_next_hop_packets(test_hop(8)) + ip4_fib_next_hop_packets(test_hop(9)) == routed);
+
+    TEST_CHECK(ip4_fib_delete_next_hop(prefix, 24, test_hop(8)) == STATUS_SUCCESS);
+    TEST_CHECK(ip4_fib_commit() == STATUS_SUCCESS);
+    for (uint32_t flow_hash = 0; flow_hash < 64; flow_hash++)
+    {
+        TEST_CHECK(test_route(dst, flow_hash * 0x9e3779b1U) == 9);
+    }
+    ip4_fib_reclaim();
+}
+
+int
+main()
+{
+    test_longest_prefix_match();
+    test_delete();
+    test_tables();
+    test_multipath();
+    for (size_t t = 0; t < IP4_FIB_MAX_TABLES; t++)
+    {
+        ip4_fib_clear(uint8_t(t));
+    }
+    ip4_fib_commit();
+    ip4_fib_reclaim();
+    std::printf("ip4_fib_test: %d failures\n", test_failures);
+    return test_failures == 0 ? 0 : 1;
+}
+
+//
+// END OF FILE
+//
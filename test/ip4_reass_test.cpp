@@ -0,0 +1,219 @@
+///
+/// file: ip4_reass_test.cpp
+///
+/// IPv4 reassembly (ip4_frag.h): fragments in and out of order, overlapping
+/// and malformed fragments, expiry with its ICMP time exceeded, and eviction
+/// when the queued fragments reach IP4_REASS_MAX_BYTES.
+///
+
+#include "test_stubs.h"
+#include <ip4.h>
+#include <ip4_frag.h>
+
+/* payload byte at offset of datagram id */
+static uint8_t
+test_payload_byte(const uint16_t id, const size_t offset)
+{
+    return uint8_t(offset * 7 + id);
+}
+
+/* fragment of datagram id carrying payload bytes [offset, offset + len) */
+static PacketBuffer
+test_fragment(const uint16_t id, const size_t offset, const size_t len, const bool more)
+{
+    PacketBuffer p{};
+    p.data.assign(IP4_HDR_LEN + len, 0);
+    std::vector<uint8_t>& d = p.data;
+    const size_t tot_len = IP4_HDR_LEN + len;
+    const uint16_t frag = uint16_t((more ? 0x2000 : 0) | offset / 8);
+    d[0] = 0x45;
+    d[2] = uint8_t(tot_len >> 8);
+    d[3] = uint8_t(tot_len);
+    d[4] = uint8_t(id >> 8);
+    d[5] = uint8_t(id);
+    d[6] = uint8_t(frag >> 8);
+    d[7] = uint8_t(frag);
+    d[8] = 64;
+    d[9] = 17;
+    const uint8_t src[] = {192, 0, 2, 1};
+    const uint8_t dst[] = {198, 51, 100, 1};
+    std::copy(std::begin(src), std::end(src), &d[12]);
+    std::copy(std::begin(dst), std::end(dst), &d[16]);
+    for (size_t i = 0; i < len; i++)
+    {
+        d[IP4_HDR_LEN + i] = test_payload_byte(id, offset + i);
+    }
+    p.input_netif_idx = 1;
+    return p;
+}
+
+static bool
+test_feed(const uint16_t id, const size_t offset, const size_t len, const bool more, PacketBuffer& out)
+{
+    out = test_fragment(id, offset, len, more);
+    return ip4_reass(out);
+}
+
+/* whether p is the complete datagram id of len payload bytes */
+static bool
+test_is_datagram(const PacketBuffer& p, const uint16_t id, const size_t len)
+{
+    const std::vector<uint8_t>& d = p.data;
+    if (d.size() != IP4_HDR_LEN + len || size_t(d[2] << 8 | d[3]) != d.size() || d[6] != 0 || d[7] != 0)
+    {
+        return false;
+    }
+    /* the checksum of a header with a correct checksum field is 0 */
+    if (inet_chksum(d.data(), uint16_t(IP4_HDR_LEN)) != 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if (d[IP4_HDR_LEN + i] != test_payload_byte(id, i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+test_in_order()
+{
+    PacketBuffer p{};
+    TEST_CHECK(!test_feed(1, 0, 1480, true, p));
+    TEST_CHECK(!test_feed(1, 1480, 1480, true, p));
+    TEST_CHECK(test_feed(1, 2960, 40, false, p));
+    TEST_CHECK(test_is_datagram(p, 1, 3000));
+    TEST_CHECK(ip4_reass_bytes == 0);
+}
+
+static void
+test_out_of_order()
+{
+    PacketBuffer p{};
+    TEST_CHECK(!test_feed(2, 2960, 40, false, p));
+    TEST_CHECK(!test_feed(2, 0, 1480, true, p));
+    TEST_CHECK(test_feed(2, 1480, 1480, true, p));
+    TEST_CHECK(test_is_datagram(p, 2, 3000));
+
+    /* two datagrams interleaved */
+    TEST_CHECK(!test_feed(3, 8, 16, false, p));
+    TEST_CHECK(!test_feed(4, 0, 8, true, p));
+    TEST_CHECK(test_feed(3, 0, 8, true, p));
+    TEST_CHECK(test_is_datagram(p, 3, 24));
+    TEST_CHECK(test_feed(4, 8, 8, false, p));
+    TEST_CHECK(test_is_datagram(p, 4, 16));
+    TEST_CHECK(ip4_reass_bytes == 0);
+}
+
+static void
+test_overlap()
+{
+    PacketBuffer p{};
+    const size_t dropped = ip4_reass_stats.dropped;
+    TEST_CHECK(!test_feed(5, 0, 800, true, p));
+    /* duplicate, overlapping the end, overlapping the start */
+    TEST_CHECK(!test_feed(5, 0, 800, true, p));
+    TEST_CHECK(!test_feed(5, 792, 16, true, p));
+    TEST_CHECK(!test_feed(5, 1600, 400, false, p));
+    TEST_CHECK(!test_feed(5, 1592, 16, true, p));
+    TEST_CHECK(ip4_reass_stats.dropped == dropped + 3);
+    /* a last fragment ending before queued data */
+    TEST_CHECK(!test_feed(5, 800, 8, false, p));
+    /* a fragment past the end of the datagram */
+    TEST_CHECK(!test_feed(5, 2000, 8, true, p));
+    TEST_CHECK(ip4_reass_stats.dropped == dropped + 5);
+    TEST_CHECK(test_feed(5, 800, 800, true, p));
+    TEST_CHECK(test_is_datagram(p, 5, 2000));
+    TEST_CHECK(ip4_reass_bytes == 0);
+}
+
+static void
+test_malformed()
+{
+    const size_t dropped = ip4_reass_stats.dropped;
+    /* not a multiple of 8 bytes, but not the last fragment */
+    PacketBuffer p = test_fragment(6, 0, 100, true);
+    TEST_CHECK(!ip4_reass(p));
+    /* total length past the buffer */
+    p = test_fragment(6, 0, 96, true);
+    p.data.resize(IP4_HDR_LEN + 50);
+    TEST_CHECK(!ip4_reass(p));
+    /* shorter than a header */
+    p.data.resize(IP4_HDR_LEN - 1);
+    TEST_CHECK(!ip4_reass(p));
+    TEST_CHECK(ip4_reass_stats.dropped == dropped + 3);
+    TEST_CHECK(ip4_reass_bytes == 0);
+}
+
+static void
+test_timeout()
+{
+    PacketBuffer p{};
+    const size_t timed_out = ip4_reass_stats.timed_out;
+    test_icmp_time_exceeded_sent.clear();
+    /* the first fragment of 7 arrived, not that of 8 */
+    TEST_CHECK(!test_feed(7, 0, 8, true, p));
+    TEST_CHECK(!test_feed(8, 8, 8, false, p));
+    for (int i = 0; i < IP_REASS_MAXAGE - 1; i++)
+    {
+        ip_reass_tmr();
+    }
+    TEST_CHECK(ip4_reass_stats.timed_out == timed_out);
+    TEST_CHECK(ip4_reass_bytes != 0);
+    ip_reass_tmr();
+    TEST_CHECK(ip4_reass_stats.timed_out == timed_out + 2);
+    TEST_CHECK(ip4_reass_bytes == 0);
+    TEST_CHECK(test_icmp_time_exceeded_sent.size() == 1);
+    if (test_icmp_time_exceeded_sent.size() == 1)
+    {
+        const std::vector<uint8_t>& d = test_icmp_time_exceeded_sent[0].data;
+        TEST_CHECK(d.size() == IP4_HDR_LEN + 8);
+        TEST_CHECK(d[4] == 0 && d[5] == 7);
+    }
+
+    /* the rest of an expired datagram does not complete it */
+    TEST_CHECK(!test_feed(7, 8, 8, false, p));
+    ip_reass_init();
+    TEST_CHECK(ip4_reass_bytes == 0);
+}
+
+static void
+test_eviction()
+{
+    PacketBuffer p{};
+    const size_t evicted = ip4_reass_stats.evicted;
+    const size_t datagrams = IP4_REASS_MAX_BYTES / 1480 + 16;
+    for (size_t id = 0; id < datagrams; id++)
+    {
+        TEST_CHECK(!test_feed(uint16_t(1000 + id), 0, 1480, true, p));
+        TEST_CHECK(ip4_reass_bytes <= IP4_REASS_MAX_BYTES);
+    }
+    TEST_CHECK(ip4_reass_stats.evicted > evicted);
+    /* the oldest datagram made room, the newest completes */
+    TEST_CHECK(!test_feed(1000, 1480, 8, false, p));
+    TEST_CHECK(test_feed(uint16_t(1000 + datagrams - 1), 1480, 8, false, p));
+    TEST_CHECK(test_is_datagram(p, uint16_t(1000 + datagrams - 1), 1488));
+    ip_reass_init();
+    TEST_CHECK(ip4_reass_bytes == 0);
+}
+
+int
+main()
+{
+    ip_reass_init();
+    test_in_order();
+    test_out_of_order();
+    test_overlap();
+    test_malformed();
+    test_timeout();
+    test_eviction();
+    std::printf("ip4_reass_test: %d failures\n", test_failures);
+    return test_failures == 0 ? 0 : 1;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,51 @@
+///
+/// file: test_stubs.cpp
+///
+/// Definitions the tested sources call into, for the test and bench targets,
+/// which only build the sources they cover.
+///
+
+#include "test_stubs.h"
+
+std::vector<PacketBuffer> test_icmp_time_exceeded_sent;
+
+size_t test_dst_cache_invalidations;
+
+void
+icmp_time_exceeded(PacketBuffer& pkt_buf, const IcmpTimeExceededCode te_type)
+{
+    if (te_type == ICMP_TE_FRAG)
+    {
+        test_icmp_time_exceeded_sent.push_back(pkt_buf);
+    }
+}
+
+/* RFC 1071 checksum, in network order like inet_chksum() */
+uint16_t
+inet_chksum(const uint8_t* dataptr, const uint16_t len)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        sum += uint32_t(dataptr[i] << 8 | dataptr[i + 1]);
+    }
+    if (len & 1)
+    {
+        sum += uint32_t(dataptr[len - 1] << 8);
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return lwip_htons(uint16_t(~sum));
+}
+
+void
+dst_cache_invalidate_all()
+{
+    test_dst_cache_invalidations++;
+}
+
+//
+// END OF FILE
+//
@@ -0,0 +1,37 @@
+///
+/// file: test_stubs.h
+///
+/// What the stubs of test_stubs.cpp record, and the check macro of the tests.
+///
+
+#pragma once
+
+#include <cstdio>
+#include <dst_cache.h>
+#include <icmp.h>
+#include <inet_chksum.h>
+#include <packet_buffer.h>
+#include <vector>
+
+/// Packets icmp_time_exceeded() was called for with ICMP_TE_FRAG.
+extern std::vector<PacketBuffer> test_icmp_time_exceeded_sent;
+
+/// Calls of dst_cache_invalidate_all().
+extern size_t test_dst_cache_invalidations;
+
+/// Failed checks of the running test.
+inline int test_failures = 0;
+
+#define TEST_CHECK(cond)                                                         \
+    do                                                                           \
+    {                                                                            \
+        if (!(cond))                                                             \
+        {                                                                        \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                     \
+        }                                                                        \
+    } while (0)
+
+//
+// END OF FILE
+//